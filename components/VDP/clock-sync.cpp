@@ -0,0 +1,84 @@
+#include "vdb/clock-sync.hpp"
+
+namespace VDP {
+/**
+ * adds a ping's timestamps to the estimate
+ * @param remote_ms the brain's VDB::time_ms() when it sent the ping
+ * @param local_us our clock when the ping arrived
+ */
+void ClockSync::add_sample(uint32_t remote_ms, int64_t local_us) {
+    const int64_t offset = local_us - (int64_t)remote_ms * 1000;
+
+    // a jump this big isn't drift or delay, the brain's clock started over
+    if (has_anchor) {
+        const int64_t error = offset - predicted_offset(local_us);
+        if (error > MAX_JUMP_US || error < -MAX_JUMP_US) {
+            reset();
+        }
+    }
+    // the first ping is a rough estimate to use until a window fills up
+    if (!has_anchor) {
+        has_anchor = true;
+        anchor_offset = offset;
+        anchor_time = local_us;
+    }
+
+    if (window_count == 0 || offset < window_min_offset) {
+        window_min_offset = offset;
+        window_min_time = local_us;
+    }
+    window_count++;
+    if (window_count < WINDOW_SIZE) {
+        return;
+    }
+
+    // window finished. The brain's clock only has millisecond resolution, so
+    // the drift is the slope all the way back to the first window, which
+    // gets more accurate the longer we've been synced
+    if (windows_done == 0) {
+        base_offset = window_min_offset;
+        base_time = window_min_time;
+    } else if (window_min_time > base_time) {
+        drift = (double)(window_min_offset - base_offset) / (double)(window_min_time - base_time);
+    }
+    anchor_offset = window_min_offset;
+    anchor_time = window_min_time;
+    windows_done++;
+    window_count = 0;
+}
+/**
+ * forgets everything, used when the brain restarts
+ */
+void ClockSync::reset() { *this = ClockSync(); }
+/**
+ * @return true once at least one ping has been seen
+ */
+bool ClockSync::synced() const { return has_anchor; }
+/**
+ * converts a brain timestamp into our clock
+ * @param remote_ms a VDB::time_ms() value from the brain
+ * @return the same moment in microseconds of our clock
+ */
+int64_t ClockSync::to_local_us(uint32_t remote_ms) const {
+    const int64_t remote_us = (int64_t)remote_ms * 1000;
+    // the drift term is tiny, so predicting it at the uncorrected time is
+    // close enough
+    return remote_us + predicted_offset(remote_us + anchor_offset);
+}
+/**
+ * @return our clock minus the brain's clock, in microseconds, as of the
+ * last finished window
+ */
+int64_t ClockSync::offset_us() const { return anchor_offset; }
+/**
+ * @return how fast the offset is changing, in parts per million
+ */
+double ClockSync::drift_ppm() const { return drift * 1e6; }
+/**
+ * @param local_us a time on our clock
+ * @return the offset expected at that time
+ */
+int64_t ClockSync::predicted_offset(int64_t local_us) const {
+    return anchor_offset + (int64_t)(drift * (double)(local_us - anchor_time));
+}
+} // namespace VDP
@@ -0,0 +1,394 @@
+#include "vdb/cobs.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+// VDB_COBS_NO_SIMD builds the word at a time search the esp32 uses on any
+// target, so it can be tested on a computer
+#if defined(VDB_COBS_NO_SIMD)
+#elif defined(__AVX2__)
+#define COBS_AVX2
+#define COBS_SSE2
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#define COBS_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace VDB {
+/**
+ * finds the first zero byte, checking a word or vector at a time where the
+ * target allows it
+ * @param buf bytes to search
+ * @param size how many bytes there are
+ * @return the index of the first zero, or size if there isn't one
+ */
+size_t find_zero(const uint8_t *buf, size_t size) {
+    // zeros are usually close together in packed data, check the first few
+    // bytes before setting up anything wider
+    static constexpr size_t short_run = 8;
+    const size_t head = std::min(size, short_run);
+    size_t i = 0;
+    for (; i < head; i++) {
+        if (buf[i] == 0) {
+            return i;
+        }
+    }
+#if defined(COBS_AVX2)
+    const __m256i zero32 = _mm256_setzero_si256();
+    for (; i + 32 <= size; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        const uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero32));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(COBS_SSE2)
+    const __m128i zero16 = _mm_setzero_si128();
+    for (; i + 16 <= size; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        const uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero16));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#else
+    // the esp32 can't do unaligned word loads, so line up first
+    for (; i < size && ((uintptr_t)(buf + i) % sizeof(uint32_t)) != 0; i++) {
+        if (buf[i] == 0) {
+            return i;
+        }
+    }
+    for (; i + sizeof(uint32_t) <= size; i += sizeof(uint32_t)) {
+        uint32_t word;
+        memcpy(&word, buf + i, sizeof(word));
+        // sets the high bit of any byte that was zero
+        if (((word - 0x01010101u) & ~word & 0x80808080u) != 0) {
+            break;
+        }
+    }
+#endif
+    for (; i < size; i++) {
+        if (buf[i] == 0) {
+            return i;
+        }
+    }
+    return size;
+}
+
+/**
+ * COBS encodes a whole packet, with a delimiter on both ends
+ * @param in the packet to encode
+ * @param out where the encoded frame is written
+ */
+void CobsEncode(const VDP::Packet &in, WirePacket &out) {
+    out.clear();
+    if (in.size() == 0) {
+        return;
+    }
+    // one code byte per zero or per 254 byte run, plus both delimiters
+    out.resize(in.size() + (in.size() / 254) + 3);
+    out[0] = 0;
+
+    // every zero becomes the code byte of the block after it, in the same
+    // place, so the input is copied across in bulk and the zeros patched after.
+    // A byte is only added when a block fills up without hitting a zero
+    uint8_t *dst = out.data();
+    size_t input_head = 0;
+    size_t output_code_head = 1;
+    size_t output_head = 2;
+    while (input_head < in.size()) {
+        const size_t room = 254 - (output_head - output_code_head - 1);
+        const size_t chunk = std::min(room, in.size() - input_head);
+        memcpy(dst + output_head, in.data() + input_head, chunk);
+        const size_t end = output_head + chunk;
+        for (size_t z = output_head + find_zero(dst + output_head, chunk); z < end;
+             z = z + 1 + find_zero(dst + z + 1, end - z - 1)) {
+            dst[output_code_head] = (uint8_t)(z - output_code_head);
+            output_code_head = z;
+        }
+        output_head = end;
+        input_head += chunk;
+
+        if (output_head - output_code_head - 1 == 254 && input_head < in.size()) {
+            // full block, start another without an implied zero
+            dst[output_code_head] = 0xff;
+            output_code_head = output_head;
+            output_head++;
+        }
+    }
+    dst[output_code_head] = (uint8_t)(output_head - output_code_head);
+
+    // Trailing delimeter
+    dst[output_head] = 0;
+    output_head++;
+
+    out.resize(output_head);
+}
+
+/**
+ * COBS decodes a single frame, stopping at the first delimiter
+ * @param in an encoded frame without its leading delimiter
+ * @param out where the decoded packet is written
+ */
+void CobsDecode(const WirePacket &in, VDP::Packet &out) {
+    out.clear();
+    // there are no zeros inside a frame, so once the delimiter is found every
+    // block can be copied without looking at it
+    const size_t frame_size = find_zero(in.data(), in.size());
+    // decoding never makes a frame longer
+    out.resize(frame_size);
+
+    const uint8_t *src = in.data();
+    size_t input_head = 0;
+    size_t write_head = 0;
+    uint8_t last_code = 0xff;
+    while (input_head < frame_size) {
+        const uint8_t code = src[input_head];
+        input_head++;
+        if (last_code != 0xff) {
+            out[write_head] = 0;
+            write_head++;
+        }
+        last_code = code;
+
+        // a block running past the delimiter keeps what arrived of it
+        const size_t len = std::min((size_t)(code - 1), frame_size - input_head);
+        memcpy(out.data() + write_head, src + input_head, len);
+        write_head += len;
+        input_head += len;
+    }
+    out.resize(write_head);
+}
+
+/**
+ * encodes a packet
+ * @param spans the pieces of the packet, in order
+ * @param count how many pieces there are
+ * @param write called with each chunk of the frame, in order
+ * @return false if write gave up partway
+ */
+bool CobsFrameEncoder::encode(const VDP::PacketSpan *spans, size_t count, const WriteFn &write) {
+    staging[0] = 0;
+    code_head = 1;
+    head = 2;
+    block_full = false;
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!add(spans[i].data, spans[i].size, write)) {
+            return false;
+        }
+        total += spans[i].size;
+    }
+    if (total == 0) {
+        return true;
+    }
+    // a full block already has its code and needs no empty block after it
+    if (!block_full) {
+        staging[code_head] = (uint8_t)(head - code_head);
+    }
+    // Trailing delimeter
+    staging[head] = 0;
+    head++;
+    return write(staging, head);
+}
+/**
+ * @param size how long a packet is
+ * @return the most bytes encoding it can take, delimiters included
+ */
+size_t CobsFrameEncoder::max_encoded_size(size_t size) { return size + (size / 254) + 3; }
+/**
+ * encodes some bytes of the packet into the staging buffer, the same way
+ * CobsEncode does
+ */
+bool CobsFrameEncoder::add(const uint8_t *data, size_t size, const WriteFn &write) {
+    while (size > 0) {
+        if (block_full) {
+            block_full = false;
+            code_head = head;
+            head++;
+        }
+        // keep room for a whole block and the trailing delimiter
+        if (code_head + 256 > STAGING_SIZE && !flush(write)) {
+            return false;
+        }
+        const size_t room = 254 - (head - code_head - 1);
+        const size_t chunk = std::min(room, size);
+        const size_t run = find_zero(data, chunk);
+        memcpy(staging + head, data, run);
+        head += run;
+        data += run;
+        size -= run;
+        if (run < chunk) {
+            // the zero ends this block and holds the next one's code
+            staging[code_head] = (uint8_t)(head - code_head);
+            code_head = head;
+            head++;
+            data++;
+            size--;
+        } else if (run == room) {
+            staging[code_head] = 0xff;
+            block_full = true;
+        }
+    }
+    return true;
+}
+/**
+ * writes out every finished block and moves the open one to the front
+ */
+bool CobsFrameEncoder::flush(const WriteFn &write) {
+    if (!write(staging, code_head)) {
+        return false;
+    }
+    memmove(staging, staging + code_head, head - code_head);
+    head -= code_head;
+    code_head = 0;
+    return true;
+}
+
+/**
+ * @param max_size the longest decoded frame to accept
+ */
+CobsFrameDecoder::CobsFrameDecoder(size_t max_size) : max_size(max_size) {}
+
+/**
+ * decodes bytes into a packet, stopping at the end of the first frame
+ * @param buf bytes from the wire
+ * @param size how many bytes there are
+ * @param out where the frame is decoded to
+ * @param consumed set to how many bytes were used
+ * @return what ended the frame, or Incomplete if every byte was used
+ */
+CobsFrameDecoder::Result
+CobsFrameDecoder::decode(const uint8_t *buf, size_t size, VDP::Packet &out, size_t &consumed) {
+    size_t i = 0;
+    while (i < size) {
+        if (skipping) {
+            // nothing to decode until the next delimiter
+            const size_t run = find_zero(buf + i, size - i);
+            if (run == size - i) {
+                i = size;
+                break;
+            }
+            i += run + 1;
+            skipping = false;
+            start_frame(out);
+            continue;
+        }
+
+        if (left_in_block == 0) {
+            const uint8_t code = buf[i];
+            i++;
+            if (code == 0) {
+                // back to back delimiters are just idle line
+                if (!in_frame) {
+                    continue;
+                }
+                consumed = i;
+                return finish_frame(out);
+            }
+            if (!in_frame) {
+                start_frame(out);
+                in_frame = true;
+            } else if (last_code != 0xff) {
+                // every block but a full one ends with a zero that wasn't sent
+                if (out.size() + 1 > max_size) {
+                    in_frame = false;
+                    skipping = true;
+                    consumed = i;
+                    return Result::TooLarge;
+                }
+                out.push_back(0);
+            }
+            last_code = code;
+            left_in_block = code - 1;
+            continue;
+        }
+
+        // copy as much of the block as has arrived
+        size_t n = std::min((size_t)left_in_block, size - i);
+        const size_t run = find_zero(buf + i, n);
+        const bool cut_short = run < n;
+        n = run;
+        if (out.size() + n > max_size) {
+            in_frame = false;
+            left_in_block = 0;
+            skipping = !cut_short;
+            consumed = cut_short ? i + n + 1 : i;
+            return Result::TooLarge;
+        }
+        out.insert(out.end(), buf + i, buf + i + n);
+        i += n;
+        left_in_block -= n;
+        if (cut_short) {
+            // the frame ended mid block, whatever came before it is garbage
+            in_frame = false;
+            left_in_block = 0;
+            consumed = i + 1;
+            return Result::Truncated;
+        }
+    }
+    if (in_frame && check_crc) {
+        update_crc(out);
+    }
+    consumed = size;
+    return Result::Incomplete;
+}
+/**
+ * throws away a partly decoded frame, decoding starts again after the next
+ * delimiter
+ */
+void CobsFrameDecoder::resync() {
+    in_frame = false;
+    left_in_block = 0;
+    skipping = true;
+}
+/**
+ * gets ready for a new frame
+ */
+void CobsFrameDecoder::start_frame(VDP::Packet &out) {
+    out.clear();
+    crc.reset();
+    crc_done = 0;
+    left_in_block = 0;
+    last_code = 0;
+}
+/**
+ * checksums everything but the last 4 bytes decoded so far, those might be
+ * the checksum itself
+ */
+void CobsFrameDecoder::update_crc(const VDP::Packet &out) {
+    if (out.size() < crc_done + 4) {
+        return;
+    }
+    const size_t end = out.size() - 4;
+    crc.update(out.data() + crc_done, end - crc_done);
+    crc_done = end;
+}
+/**
+ * checks a frame that just ended
+ */
+CobsFrameDecoder::Result CobsFrameDecoder::finish_frame(VDP::Packet &out) {
+    in_frame = false;
+    // packet header byte + checksum = 5 bytes
+    static constexpr size_t min_packet_size = 5;
+    if (out.size() < min_packet_size) {
+        return Result::TooSmall;
+    }
+    if (!check_crc) {
+        return Result::Ok;
+    }
+    update_crc(out);
+    if (crc.finalize() != VDP::get_written_checksum(out)) {
+        return Result::BadChecksum;
+    }
+    return Result::Ok;
+}
+/**
+ * @param check false to hand over frames without checking their checksum,
+ * for when something after framing has to change the bytes first
+ */
+void CobsFrameDecoder::set_check_crc(bool check) { check_crc = check; }
+
+} // namespace VDB
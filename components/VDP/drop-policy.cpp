@@ -0,0 +1,83 @@
+#include "vdb/drop-policy.hpp"
+
+namespace VDB {
+/**
+ * @param pac a decoded frame
+ * @param id set to the frame's channel if it is data, INVALID_CHANNEL_ID if
+ * its id is bad
+ * @return whether the frame is channel data
+ */
+bool get_data_channel(const VDP::Packet &pac, VDP::ChannelID &id) {
+    const VDP::PacketHeader header = VDP::decode_header_byte(pac[0]);
+    if (header.type != VDP::PacketType::Data || header.func != VDP::PacketFunction::Send ||
+        (header.flags & VDP::PacketFlags::Fragment)) {
+        return false;
+    }
+    VDP::PacketReader reader{pac, 1};
+    id = reader.get_channel_id(header);
+    return true;
+}
+
+/**
+ * @param policy the drop policy in use
+ * @param data whether the frame that just arrived is channel data
+ * @param num_free receive buffers nothing is using
+ * @return whether the frame can take a free buffer
+ */
+bool may_take_buffer(DropPolicy policy, bool data, size_t num_free) {
+    // under LatestPerChannel data leaves the last few buffers to control
+    // frames, so a broadcast, ping or request always has one to go to
+    return !data || policy != DropPolicy::LatestPerChannel || num_free > CONTROL_RESERVE;
+}
+
+/**
+ * picks the frame to drop when a frame arrives and there's no buffer for it
+ * @param policy the drop policy in use
+ * @param queued the frames waiting, oldest first
+ * @param count how many there are
+ * @param data whether the frame that just arrived is channel data
+ * @param new_id its channel, if it is
+ */
+DropChoice choose_drop(DropPolicy policy, const InboundFrame *queued, size_t count, bool data,
+                       VDP::ChannelID new_id) {
+    DropChoice choice{count, data, false};
+    VDP::ChannelID id = 0;
+    switch (policy) {
+    case DropPolicy::DropNewest:
+        return choice;
+    case DropPolicy::DropOldest:
+        if (count > 0) {
+            choice.victim = 0;
+            choice.data = get_data_channel(*queued[0].packet, id);
+        }
+        return choice;
+    case DropPolicy::LatestPerChannel:
+        break;
+    }
+
+    if (!data) {
+        // a control packet matches no channel, so the oldest data makes way
+        new_id = VDP::INVALID_CHANNEL_ID;
+    } else if (new_id == VDP::INVALID_CHANNEL_ID) {
+        // the listener would drop it anyway, don't push out good data for it
+        return choice;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (!get_data_channel(*queued[i].packet, id)) {
+            continue;
+        }
+        if (id == VDP::INVALID_CHANNEL_ID) {
+            // garbage goes before anything the listener could use
+            return DropChoice{i, true, false};
+        }
+        if (id == new_id) {
+            return DropChoice{i, true, true};
+        }
+        if (choice.victim == count) {
+            choice = DropChoice{i, true, false};
+        }
+    }
+    return choice;
+}
+} // namespace VDB
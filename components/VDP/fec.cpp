@@ -0,0 +1,311 @@
+#include "vdb/fec.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace VDB {
+namespace {
+/**
+ * exp and log tables for GF(256) with the polynomial x^8+x^4+x^3+x^2+1. exp
+ * is doubled up so adding two logs never needs a modulo
+ */
+struct GaloisTables {
+    uint8_t exp[512];
+    uint8_t log[256];
+    GaloisTables() {
+        uint16_t x = 1;
+        for (int i = 0; i < 255; i++) {
+            exp[i] = (uint8_t)x;
+            log[x] = (uint8_t)i;
+            x <<= 1;
+            if (x & 0x100) {
+                x ^= 0x11d;
+            }
+        }
+        for (int i = 255; i < 512; i++) {
+            exp[i] = exp[i - 255];
+        }
+        log[0] = 0;
+    }
+};
+const GaloisTables gf;
+
+uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    return gf.exp[gf.log[a] + gf.log[b]];
+}
+uint8_t gf_div(uint8_t a, uint8_t b) {
+    if (a == 0) {
+        return 0;
+    }
+    return gf.exp[gf.log[a] + 255 - gf.log[b]];
+}
+/**
+ * @param poly coefficients, lowest power first
+ * @param size how many coefficients there are
+ * @param x where to evaluate it
+ */
+uint8_t poly_eval(const uint8_t *poly, size_t size, uint8_t x) {
+    uint8_t y = 0;
+    for (size_t i = size; i > 0; i--) {
+        y = gf_mul(y, x) ^ poly[i - 1];
+    }
+    return y;
+}
+} // namespace
+
+/**
+ * @param parity parity bytes per codeword, 0 turns correction off
+ */
+ReedSolomon::ReedSolomon(size_t parity) : nparity(std::min(parity, MAX_PARITY)) {
+    // the generator is (x - a^0)(x - a^1)...(x - a^(parity-1)), built highest
+    // power first
+    uint8_t generator[MAX_PARITY + 1] = {1};
+    for (size_t i = 0; i < nparity; i++) {
+        const uint8_t root = gf.exp[i];
+        generator[i + 1] = 0;
+        for (size_t j = i + 1; j > 0; j--) {
+            generator[j] ^= gf_mul(generator[j - 1], root);
+        }
+    }
+    for (size_t i = 0; i < nparity; i++) {
+        generator_log[i] = generator[i + 1] == 0 ? 0xff : gf.log[generator[i + 1]];
+    }
+}
+/**
+ * @return parity bytes per codeword
+ */
+size_t ReedSolomon::parity() const { return nparity; }
+/**
+ * @return whether frames carry parity at all
+ */
+bool ReedSolomon::enabled() const { return nparity > 0; }
+/**
+ * @param data_size how many packet bytes there are
+ * @return how many codewords they're split into
+ */
+size_t ReedSolomon::num_codewords(size_t data_size) const {
+    const size_t per_codeword = 255 - nparity;
+    return std::max((size_t)1, (data_size + per_codeword - 1) / per_codeword);
+}
+/**
+ * @param size how long a packet is
+ * @return how many parity bytes are added after it
+ */
+size_t ReedSolomon::overhead(size_t size) const {
+    if (!enabled()) {
+        return 0;
+    }
+    return num_codewords(size) * nparity;
+}
+/**
+ * works out the parity for a packet given in pieces, running one encoder per
+ * codeword and feeding each byte to the codeword it interleaves into
+ * @param spans the pieces of the packet, in order
+ * @param count how many pieces there are
+ * @param out set to the parity to send after the packet
+ */
+void ReedSolomon::protect(const VDP::PacketSpan *spans, size_t count, std::vector<uint8_t> &out) const {
+    out.clear();
+    if (!enabled()) {
+        return;
+    }
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size += spans[i].size;
+    }
+    const size_t codewords = num_codewords(size);
+    // the parity carries on the rotation where the packet left off, so
+    // parity byte k belongs to codeword (size + k) % codewords. Codeword j's
+    // remainder is then out[first], out[first + codewords], ... which is
+    // already the order it's sent in
+    const size_t shift = codewords - size % codewords;
+    out.assign(codewords * nparity, 0);
+
+    size_t codeword = 0;
+    for (size_t s = 0; s < count; s++) {
+        for (size_t i = 0; i < spans[s].size; i++) {
+            uint8_t *rem = out.data() + (codeword + shift) % codewords;
+            const uint8_t feedback = spans[s].data[i] ^ rem[0];
+            for (size_t m = 0; m + 1 < nparity; m++) {
+                uint8_t term = 0;
+                if (feedback != 0 && generator_log[m] != 0xff) {
+                    term = gf.exp[gf.log[feedback] + generator_log[m]];
+                }
+                rem[m * codewords] = rem[(m + 1) * codewords] ^ term;
+            }
+            uint8_t term = 0;
+            if (feedback != 0 && generator_log[nparity - 1] != 0xff) {
+                term = gf.exp[gf.log[feedback] + generator_log[nparity - 1]];
+            }
+            rem[(nparity - 1) * codewords] = term;
+
+            codeword++;
+            if (codeword == codewords) {
+                codeword = 0;
+            }
+        }
+    }
+}
+/**
+ * fixes what it can in a frame with parity on the end, then takes the
+ * parity off
+ * @param frame the packet followed by its parity
+ * @return how many bytes were fixed, or -1 if there were too many to fix
+ */
+int ReedSolomon::repair(VDP::Packet &frame) const {
+    if (!enabled()) {
+        return 0;
+    }
+    // every codeword but the last is full, so the count falls out of the
+    // total length
+    const size_t codewords = (frame.size() + 254) / 255;
+    if (frame.size() <= codewords * nparity) {
+        return -1;
+    }
+    const size_t data_size = frame.size() - codewords * nparity;
+    if (num_codewords(data_size) != codewords) {
+        return -1;
+    }
+
+    // each codeword is pulled out, fixed, and the packet bytes put back.
+    // The parity isn't needed after this so it's left as is
+    const size_t shift = codewords - data_size % codewords;
+    uint8_t codeword[255];
+    int fixed = 0;
+    for (size_t j = 0; j < codewords; j++) {
+        size_t n = 0;
+        for (size_t i = j; i < data_size; i += codewords) {
+            codeword[n++] = frame[i];
+        }
+        for (size_t m = 0; m < nparity; m++) {
+            codeword[n++] =
+                frame[data_size + m * codewords + (j + shift) % codewords];
+        }
+        const int res = decode(codeword, n);
+        if (res < 0) {
+            return -1;
+        }
+        if (res > 0) {
+            n = 0;
+            for (size_t i = j; i < data_size; i += codewords) {
+                frame[i] = codeword[n++];
+            }
+        }
+        fixed += res;
+    }
+    frame.resize(data_size);
+    return fixed;
+}
+/**
+ * fixes a single codeword in place, finding the error locations with
+ * Berlekamp-Massey and a Chien search and their values with Forney
+ * @param codeword data followed by parity, first byte is the highest power
+ * @param size length of the codeword, at most 255
+ * @return how many bytes were fixed, or -1 if it can't be fixed
+ */
+int ReedSolomon::decode(uint8_t *codeword, size_t size) const {
+    uint8_t syndromes[MAX_PARITY];
+    bool clean = true;
+    for (size_t j = 0; j < nparity; j++) {
+        const uint8_t root = gf.exp[j];
+        uint8_t s = 0;
+        for (size_t i = 0; i < size; i++) {
+            s = gf_mul(s, root) ^ codeword[i];
+        }
+        syndromes[j] = s;
+        clean = clean && s == 0;
+    }
+    if (clean) {
+        return 0;
+    }
+
+    // error locator, lowest power first
+    uint8_t locator[MAX_PARITY + 1] = {1};
+    uint8_t prev[MAX_PARITY + 1] = {1};
+    uint8_t temp[MAX_PARITY + 1];
+    size_t num_errors = 0;
+    size_t shift = 1;
+    uint8_t prev_discrepancy = 1;
+    for (size_t n = 0; n < nparity; n++) {
+        uint8_t discrepancy = syndromes[n];
+        for (size_t i = 1; i <= num_errors; i++) {
+            discrepancy ^= gf_mul(locator[i], syndromes[n - i]);
+        }
+        if (discrepancy == 0) {
+            shift++;
+            continue;
+        }
+        const uint8_t scale = gf_div(discrepancy, prev_discrepancy);
+        if (2 * num_errors <= n) {
+            memcpy(temp, locator, sizeof(temp));
+            for (size_t i = 0; i + shift <= nparity; i++) {
+                locator[i + shift] ^= gf_mul(scale, prev[i]);
+            }
+            num_errors = n + 1 - num_errors;
+            memcpy(prev, temp, sizeof(prev));
+            prev_discrepancy = discrepancy;
+            shift = 1;
+        } else {
+            for (size_t i = 0; i + shift <= nparity; i++) {
+                locator[i + shift] ^= gf_mul(scale, prev[i]);
+            }
+            shift++;
+        }
+    }
+    if (2 * num_errors > nparity) {
+        return -1;
+    }
+
+    // error evaluator, syndromes times locator mod x^parity
+    uint8_t evaluator[MAX_PARITY] = {0};
+    for (size_t i = 0; i < nparity; i++) {
+        for (size_t j = 0; j <= std::min(i, num_errors); j++) {
+            evaluator[i] ^= gf_mul(syndromes[i - j], locator[j]);
+        }
+    }
+
+    // the byte at index i stands for x^(size-1-i), it's bad if the locator
+    // has a root at the inverse of that
+    uint8_t fixes[MAX_PARITY / 2];
+    size_t positions[MAX_PARITY / 2];
+    size_t found = 0;
+    for (size_t i = 0; i < size; i++) {
+        const size_t power = size - 1 - i;
+        const uint8_t x_inv = gf.exp[(255 - power) % 255];
+        if (poly_eval(locator, num_errors + 1, x_inv) != 0) {
+            continue;
+        }
+        if (found == num_errors) {
+            return -1;
+        }
+        // the derivative keeps only the odd powers in GF(2^n)
+        uint8_t derivative = 0;
+        for (size_t k = 1; k <= num_errors; k += 2) {
+            uint8_t term = locator[k];
+            for (size_t e = 0; e + 1 < k; e++) {
+                term = gf_mul(term, x_inv);
+            }
+            derivative ^= term;
+        }
+        if (derivative == 0) {
+            return -1;
+        }
+        const uint8_t x = gf.exp[power];
+        const uint8_t value = gf_mul(x, gf_div(poly_eval(evaluator, nparity, x_inv), derivative));
+        positions[found] = i;
+        fixes[found] = value;
+        found++;
+    }
+    if (found != num_errors) {
+        return -1;
+    }
+    for (size_t e = 0; e < found; e++) {
+        codeword[positions[e]] ^= fixes[e];
+    }
+    return (int)found;
+}
+
+} // namespace VDB
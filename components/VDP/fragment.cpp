@@ -0,0 +1,156 @@
+#include "vdb/fragment.hpp"
+#include "vdb/crc32.hpp"
+
+#include <algorithm>
+
+namespace VDP {
+/**
+ * splits a packet into fragments that each fit in the MTU
+ * @param pac the packet to split
+ * @param mtu the biggest packet the link should carry
+ * @param message_id tells this packet's fragments apart from others in flight
+ * @param out set to the fragments, in order
+ * @return false if the packet would take more than MAX_FRAGMENTS
+ */
+bool fragment_packet(const Packet &pac, size_t mtu, uint16_t message_id, std::vector<Packet> &out) {
+    out.clear();
+    if (mtu <= FRAGMENT_OVERHEAD || pac.empty()) {
+        return false;
+    }
+    const size_t piece_size = mtu - FRAGMENT_OVERHEAD;
+    const size_t count = (pac.size() + piece_size - 1) / piece_size;
+    if (count > MAX_FRAGMENTS) {
+        return false;
+    }
+
+    // fragments keep the whole packet's type and function so anything
+    // scheduling them can tell what they are
+    PacketHeader header = decode_header_byte(pac[0]);
+    header.flags = PacketFlags::Fragment;
+    const uint8_t header_byte = make_header_byte(header);
+
+    out.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        const size_t start = i * piece_size;
+        const size_t len = std::min(piece_size, pac.size() - start);
+        PacketWriter writer{out[i]};
+        writer.write_number<uint8_t>(header_byte);
+        writer.write_number<uint16_t>(message_id);
+        writer.write_number<uint8_t>((uint8_t)i);
+        writer.write_number<uint8_t>((uint8_t)count);
+        out[i].insert(out[i].end(), pac.begin() + start, pac.begin() + start + len);
+        uint32_t crc = CRC32::calculate(out[i].data(), out[i].size());
+        writer.write_number<uint32_t>(crc);
+    }
+    return true;
+}
+
+/**
+ * @param timeout_us how long to wait for the rest of a packet after its
+ * first fragment
+ */
+Reassembler::Reassembler(uint32_t timeout_us) : timeout_us(timeout_us) {}
+
+/**
+ * takes in a fragment
+ * @param fragment a fragment with a good checksum
+ * @param rx_time_us when it arrived
+ * @param out set to the whole packet when this returns Complete
+ * @return whether the packet is complete
+ */
+Reassembler::Result Reassembler::add(const Packet &fragment, uint64_t rx_time_us, Packet &out) {
+    num_fragments++;
+    expire(rx_time_us);
+    if (fragment.size() <= FRAGMENT_OVERHEAD) {
+        num_bad++;
+        return Result::Bad;
+    }
+    PacketReader reader{fragment, 1};
+    const uint16_t message_id = reader.get_number<uint16_t>();
+    const uint8_t index = reader.get_number<uint8_t>();
+    const uint8_t count = reader.get_number<uint8_t>();
+    if (count == 0 || index >= count) {
+        num_bad++;
+        return Result::Bad;
+    }
+
+    Pending *slot = nullptr;
+    for (Pending &p : pending) {
+        if (p.active && p.message_id == message_id) {
+            slot = &p;
+            break;
+        }
+    }
+    if (slot == nullptr) {
+        // a free slot, or the one that has waited longest
+        slot = &pending[0];
+        for (Pending &p : pending) {
+            if (!p.active) {
+                slot = &p;
+                break;
+            }
+            if (p.first_us < slot->first_us) {
+                slot = &p;
+            }
+        }
+        if (slot->active) {
+            num_timeouts++;
+        }
+        slot->active = true;
+        slot->message_id = message_id;
+        slot->count = count;
+        slot->received = 0;
+        slot->size = 0;
+        slot->first_us = rx_time_us;
+        slot->pieces.assign(count, Packet{});
+    }
+    if (slot->count != count) {
+        num_bad++;
+        return Result::Bad;
+    }
+
+    Packet &piece = slot->pieces[index];
+    if (!piece.empty()) {
+        // a repeat, we already have it
+        return Result::Incomplete;
+    }
+    const size_t piece_size = fragment.size() - FRAGMENT_OVERHEAD;
+    if (slot->size + piece_size > MAX_PACKET_SIZE) {
+        slot->active = false;
+        slot->pieces.clear();
+        num_bad++;
+        return Result::Bad;
+    }
+    // skip the header, message id, index and count, and leave off the
+    // fragment's own checksum
+    piece.assign(fragment.begin() + 5, fragment.end() - 4);
+    slot->size += piece_size;
+    slot->received++;
+    if (slot->received < slot->count) {
+        return Result::Incomplete;
+    }
+
+    slot->active = false;
+    out.clear();
+    out.reserve(slot->size);
+    for (const Packet &p : slot->pieces) {
+        out.insert(out.end(), p.begin(), p.end());
+    }
+    slot->pieces.clear();
+    num_reassembled++;
+    return Result::Complete;
+}
+
+/**
+ * throws away packets that have waited too long
+ */
+void Reassembler::expire(uint64_t now_us) {
+    for (Pending &p : pending) {
+        if (p.active && now_us > p.first_us + timeout_us) {
+            p.active = false;
+            p.pieces.clear();
+            num_timeouts++;
+        }
+    }
+}
+} // namespace VDP
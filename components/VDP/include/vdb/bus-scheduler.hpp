@@ -0,0 +1,303 @@
+#pragma once
+#include "vdb/cobs.hpp"
+#include "vdb/protocol.hpp"
+#include <algorithm>
+#include <mutex>
+
+namespace VDP {
+/**
+ * counters for how well sending fits around the brain on a half-duplex bus
+ */
+struct BusStats {
+  // windows the brain gave us, from requests
+  uint32_t grants = 0;
+  // frames sent inside a window
+  uint32_t scheduled = 0;
+  // frames sent without a window because they waited too long for one
+  uint32_t unscheduled = 0;
+  // frames held over because they didn't fit in what was left of a window
+  uint32_t deferred = 0;
+  // frames turned away because the queue was full
+  uint32_t queue_full = 0;
+  // frames from the brain that finished while we were still sending, so at
+  // least one side's frame was probably garbled
+  uint32_t collisions = 0;
+  // from a request arriving to our first frame going out
+  LatencyStats turnaround;
+  // from a frame being queued to it going out
+  LatencyStats queue_wait;
+};
+
+/**
+ * Sits between a device on a half-duplex bus and whatever sends through it,
+ * and holds outbound frames until the brain says the bus is ours. Every
+ * request from the brain opens a window, either as long as the request says
+ * or a default length for requests that don't say. Pings are requests too,
+ * and a channel broadcast opens a default window as well since the brain
+ * waits for its ack, so acks and pongs go out as soon as they're written.
+ * Frames that fit in the time left go out, the rest wait for the next window.
+ * A brain that never sends requests would starve the queue, so frames
+ * waiting longer than max_hold_us go out anyway and are counted as
+ * unscheduled.
+ *
+ * A frame that can go out when it's sent is passed to the device as the
+ * caller's spans, without a copy. Frames that have to wait are copied into
+ * one of MAX_QUEUED slots allocated up front
+ */
+template <typename MutexType> class BusScheduler : public AbstractDevice {
+public:
+  // frames that can wait for a window before new ones are turned away
+  static constexpr size_t MAX_QUEUED = 16;
+  // bytes each waiting slot has room for up front, a longer frame grows its
+  // slot once and the slot keeps the room
+  static constexpr size_t SLOT_SIZE = 256;
+
+  /**
+   * @param device the device on the bus
+   * @param baud the bus's baud rate, for working out how long frames take
+   * @param default_window_us how long a request without a window length
+   * leaves the bus to us
+   * @param max_hold_us the longest a frame waits for a window
+   */
+  BusScheduler(AbstractDevice *device, uint32_t baud,
+               uint32_t default_window_us = 2000,
+               uint32_t max_hold_us = 50000)
+      : device(device), baud(baud), default_window_us(default_window_us),
+        max_hold_us(max_hold_us) {
+    for (Outbound &slot : slots) {
+      slot.packet.reserve(SLOT_SIZE);
+    }
+    device->register_timed_receive_callback(
+        [this](const Packet &p, uint64_t rx_time_us) {
+          take_packet(p, rx_time_us);
+        });
+  }
+
+  bool send_packet(const Packet &packet) override {
+    const PacketSpan span{packet.data(), packet.size()};
+    return send_packet_spans(&span, 1) == SendStatus::Sent;
+  }
+  /**
+   * sends a packet straight away if a window is open and nothing is waiting,
+   * otherwise queues it for the next window
+   * @return Sent once the packet is sent or queued, Busy if the queue is full
+   */
+  SendStatus send_packet_spans(const PacketSpan *spans, size_t count) override {
+    std::lock_guard<MutexType> lock(mutex);
+    const uint64_t now = VDB::time_us();
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+      size += spans[i].size;
+    }
+    if (num_queued == 0 &&
+        try_send(spans, count, size, now, now) == Attempt::Sent) {
+      return SendStatus::Sent;
+    }
+    if (num_queued >= MAX_QUEUED) {
+      stats.queue_full++;
+      return SendStatus::Busy;
+    }
+    size_t slot = 0;
+    while (slots[slot].used) {
+      slot++;
+    }
+    Outbound &out = slots[slot];
+    out.used = true;
+    out.deferred = false;
+    out.queued_us = now;
+    out.packet.clear();
+    for (size_t i = 0; i < count; i++) {
+      out.packet.insert(out.packet.end(), spans[i].data,
+                        spans[i].data + spans[i].size);
+    }
+    out.fragment = !out.packet.empty() &&
+                   (decode_header_byte(out.packet[0]).flags &
+                    PacketFlags::Fragment) != 0;
+    // whole packets go ahead of queued fragments, so small urgent frames
+    // don't wait behind every piece of a big one
+    size_t pos = num_queued;
+    while (!out.fragment && pos > 0 && slots[order[pos - 1]].fragment) {
+      order[pos] = order[pos - 1];
+      pos--;
+    }
+    order[pos] = slot;
+    num_queued++;
+    flush(now);
+    return SendStatus::Sent;
+  }
+  void register_receive_callback(
+      std::function<void(const Packet &packet)> new_callback) override {
+    callback = [new_callback](const Packet &packet, uint64_t) {
+      new_callback(packet);
+    };
+  }
+  void register_timed_receive_callback(
+      std::function<void(const Packet &packet, uint64_t rx_time_us)>
+          new_callback) override {
+    callback = new_callback;
+  }
+  bool validates_checksums() const override {
+    return device->validates_checksums();
+  }
+
+  /**
+   * sends frames that have waited too long for a window. Happens on its own
+   * whenever something is sent or received, call this if the link can go
+   * quiet for a while
+   */
+  void poll() {
+    std::lock_guard<MutexType> lock(mutex);
+    flush(VDB::time_us());
+  }
+
+  /**
+   * @return a copy of the scheduling counters
+   */
+  BusStats get_stats() {
+    std::lock_guard<MutexType> lock(mutex);
+    return stats;
+  }
+
+private:
+  struct Outbound {
+    Packet packet;
+    uint64_t queued_us = 0;
+    bool used = false;
+    bool deferred = false;
+    bool fragment = false;
+  };
+  enum class Attempt {
+    Sent,
+    // no window has room for it yet
+    Wait,
+    // the device is still draining
+    Busy,
+  };
+
+  /**
+   * watches for requests and collisions, then passes the packet on
+   */
+  void take_packet(const Packet &pac, uint64_t rx_time_us) {
+    {
+      std::lock_guard<MutexType> lock(mutex);
+      if (rx_time_us < tx_busy_until_us) {
+        stats.collisions++;
+      }
+      const PacketHeader header = decode_header_byte(pac[0]);
+      // the brain waits for an answer to any request, pings included, and
+      // for the ack to a channel broadcast
+      const bool request = header.func == PacketFunction::Request;
+      const bool broadcast = header.type == PacketType::Broadcast &&
+                             header.func == PacketFunction::Send;
+      if (request || broadcast) {
+        uint32_t window_us = default_window_us;
+        // a broadcast request is the header, then a window length if the
+        // brain gave one, then checksum
+        if (request && header.type == PacketType::Broadcast &&
+            pac.size() >= 1 + 4 + 4) {
+          PacketReader reader{pac, 1};
+          window_us = reader.get_number<uint32_t>();
+        }
+        stats.grants++;
+        grant_start_us = rx_time_us;
+        window_end_us = rx_time_us + window_us;
+        turnaround_pending = true;
+      }
+    }
+    // whatever the receiver sends back in here is queued, and goes out in
+    // the window the request just opened
+    callback(pac, rx_time_us);
+
+    std::lock_guard<MutexType> lock(mutex);
+    flush(VDB::time_us());
+  }
+
+  /**
+   * @param size bytes in a packet
+   * @return about how long the packet takes on the wire, 10 bits a byte
+   */
+  uint64_t airtime_us(size_t size) const {
+    return (uint64_t)VDB::CobsFrameEncoder::max_encoded_size(size) * 10 *
+           1000000 / baud;
+  }
+
+  /**
+   * sends a frame if it fits in the open window or has waited too long.
+   * Call with the mutex held
+   * @param spans the pieces of the frame
+   * @param size bytes in all the pieces
+   * @param queued_us when the frame was first sent
+   */
+  Attempt try_send(const PacketSpan *spans, size_t count, size_t size,
+                   uint64_t queued_us, uint64_t now) {
+    const uint64_t airtime = airtime_us(size);
+    // frames already handed to the device go out first
+    const uint64_t start = std::max(now, tx_busy_until_us);
+    const bool in_window = start + airtime <= window_end_us;
+    const bool overdue = now >= queued_us + max_hold_us;
+    if (!in_window && !overdue) {
+      return Attempt::Wait;
+    }
+    if (device->send_packet_spans(spans, count) == SendStatus::Busy) {
+      return Attempt::Busy;
+    }
+    if (in_window) {
+      stats.scheduled++;
+      if (turnaround_pending) {
+        stats.turnaround.add((int64_t)(now - grant_start_us));
+        turnaround_pending = false;
+      }
+    } else {
+      stats.unscheduled++;
+    }
+    stats.queue_wait.add((int64_t)(now - queued_us));
+    tx_busy_until_us = start + airtime;
+    return Attempt::Sent;
+  }
+
+  /**
+   * sends what fits in the open window, and anything that has waited too
+   * long. Call with the mutex held
+   */
+  void flush(uint64_t now) {
+    while (num_queued > 0) {
+      Outbound &out = slots[order[0]];
+      const PacketSpan span{out.packet.data(), out.packet.size()};
+      const Attempt res = try_send(&span, 1, span.size, out.queued_us, now);
+      if (res == Attempt::Wait) {
+        if (now < window_end_us && !out.deferred) {
+          out.deferred = true;
+          stats.deferred++;
+        }
+        return;
+      }
+      if (res == Attempt::Busy) {
+        // try again next time
+        return;
+      }
+      out.used = false;
+      num_queued--;
+      std::copy(order + 1, order + 1 + num_queued, order);
+    }
+  }
+
+  AbstractDevice *device;
+  uint32_t baud;
+  uint32_t default_window_us;
+  uint32_t max_hold_us;
+  std::function<void(const Packet &packet, uint64_t rx_time_us)> callback =
+      [](const Packet &, uint64_t) {};
+
+  MutexType mutex;
+  Outbound slots[MAX_QUEUED];
+  // the slots waiting to go out, in the order they go
+  size_t order[MAX_QUEUED];
+  size_t num_queued = 0;
+  BusStats stats;
+  uint64_t grant_start_us = 0;
+  uint64_t window_end_us = 0;
+  // about when the last frame we sent finishes going out
+  uint64_t tx_busy_until_us = 0;
+  bool turnaround_pending = false;
+};
+} // namespace VDP
@@ -0,0 +1,74 @@
+#pragma once
+#include <cstdint>
+
+namespace VDP {
+/**
+ * Estimates the offset and drift between the brain's millisecond clock and
+ * our own microsecond clock from the timestamps in ping packets.
+ *
+ * A ping's offset (our receive time minus its send time) is the real offset
+ * plus however long the ping waited on the way here. The smallest offset in
+ * a window of pings was delayed the least, so it is taken as the estimate for
+ * that window, and the slope from the first window to the latest is the drift.
+ */
+class ClockSync {
+  public:
+    // pings per window
+    static constexpr int WINDOW_SIZE = 8;
+    // a ping this far from the prediction means the brain's clock restarted
+    static constexpr int64_t MAX_JUMP_US = 500000;
+
+    /**
+     * adds a ping's timestamps to the estimate
+     * @param remote_ms the brain's VDB::time_ms() when it sent the ping
+     * @param local_us our clock when the ping arrived
+     */
+    void add_sample(uint32_t remote_ms, int64_t local_us);
+    /**
+     * forgets everything, used when the brain restarts
+     */
+    void reset();
+    /**
+     * @return true once at least one ping has been seen
+     */
+    bool synced() const;
+    /**
+     * converts a brain timestamp into our clock
+     * @param remote_ms a VDB::time_ms() value from the brain
+     * @return the same moment in microseconds of our clock
+     */
+    int64_t to_local_us(uint32_t remote_ms) const;
+    /**
+     * @return our clock minus the brain's clock, in microseconds, as of the
+     * last finished window
+     */
+    int64_t offset_us() const;
+    /**
+     * @return how fast the offset is changing, in parts per million
+     */
+    double drift_ppm() const;
+
+  private:
+    /**
+     * @param local_us a time on our clock
+     * @return the offset expected at that time
+     */
+    int64_t predicted_offset(int64_t local_us) const;
+
+    // the window being filled
+    int window_count = 0;
+    int64_t window_min_offset = 0;
+    int64_t window_min_time = 0;
+
+    // the estimate everything is predicted from
+    bool has_anchor = false;
+    int windows_done = 0;
+    int64_t anchor_offset = 0;
+    int64_t anchor_time = 0;
+    // the first finished window, drift is measured from here
+    int64_t base_offset = 0;
+    int64_t base_time = 0;
+    // microseconds of offset change per microsecond of our clock
+    double drift = 0;
+};
+} // namespace VDP
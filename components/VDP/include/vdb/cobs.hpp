@@ -0,0 +1,154 @@
+#pragma once
+#include "vdb/crc32.hpp"
+#include "vdb/protocol.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace VDB {
+using WirePacket = std::vector<uint8_t>; // 0x00 delimeted, cobs encoded
+
+/**
+ * COBS encodes a whole packet, with a delimiter on both ends
+ * @param in the packet to encode
+ * @param out where the encoded frame is written
+ */
+void CobsEncode(const VDP::Packet &in, WirePacket &out);
+/**
+ * COBS decodes a single frame, stopping at the first delimiter
+ * @param in an encoded frame without its leading delimiter
+ * @param out where the decoded packet is written
+ */
+void CobsDecode(const WirePacket &in, VDP::Packet &out);
+/**
+ * finds the first zero byte, checking a word or vector at a time where the
+ * target allows it
+ * @param buf bytes to search
+ * @param size how many bytes there are
+ * @return the index of the first zero, or size if there isn't one
+ */
+size_t find_zero(const uint8_t *buf, size_t size);
+
+/**
+ * COBS encodes a packet given in pieces and hands the encoded frame, with a
+ * delimiter on both ends, to a write function a chunk at a time. Only a
+ * small staging buffer is used, so the frame never exists in memory whole
+ */
+class CobsFrameEncoder {
+  public:
+    /**
+     * takes a chunk of the encoded frame
+     * @return false to give up on the rest of the frame
+     */
+    using WriteFn = std::function<bool(const uint8_t *data, size_t size)>;
+    /**
+     * encodes a packet
+     * @param spans the pieces of the packet, in order
+     * @param count how many pieces there are
+     * @param write called with each chunk of the frame, in order
+     * @return false if write gave up partway
+     */
+    bool encode(const VDP::PacketSpan *spans, size_t count, const WriteFn &write);
+    /**
+     * @param size how long a packet is
+     * @return the most bytes encoding it can take, delimiters included
+     */
+    static size_t max_encoded_size(size_t size);
+
+  private:
+    /**
+     * encodes some bytes of the packet into the staging buffer
+     */
+    bool add(const uint8_t *data, size_t size, const WriteFn &write);
+    /**
+     * writes out every finished block and moves the open one to the front
+     */
+    bool flush(const WriteFn &write);
+
+    // room for a few finished blocks and one open one
+    static constexpr size_t STAGING_SIZE = 512;
+    uint8_t staging[STAGING_SIZE];
+    // where the open block's code byte goes
+    size_t code_head = 0;
+    size_t head = 0;
+    // the last block was a full 254 bytes, the next one hasn't started
+    bool block_full = false;
+};
+
+/**
+ * Splits a byte stream into 0x00 delimited frames and COBS decodes each frame
+ * as its bytes arrive, checking the frame's CRC32 along the way. Decoded
+ * bytes go straight into the caller's packet, so a finished frame is ready to
+ * parse without another copy.
+ */
+class CobsFrameDecoder {
+  public:
+    enum class Result {
+        // ran out of bytes before the end of a frame
+        Incomplete,
+        // the packet holds a whole frame with a good checksum
+        Ok,
+        // a whole frame whose checksum didn't match
+        BadChecksum,
+        // a frame too short to have a header and checksum
+        TooSmall,
+        // a frame longer than the maximum, the rest of it will be skipped
+        TooLarge,
+        // a delimiter showed up in the middle of a COBS block
+        Truncated,
+    };
+    /**
+     * @param max_size the longest decoded frame to accept
+     */
+    explicit CobsFrameDecoder(size_t max_size);
+    /**
+     * decodes bytes into a packet, stopping at the end of the first frame
+     * @param buf bytes from the wire
+     * @param size how many bytes there are
+     * @param out where the frame is decoded to. Pass the same packet until
+     * this returns something other than Incomplete
+     * @param consumed set to how many bytes were used
+     * @return what ended the frame, or Incomplete if every byte was used
+     */
+    Result decode(const uint8_t *buf, size_t size, VDP::Packet &out, size_t &consumed);
+    /**
+     * throws away a partly decoded frame, decoding starts again after the
+     * next delimiter
+     */
+    void resync();
+    /**
+     * @param check false to hand over frames without checking their
+     * checksum, for when something after framing has to change the bytes
+     * first. Ok then only means the frame was long enough
+     */
+    void set_check_crc(bool check);
+
+  private:
+    /**
+     * gets ready for a new frame
+     */
+    void start_frame(VDP::Packet &out);
+    /**
+     * checksums everything but the last 4 bytes decoded so far, those might
+     * be the checksum itself
+     */
+    void update_crc(const VDP::Packet &out);
+    /**
+     * checks a frame that just ended
+     */
+    Result finish_frame(VDP::Packet &out);
+
+    size_t max_size;
+    CRC32 crc;
+    // how much of the packet has been added to crc
+    size_t crc_done = 0;
+    // bytes left in the current COBS block, 0 when the next byte is a code
+    uint8_t left_in_block = 0;
+    uint8_t last_code = 0;
+    bool in_frame = false;
+    bool skipping = false;
+    bool check_crc = true;
+};
+
+} // namespace VDB
@@ -0,0 +1,74 @@
+#pragma once
+#include "vdb/protocol.hpp"
+#include <cstddef>
+#include <cstdint>
+
+namespace VDB {
+// a decoded, checked packet waiting for the packet handler, stamped when its
+// delimiter arrived
+struct InboundFrame {
+    VDP::Packet *packet;
+    uint64_t rx_time_us;
+};
+
+/**
+ * what to throw away when frames arrive faster than the packet handler
+ * takes them
+ */
+enum class DropPolicy {
+    // the frame that just arrived
+    DropNewest,
+    // the frame that has been waiting longest
+    DropOldest,
+    // an older frame of the same channel, so every channel keeps its latest
+    // value. Falls back to the oldest data frame. Data never takes the last
+    // CONTROL_RESERVE buffers and is never dropped for a broadcast, ping or
+    // request, so those are only dropped once that many are waiting
+    LatestPerChannel,
+};
+
+// buffers only control frames can take under LatestPerChannel
+constexpr size_t CONTROL_RESERVE = 2;
+
+/**
+ * which frame a drop policy gave up to keep the one that just arrived
+ */
+struct DropChoice {
+    // index of the queued frame to drop, or the number of queued frames to
+    // drop the one that just arrived instead
+    size_t victim;
+    // whether the dropped frame is channel data
+    bool data;
+    // whether it was dropped for a newer frame of the same channel
+    bool superseded;
+};
+
+/**
+ * @param pac a decoded frame
+ * @param id set to the frame's channel if it is data, INVALID_CHANNEL_ID if
+ * its id is bad
+ * @return whether the frame is channel data
+ */
+bool get_data_channel(const VDP::Packet &pac, VDP::ChannelID &id);
+
+/**
+ * @param policy the drop policy in use
+ * @param data whether the frame that just arrived is channel data
+ * @param num_free receive buffers nothing is using
+ * @return whether the frame can take a free buffer, rather than making room
+ * with choose_drop
+ */
+bool may_take_buffer(DropPolicy policy, bool data, size_t num_free);
+
+/**
+ * picks the frame to drop when a frame arrives and there's no buffer for it
+ * @param policy the drop policy in use
+ * @param queued the frames waiting for the packet handler, oldest first.
+ * DropOldest only looks at the first
+ * @param count how many there are
+ * @param data whether the frame that just arrived is channel data
+ * @param new_id its channel, if it is
+ */
+DropChoice choose_drop(DropPolicy policy, const InboundFrame *queued, size_t count, bool data,
+                       VDP::ChannelID new_id);
+} // namespace VDB
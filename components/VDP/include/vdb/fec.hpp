@@ -0,0 +1,76 @@
+#pragma once
+#include "vdb/protocol.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace VDB {
+/**
+ * Reed-Solomon forward error correction over GF(256), applied to whole frames.
+ * A frame is split into as few codewords of at most 255 bytes as it takes,
+ * and the codewords are interleaved byte by byte, so a burst of bad bytes on
+ * the wire is spread across codewords instead of overwhelming one. The
+ * parity for every codeword goes after the packet and carries on the same
+ * rotation, so a burst across the end of the packet is spread too. Each
+ * codeword can fix up to parity / 2 bad bytes
+ */
+class ReedSolomon {
+  public:
+    // the most parity bytes a codeword can have
+    static constexpr size_t MAX_PARITY = 64;
+    /**
+     * @param parity parity bytes per codeword, 0 turns correction off.
+     * Clamped to MAX_PARITY
+     */
+    explicit ReedSolomon(size_t parity = 0);
+    /**
+     * @return parity bytes per codeword
+     */
+    size_t parity() const;
+    /**
+     * @return whether frames carry parity at all
+     */
+    bool enabled() const;
+    /**
+     * @param size how long a packet is
+     * @return how many parity bytes are added after it
+     */
+    size_t overhead(size_t size) const;
+    /**
+     * works out the parity for a packet given in pieces
+     * @param spans the pieces of the packet, in order
+     * @param count how many pieces there are
+     * @param out set to the parity to send after the packet
+     */
+    void protect(const VDP::PacketSpan *spans, size_t count, std::vector<uint8_t> &out) const;
+    /**
+     * fixes what it can in a frame with parity on the end, then takes the
+     * parity off
+     * @param frame the packet followed by its parity
+     * @return how many bytes were fixed, or -1 if there were too many bad
+     * bytes to fix. Some codewords may have been fixed in that case, the
+     * frame should just be dropped
+     */
+    int repair(VDP::Packet &frame) const;
+
+  private:
+    /**
+     * fixes a single codeword in place
+     * @param codeword data followed by parity
+     * @param size length of the codeword, at most 255
+     * @return how many bytes were fixed, or -1 if it can't be fixed
+     */
+    int decode(uint8_t *codeword, size_t size) const;
+    /**
+     * @param data_size how many packet bytes there are
+     * @return how many codewords they're split into
+     */
+    size_t num_codewords(size_t data_size) const;
+
+    size_t nparity;
+    // log of each coefficient of the generator polynomial, highest power
+    // first and without the leading 1
+    uint8_t generator_log[MAX_PARITY];
+};
+
+} // namespace VDB
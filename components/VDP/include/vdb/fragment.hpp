@@ -0,0 +1,95 @@
+#pragma once
+#include "vdb/protocol.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace VDP {
+/**
+ * Packets bigger than a link's MTU are sent as fragments, each a packet of
+ * its own:
+ * header (Fragment flag, type and function of the whole packet) | uint16
+ * message id | uint8 index | uint8 count | piece of the packet | checksum
+ * The pieces put back together are the whole packet, checksum and all, so
+ * it gets checked end to end once it is rebuilt
+ */
+// header, message id, index, count and checksum
+constexpr size_t FRAGMENT_OVERHEAD = 1 + 2 + 1 + 1 + 4;
+// a packet can be split into at most this many fragments
+constexpr size_t MAX_FRAGMENTS = 255;
+
+/**
+ * splits a packet into fragments that each fit in the MTU
+ * @param pac the packet to split
+ * @param mtu the biggest packet the link should carry, more than
+ * FRAGMENT_OVERHEAD
+ * @param message_id tells this packet's fragments apart from any others in
+ * flight, should change with every split packet
+ * @param out set to the fragments, in order
+ * @return false if the packet would take more than MAX_FRAGMENTS
+ */
+bool fragment_packet(const Packet &pac, size_t mtu, uint16_t message_id, std::vector<Packet> &out);
+
+/**
+ * Puts fragments back together. Fragments of a few packets can arrive
+ * interleaved with each other and with whole packets. A packet whose
+ * fragments stop coming is thrown away after a timeout
+ */
+class Reassembler {
+  public:
+    enum class Result {
+        // still waiting on more fragments
+        Incomplete,
+        // that was the last fragment, the whole packet is ready
+        Complete,
+        // the fragment didn't make sense and was ignored
+        Bad,
+    };
+    // packets that can be partly received at once
+    static constexpr size_t MAX_PENDING = 4;
+    // the biggest packet it will rebuild
+    static constexpr size_t MAX_PACKET_SIZE = 16384;
+
+    // fragments taken in
+    int num_fragments = 0;
+    // whole packets rebuilt
+    int num_reassembled = 0;
+    // partly received packets thrown away for taking too long, or to make
+    // room for newer ones
+    int num_timeouts = 0;
+    // fragments that were malformed or didn't match the rest of their packet
+    int num_bad = 0;
+
+    /**
+     * @param timeout_us how long to wait for the rest of a packet after its
+     * first fragment
+     */
+    explicit Reassembler(uint32_t timeout_us = 500000);
+    /**
+     * takes in a fragment
+     * @param fragment a fragment with a good checksum
+     * @param rx_time_us when it arrived
+     * @param out set to the whole packet when this returns Complete
+     * @return whether the packet is complete
+     */
+    Result add(const Packet &fragment, uint64_t rx_time_us, Packet &out);
+
+  private:
+    struct Pending {
+        bool active = false;
+        uint16_t message_id = 0;
+        uint8_t count = 0;
+        uint8_t received = 0;
+        size_t size = 0;
+        uint64_t first_us = 0;
+        std::vector<Packet> pieces;
+    };
+    /**
+     * throws away packets that have waited too long
+     */
+    void expire(uint64_t now_us);
+
+    uint32_t timeout_us;
+    Pending pending[MAX_PENDING];
+};
+} // namespace VDP
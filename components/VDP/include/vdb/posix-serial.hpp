@@ -0,0 +1,112 @@
+#pragma once
+#include "vdb/cobs.hpp"
+#include "vdb/protocol.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace VDB {
+/**
+ * A serial port on Linux or macOS, for talking to the brain over its USB
+ * serial port from a computer instead of the board. Frames are COBS encoded
+ * the same way VDBDevice does it.
+ *
+ * The port is non-blocking and nothing here runs a thread. Whoever owns the
+ * device watches fd() with poll or epoll and calls handle_readable() and
+ * handle_writable() when the port is ready, and receive callbacks run from
+ * inside handle_readable().
+ * Only built for hosts, it isn't part of the ESP-IDF component
+ */
+class PosixSerialDevice : public VDP::AbstractDevice {
+  public:
+    // longest decoded frame we accept, anything longer is dropped
+    static constexpr size_t MAX_PACKET_SIZE = 2048;
+    // encoded bytes send_packet_spans lets pile up before it says Busy
+    static constexpr size_t TX_BUFFER_SIZE = 4096;
+
+    // frames dropped while decoding
+    int num_bad_checksum = 0;
+    int num_too_small = 0;
+    int num_too_large = 0;
+    int num_truncated = 0;
+    // packets turned away because too much was waiting to go out
+    int num_tx_busy = 0;
+
+    /**
+     * opens a serial port in raw mode
+     * @param path the port, like /dev/ttyACM0
+     * @param baud bits per second, ignored by USB serial but needed for real
+     * uarts and pseudo terminals don't mind it
+     */
+    PosixSerialDevice(const char *path, uint32_t baud);
+    ~PosixSerialDevice();
+    PosixSerialDevice(const PosixSerialDevice &) = delete;
+    PosixSerialDevice &operator=(const PosixSerialDevice &) = delete;
+
+    /**
+     * @return false if the port couldn't be opened or has failed since
+     */
+    bool is_open() const;
+    /**
+     * @return the port's file descriptor, for poll or epoll
+     */
+    int fd() const;
+    /**
+     * reads everything that has arrived and hands each whole packet to the
+     * receive callback
+     * @return false if the port closed or failed
+     */
+    bool handle_readable();
+    /**
+     * writes as much of the waiting output as the port takes
+     * @return false if the port failed
+     */
+    bool handle_writable();
+    /**
+     * @return true while output is waiting, watch for the port being
+     * writable until this is false
+     */
+    bool wants_write();
+
+    /**
+     * queues a packet and writes what the port takes straight away, never
+     * turning it away
+     */
+    bool send_packet(const VDP::Packet &packet) override;
+    /**
+     * queues a packet and writes what the port takes straight away
+     * @return Sent, Busy if TX_BUFFER_SIZE would be passed, or Failed if the
+     * port has failed
+     */
+    VDP::SendStatus send_packet_spans(const VDP::PacketSpan *spans, size_t count) override;
+    void register_receive_callback(std::function<void(const VDP::Packet &packet)> callback) override;
+    void register_timed_receive_callback(
+        std::function<void(const VDP::Packet &packet, uint64_t rx_time_us)> callback) override;
+    bool validates_checksums() const override;
+
+  private:
+    /**
+     * encodes a frame onto the end of the output. Call with tx_mutex held
+     */
+    void queue_frame(const VDP::PacketSpan *spans, size_t count);
+    /**
+     * writes what the port takes. Call with tx_mutex held
+     * @return false if the port failed
+     */
+    bool write_pending();
+
+    int port = -1;
+    CobsFrameDecoder decoder{MAX_PACKET_SIZE};
+    VDP::Packet inbound;
+    std::function<void(const VDP::Packet &packet, uint64_t rx_time_us)> callback =
+        [](const VDP::Packet &, uint64_t) {};
+
+    std::mutex tx_mutex;
+    CobsFrameEncoder encoder;
+    // encoded bytes the port hasn't taken yet, starting at tx_head
+    std::vector<uint8_t> tx_pending;
+    size_t tx_head = 0;
+};
+} // namespace VDB
@@ -12,6 +12,7 @@
 
 namespace VDB {
 uint32_t time_ms();
+uint64_t time_us();
 void delay_ms(uint32_t ms);
 } // namespace VDB
 
@@ -37,8 +38,15 @@ void delay_ms(uint32_t ms);
 #define VDPTracef(...)
 #endif
 
+// Upper bound on how many channels a registry will negotiate in one session.
+// Channel tables are sized by the number of channels actually negotiated, this
+// only caps how far they may grow
+#ifndef VDP_MAX_CHANNELS
+#define VDP_MAX_CHANNELS 4096
+#endif
+
 namespace VDP {
-constexpr size_t MAX_CHANNELS = 256;
+constexpr size_t MAX_CHANNELS = VDP_MAX_CHANNELS;
 
 class Part;
 // Shared Part Pointer to delete an object that has no pointer pointing to it
@@ -47,8 +55,56 @@ using PartPtr = std::shared_ptr<Part>;
 // Packet of bytes stored in a vector of 8 bit unsigned integers
 using Packet = std::vector<uint8_t>;
 
-// defines a channel id as an 8bit unsigned integer
-using ChannelID = uint8_t;
+// defines a channel id as a 16bit unsigned integer
+// on the wire it is a single byte unless the session negotiated varint ids
+using ChannelID = uint16_t;
+// what get_channel_id returns for an id that can't be one, past MAX_CHANNELS
+// or a broken varint. Packets carrying it are dropped
+constexpr ChannelID INVALID_CHANNEL_ID = 0xFFFF;
+static_assert(MAX_CHANNELS <= INVALID_CHANNEL_ID, "VDP_MAX_CHANNELS must fit in a ChannelID");
+/**
+ * the optional fields between the channel id and the data of a data packet,
+ * and when the receiver thinks the data was sampled
+ */
+struct DataInfo {
+    bool has_sequence = false;
+    // this channel's count of data packets sent, wrapping
+    uint16_t sequence = 0;
+    bool has_source_time = false;
+    // the sender's VDB::time_ms() when it fetched the data
+    uint32_t source_time_ms = 0;
+    // receiver only: when the device saw the end of the frame, in
+    // microseconds of the receiver's clock
+    int64_t rx_time_us = 0;
+    // receiver only: when the data was sampled in microseconds of the
+    // receiver's clock, 0 if unknown
+    int64_t time_us = 0;
+};
+/**
+ * running count, mean and max of a delay, for seeing where packets wait
+ */
+struct LatencyStats {
+    uint32_t count = 0;
+    uint64_t total_us = 0;
+    uint32_t max_us = 0;
+    /**
+     * @param us one more delay to count
+     */
+    void add(int64_t us) {
+        if (us < 0) {
+            return;
+        }
+        count++;
+        total_us += (uint64_t)us;
+        if ((uint64_t)us > max_us) {
+            max_us = (uint32_t)us;
+        }
+    }
+    /**
+     * @return the average delay, 0 if nothing was counted
+     */
+    uint32_t mean_us() const { return count == 0 ? 0 : (uint32_t)(total_us / count); }
+};
 class Channel {
   public:
     template <typename MutexType> friend class RegistryListener;
@@ -59,8 +115,10 @@ class Channel {
      */
     explicit Channel(PartPtr data) : data(data) {}
     PartPtr data;
+    // sequence and timing of the data packet this channel was last read from
+    DataInfo info;
     /*
-     * @return The Channel ID from 0 - 256
+     * @return The Channel ID from 0 - MAX_CHANNELS
      */
     ChannelID getID() const;
 
@@ -68,13 +126,17 @@ class Channel {
     /**
      * Creates a channel used for sending data to the brain
      * @param data Part Pointer of data to be stored at the channel
-     * @param channel_id The Channel ID to assign the channel from 0 - 256
+     * @param channel_id The Channel ID to assign the channel from 0 - MAX_CHANNELS
      */
     Channel(PartPtr data, ChannelID channel_id) : data(data), id(channel_id) {}
 
     ChannelID id = 0;
     Packet packet_scratch_space;
     bool acked = false;
+    // checksum of the broadcast that announced this channel, it covers the id
+    // and schema so two broadcasts with the same checksum describe the same
+    // channel
+    uint32_t schema_crc = 0;
     // std::vector
 };
 
@@ -97,6 +159,22 @@ enum class PacketFunction : uint8_t {
   Response = 0b01000000,
   Request = 0b01100000
 };
+/**
+ * optional bits in the low part of the header byte
+ * older senders leave these zero so their packets decode the same as before
+ */
+enum PacketFlags : uint8_t {
+    // the channel id after the header is a varint instead of a single byte
+    VarintChannelID = 0b00010000,
+    // a uint16 per channel sequence number follows the channel id of a data
+    // packet
+    Sequenced = 0b00001000,
+    // a uint32 VDB::time_ms() from the sender follows the sequence number (or
+    // the channel id if there is none) of a data packet
+    Timestamped = 0b00000100,
+    // the packet is one piece of a bigger packet, see vdb/fragment.hpp
+    Fragment = 0b00000010,
+};
 /**
  * struct to define the header of a packet,
  * defines wheether a packet is Broadcoast or data
@@ -105,6 +183,7 @@ enum class PacketFunction : uint8_t {
 struct PacketHeader {
     PacketType type;
     PacketFunction func;
+    uint8_t flags = 0;
 };
 enum PacketValidity : uint8_t {
     Ok,
@@ -112,6 +191,11 @@ enum PacketValidity : uint8_t {
     TooSmall,
 };
 PacketValidity validate_packet(const VDP::Packet &packet);
+/**
+ * @param packet a packet at least 4 bytes long
+ * @return the checksum stored in the last 4 bytes of the packet
+ */
+uint32_t get_written_checksum(const VDP::Packet &packet);
 /**
  * defines what byte value is what type in a packet
  */
@@ -195,7 +279,7 @@ class Part {
      */
     virtual void read_data_from_message(PacketReader &reader) = 0;
 
-    std::string get_name() const;
+    const std::string &get_name() const;
 
     virtual void Visit(Visitor *) = 0;
 
@@ -228,6 +312,7 @@ class Part {
 };
 /*
  * Defines a PacketReader, it reads packets
+ * it reads the packet in place, so the packet has to outlive the reader
  */
 class PacketReader {
   public:
@@ -235,13 +320,13 @@ class PacketReader {
      * Defines a PacketReader to read a packet
      * @param pac the packet to read
      */
-    PacketReader(Packet pac);
+    PacketReader(const Packet &pac);
     /**
      * Defines a PacketReader to read a packet with a set start location for the packet
      * @param pac the packet to read
      * @param start the start location for the reader to start reading from
      */
-    PacketReader(Packet pac, size_t start);
+    PacketReader(const Packet &pac, size_t start);
     /**
      * @return the current byte the reader is on
      */
@@ -258,8 +343,18 @@ class PacketReader {
      * @return a string of bytes the reader is reading until the next 0 byte (end of the Packet)
      */
     std::string get_string();
-
-    
+    /**
+     * reads an unsigned LEB128 varint, 7 bits per byte with the high bit set on all but the last byte
+     * @param value set to the varint
+     * @return false if it runs past the end of the packet or doesn't fit in 32 bits (5 bytes)
+     */
+    bool get_varint(uint32_t &value);
+    /**
+     * reads a channel id in the encoding the header says was used
+     * @param header the already decoded header of this packet
+     * @return the channel id, or INVALID_CHANNEL_ID if it is past MAX_CHANNELS or its varint is broken
+     */
+    ChannelID get_channel_id(const PacketHeader &header);
 
     /**
      * @return the value stored by a Number Part
@@ -290,7 +385,7 @@ class PacketReader {
     }
 
   private:
-    Packet pac;
+    const Packet &pac;
     size_t read_head;
 };
 /**
@@ -326,6 +421,21 @@ class PacketWriter {
      * @param str the string to write to the packet
      */
     void write_string(const std::string &str);
+    /**
+     * writes an unsigned LEB128 varint to the packet
+     * @param value the value to write
+     */
+    void write_varint(uint32_t value);
+    /**
+     * writes a channel id in the encoding this writer was told to use
+     * @param id the channel id to write
+     */
+    void write_channel_id(ChannelID id);
+    /**
+     * chooses between single byte and varint channel ids for every packet this writer makes
+     * @param use_varint true once the session has negotiated varint ids
+     */
+    void set_varint_channel_ids(bool use_varint);
     /**
      * writes a broadcast acknowledgement of a channel to the packet
      * @param chan the channel to write the acknowledgement for
@@ -346,11 +456,35 @@ class PacketWriter {
      * @param chan the Channel to write the data from
      */
     void write_data_message(const Channel &part);
+    /**
+     * writes the data from a channel to the packet with whichever of a
+     * sequence number and source timestamp the info has
+     * @param chan the Channel to write the data from
+     * @param info the sequence number and timestamp to include
+     */
+    void write_data_message(const Channel &part, const DataInfo &info);
+    /**
+     * writes a ping the receiver uses to line its clock up with ours
+     * @param time_ms VDB::time_ms() right before sending
+     */
+    void write_ping(uint32_t time_ms);
+    /**
+     * writes the answer to a ping
+     * @param ping_time_ms the time from the ping being answered
+     * @param local_time_us our clock when the ping arrived
+     */
+    void write_pong(uint32_t ping_time_ms, uint64_t local_time_us);
     /**
      * writes a request for a channel schematic to the packets
      * @param chan the Channel to write the data from
      */
     void write_request();
+    /**
+     * writes a request that also promises the bus stays quiet for a while,
+     * so the receiver can send anything it has queued up
+     * @param window_us how long the sender will stay off the bus
+     */
+    void write_request(uint32_t window_us);
     /**
      * @return the packet the writer is writing to
      */
@@ -367,11 +501,41 @@ class PacketWriter {
     }
 
   private:
+    /**
+     * writes a data packet, optionally with a sequence number and timestamp
+     * after the id
+     */
+    void write_data_packet(const Channel &chan, const DataInfo *info);
+    /**
+     * @return the header flags describing how this writer encodes channel ids
+     */
+    uint8_t id_flags() const;
+
     Packet &sofar;
+    bool varint_ids = false;
 };
 /**
  * defines a generic device to trasmit packets through
  */
+/**
+ * a run of bytes that makes up part of a packet being sent
+ */
+struct PacketSpan {
+    const uint8_t *data;
+    size_t size;
+};
+/**
+ * what happened to a packet handed to a device
+ */
+enum class SendStatus {
+    // the device has the packet, the caller's buffers can be reused
+    Sent,
+    // the device has no room right now, nothing was sent. Try again later or drop it
+    Busy,
+    // the device couldn't send the packet
+    Failed,
+};
+
 class AbstractDevice {
   public:
     /** Sends a packet over some transmission medium
@@ -381,12 +545,36 @@ class AbstractDevice {
      * @return whether the packet was sent sucessfully or not
      */
     virtual bool send_packet(const VDP::Packet &packet) = 0;
+    /**
+     * sends a packet made of several pieces without waiting for room on the
+     * transmission medium. The pieces are sent back to back as if they were
+     * one packet, including the checksum at the end
+     * The default joins the pieces and calls send_packet, devices that can
+     * send without copying or blocking override this
+     * @param spans the pieces of the packet, in order
+     * @param count how many pieces there are
+     * @return Sent once the device has the packet, Busy if it has no room
+     */
+    virtual SendStatus send_packet_spans(const PacketSpan *spans, size_t count);
     /**
      * a callback to function that runs when a new packet is available
      * @param the function for the callback to call
      * me when my ex-wife
      */
     virtual void register_receive_callback(std::function<void(const VDP::Packet &packet)> callback) = 0;
+    /**
+     * a callback that also gets the time the device saw the end of the frame
+     * @param callback called with the packet and its receive time in
+     * microseconds. The default stamps packets when the callback runs, devices
+     * that know better override this
+     */
+    virtual void
+    register_timed_receive_callback(std::function<void(const VDP::Packet &packet, uint64_t rx_time_us)> callback);
+    /**
+     * @return true if the device only hands over packets whose checksum it
+     * already checked, so the receiver doesn't need to check again
+     */
+    virtual bool validates_checksums() const;
     /**
      *  deleter for the device, used to delete it when it is no longer needed
      */
@@ -411,10 +599,19 @@ PacketHeader decode_header_byte(uint8_t hb);
 /**
  * Decodes the broadcast in a packet
  * @param packet the packet to decode
- * @return the pair of the Channel ID and the Part Pointer of the packet schematic
+ * @return the pair of the Channel ID and the Part Pointer of the packet schematic, or
+ * INVALID_CHANNEL_ID and nullptr if the id is bad
  */
 std::pair<ChannelID, PartPtr> decode_broadcast(const Packet &packet);
 
 std::pair<ChannelID, PartPtr> decode_data(const Packet &packet);
+/**
+ * reads the optional sequence number and timestamp that follow the channel id
+ * of a data packet
+ * @param reader a reader positioned right after the channel id
+ * @param header the header of the packet being read
+ * @return the fields the header says are there
+ */
+DataInfo read_data_info(PacketReader &reader, const PacketHeader &header);
 
 } // namespace VDP
@@ -1,8 +1,57 @@
 #pragma once
+#include "vdb/clock-sync.hpp"
+#include "vdb/fragment.hpp"
 #include "vdb/protocol.hpp"
+#include <atomic>
 #include <deque>
+#include <mutex>
 
 namespace VDP {
+/**
+ * how a broadcast changed the listener's channel table
+ */
+enum class BroadcastChange {
+  // a channel id we had no schema for
+  Added,
+  // a known channel id with a different schema than before
+  Changed,
+  // a known channel id re-announced with the same schema, consumers can keep
+  // using it as-is
+  Unchanged,
+  // the brain restarted its registry and did not re-announce this channel
+  // before sending data again
+  Removed,
+};
+
+/**
+ * link quality counters for one channel, only sequenced data packets count
+ * towards lost and reordered
+ */
+struct ChannelStats {
+  // data packets received on this channel
+  uint32_t received = 0;
+  // sequence numbers that were skipped over
+  uint32_t lost = 0;
+  // packets that showed up with a sequence number at or before one we already
+  // had, either late or duplicated
+  uint32_t reordered = 0;
+  // last in-order sequence number seen
+  uint16_t last_sequence = 0;
+  // false until the first sequenced packet since the channel was announced
+  bool has_sequence = false;
+};
+
+/**
+ * the Reassembler's counters, copied out so they can be read from another
+ * thread
+ */
+struct FragmentStats {
+  int received = 0;
+  int reassembled = 0;
+  int timeouts = 0;
+  int bad = 0;
+};
+
 /**
  * defines a device registry for sending data or listening to data over a device
  */
@@ -10,7 +59,17 @@ template <typename MutexType> class RegistryListener {
 public:
   int num_bad = 0;
   int num_small = 0;
+  // totals of ChannelStats::lost and ChannelStats::reordered over all channels
+  int num_lost = 0;
+  int num_reordered = 0;
+  // from the end of a data frame arriving to its data callback starting
+  LatencyStats decode_latency;
+  // acks, pongs, responses and data the device had no room for
+  int num_send_busy = 0;
   using CallbackFn = std::function<void(const VDP::Channel &)>;
+  using BroadcastCallbackFn =
+      std::function<void(const VDP::Channel &, BroadcastChange)>;
+  using RawCallbackFn = std::function<void(const Packet &)>;
   /**
    * creates a device registry for sending data or listening to data over the
    * device
@@ -18,20 +77,29 @@ public:
    * @param reg_type the type of registry it is (Listener or Controller)
    */
   RegistryListener(AbstractDevice *device) : device(device) {
-    device->register_receive_callback([&](const Packet &p) {
-      printf("Listener: GOT PACKET\n");
-      take_packet(p);
-    });
+    device->register_timed_receive_callback(
+        [&](const Packet &p, uint64_t rx_time_us) {
+          take_packet(p, rx_time_us);
+        });
   };
   /**
    * @brief Call this if you are a device who has a packet for the protocol to
    * decode
    * @param pac the packet to take.
    */
-  void take_packet(const Packet &pac) {
+  void take_packet(const Packet &pac) { take_packet(pac, VDB::time_us()); }
+  /**
+   * @brief Call this if you are a device who has a packet for the protocol to
+   * decode and know when it arrived
+   * @param pac the packet to take.
+   * @param rx_time_us VDB::time_us() when the end of the packet arrived
+   */
+  void take_packet(const Packet &pac, uint64_t rx_time_us) {
     VDPTracef("Received packet of size %d", (int)pac.size());
-    // checks the validity of the packet
-    const VDP::PacketValidity status = validate_packet(pac);
+    // checks the validity of the packet, unless the device already did
+    const VDP::PacketValidity status =
+        device->validates_checksums() ? VDP::PacketValidity::Ok
+                                      : validate_packet(pac);
 
     if (status == VDP::PacketValidity::BadChecksum) {
       VDPWarnf("Listener: Bad packet checksum. Skipping");
@@ -48,52 +116,133 @@ public:
     }
     // checks the packet function from the header
     const VDP::PacketHeader header = VDP::decode_header_byte(pac[0]);
+    if (header.flags & PacketFlags::Fragment) {
+      // one piece of a bigger packet, hold onto it until the rest arrive
+      Packet whole;
+      Reassembler::Result result;
+      {
+        std::lock_guard<MutexType> lock(stats_mutex);
+        result = reassembler.add(pac, rx_time_us, whole);
+      }
+      if (result != Reassembler::Result::Complete) {
+        return;
+      }
+      // the device only checked the pieces, the whole packet has a checksum
+      // of its own
+      if (validate_packet(whole) != VDP::PacketValidity::Ok) {
+        VDPWarnf("Listener: Bad checksum on a reassembled packet. Skipping");
+        num_bad++;
+        return;
+      }
+      take_packet(whole, rx_time_us);
+      return;
+    }
     if (header.func == VDP::PacketFunction::Send) {
       VDPTracef("Listener: PacketFunction Send");
 
       if (header.type == VDP::PacketType::Data) {
         // if the packet is a data, get the data from the packet
         VDPTracef("Listener: PacketType Data");
-        // get the channel id from the second byte of the packet
-        const ChannelID id = pac[1];
+        // data means the brain is done announcing channels
+        finish_negotiation();
+        // creates a PacketReader starting after the header byte
+        PacketReader reader{pac, 1};
+        // get the channel id, either a single byte or a varint
+        const ChannelID id = reader.get_channel_id(header);
+        if (id == INVALID_CHANNEL_ID) {
+          VDPWarnf("Listener: Data packet with a bad channel id. dropping");
+          return;
+        }
         // stores the channel id's schema in a Part Pointer
         const PartPtr part = get_remote_schema(id);
         if (part == nullptr) {
           VDPDebugf("VDB-Listener: No channel information for id: %d", id);
           return;
         }
-        // creates a PacketReader starting after the channel id location
-        PacketReader reader{pac, 2};
+        // sequence number and source timestamp, if the brain sent them
+        DataInfo info = read_data_info(reader, header);
+        {
+          std::lock_guard<MutexType> lock(stats_mutex);
+          ChannelStats &stats = channel_stats[id];
+          stats.received++;
+          if (info.has_sequence) {
+            count_sequence(stats, info.sequence);
+          }
+        }
+        // when the brain sampled it if we can tell, otherwise when it got here
+        info.rx_time_us = (int64_t)rx_time_us;
+        if (info.has_source_time && clock.synced()) {
+          info.time_us = clock.to_local_us(info.source_time_ms);
+        } else {
+          info.time_us = info.rx_time_us;
+        }
+        if (on_raw) {
+          on_raw(pac);
+        }
+        if (!decode_data) {
+          return;
+        }
+        decode_latency.add((int64_t)VDB::time_us() - info.rx_time_us);
         // stores the data read from the packet to the Registry Part
         part->read_data_from_message(reader);
         // runs the channel's on data callback
-        on_data(Channel{part, id});
+        Channel chan{part, id};
+        chan.info = info;
+        on_data(chan);
       } else if (header.type == VDP::PacketType::Broadcast) {
         printf("got broadcast packet\n");
         // if the packet is a broadcast, decode the packet
         VDPTracef("Listener: PacketType Broadcast", "");
         auto decoded = VDP::decode_broadcast(pac);
+        if (decoded.first == INVALID_CHANNEL_ID) {
+          VDPWarnf("Listener: Broadcast with a bad channel id. dropping");
+          return;
+        }
         // create a channel and give it the decoded packet
         VDP::Channel chan{decoded.second, decoded.first};
+        // the checksum covers the id and schema, so it fingerprints the schema
+        chan.schema_crc = get_written_checksum(pac);
         // checks if the new channel is outside of the vector of remote channels
         if (channels.size() < chan.id) {
           VDPWarnf("Listener: Out of order broadcast. dropping");
           return;
         }
-        // adds the channel to the vector of remote channels
-        channels.push_back(chan);
+        // the brain picks the id encoding, answer in whatever it used
+        varint_ids = (header.flags & PacketFlags::VarintChannelID) != 0;
+        // adds the channel to the table, or keeps the one we had if nothing
+        // about it changed
+        const BroadcastChange change = store_broadcast(chan);
         VDPTracef("Listener: Got broadcast of channel %d", int(chan.id));
         // runs the channel's on broadcast callback
-        on_broadcast(chan);
+        on_broadcast(channels[chan.id], change);
+        if (on_raw) {
+          on_raw(pac);
+        }
 
         // creates a packet and writes the channel acknowledgement to it,
         // then sends it to the device
         Packet scratch;
         PacketWriter writer{scratch};
-        writer.write_channel_acknowledge(chan);
-        device->send_packet(writer.get_packet());
+        writer.set_varint_channel_ids(varint_ids);
+        writer.write_channel_acknowledge(channels[chan.id]);
+        send(writer.get_packet());
         printf("Listener: sent channel ack\n");
       }
+    } else if (header.func == VDP::PacketFunction::Request &&
+               header.type == VDP::PacketType::Data) {
+      // a ping, answer right away so the brain can time the round trip
+      VDPTracef("Listener: PacketType Ping");
+      PacketReader reader{pac, 1};
+      const uint32_t ping_time_ms = reader.get_number<uint32_t>();
+      {
+        std::lock_guard<MutexType> lock(stats_mutex);
+        clock.add_sample(ping_time_ms, (int64_t)rx_time_us);
+      }
+
+      Packet scratch;
+      PacketWriter writer{scratch};
+      writer.write_pong(ping_time_ms, rx_time_us);
+      send(writer.get_packet());
     } else if (header.func == VDP::PacketFunction::Request) {
       printf("got request packet\n");
       // if the packet is a data, get the data from the packet
@@ -102,10 +251,11 @@ public:
       if(channel_response_queue.size() > 0){
         Packet scratch;
         PacketWriter writer{scratch};
+        writer.set_varint_channel_ids(varint_ids);
         response_queue_mutex.lock();
         writer.write_response(channel_response_queue);
         response_queue_mutex.unlock();
-        device->send_packet(writer.get_packet());
+        send(writer.get_packet());
         printf("Listener: sent available data\n");
       }
       else{
@@ -125,18 +275,55 @@ public:
       printf("packet type is not data, not usable data\n");
       return false;
     }
-    VDP::Channel channel_response = channels[id];
-    channel_response.data = data;
-    if (channels.size() < id) {
+    if (id >= channels.size()) {
       printf("cannot respond to channel: %d, channel does not exist\n", id);
       return false;
     }
+    VDP::Channel channel_response = channels[id];
+    channel_response.data = data;
     response_queue_mutex.lock();
     channel_response_queue.push_back(channel_response);
     response_queue_mutex.unlock();
     return true;
   };
 
+  /**
+   * @return a copy of the link quality counters for every channel, indexed by
+   * channel id. Safe to call from another thread
+   */
+  std::vector<ChannelStats> get_channel_stats() const {
+    std::lock_guard<MutexType> lock(stats_mutex);
+    return channel_stats;
+  }
+  /**
+   * @return a copy of the estimate of the brain's clock built from its pings.
+   * Safe to call from another thread
+   */
+  ClockSync get_clock_sync() const {
+    std::lock_guard<MutexType> lock(stats_mutex);
+    return clock;
+  }
+  /**
+   * @return the counters for packets that came in as fragments. Safe to call
+   * from another thread
+   */
+  FragmentStats get_fragment_stats() const {
+    std::lock_guard<MutexType> lock(stats_mutex);
+    FragmentStats stats;
+    stats.received = reassembler.num_fragments;
+    stats.reassembled = reassembler.num_reassembled;
+    stats.timeouts = reassembler.num_timeouts;
+    stats.bad = reassembler.num_bad;
+    return stats;
+  }
+  /**
+   * splits packets we send that are bigger than this into fragments, so one
+   * big packet doesn't hold up everything behind it. The brain has to
+   * understand fragments
+   * @param new_mtu the biggest packet to send whole, 0 to never split
+   */
+  void set_mtu(size_t new_mtu) { mtu = new_mtu; }
+
   PartPtr get_remote_schema(ChannelID id) {
     if (id >= channels.size()) {
       return nullptr;
@@ -150,6 +337,20 @@ public:
    * schematic
    */
   void install_broadcast_callback(CallbackFn on_broadcastf) {
+    VDPTracef("Listener: Installed broadcast callback for ");
+    this->on_broadcast = [on_broadcastf](const VDP::Channel &chan,
+                                         BroadcastChange change) {
+      if (change != BroadcastChange::Removed) {
+        on_broadcastf(chan);
+      }
+    };
+  };
+  /**
+   * installs a callback that is told how each broadcast changed the channel
+   * table, including channels that went away after the brain restarted
+   * @param on_broadcastf the callback to run for every broadcast and removal
+   */
+  void install_broadcast_callback(BroadcastCallbackFn on_broadcastf) {
     VDPTracef("Listener: Installed broadcast callback for ");
     this->on_broadcast = (on_broadcastf);
   };
@@ -162,6 +363,24 @@ public:
     VDPTracef("Listener: Installed data callback for ");
     this->on_data = (on_dataf);
   };
+  /**
+   * installs a callback that gets every data and broadcast packet from the
+   * brain as is, once it is validated and put back together from fragments,
+   * for passing VDP along to something that decodes it itself. Data packets
+   * for channels that were never broadcast are left out
+   * @param on_rawf the callback to run with each packet
+   */
+  void install_raw_callback(RawCallbackFn on_rawf) {
+    VDPTracef("Listener: Installed raw callback");
+    this->on_raw = (on_rawf);
+  };
+  /**
+   * with decoding off, data packets are still counted and handed to the raw
+   * callback, but aren't decoded and the data callback doesn't run. Safe to
+   * call from another thread
+   * @param decode false when nothing needs data decoded
+   */
+  void set_decode_data(bool decode) { decode_data = decode; }
   /**
    * sets the data at the channel id to a Part Pointer and sends it to the
    * device
@@ -170,7 +389,7 @@ public:
    */
   bool send_data(ChannelID id, PartPtr data) {
     // checks if the channel is actually stored in the Registry
-    if (id > channels.size()) {
+    if (id >= channels.size()) {
       printf("VDB-Listener: Channel with ID %d doesn't exist yet\n", (int)id);
       return false;
     }
@@ -188,11 +407,11 @@ public:
     // it to the device
     VDP::Packet scratch;
     PacketWriter writ{scratch};
+    writ.set_varint_channel_ids(varint_ids);
 
     writ.write_data_message(chan);
-    VDP::Packet pac = writ.get_packet();
 
-    return device->send_packet(pac);
+    return send(writ.get_packet());
   };
   /**
    * sends channel schematics to the Registry device and checks for
@@ -200,6 +419,139 @@ public:
    * @return whether or not all channel's were acknowledgements
    */
 private:
+  /**
+   * hands a packet to the device without waiting for room to send it, so
+   * answering the brain never holds up receiving from it
+   * @param pac the packet to send
+   * @return whether the device took the packet
+   */
+  bool send(const Packet &pac) {
+    if (mtu != 0 && pac.size() > mtu) {
+      std::vector<Packet> fragments;
+      if (!fragment_packet(pac, mtu, next_message_id++, fragments)) {
+        VDPWarnf("Listener: %d byte packet is too big to fragment",
+                 (int)pac.size());
+        return false;
+      }
+      for (const Packet &fragment : fragments) {
+        if (!send_whole(fragment)) {
+          // the rest are no use without this one
+          return false;
+        }
+      }
+      return true;
+    }
+    return send_whole(pac);
+  }
+  /**
+   * hands a packet to the device as is
+   * @param pac the packet to send
+   * @return whether the device took the packet
+   */
+  bool send_whole(const Packet &pac) {
+    const PacketSpan span{pac.data(), pac.size()};
+    const SendStatus status = device->send_packet_spans(&span, 1);
+    if (status == SendStatus::Busy) {
+      VDPDebugf("Listener: device busy, dropped a %d byte packet",
+                (int)pac.size());
+      num_send_busy++;
+    }
+    return status == SendStatus::Sent;
+  }
+  /**
+   * puts a broadcast channel into the table, keeping the existing entry if
+   * its schema didn't change so anything holding its data keeps working
+   * @param chan the channel that was just broadcast
+   * @return how the table changed
+   */
+  BroadcastChange store_broadcast(const Channel &chan) {
+    std::lock_guard<MutexType> lock(stats_mutex);
+    if (!negotiating) {
+      negotiating = true;
+      restarted = false;
+      announced.assign(channels.size(), false);
+    }
+    // the brain hands out ids from 0, so seeing 0 again means it restarted
+    // its registry and will re-announce every channel it still has
+    if (chan.id == 0) {
+      restarted = true;
+      // its clock started over too
+      clock.reset();
+    }
+    if (announced.size() <= chan.id) {
+      announced.resize(chan.id + 1, false);
+    }
+    announced[chan.id] = true;
+
+    if (chan.id == channels.size()) {
+      channels.push_back(chan);
+      channel_stats.emplace_back();
+      return BroadcastChange::Added;
+    }
+    // the sender's sequence numbers start over when it re-announces
+    channel_stats[chan.id].has_sequence = false;
+    Channel &existing = channels[chan.id];
+    if (existing.data != nullptr && existing.schema_crc == chan.schema_crc) {
+      return BroadcastChange::Unchanged;
+    }
+    const BroadcastChange change = existing.data == nullptr
+                                       ? BroadcastChange::Added
+                                       : BroadcastChange::Changed;
+    existing = chan;
+    channel_stats[chan.id] = ChannelStats{};
+    return change;
+  }
+  /**
+   * called when data shows up after a run of broadcasts. If the brain
+   * restarted, drops every channel it didn't announce again
+   */
+  void finish_negotiation() {
+    if (!negotiating) {
+      return;
+    }
+    negotiating = false;
+    if (!restarted) {
+      return;
+    }
+    for (size_t id = 0; id < channels.size(); id++) {
+      if ((id < announced.size() && announced[id]) ||
+          channels[id].data == nullptr) {
+        continue;
+      }
+      const Channel removed = channels[id];
+      channels[id].data = nullptr;
+      on_broadcast(removed, BroadcastChange::Removed);
+    }
+    std::lock_guard<MutexType> lock(stats_mutex);
+    while (!channels.empty() && channels.back().data == nullptr) {
+      channels.pop_back();
+      channel_stats.pop_back();
+    }
+  }
+  /**
+   * updates a channel's loss and reorder counts with the sequence number of a
+   * packet that just arrived. Hold stats_mutex
+   * @param stats the channel's counters
+   * @param sequence the sequence number from the packet
+   */
+  void count_sequence(ChannelStats &stats, uint16_t sequence) {
+    if (!stats.has_sequence) {
+      stats.has_sequence = true;
+      stats.last_sequence = sequence;
+      return;
+    }
+    // wrapping distance from the last in-order packet
+    const int16_t delta = (int16_t)(uint16_t)(sequence - stats.last_sequence);
+    if (delta <= 0) {
+      stats.reordered++;
+      num_reordered++;
+      return;
+    }
+    stats.lost += delta - 1;
+    num_lost += delta - 1;
+    stats.last_sequence = sequence;
+  }
+
   ChannelID new_channel_id() {
     ChannelID id = next_channel_id;
     next_channel_id++;
@@ -207,10 +559,33 @@ private:
   }
   bool needs_ack = false;
   static constexpr size_t ack_ms = 500;
+  // whether this session's channel ids are varints, decided by the brain's
+  // broadcasts
+  bool varint_ids = false;
+  // true between the first broadcast of a run and the data that follows it
+  bool negotiating = false;
+  // true if this run of broadcasts started over from channel 0
+  bool restarted = false;
+  // which ids were announced during the current run of broadcasts
+  std::vector<bool> announced;
 
   AbstractDevice *device;
   // Our channels (us -> them)
+  // indexed by id, ids are handed out in order so this only grows with the
+  // number of channels negotiated, capped at MAX_CHANNELS
   std::vector<Channel> channels;
+  // link quality counters, parallel to channels
+  std::vector<ChannelStats> channel_stats;
+  // the brain's clock relative to ours, from its pings
+  ClockSync clock;
+  // puts fragmented packets from the brain back together
+  Reassembler reassembler;
+  // only this task changes channel_stats, clock and reassembler, but the
+  // webserver copies them out for /link_stats
+  mutable MutexType stats_mutex;
+  // packets we send bigger than this get fragmented, 0 for never
+  size_t mtu = 0;
+  uint16_t next_message_id = 0;
   ChannelID next_channel_id = 0;
   std::deque<Channel> chans_to_send;
 
@@ -220,7 +595,11 @@ private:
 
   MutexType response_queue_mutex;
 
-  CallbackFn on_broadcast = [&](VDP::Channel chan) {
+  BroadcastCallbackFn on_broadcast = [&](VDP::Channel chan,
+                                        BroadcastChange change) {
+    if (change == BroadcastChange::Removed) {
+      return;
+    }
     std::string schema_str = chan.data->pretty_print();
     printf("VDB-Listener: No Broadcast Callback installed: Received broadcast "
            "for channel id "
@@ -232,6 +611,8 @@ private:
            "%d:\n%s\n",
            int(chan.id), chan.data->pretty_print_data().c_str());
   };
+  RawCallbackFn on_raw = nullptr;
+  std::atomic<bool> decode_data{true};
   CallbackFn on_rec = [](VDP::Channel chan) {
     printf(
         "VDB Listener: No Data Callback installed: Received data for channel "
@@ -0,0 +1,187 @@
+#pragma once
+#include "vdb/cobs.hpp"
+#include "vdb/protocol.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <vector>
+
+namespace VDB {
+/**
+ * how the simulated serial line between the brain and the board behaves
+ */
+struct LinkModel {
+    // bits per second, every byte takes 10 bits on the wire
+    uint32_t baud = 115200;
+    // both ends share one pair of wires, so frames sent at the same time
+    // garble each other
+    bool half_duplex = true;
+    // how long an end needs after receiving before it can drive the bus
+    uint32_t turnaround_us = 0;
+    // chance of each bit on the wire being flipped
+    double bit_error_rate = 0;
+    // chance of a whole frame never arriving
+    double drop_rate = 0;
+    // delay on top of the time on the wire, like a USB adapter adds
+    uint32_t latency_us = 0;
+    // up to this much more delay, picked at random per frame. Frames still
+    // arrive in the order they were sent
+    uint32_t jitter_us = 0;
+    // bytes an end can have waiting to go out before sends come back Busy
+    size_t tx_buffer_size = 2048;
+    // longest decoded frame an end accepts
+    size_t max_packet_size = 2048;
+};
+
+/**
+ * Two devices joined by a simulated serial line, so both sides of the
+ * protocol can run together on a computer. Frames are COBS encoded exactly
+ * as VDBDevice sends them, take as long as they would at the model's baud
+ * rate, pick up bit errors, collisions and drops along the way, and are
+ * decoded and checked on the other end.
+ *
+ * Time is simulated and only moves forward in step() and run_until(), so
+ * runs are repeatable for a given seed. Code on the host that calls
+ * VDB::time_us() should have it return now_us()
+ *
+ * Only built on a computer, by tools/tests, it isn't part of the firmware
+ */
+class SimLink {
+  public:
+    /**
+     * one end of the link
+     */
+    class Endpoint : public VDP::AbstractDevice {
+      public:
+        // frames handed to the link
+        int num_sent = 0;
+        // bytes put on the wire, delimiters and COBS overhead included
+        uint64_t bytes_sent = 0;
+        // sends turned away because the transmit buffer was full
+        int num_busy = 0;
+        // good frames handed to the receive callback
+        int num_received = 0;
+        // frames that arrived with a checksum that didn't match
+        int num_bad_checksum = 0;
+        // frames too short to have a header and checksum
+        int num_too_small = 0;
+        // frames longer than max_packet_size
+        int num_too_large = 0;
+        // frames cut off by a delimiter in the middle of a COBS block
+        int num_truncated = 0;
+
+        bool send_packet(const VDP::Packet &packet) override;
+        /**
+         * puts a packet on the wire after whatever this end is already
+         * sending
+         * @param spans the pieces of the packet, in order
+         * @param count how many pieces there are
+         * @return Sent, or Busy if the transmit buffer doesn't have room
+         */
+        VDP::SendStatus send_packet_spans(const VDP::PacketSpan *spans, size_t count) override;
+        void register_receive_callback(std::function<void(const VDP::Packet &packet)> callback) override;
+        void register_timed_receive_callback(
+            std::function<void(const VDP::Packet &packet, uint64_t rx_time_us)> callback) override;
+        bool validates_checksums() const override;
+
+      private:
+        friend class SimLink;
+        Endpoint(SimLink *link, int index);
+        /**
+         * decodes bytes that came off the wire
+         * @param bytes what arrived, possibly damaged
+         * @param rx_time_us when the last byte arrived
+         */
+        void receive(const WirePacket &bytes, uint64_t rx_time_us);
+
+        SimLink *link;
+        int index;
+        CobsFrameDecoder decoder;
+        VDP::Packet inbound;
+        std::function<void(const VDP::Packet &packet, uint64_t rx_time_us)> callback =
+            [](const VDP::Packet &, uint64_t) {};
+        // when the last frame this end sent finishes going out
+        uint64_t tx_free_us = 0;
+        // when the last frame this end received finished coming in
+        uint64_t rx_end_us = 0;
+        // when the last frame this end sent arrives at the other end
+        uint64_t last_arrival_us = 0;
+    };
+
+    // frames lost to drop_rate
+    int num_dropped = 0;
+    // frames that overlapped a frame from the other end on a half-duplex link
+    int num_collisions = 0;
+    // bits flipped by bit_error_rate
+    int num_bit_errors = 0;
+
+    /**
+     * @param model how the line behaves
+     * @param seed starts the random errors, the same seed gives the same run
+     */
+    explicit SimLink(const LinkModel &model, uint32_t seed = 1);
+    SimLink(const SimLink &) = delete;
+    SimLink &operator=(const SimLink &) = delete;
+
+    /**
+     * @return the end the brain talks through
+     */
+    Endpoint &brain();
+    /**
+     * @return the end the board talks through
+     */
+    Endpoint &board();
+    /**
+     * @return the simulated time, in microseconds
+     */
+    uint64_t now_us() const;
+    /**
+     * moves time forward to the next frame arriving and delivers it.
+     * Anything sent from the receive callback goes out after that
+     * @return false if nothing was on the way
+     */
+    bool step();
+    /**
+     * delivers every frame that arrives up to a time, then moves time to it
+     * @param time_us when to stop, in simulated microseconds
+     */
+    void run_until(uint64_t time_us);
+
+  private:
+    struct Flight {
+        int to;
+        WirePacket bytes;
+        uint64_t start_us;
+        uint64_t end_us;
+        uint64_t arrival_us;
+        // the part that overlapped a frame going the other way, empty if
+        // nothing did
+        uint64_t collision_start_us = 0;
+        uint64_t collision_end_us = 0;
+    };
+
+    /**
+     * @param bytes bytes on the wire
+     * @return how long they take to send
+     */
+    uint64_t airtime_us(size_t bytes) const;
+    /**
+     * puts a frame on the wire
+     * @param from the end sending it
+     * @param bytes the encoded frame
+     * @return false if the transmit buffer is full
+     */
+    bool transmit(Endpoint &from, WirePacket &&bytes);
+    /**
+     * flips bits at random, and garbles bytes sent during a collision
+     */
+    void damage(Flight &flight);
+
+    LinkModel model;
+    std::mt19937 rng;
+    uint64_t now = 0;
+    Endpoint ends[2];
+    std::vector<Flight> in_flight;
+};
+} // namespace VDB
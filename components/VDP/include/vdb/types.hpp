@@ -45,7 +45,7 @@ class Record : public Part {
      */
     void set_fields(std::vector<PartPtr> fields);
 
-    std::vector<PartPtr> get_fields() const;
+    const std::vector<PartPtr> &get_fields() const;
 
     /**
      * sets the values of each Part the Record contains
@@ -111,7 +111,7 @@ class String : public Part {
     /**
      * @return the currently stored string
      */
-    std::string get_value();
+    const std::string &get_value();
 
     PartPtr clone() override;
     /**
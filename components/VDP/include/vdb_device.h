@@ -1,23 +1,141 @@
 #pragma once
 #include "driver/uart.h"
 #include "esp_err.h"
+#include "vdb/cobs.hpp"
+#include "vdb/drop-policy.hpp"
+#include "vdb/fec.hpp"
 #include "vdb/protocol.hpp"
+#include <mutex>
+
+// how many receive buffers are allocated up front, one is always being decoded
+// into and the rest can be waiting on or held by the packet handler
+#ifndef VDB_RX_POOL_SIZE
+#define VDB_RX_POOL_SIZE 12
+#endif
+
+// parity bytes per Reed-Solomon codeword on the brain link, 0 for none. Has
+// to match the brain
+#ifndef VDB_FEC_PARITY
+#define VDB_FEC_PARITY 0
+#endif
+
+namespace VDB {
+/**
+ * A fixed set of packet buffers allocated once at startup and handed out and
+ * back through a free-list. Safe to acquire from one task and release from
+ * another, so the uart task and the packet handler share it without ever
+ * touching the heap once running.
+ */
+class PacketPool {
+public:
+  /**
+   * @param count how many buffers to allocate
+   * @param packet_size capacity reserved in each buffer
+   */
+  PacketPool(size_t count, size_t packet_size);
+  /**
+   * @return a free buffer, or nullptr if every buffer is in use
+   */
+  VDP::Packet *acquire();
+  /**
+   * gives a buffer from acquire back to the pool
+   */
+  void release(VDP::Packet *packet);
+  size_t size() const;
+  // buffers not currently handed out
+  size_t num_free() const;
+
+private:
+  std::vector<VDP::Packet> packets;
+  QueueHandle_t free_list;
+};
+} // namespace VDB
+
 class VDBDevice : public VDP::AbstractDevice {
 
 public:
-  static constexpr size_t NUM_INCOMING_PACKETS = 10;
+  using DropPolicy = VDB::DropPolicy;
+
+  // the pool bounds how many frames can be in flight, so the queue never has
+  // to be the one to turn a frame away
+  static constexpr size_t NUM_INCOMING_PACKETS = VDB_RX_POOL_SIZE;
+  // buffers only control frames can take under LatestPerChannel
+  static constexpr size_t CONTROL_RESERVE = VDB::CONTROL_RESERVE;
+  static_assert(CONTROL_RESERVE + 2 <= NUM_INCOMING_PACKETS,
+                "data needs one buffer to decode into and one to queue");
+  // longest decoded frame we accept, anything longer is dropped
+  static constexpr size_t MAX_PACKET_SIZE = 2048;
+  // size of the driver's transmit ring, encoded frames are written into it
+  static constexpr size_t TX_BUFFER_SIZE = 2048;
+
+  // frames dropped because the packet handler fell behind
+  int num_queue_full = 0;
+  // times a frame arrived with no receive buffer it could use, each one drops
+  // a frame according to the drop policy
+  int num_pool_exhausted = 0;
+  // data frames dropped that way
+  int num_dropped_newest = 0;
+  int num_dropped_oldest = 0;
+  // broadcasts, pings and requests dropped that way, under LatestPerChannel
+  // only when the reserved buffers are all taken by other control frames
+  int num_dropped_control = 0;
+  // frames replaced by a newer frame of the same channel
+  int num_superseded = 0;
+  // frames dropped while decoding
+  int num_bad_checksum = 0;
+  int num_too_small = 0;
+  int num_too_large = 0;
+  int num_truncated = 0;
+  // times the hardware fifo overflowed and bytes were lost, decoding picks up
+  // again at the next delimiter
+  int num_fifo_overflow = 0;
+  // times the driver's ring buffer filled up. Nothing is lost until the fifo
+  // behind it overflows too
+  int num_buffer_full = 0;
+  // packets turned away because the transmit ring didn't have room
+  int num_tx_busy = 0;
+  // bytes the error correction fixed, and frames it couldn't fix
+  int num_fec_corrected = 0;
+  int num_fec_failed = 0;
+  // from the end of a frame arriving to the packet handler picking it up
+  VDP::LatencyStats queue_latency;
+  // the least stack the uart task has had left, in bytes, from its first
+  // event on
+  int uart_stack_free = INT32_MAX;
 
   VDBDevice(uart_port_t uart_num, int tx_num, int rx_num, int rts_num,
             int baud);
   bool send_packet(const VDP::Packet &pac) override;
+  VDP::SendStatus send_packet_spans(const VDP::PacketSpan *spans,
+                                    size_t count) override;
 
   void register_receive_callback(
       std::function<void(const VDP::Packet &packet)> callback) override;
+  void register_timed_receive_callback(
+      std::function<void(const VDP::Packet &packet, uint64_t rx_time_us)>
+          callback) override;
+  bool validates_checksums() const override;
 
   static void uart_event_task(void *pvParameters);
   static void packet_handler_thread(void *pvParameters);
 
   void handle_uart_bytes(const uint8_t *buf, int size);
+  /**
+   * decodes everything waiting in the driver's ring buffer
+   * @param buf scratch space to read into
+   * @param buf_size how big buf is
+   */
+  void drain_uart(uint8_t *buf, size_t buf_size);
+
+  void set_drop_policy(DropPolicy policy);
+  /**
+   * turns Reed-Solomon error correction on or off for both directions. Both
+   * ends of the link have to use the same parity, set this before any
+   * traffic
+   * @param parity parity bytes per codeword, 0 for none. Each codeword can
+   * fix up to parity / 2 bad bytes
+   */
+  void set_fec_parity(size_t parity);
 
   esp_err_t init_serial(VDBDevice *self, uart_port_t uart_num, int tx_num,
                         int rx_num, int rts_num, int baud);
@@ -26,16 +144,39 @@ private:
   uart_port_t uart_num;
   QueueHandle_t packet_queue;
 
-  std::vector<uint8_t> inbound_buffer;
-  std::function<void(const VDP::Packet &packet)> callback =
-      [](const VDP::Packet &) {};
-  QueueHandle_t uart0_queue;
-};
+  /**
+   * frees a buffer by dropping a queued frame, following the drop policy
+   * @param data whether the frame in rx_packet is channel data
+   * @param new_id its channel, if it is
+   * @return the freed buffer, or nullptr to drop the newest frame
+   */
+  VDP::Packet *make_room(bool data, VDP::ChannelID new_id);
 
-namespace VDB {
-using WirePacket = std::vector<uint8_t>; // 0x00 delimeted, cobs encoded
+  /**
+   * runs error correction on the frame in rx_packet and checks its checksum
+   * @return whether the frame is good to pass on
+   */
+  bool repair_frame();
 
-void CobsEncode(const VDP::Packet &in, WirePacket &out);
-void CobsDecode(const WirePacket &in, VDP::Packet &out);
+  DropPolicy drop_policy = DropPolicy::LatestPerChannel;
+  VDB::ReedSolomon fec{VDB_FEC_PARITY};
+  VDB::PacketPool pool;
+  // frames are decoded and checked as bytes come in, straight into rx_packet
+  VDB::CobsFrameDecoder decoder{MAX_PACKET_SIZE};
+  VDP::Packet *rx_packet;
+  std::function<void(const VDP::Packet &packet, uint64_t rx_time_us)>
+      callback = [](const VDP::Packet &, uint64_t) {};
+  QueueHandle_t uart0_queue;
 
-} // namespace VDB
+  /**
+   * COBS encodes a packet straight into the transmit ring, waiting for room
+   * if there isn't enough
+   */
+  bool write_frame(const VDP::PacketSpan *spans, size_t count);
+  // keeps frames from different senders from interleaving
+  std::mutex tx_mutex;
+  VDB::CobsFrameEncoder encoder;
+  // the packet's spans plus its parity, reused between sends
+  std::vector<VDP::PacketSpan> tx_spans;
+  std::vector<uint8_t> tx_parity;
+};
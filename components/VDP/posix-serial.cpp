@@ -0,0 +1,262 @@
+#include "vdb/posix-serial.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace VDB {
+namespace {
+/**
+ * @param baud bits per second
+ * @return the termios speed for it, or B0 if there isn't one
+ */
+speed_t termios_speed(uint32_t baud) {
+    switch (baud) {
+    case 9600:
+        return B9600;
+    case 19200:
+        return B19200;
+    case 38400:
+        return B38400;
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+    case 230400:
+        return B230400;
+#ifdef B460800
+    case 460800:
+        return B460800;
+#endif
+#ifdef B921600
+    case 921600:
+        return B921600;
+#endif
+    default:
+        return B0;
+    }
+}
+} // namespace
+
+/**
+ * opens a serial port in raw mode
+ * @param path the port, like /dev/ttyACM0
+ * @param baud bits per second
+ */
+PosixSerialDevice::PosixSerialDevice(const char *path, uint32_t baud) {
+    port = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (port < 0) {
+        VDPWarnf("Serial: couldn't open %s: %s", path, strerror(errno));
+        return;
+    }
+    termios tty;
+    if (tcgetattr(port, &tty) != 0) {
+        // not a terminal, a pipe or socket still works for testing
+        VDPDebugf("Serial: %s isn't a terminal, using it as is", path);
+        return;
+    }
+    cfmakeraw(&tty);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cflag &= ~CRTSCTS;
+    // with a minimum of 0 an empty port reads as end of file instead of
+    // EAGAIN, which looks just like the port going away
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+    const speed_t speed = termios_speed(baud);
+    if (speed == B0) {
+        VDPWarnf("Serial: %u baud isn't supported, leaving the speed alone", (unsigned)baud);
+    } else {
+        cfsetispeed(&tty, speed);
+        cfsetospeed(&tty, speed);
+    }
+    if (tcsetattr(port, TCSANOW, &tty) != 0) {
+        VDPWarnf("Serial: couldn't configure %s: %s", path, strerror(errno));
+    }
+    tcflush(port, TCIOFLUSH);
+}
+
+PosixSerialDevice::~PosixSerialDevice() {
+    if (port >= 0) {
+        close(port);
+    }
+}
+
+/**
+ * @return false if the port couldn't be opened or has failed since
+ */
+bool PosixSerialDevice::is_open() const { return port >= 0; }
+/**
+ * @return the port's file descriptor, for poll or epoll
+ */
+int PosixSerialDevice::fd() const { return port; }
+
+/**
+ * reads everything that has arrived and hands each whole packet to the
+ * receive callback
+ * @return false if the port closed or failed
+ */
+bool PosixSerialDevice::handle_readable() {
+    if (port < 0) {
+        return false;
+    }
+    uint8_t buf[1024];
+    while (true) {
+        const ssize_t n = read(port, buf, sizeof(buf));
+        if (n == 0) {
+            // the other end of a pipe went away
+            close(port);
+            port = -1;
+            return false;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            VDPWarnf("Serial: read failed: %s", strerror(errno));
+            close(port);
+            port = -1;
+            return false;
+        }
+        const uint64_t rx_time_us = VDB::time_us();
+
+        size_t pos = 0;
+        while (pos < (size_t)n) {
+            size_t consumed = 0;
+            const CobsFrameDecoder::Result res = decoder.decode(buf + pos, (size_t)n - pos, inbound, consumed);
+            pos += consumed;
+            switch (res) {
+            case CobsFrameDecoder::Result::Incomplete:
+                break;
+            case CobsFrameDecoder::Result::Ok:
+                callback(inbound, rx_time_us);
+                break;
+            case CobsFrameDecoder::Result::BadChecksum:
+                num_bad_checksum++;
+                break;
+            case CobsFrameDecoder::Result::TooSmall:
+                num_too_small++;
+                break;
+            case CobsFrameDecoder::Result::TooLarge:
+                num_too_large++;
+                break;
+            case CobsFrameDecoder::Result::Truncated:
+                num_truncated++;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * writes as much of the waiting output as the port takes
+ * @return false if the port failed
+ */
+bool PosixSerialDevice::handle_writable() {
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    return write_pending();
+}
+
+/**
+ * @return true while output is waiting
+ */
+bool PosixSerialDevice::wants_write() {
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    return tx_head < tx_pending.size();
+}
+
+/**
+ * queues a packet and writes what the port takes straight away, never
+ * turning it away
+ */
+bool PosixSerialDevice::send_packet(const VDP::Packet &packet) {
+    const VDP::PacketSpan span{packet.data(), packet.size()};
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    if (port < 0) {
+        return false;
+    }
+    queue_frame(&span, 1);
+    return write_pending();
+}
+
+/**
+ * queues a packet and writes what the port takes straight away
+ * @return Sent, Busy if TX_BUFFER_SIZE would be passed, or Failed if the
+ * port has failed
+ */
+VDP::SendStatus PosixSerialDevice::send_packet_spans(const VDP::PacketSpan *spans, size_t count) {
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size += spans[i].size;
+    }
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    if (port < 0) {
+        return VDP::SendStatus::Failed;
+    }
+    const size_t waiting = tx_pending.size() - tx_head;
+    // a frame bigger than the whole buffer still goes out once the rest has
+    if (waiting > 0 && waiting + CobsFrameEncoder::max_encoded_size(size) > TX_BUFFER_SIZE) {
+        num_tx_busy++;
+        return VDP::SendStatus::Busy;
+    }
+    queue_frame(spans, count);
+    return write_pending() ? VDP::SendStatus::Sent : VDP::SendStatus::Failed;
+}
+
+/**
+ * encodes a frame onto the end of the output. Call with tx_mutex held
+ */
+void PosixSerialDevice::queue_frame(const VDP::PacketSpan *spans, size_t count) {
+    if (tx_head == tx_pending.size()) {
+        tx_pending.clear();
+        tx_head = 0;
+    }
+    encoder.encode(spans, count, [this](const uint8_t *data, size_t size) {
+        tx_pending.insert(tx_pending.end(), data, data + size);
+        return true;
+    });
+}
+
+/**
+ * writes what the port takes. Call with tx_mutex held
+ * @return false if the port failed
+ */
+bool PosixSerialDevice::write_pending() {
+    while (port >= 0 && tx_head < tx_pending.size()) {
+        const ssize_t n = write(port, tx_pending.data() + tx_head, tx_pending.size() - tx_head);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            VDPWarnf("Serial: write failed: %s", strerror(errno));
+            return false;
+        }
+        tx_head += (size_t)n;
+    }
+    if (tx_head == tx_pending.size()) {
+        tx_pending.clear();
+        tx_head = 0;
+    } else if (tx_head > TX_BUFFER_SIZE) {
+        // keep what's left at the front so the buffer doesn't creep
+        tx_pending.erase(tx_pending.begin(), tx_pending.begin() + tx_head);
+        tx_head = 0;
+    }
+    return port >= 0;
+}
+
+void PosixSerialDevice::register_receive_callback(std::function<void(const VDP::Packet &packet)> new_callback) {
+    callback = [new_callback](const VDP::Packet &packet, uint64_t) { new_callback(packet); };
+}
+void PosixSerialDevice::register_timed_receive_callback(
+    std::function<void(const VDP::Packet &packet, uint64_t rx_time_us)> new_callback) {
+    callback = new_callback;
+}
+bool PosixSerialDevice::validates_checksums() const { return true; }
+} // namespace VDB
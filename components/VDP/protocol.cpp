@@ -99,7 +99,7 @@ Part::Part(std::string name) : name(std::move(name)) {}
  */
 Part::~Part() {}
 
-std::string Part::get_name() const { return name; }
+const std::string &Part::get_name() const { return name; }
 
 void Part::response() {}
 /**
@@ -123,13 +123,13 @@ std::string Part::pretty_print_data() const {
  * Defines a PacketReader to read a packet
  * @param pac the packet to read
  */
-PacketReader::PacketReader(Packet pac) : pac(std::move(pac)), read_head(0) {}
+PacketReader::PacketReader(const Packet &pac) : pac(pac), read_head(0) {}
 /**
  * Defines a PacketReader to read a packet with a set start location for the packet
  * @param pac the packet to read
  * @param start the start location for the reader to start reading from
  */
-PacketReader::PacketReader(Packet pac, size_t start) : pac(std::move(pac)), read_head(start) {}
+PacketReader::PacketReader(const Packet &pac, size_t start) : pac(pac), read_head(start) {}
 /**
  * checks a packets validility
  * @param packet the packet to check the validity of
@@ -149,9 +149,7 @@ VDP::PacketValidity validate_packet(const VDP::Packet &packet) {
     uint32_t checksum = CRC32::calculate(packet.data(), packet.size() - 4);
 
     // recreates the checksum manually
-    auto size = packet.size();
-    const uint32_t written_checksum = (uint32_t(packet[size - 1]) << 24) | (uint32_t(packet[size - 2]) << 16) |
-                                      (uint32_t(packet[size - 3]) << 8) | uint32_t(packet[size - 4]);
+    const uint32_t written_checksum = get_written_checksum(packet);
     // checks if both checksums match
     if (checksum != written_checksum) {
         VDPWarnf("Checksums do not match: expected: %08lx, got: %08lx", checksum, written_checksum);
@@ -160,6 +158,15 @@ VDP::PacketValidity validate_packet(const VDP::Packet &packet) {
     // if no problems with the packet are found, packet is Ok
     return VDP::PacketValidity::Ok;
 }
+/**
+ * @param packet a packet at least 4 bytes long
+ * @return the checksum stored in the last 4 bytes of the packet
+ */
+uint32_t get_written_checksum(const VDP::Packet &packet) {
+    auto size = packet.size();
+    return (uint32_t(packet[size - 1]) << 24) | (uint32_t(packet[size - 2]) << 16) | (uint32_t(packet[size - 3]) << 8) |
+           uint32_t(packet[size - 4]);
+}
 /**
  * @return the current byte the reader is on
  */
@@ -198,6 +205,52 @@ std::string PacketReader::get_string() {
     }
     return s;
 }
+/**
+ * reads an unsigned LEB128 varint, 7 bits per byte with the high bit set on all but the last byte
+ * @param value set to the varint
+ * @return false if it runs past the end of the packet or doesn't fit in 32 bits (5 bytes)
+ */
+bool PacketReader::get_varint(uint32_t &value) {
+    value = 0;
+    // a uint32 takes at most 5 groups of 7 bits
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (read_head >= pac.size()) {
+            VDPWarnf("Varint runs past the end of a packet of size %d", (int)pac.size());
+            return false;
+        }
+        const uint8_t b = get_byte();
+        // the fifth group only has room for the top 4 bits
+        if (shift == 28 && (b & 0xf0) != 0) {
+            VDPWarnf("Varint is longer than 32 bits");
+            return false;
+        }
+        value |= uint32_t(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+/**
+ * reads a channel id in the encoding the header says was used
+ * @param header the already decoded header of this packet
+ * @return the channel id, or INVALID_CHANNEL_ID if it is past MAX_CHANNELS or its varint is broken
+ */
+ChannelID PacketReader::get_channel_id(const PacketHeader &header) {
+    uint32_t id = 0;
+    if (header.flags & PacketFlags::VarintChannelID) {
+        if (!get_varint(id)) {
+            return INVALID_CHANNEL_ID;
+        }
+    } else {
+        id = get_number<uint8_t>();
+    }
+    if (id >= MAX_CHANNELS) {
+        VDPWarnf("Channel id %u is past the limit of %d channels", (unsigned)id, (int)MAX_CHANNELS);
+        return INVALID_CHANNEL_ID;
+    }
+    return (ChannelID)id;
+}
 
 /**
  * creates a packet writer
@@ -233,6 +286,41 @@ void PacketWriter::write_string(const std::string &str) {
     sofar.push_back(0);
 }
 
+/**
+ * writes an unsigned LEB128 varint to the packet
+ * @param value the value to write
+ */
+void PacketWriter::write_varint(uint32_t value) {
+    while (value >= 0x80) {
+        write_byte((uint8_t)(value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    write_byte((uint8_t)value);
+}
+/**
+ * writes a channel id in the encoding this writer was told to use
+ * @param id the channel id to write
+ */
+void PacketWriter::write_channel_id(ChannelID id) {
+    if (varint_ids) {
+        write_varint(id);
+        return;
+    }
+    if (id > 0xff) {
+        VDPWarnf("Channel id %d doesn't fit in a byte without varint ids", (int)id);
+    }
+    write_number<uint8_t>((uint8_t)id);
+}
+/**
+ * chooses between single byte and varint channel ids for every packet this writer makes
+ * @param use_varint true once the session has negotiated varint ids
+ */
+void PacketWriter::set_varint_channel_ids(bool use_varint) { varint_ids = use_varint; }
+/**
+ * @return the header flags describing how this writer encodes channel ids
+ */
+uint8_t PacketWriter::id_flags() const { return varint_ids ? (uint8_t)PacketFlags::VarintChannelID : 0; }
+
 /**
  * @return the packet the writer is writing to
  */
@@ -245,11 +333,12 @@ const Packet &PacketWriter::get_packet() const { return sofar; }
 void PacketWriter::write_channel_acknowledge(const Channel &chan) {
     clear();
     // makes a header byte with the type broadcast and the function acknowledgement
-    const uint8_t header = make_header_byte(PacketHeader{PacketType::Broadcast, PacketFunction::Acknowledge});
+    const uint8_t header =
+      make_header_byte(PacketHeader{PacketType::Broadcast, PacketFunction::Acknowledge, id_flags()});
 
     // writes the header byte and channel id to the packet
     write_number<uint8_t>(header);
-    write_number<ChannelID>(chan.getID());
+    write_channel_id(chan.getID());
 
     // creates and writes the Checksum to the packet
     uint32_t crc = CRC32::calculate(sofar.data(), sofar.size());
@@ -262,10 +351,10 @@ void PacketWriter::write_channel_acknowledge(const Channel &chan) {
 void PacketWriter::write_channel_broadcast(const Channel &chan) {
     clear();
     // makes a header byte with the type broadcast and function send
-    const uint8_t header = make_header_byte(PacketHeader{PacketType::Broadcast, PacketFunction::Send});
+    const uint8_t header = make_header_byte(PacketHeader{PacketType::Broadcast, PacketFunction::Send, id_flags()});
     // writes the header byte and channel id to the packet
     write_number<uint8_t>(header);
-    write_number<ChannelID>(chan.getID());
+    write_channel_id(chan.getID());
 
     // writes the packet schematic from the channel to the packet
     chan.data->write_schema(*this);
@@ -279,14 +368,41 @@ void PacketWriter::write_channel_broadcast(const Channel &chan) {
  * writes the data from a channel to the packet
  * @param chan the Channel to write the data from
  */
-void PacketWriter::write_data_message(const Channel &chan) {
+void PacketWriter::write_data_message(const Channel &chan) { write_data_packet(chan, nullptr); }
+/**
+ * writes the data from a channel to the packet with whichever of a
+ * sequence number and source timestamp the info has
+ * @param chan the Channel to write the data from
+ * @param info the sequence number and timestamp to include
+ */
+void PacketWriter::write_data_message(const Channel &chan, const DataInfo &info) { write_data_packet(chan, &info); }
+
+/**
+ * writes a data packet, optionally with a sequence number and timestamp after the id
+ * @param chan the Channel to write the data from
+ * @param info the optional fields to write or nullptr for none
+ */
+void PacketWriter::write_data_packet(const Channel &chan, const DataInfo *info) {
     clear();
+    uint8_t flags = id_flags();
+    if (info != nullptr && info->has_sequence) {
+        flags |= PacketFlags::Sequenced;
+    }
+    if (info != nullptr && info->has_source_time) {
+        flags |= PacketFlags::Timestamped;
+    }
     // makes a header byte with the type data and function send
-    const uint8_t header = make_header_byte(PacketHeader{PacketType::Data, PacketFunction::Send});
+    const uint8_t header = make_header_byte(PacketHeader{PacketType::Data, PacketFunction::Send, flags});
 
     // writes the header byte and channel id to the packet
     write_number<uint8_t>(header);
-    write_number<ChannelID>(chan.getID());
+    write_channel_id(chan.getID());
+    if (flags & PacketFlags::Sequenced) {
+        write_number<uint16_t>(info->sequence);
+    }
+    if (flags & PacketFlags::Timestamped) {
+        write_number<uint32_t>(info->source_time_ms);
+    }
 
     // writes the data from the channel to the packet
     chan.data->write_message(*this);
@@ -296,6 +412,35 @@ void PacketWriter::write_data_message(const Channel &chan) {
     // printf("data checksum: %08lx\n", crc);
     write_number<uint32_t>(crc);
 }
+/**
+ * writes a ping the receiver uses to line its clock up with ours
+ * @param time_ms VDB::time_ms() right before sending
+ */
+void PacketWriter::write_ping(uint32_t time_ms) {
+    clear();
+    // a data request is a ping, a broadcast request asks for responses
+    const uint8_t header = make_header_byte(PacketHeader{PacketType::Data, PacketFunction::Request});
+    write_number<uint8_t>(header);
+    write_number<uint32_t>(time_ms);
+    // creates and writes the Checksum to the packet
+    uint32_t crc = CRC32::calculate(sofar.data(), sofar.size());
+    write_number<uint32_t>(crc);
+}
+/**
+ * writes the answer to a ping
+ * @param ping_time_ms the time from the ping being answered
+ * @param local_time_us our clock when the ping arrived
+ */
+void PacketWriter::write_pong(uint32_t ping_time_ms, uint64_t local_time_us) {
+    clear();
+    const uint8_t header = make_header_byte(PacketHeader{PacketType::Broadcast, PacketFunction::Response});
+    write_number<uint8_t>(header);
+    write_number<uint32_t>(ping_time_ms);
+    write_number<uint64_t>(local_time_us);
+    // creates and writes the Checksum to the packet
+    uint32_t crc = CRC32::calculate(sofar.data(), sofar.size());
+    write_number<uint32_t>(crc);
+}
 
 /**
  * writes a request for a channel schematic to the packet
@@ -311,6 +456,18 @@ void PacketWriter::write_request() {
     uint32_t crc = CRC32::calculate(sofar.data(), sofar.size());
     write_number<uint32_t>(crc);
 }
+/**
+ * writes a request that also promises the bus stays quiet for a while
+ * @param window_us how long the sender will stay off the bus
+ */
+void PacketWriter::write_request(uint32_t window_us) {
+    clear();
+    const uint8_t header = make_header_byte(PacketHeader{PacketType::Broadcast, PacketFunction::Request});
+    write_number<uint8_t>(header);
+    write_number<uint32_t>(window_us);
+    uint32_t crc = CRC32::calculate(sofar.data(), sofar.size());
+    write_number<uint32_t>(crc);
+}
 /**
  * writes a response packet to the brain
  * @param response_queue the queue of channels to respond with
@@ -319,13 +476,13 @@ void PacketWriter::write_response(std::deque<Channel> &response_queue) {
   clear();
   // makes a header byte with the type broadcast and the function Receive
   const uint8_t header = make_header_byte(
-      PacketHeader{PacketType::Data, PacketFunction::Response});
+      PacketHeader{PacketType::Data, PacketFunction::Response, id_flags()});
 
   // writes the header byte and number of responses in the queue
   write_number<uint8_t>(header);
   write_number<uint8_t>(response_queue.size());
   //writes the channel id for the channel we are responding to
-  write_number<ChannelID>(response_queue.front().getID());
+  write_channel_id(response_queue.front().getID());
   response_queue.front().data->write_message(*this);
   //removes the response from the queue
   response_queue.pop_front();
@@ -339,6 +496,34 @@ void PacketWriter::write_response(std::deque<Channel> &response_queue) {
  *  deleter for the device, used to delete it when it is no longer needed
  */
 AbstractDevice::~AbstractDevice() {}
+/**
+ * a callback that also gets the time the device saw the end of the frame
+ * @param callback called with the packet and its receive time in microseconds
+ */
+void AbstractDevice::register_timed_receive_callback(
+  std::function<void(const VDP::Packet &packet, uint64_t rx_time_us)> callback
+) {
+    register_receive_callback([callback](const VDP::Packet &packet) {
+        callback(packet, VDB::time_us());
+    });
+}
+/**
+ * @return true if the device only hands over packets whose checksum it already checked
+ */
+bool AbstractDevice::validates_checksums() const { return false; }
+/**
+ * joins the pieces of a packet and sends them with send_packet
+ * @param spans the pieces of the packet, in order
+ * @param count how many pieces there are
+ * @return Sent if send_packet succeeded, Failed otherwise
+ */
+SendStatus AbstractDevice::send_packet_spans(const PacketSpan *spans, size_t count) {
+    Packet joined;
+    for (size_t i = 0; i < count; i++) {
+        joined.insert(joined.end(), spans[i].data, spans[i].data + spans[i].size);
+    }
+    return send_packet(joined) ? SendStatus::Sent : SendStatus::Failed;
+}
 /**
  * creates a decoder to decode a packet
  * @param pac the packet reader to make a decoder from
@@ -385,34 +570,62 @@ PartPtr make_decoder(PacketReader &pac) {
 }
 static constexpr auto PACKET_TYPE_BIT_MASK = 0b10000000;
 static constexpr auto PACKET_FUNCTION_BIT_MASK = 0b01100000;
+static constexpr auto PACKET_FLAGS_BIT_MASK = 0b00011111;
 
 uint8_t make_header_byte(PacketHeader head) {
-  return (uint8_t)head.type | (uint8_t)head.func;
+  return (uint8_t)head.type | (uint8_t)head.func |
+         (head.flags & PACKET_FLAGS_BIT_MASK);
 }
 
 PacketHeader decode_header_byte(uint8_t hb) {
   const PacketType pt = (PacketType)(hb & PACKET_TYPE_BIT_MASK);
   const PacketFunction func =
       (PacketFunction)(hb & PACKET_FUNCTION_BIT_MASK);
+  const uint8_t flags = hb & PACKET_FLAGS_BIT_MASK;
 
-  return {pt, func};
+  return {pt, func, flags};
 }
 /**
  * Decodes the broadcast in a packet
  * @param packet the packet to decode
- * @return the pair of the Channel ID and the Part Pointer of the packet schematic
+ * @return the pair of the Channel ID and the Part Pointer of the packet schematic, or
+ * INVALID_CHANNEL_ID and nullptr if the id is bad
  */
 std::pair<ChannelID, PartPtr> decode_broadcast(const Packet &packet) {
     VDPTracef("Decoding broadcast of size: %d", (int)packet.size());
     PacketReader reader(packet);
     // reads the header byte, which had to be read to know were a braodcast
-    (void)reader.get_byte();
+    const PacketHeader header = decode_header_byte(reader.get_byte());
     // checks the channel id from the packet
-    const ChannelID id = reader.get_number<ChannelID>();
+    const ChannelID id = reader.get_channel_id(header);
+    if (id == INVALID_CHANNEL_ID) {
+        // nothing after a bad id can be trusted
+        return {id, nullptr};
+    }
     // constructs the schematic for the packet from the byte as a Part Pointer
     const PartPtr schema = make_decoder(reader);
     // returns the pair of the channel id and the packet shematic
     return {id, schema};
 }
 
+/**
+ * reads the optional sequence number and timestamp that follow the channel id
+ * of a data packet
+ * @param reader a reader positioned right after the channel id
+ * @param header the header of the packet being read
+ * @return the fields the header says are there
+ */
+DataInfo read_data_info(PacketReader &reader, const PacketHeader &header) {
+    DataInfo info;
+    if (header.flags & PacketFlags::Sequenced) {
+        info.has_sequence = true;
+        info.sequence = reader.get_number<uint16_t>();
+    }
+    if (header.flags & PacketFlags::Timestamped) {
+        info.has_source_time = true;
+        info.source_time_ms = reader.get_number<uint32_t>();
+    }
+    return info;
+}
+
 } // namespace VDP
@@ -0,0 +1,238 @@
+#include "vdb/sim-link.hpp"
+
+#include <algorithm>
+
+namespace VDB {
+/**
+ * @param model how the line behaves
+ * @param seed starts the random errors, the same seed gives the same run
+ */
+SimLink::SimLink(const LinkModel &model, uint32_t seed)
+    : model(model), rng(seed), ends{{this, 0}, {this, 1}} {}
+
+/**
+ * @return the end the brain talks through
+ */
+SimLink::Endpoint &SimLink::brain() { return ends[0]; }
+/**
+ * @return the end the board talks through
+ */
+SimLink::Endpoint &SimLink::board() { return ends[1]; }
+/**
+ * @return the simulated time, in microseconds
+ */
+uint64_t SimLink::now_us() const { return now; }
+
+/**
+ * @param bytes bytes on the wire
+ * @return how long they take to send
+ */
+uint64_t SimLink::airtime_us(size_t bytes) const { return (uint64_t)bytes * 10 * 1000000 / model.baud; }
+
+/**
+ * puts a frame on the wire after whatever the end is already sending, and
+ * marks it and anything going the other way as collided if they overlap
+ * @param from the end sending it
+ * @param bytes the encoded frame
+ * @return false if the transmit buffer is full
+ */
+bool SimLink::transmit(Endpoint &from, WirePacket &&bytes) {
+    // what's still waiting to go out is about however much fits in the time
+    // until the end is free
+    const uint64_t backlog_us = from.tx_free_us > now ? from.tx_free_us - now : 0;
+    const size_t backlog = (size_t)(backlog_us * model.baud / 10 / 1000000);
+    if (backlog > 0 && backlog + bytes.size() > model.tx_buffer_size) {
+        return false;
+    }
+
+    Flight flight;
+    flight.to = 1 - from.index;
+    flight.start_us = std::max(now, from.tx_free_us);
+    if (model.half_duplex) {
+        flight.start_us = std::max(flight.start_us, from.rx_end_us + model.turnaround_us);
+    }
+    flight.end_us = flight.start_us + airtime_us(bytes.size());
+    from.tx_free_us = flight.end_us;
+
+    uint64_t delay = model.latency_us;
+    if (model.jitter_us > 0) {
+        delay += std::uniform_int_distribution<uint32_t>(0, model.jitter_us)(rng);
+    }
+    // bytes on one wire can't pass each other
+    flight.arrival_us = std::max(flight.end_us + delay, from.last_arrival_us);
+    from.last_arrival_us = flight.arrival_us;
+    flight.bytes = std::move(bytes);
+
+    if (model.half_duplex) {
+        // anything going the other way is still in flight until after it
+        // finishes sending, so overlaps are always caught here by whichever
+        // frame is sent second
+        for (Flight &other : in_flight) {
+            if (other.to == flight.to || other.end_us <= flight.start_us || flight.end_us <= other.start_us) {
+                continue;
+            }
+            const uint64_t start = std::max(flight.start_us, other.start_us);
+            const uint64_t end = std::min(flight.end_us, other.end_us);
+            for (Flight *f : {&flight, &other}) {
+                if (f->collision_end_us == 0) {
+                    num_collisions++;
+                    f->collision_start_us = start;
+                    f->collision_end_us = end;
+                } else {
+                    f->collision_start_us = std::min(f->collision_start_us, start);
+                    f->collision_end_us = std::max(f->collision_end_us, end);
+                }
+            }
+        }
+    }
+
+    if (model.drop_rate > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < model.drop_rate) {
+        // it still took up the wire, it just never shows up
+        num_dropped++;
+        flight.bytes.clear();
+    }
+    in_flight.push_back(std::move(flight));
+    return true;
+}
+
+/**
+ * flips bits at random, and garbles bytes sent during a collision
+ */
+void SimLink::damage(Flight &flight) {
+    if (flight.collision_end_us != 0) {
+        const uint64_t byte_us = std::max<uint64_t>(1, airtime_us(1));
+        const size_t first = (size_t)((flight.collision_start_us - flight.start_us) / byte_us);
+        const size_t last = std::min(flight.bytes.size(),
+                                     (size_t)((flight.collision_end_us - flight.start_us + byte_us - 1) / byte_us));
+        for (size_t i = first; i < last; i++) {
+            flight.bytes[i] = (uint8_t)rng();
+        }
+    }
+    if (model.bit_error_rate > 0) {
+        // skip straight to the next bad bit instead of rolling for every bit
+        std::geometric_distribution<uint64_t> gap(std::min(model.bit_error_rate, 1.0));
+        const uint64_t bits = (uint64_t)flight.bytes.size() * 8;
+        for (uint64_t bit = gap(rng); bit < bits; bit += 1 + gap(rng)) {
+            flight.bytes[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+            num_bit_errors++;
+        }
+    }
+}
+
+/**
+ * moves time forward to the next frame arriving and delivers it
+ * @return false if nothing was on the way
+ */
+bool SimLink::step() {
+    if (in_flight.empty()) {
+        return false;
+    }
+    // frames from one end are already in order, so the earliest of the few
+    // in flight is a short search
+    auto next = std::min_element(in_flight.begin(), in_flight.end(), [](const Flight &a, const Flight &b) {
+        return a.arrival_us < b.arrival_us;
+    });
+    Flight flight = std::move(*next);
+    in_flight.erase(next);
+
+    now = std::max(now, flight.arrival_us);
+    Endpoint &to = ends[flight.to];
+    to.rx_end_us = std::max(to.rx_end_us, flight.end_us);
+    if (!flight.bytes.empty()) {
+        damage(flight);
+        to.receive(flight.bytes, flight.arrival_us);
+    }
+    return true;
+}
+
+/**
+ * delivers every frame that arrives up to a time, then moves time to it
+ * @param time_us when to stop, in simulated microseconds
+ */
+void SimLink::run_until(uint64_t time_us) {
+    while (true) {
+        auto next = std::min_element(in_flight.begin(), in_flight.end(), [](const Flight &a, const Flight &b) {
+            return a.arrival_us < b.arrival_us;
+        });
+        if (next == in_flight.end() || next->arrival_us > time_us) {
+            break;
+        }
+        step();
+    }
+    now = std::max(now, time_us);
+}
+
+SimLink::Endpoint::Endpoint(SimLink *link, int index)
+    : link(link), index(index), decoder(link->model.max_packet_size) {}
+
+bool SimLink::Endpoint::send_packet(const VDP::Packet &packet) {
+    const VDP::PacketSpan span{packet.data(), packet.size()};
+    return send_packet_spans(&span, 1) == VDP::SendStatus::Sent;
+}
+/**
+ * puts a packet on the wire after whatever this end is already sending
+ * @param spans the pieces of the packet, in order
+ * @param count how many pieces there are
+ * @return Sent, or Busy if the transmit buffer doesn't have room
+ */
+VDP::SendStatus SimLink::Endpoint::send_packet_spans(const VDP::PacketSpan *spans, size_t count) {
+    WirePacket bytes;
+    CobsFrameEncoder encoder;
+    encoder.encode(spans, count, [&bytes](const uint8_t *data, size_t size) {
+        bytes.insert(bytes.end(), data, data + size);
+        return true;
+    });
+    const size_t size = bytes.size();
+    if (!link->transmit(*this, std::move(bytes))) {
+        num_busy++;
+        return VDP::SendStatus::Busy;
+    }
+    num_sent++;
+    bytes_sent += size;
+    return VDP::SendStatus::Sent;
+}
+void SimLink::Endpoint::register_receive_callback(std::function<void(const VDP::Packet &packet)> new_callback) {
+    callback = [new_callback](const VDP::Packet &packet, uint64_t) { new_callback(packet); };
+}
+void SimLink::Endpoint::register_timed_receive_callback(
+    std::function<void(const VDP::Packet &packet, uint64_t rx_time_us)> new_callback) {
+    callback = new_callback;
+}
+bool SimLink::Endpoint::validates_checksums() const { return true; }
+
+/**
+ * decodes bytes that came off the wire. The decoder carries on across
+ * frames, so a damaged delimiter runs two frames together like it would on
+ * the real line
+ * @param bytes what arrived, possibly damaged
+ * @param rx_time_us when the last byte arrived
+ */
+void SimLink::Endpoint::receive(const WirePacket &bytes, uint64_t rx_time_us) {
+    size_t pos = 0;
+    while (pos < bytes.size()) {
+        size_t consumed = 0;
+        const CobsFrameDecoder::Result res = decoder.decode(bytes.data() + pos, bytes.size() - pos, inbound, consumed);
+        pos += consumed;
+        switch (res) {
+        case CobsFrameDecoder::Result::Incomplete:
+            break;
+        case CobsFrameDecoder::Result::Ok:
+            num_received++;
+            callback(inbound, rx_time_us);
+            break;
+        case CobsFrameDecoder::Result::BadChecksum:
+            num_bad_checksum++;
+            break;
+        case CobsFrameDecoder::Result::TooSmall:
+            num_too_small++;
+            break;
+        case CobsFrameDecoder::Result::TooLarge:
+            num_too_large++;
+            break;
+        case CobsFrameDecoder::Result::Truncated:
+            num_truncated++;
+            break;
+        }
+    }
+}
+} // namespace VDB
@@ -46,7 +46,7 @@ Record::Record(std::string name, PacketReader &reader) : Part(std::move(name)),
  */
 void Record::set_fields(std::vector<PartPtr> fs) { fields = std::move(fs); }
 
-std::vector<PartPtr> Record::get_fields() const { return fields; }
+const std::vector<PartPtr> &Record::get_fields() const { return fields; }
 
 PartPtr Record::clone(){
     std::shared_ptr<Record> cloned_record = std::make_shared<Record>(this->name);
@@ -156,7 +156,7 @@ void String::set_value(std::string new_value) { value = std::move(new_value); }
 /**
  * @return the currently stored string
  */
-std::string String::get_value() { return value; }
+const std::string &String::get_value() { return value; }
 
 PartPtr String::clone() {
     std::shared_ptr<String> cloned_string = std::make_shared<String>(this->name);
@@ -319,16 +319,16 @@ void UpcastNumbersVisitor::VisitUint64(Uint64 *f) {
 }
 
 void UpcastNumbersVisitor::VisitInt8(Int8 *f) {
-  VisitAnyUint(f->get_name(), (int64_t)f->get_value(), f);
+  VisitAnyInt(f->get_name(), (int64_t)f->get_value(), f);
 }
 void UpcastNumbersVisitor::VisitInt16(Int16 *f) {
-  VisitAnyUint(f->get_name(), (int64_t)f->get_value(), f);
+  VisitAnyInt(f->get_name(), (int64_t)f->get_value(), f);
 }
 void UpcastNumbersVisitor::VisitInt32(Int32 *f) {
-  VisitAnyUint(f->get_name(), (int64_t)f->get_value(), f);
+  VisitAnyInt(f->get_name(), (int64_t)f->get_value(), f);
 }
 void UpcastNumbersVisitor::VisitInt64(Int64 *f) {
-  VisitAnyUint(f->get_name(), (int64_t)f->get_value(), f);
+  VisitAnyInt(f->get_name(), (int64_t)f->get_value(), f);
 }
 
 PartPtr Float::clone(){
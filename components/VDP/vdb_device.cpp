@@ -7,6 +7,7 @@
 #include "esp_err.h"
 #include "esp_log.h"
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
@@ -17,53 +18,54 @@
 
 static constexpr const char *TAG = "VDB";
 
+// the uart task decodes, repairs and queues every frame itself. Reed-Solomon
+// repair alone takes about 750 bytes of stack and make_room copies the whole
+// queue onto it, on top of the driver calls and logging
+static constexpr uint32_t UART_TASK_STACK_SIZE = 4096;
+// warn when the uart task comes this close to the end of its stack
+static constexpr int UART_STACK_MARGIN = 512;
+
 void VDBDevice::uart_event_task(void *pvParameters) {
   VDBDevice *self = (VDBDevice *)pvParameters;
-  uart_port_t uart_num = self->uart_num;
 
   uart_event_t event;
 
 #define BUF_SIZE (1024)
 #define RD_BUF_SIZE (BUF_SIZE)
   uint8_t *dtmp = (uint8_t *)malloc(RD_BUF_SIZE);
-  int ret;
 
   for (;;) {
     // Waiting for UART event.
     if (xQueueReceive(self->uart0_queue, (void *)&event,
                       (TickType_t)portMAX_DELAY)) {
-      bzero(dtmp, RD_BUF_SIZE);
       switch (event.type) {
       // Event of UART receving data
       /*We'd better handler data event fast, there would be much more data
       events than other types of events. If we take too much time on data event,
       the queue might be full.*/
       case UART_DATA:
-        ret = uart_read_bytes(uart_num, dtmp, event.size, portMAX_DELAY);
-        if (ret < 0) {
-          ESP_LOGE(TAG, "Error reading bytes from uart: %d\n", ret);
-        } else {
-          self->handle_uart_bytes(dtmp, ret);
-        }
+        // earlier events may have already read these bytes, so take whatever
+        // is buffered rather than waiting for event.size more
+        self->drain_uart(dtmp, RD_BUF_SIZE);
         break;
       // Event of HW FIFO overflow detected
       case UART_FIFO_OVF:
         ESP_LOGI(TAG, "hw fifo overflow");
-        // If fifo overflow happened, you should consider adding flow control
-        // for your application. The ISR has already reset the rx FIFO, As an
-        // example, we directly flush the rx buffer here in order to read more
-        // data.
-        uart_flush_input(uart_num);
-        xQueueReset(self->uart0_queue);
+        // The ISR has already reset the rx FIFO, so the bytes in it are gone.
+        // Everything in the ring buffer came before them and is still good,
+        // decode that and then skip to the next delimiter, which drops only
+        // the frame that lost bytes
+        self->drain_uart(dtmp, RD_BUF_SIZE);
+        self->decoder.resync();
+        self->num_fifo_overflow++;
         break;
       // Event of UART ring buffer full
       case UART_BUFFER_FULL:
         ESP_LOGI(TAG, "ring buffer full");
-        // If buffer full happened, you should consider increasing your buffer
-        // size As an example, we directly flush the rx buffer here in order to
-        // read more data.
-        uart_flush_input(uart_num);
-        xQueueReset(self->uart0_queue);
+        // bytes wait in the fifo until the ring has room, so emptying it is
+        // enough to keep from losing any
+        self->drain_uart(dtmp, RD_BUF_SIZE);
+        self->num_buffer_full++;
         break;
       // Event of UART RX break detected
       case UART_BREAK:
@@ -82,6 +84,13 @@ void VDBDevice::uart_event_task(void *pvParameters) {
         ESP_LOGI(TAG, "uart event type: %d", event.type);
         break;
       }
+      // the high water mark only goes down, so this warns once
+      const int stack_free = (int)uxTaskGetStackHighWaterMark(NULL);
+      if (stack_free < UART_STACK_MARGIN &&
+          self->uart_stack_free >= UART_STACK_MARGIN) {
+        ESP_LOGW(TAG, "uart task has only %d bytes of stack left", stack_free);
+      }
+      self->uart_stack_free = stack_free;
     }
   }
   free(dtmp);
@@ -90,21 +99,193 @@ void VDBDevice::uart_event_task(void *pvParameters) {
 }
 
 void VDBDevice::handle_uart_bytes(const uint8_t *buf, int size) {
-  for (int i = 0; i < size; i++) {
-    uint8_t b = buf[i];
-    if (b == 0x00 && inbound_buffer.size() > 0) {
-      VDB::WirePacket *copy_buf = new VDB::WirePacket(inbound_buffer);
+  size_t used = 0;
+  while (used < (size_t)size) {
+    size_t consumed = 0;
+    VDB::CobsFrameDecoder::Result res =
+        decoder.decode(buf + used, size - used, *rx_packet, consumed);
+    used += consumed;
+
+    switch (res) {
+    case VDB::CobsFrameDecoder::Result::Incomplete:
+      break;
+    case VDB::CobsFrameDecoder::Result::Ok: {
+      // the delimiter just came in, before repair and make_room take time
+      const uint64_t rx_time_us = (uint64_t)esp_timer_get_time();
+      if (fec.enabled() && !repair_frame()) {
+        break;
+      }
+      VDP::ChannelID id = VDP::INVALID_CHANNEL_ID;
+      const bool data = VDB::get_data_channel(*rx_packet, id);
+      VDP::Packet *next = nullptr;
+      if (VDB::may_take_buffer(drop_policy, data, pool.num_free())) {
+        next = pool.acquire();
+      }
+      if (next == nullptr) {
+        num_pool_exhausted++;
+        next = make_room(data, id);
+      }
+      if (next == nullptr) {
+        // decode the next frame over this one
+        if (data) {
+          num_dropped_newest++;
+        } else {
+          num_dropped_control++;
+        }
+        break;
+      }
+      VDB::InboundFrame frame{rx_packet, rx_time_us};
+      if (xQueueSend(packet_queue, (void *)&frame, 4) != pdTRUE) {
+        // handler fell behind, decode the next frame over this one
+        num_queue_full++;
+        pool.release(next);
+      } else {
+        rx_packet = next;
+      }
+      break;
+    }
+    case VDB::CobsFrameDecoder::Result::BadChecksum:
+      VDPWarnf("Dropping frame with a bad checksum");
+      num_bad_checksum++;
+      break;
+    case VDB::CobsFrameDecoder::Result::TooSmall:
+      num_too_small++;
+      break;
+    case VDB::CobsFrameDecoder::Result::TooLarge:
+      VDPWarnf("Dropping frame longer than %d bytes", (int)MAX_PACKET_SIZE);
+      num_too_large++;
+      break;
+    case VDB::CobsFrameDecoder::Result::Truncated:
+      num_truncated++;
+      break;
+    }
+  }
+}
 
-      xQueueSend(packet_queue, (void *)&copy_buf, 4);
+bool VDBDevice::repair_frame() {
+  const int fixed = fec.repair(*rx_packet);
+  if (fixed < 0) {
+    VDPWarnf("Dropping frame with too many errors to correct");
+    num_fec_failed++;
+    return false;
+  }
+  num_fec_corrected += fixed;
+  // the decoder couldn't check this before the repair
+  if (rx_packet->size() < 5) {
+    num_too_small++;
+    return false;
+  }
+  const uint32_t crc =
+      CRC32::calculate(rx_packet->data(), rx_packet->size() - 4);
+  if (crc != VDP::get_written_checksum(*rx_packet)) {
+    VDPWarnf("Dropping frame with a bad checksum");
+    num_bad_checksum++;
+    return false;
+  }
+  return true;
+}
 
-      // Starting a new packet now
-      inbound_buffer.clear();
-    } else if (b != 0x00) {
-      inbound_buffer.push_back(b);
+void VDBDevice::set_fec_parity(size_t parity) {
+  fec = VDB::ReedSolomon(parity);
+  decoder.set_check_crc(!fec.enabled());
+}
+
+void VDBDevice::drain_uart(uint8_t *buf, size_t buf_size) {
+  size_t buffered = 0;
+  if (uart_get_buffered_data_len(uart_num, &buffered) != ESP_OK) {
+    return;
+  }
+  while (buffered > 0) {
+    const int ret =
+        uart_read_bytes(uart_num, buf, std::min(buffered, buf_size), 0);
+    if (ret < 0) {
+      ESP_LOGE(TAG, "Error reading bytes from uart: %d\n", ret);
+      return;
+    }
+    if (ret == 0) {
+      return;
+    }
+    handle_uart_bytes(buf, ret);
+    buffered -= std::min(buffered, (size_t)ret);
+  }
+}
+
+VDP::Packet *VDBDevice::make_room(bool data, VDP::ChannelID new_id) {
+  // DropOldest only ever needs the front of the queue, LatestPerChannel
+  // looks through all of it
+  size_t wanted = 0;
+  switch (drop_policy) {
+  case DropPolicy::DropNewest:
+    return nullptr;
+  case DropPolicy::DropOldest:
+    wanted = 1;
+    break;
+  case DropPolicy::LatestPerChannel:
+    wanted = NUM_INCOMING_PACKETS;
+    break;
+  }
+
+  // pull them out to look through, then put back all but one in the same
+  // order. Only this task adds to the queue so nothing can get in between
+  VDB::InboundFrame waiting[NUM_INCOMING_PACKETS];
+  size_t num_waiting = 0;
+  while (num_waiting < wanted &&
+         xQueueReceive(packet_queue, (void *)&waiting[num_waiting], 0) ==
+             pdTRUE) {
+    num_waiting++;
+  }
+
+  const VDB::DropChoice choice =
+      VDB::choose_drop(drop_policy, waiting, num_waiting, data, new_id);
+  for (size_t i = 0; i < num_waiting; i++) {
+    if (i != choice.victim) {
+      xQueueSend(packet_queue, (void *)&waiting[i], 0);
     }
   }
+  if (choice.victim == num_waiting) {
+    return nullptr;
+  }
+  if (choice.superseded) {
+    num_superseded++;
+  } else if (choice.data) {
+    num_dropped_oldest++;
+  } else {
+    num_dropped_control++;
+  }
+  return waiting[choice.victim].packet;
+}
+
+void VDBDevice::set_drop_policy(DropPolicy policy) { drop_policy = policy; }
+
+namespace VDB {
+PacketPool::PacketPool(size_t count, size_t packet_size)
+    : packets(count), free_list(xQueueCreate(count, sizeof(VDP::Packet *))) {
+  for (VDP::Packet &packet : packets) {
+    packet.reserve(packet_size);
+    VDP::Packet *ptr = &packet;
+    xQueueSend(free_list, (void *)&ptr, 0);
+  }
 }
 
+VDP::Packet *PacketPool::acquire() {
+  VDP::Packet *packet = nullptr;
+  if (xQueueReceive(free_list, (void *)&packet, 0) != pdTRUE) {
+    return nullptr;
+  }
+  packet->clear();
+  return packet;
+}
+
+void PacketPool::release(VDP::Packet *packet) {
+  xQueueSend(free_list, (void *)&packet, 0);
+}
+
+size_t PacketPool::size() const { return packets.size(); }
+size_t PacketPool::num_free() const {
+  return uxQueueMessagesWaiting(free_list);
+}
+} // namespace VDB
+
 esp_err_t VDBDevice::init_serial(VDBDevice *self, uart_port_t uart_num,
                                  int tx_num, int rx_num, int rts_num,
                                  int baud) {
@@ -128,16 +309,17 @@ esp_err_t VDBDevice::init_serial(VDBDevice *self, uart_port_t uart_num,
       uart_set_pin(uart_num, tx_num, rx_num, rts_num, UART_PIN_NO_CHANGE), TAG,
       "Failed to set UART Pins");
 
-  ESP_RETURN_ON_ERROR(uart_driver_install(uart_num, BUF_SIZE * 2, BUF_SIZE * 2,
-                                          20, &self->uart0_queue, 0),
+  ESP_RETURN_ON_ERROR(uart_driver_install(uart_num, BUF_SIZE * 2,
+                                          TX_BUFFER_SIZE, 20,
+                                          &self->uart0_queue, 0),
                       TAG, "Failed to install driver");
 
   // Set RS485 half duplex mode
   ESP_RETURN_ON_ERROR(uart_set_mode(uart_num, UART_MODE_RS485_HALF_DUPLEX), TAG,
                       "Failed to set UART mode");
 
-  xTaskCreate(VDBDevice::uart_event_task, "uart_handler_task", 2048, self, 12,
-              NULL);
+  xTaskCreate(VDBDevice::uart_event_task, "uart_handler_task",
+              UART_TASK_STACK_SIZE, self, 12, NULL);
 
   xTaskCreate(VDBDevice::packet_handler_thread, "packet_handler_thread", 4096,
               self, 12, NULL);
@@ -152,17 +334,17 @@ void VDBDevice::packet_handler_thread(void *pvParameters) {
   VDBDevice *self = (VDBDevice *)pvParameters;
 
   for (;;) {
-    VDB::WirePacket *wire_packet;
+    VDB::InboundFrame frame;
     // Waiting for UART event.
-    if (xQueueReceive(self->packet_queue, (void *)&wire_packet,
+    if (xQueueReceive(self->packet_queue, (void *)&frame,
                       (TickType_t)portMAX_DELAY)) {
 
-      VDPTracef("Recieved wire packet of size %d", (int)wire_packet->size());
+      VDPTracef("Recieved packet of size %d", (int)frame.packet->size());
+      self->queue_latency.add(esp_timer_get_time() - (int64_t)frame.rx_time_us);
 
-      VDP::Packet packet;
-      VDB::CobsDecode(*wire_packet, packet);
-      delete wire_packet;
-      self->callback(packet);
+      // already decoded and checked, hand it over as is
+      self->callback(*frame.packet, frame.rx_time_us);
+      self->pool.release(frame.packet);
     }
   }
 }
@@ -171,7 +353,9 @@ VDBDevice::VDBDevice(uart_port_t uart_num, int tx_num, int rx_num, int rts_num,
                      int baud)
     : uart_num(uart_num),
       packet_queue(
-          xQueueCreate(NUM_INCOMING_PACKETS, sizeof(VDB::WirePacket *))) {
+          xQueueCreate(NUM_INCOMING_PACKETS, sizeof(VDB::InboundFrame))),
+      pool(VDB_RX_POOL_SIZE, MAX_PACKET_SIZE), rx_packet(pool.acquire()) {
+  set_fec_parity(VDB_FEC_PARITY);
   esp_err_t res = init_serial(this, uart_num, tx_num, rx_num, rts_num, baud);
 
   if (res != ESP_OK) {
@@ -181,104 +365,79 @@ VDBDevice::VDBDevice(uart_port_t uart_num, int tx_num, int rx_num, int rts_num,
 
 void VDBDevice::register_receive_callback(
     std::function<void(const VDP::Packet &packet)> new_callback) {
+  callback = [new_callback](const VDP::Packet &packet, uint64_t) {
+    new_callback(packet);
+  };
+}
+bool VDBDevice::validates_checksums() const { return true; }
+void VDBDevice::register_timed_receive_callback(
+    std::function<void(const VDP::Packet &packet, uint64_t rx_time_us)>
+        new_callback) {
   callback = new_callback;
 }
 bool VDBDevice::send_packet(const VDP::Packet &pac) {
-  VDB::WirePacket out;
-  VDB::CobsEncode(pac, out);
+  const VDP::PacketSpan span{pac.data(), pac.size()};
+  std::lock_guard<std::mutex> lock(tx_mutex);
+  return write_frame(&span, 1);
+}
+
+VDP::SendStatus VDBDevice::send_packet_spans(const VDP::PacketSpan *spans,
+                                             size_t count) {
+  size_t size = 0;
+  for (size_t i = 0; i < count; i++) {
+    size += spans[i].size;
+  }
+  std::lock_guard<std::mutex> lock(tx_mutex);
+  // only start a frame the ring can take whole, so writing never waits.
+  // Frames bigger than the whole ring have to wait regardless
+  const size_t needed =
+      VDB::CobsFrameEncoder::max_encoded_size(size + fec.overhead(size));
+  size_t free_space = 0;
+  if (uart_get_tx_buffer_free_size(uart_num, &free_space) != ESP_OK) {
+    return VDP::SendStatus::Failed;
+  }
+  if (free_space < std::min(needed, TX_BUFFER_SIZE)) {
+    num_tx_busy++;
+    return VDP::SendStatus::Busy;
+  }
+  return write_frame(spans, count) ? VDP::SendStatus::Sent
+                                   : VDP::SendStatus::Failed;
+}
+
+bool VDBDevice::write_frame(const VDP::PacketSpan *spans, size_t count) {
+  if (fec.enabled()) {
+    // parity goes on the end, inside the same COBS frame
+    fec.protect(spans, count, tx_parity);
+    tx_spans.assign(spans, spans + count);
+    tx_spans.push_back({tx_parity.data(), tx_parity.size()});
+    spans = tx_spans.data();
+    count = tx_spans.size();
+  }
 
   // ESP_ERROR_CHECK_WITHOUT_ABORT(uart_set_rts(uart_num, 0), TAG,
   // "failed to set rts");
 
-  int res = uart_write_bytes(uart_num, (const char *)out.data(), out.size());
-  if (res < 0) {
-    ESP_LOGW(TAG, "Failed to write bytes: error code %d", (int)res);
-  } else if (res != out.size()) {
-    ESP_LOGW(TAG, "Didn't write all bytes. Wanted %d got %d", (int)out.size(),
-             res);
-  }
+  const bool ok = encoder.encode(
+      spans, count, [this](const uint8_t *data, size_t size) {
+        int res = uart_write_bytes(uart_num, (const char *)data, size);
+        if (res < 0) {
+          ESP_LOGW(TAG, "Failed to write bytes: error code %d", (int)res);
+          return false;
+        } else if (res != (int)size) {
+          ESP_LOGW(TAG, "Didn't write all bytes. Wanted %d got %d", (int)size,
+                   res);
+          return false;
+        }
+        return true;
+      });
   // ESP_ERROR_CHECK_WITHOUT_ABORT(uart_set_rts(uart_num, 1), TAG,
   // "failed to set rts");
 
-  return res == ESP_OK;
+  return ok;
 }
 
 namespace VDB {
 uint32_t time_ms() { return esp_timer_get_time() / 1000; }
+uint64_t time_us() { return esp_timer_get_time(); }
 void delay_ms(uint32_t ms) { vTaskDelay(ms / portTICK_PERIOD_MS); }
-
-void CobsEncode(const VDP::Packet &in, WirePacket &out) {
-  out.clear();
-  if (in.size() == 0) {
-    return;
-  }
-  size_t output_size = in.size() + (in.size() / 254) + 1;
-  output_size += 2; // delimeter bytes
-  out.resize(output_size);
-  out[0] = 0;
-
-  size_t output_code_head = 1;
-  size_t code_value = 1;
-
-  size_t input_head = 0;
-  size_t output_head = 2;
-  size_t length = 0;
-  while (input_head < in.size()) {
-    if (in[input_head] == 0 || length == 255) {
-      out[output_code_head] = (uint8_t)code_value;
-      code_value = 1;
-      output_code_head = output_head;
-      length = 0;
-      output_head++;
-      if (in[input_head] == 0) {
-        input_head++;
-      }
-    } else {
-      out[output_head] = in[input_head];
-      code_value++;
-      input_head++;
-      output_head++;
-    }
-    length++;
-  }
-  out[output_code_head] = code_value;
-
-  // Trailing delimeter
-  out[output_head] = 0;
-  output_head++;
-
-  out.resize(output_head);
-}
-
-void CobsDecode(const WirePacket &in, VDP::Packet &out) {
-  out.clear();
-  if (in.size() == 0) {
-    return;
-  }
-
-  out.resize(in.size() + in.size() / 254);
-  uint8_t code = 0xff;
-  uint8_t left_in_block = 0;
-  size_t write_head = 0;
-  for (const uint8_t byte : in) {
-    if (left_in_block) {
-      out[write_head] = byte;
-      write_head++;
-    } else {
-      left_in_block = byte;
-      if (left_in_block != 0 && (code != 0xff)) {
-        out[write_head] = 0;
-        write_head++;
-      }
-      code = left_in_block;
-      if (code == 0) {
-        // hit a delimeter
-        break;
-      }
-    }
-    left_in_block--;
-  }
-  out.resize(write_head);
-}
-
 } // namespace VDB
@@ -1,30 +1,209 @@
 #include "foxglove-ws.hpp"
+#include "cJSON.h"
+#include "esp_timer.h"
+#include "ws-queue.hpp"
+#include <mutex>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 static const char *TAG = "foxglove_ws";
 
-esp_err_t foxglove_ws_handler(httpd_req_t *r) { return 0; }
+static const char SUBPROTOCOL[] = "foxglove.websocket.v1";
+// the first byte of a binary messageData frame
+static const uint8_t OP_MESSAGE_DATA = 0x01;
+// opcode, subscription id and timestamp, ahead of the payload
+static const size_t MESSAGE_DATA_HEADER_SIZE = 1 + 4 + 8;
+static_assert(MESSAGE_DATA_HEADER_SIZE <= WsQueue::MAX_HEADER,
+              "the header goes out as its own fragment");
 
-static const httpd_uri_t ws = {
-    .uri = "/ws",
+namespace {
+// a client's subscription, by the id the client picked for it
+struct Subscription {
+  uint32_t id;
+  uint32_t channel_id;
+};
+struct Client {
+  int fd;
+  std::vector<Subscription> subscriptions;
+};
+} // namespace
+
+static httpd_handle_t foxglove_handle = NULL;
+// told to clients so they can tell the board restarted
+static int64_t session_id = 0;
+// the httpd task changes these while the main task sends
+static std::mutex clients_mutex;
+static std::vector<Client> clients;
+
+// what is waiting to go out to each client. Data is skipped for clients that
+// fall behind, everything else always goes
+static WsQueue queue{TAG};
+
+/**
+ * sends a text message to every client
+ */
+static void send_to_all(const std::string &msg) {
+  queue.broadcast_all(std::make_shared<const std::string>(msg), false);
+}
+
+/**
+ * @return the client on a socket, or NULL if it isn't one. Hold
+ * clients_mutex while using it
+ */
+static Client *find_client(int fd) {
+  for (Client &client : clients) {
+    if (client.fd == fd) {
+      return &client;
+    }
+  }
+  return NULL;
+}
+
+static std::string server_info_msg() {
+  char buf[192];
+  snprintf(buf, sizeof(buf),
+           "{\"op\":\"serverInfo\",\"name\":\"V5 Debug Board\","
+           "\"capabilities\":[],\"supportedEncodings\":[],\"metadata\":{},"
+           "\"sessionId\":\"%lld\"}",
+           (long long)session_id);
+  return buf;
+}
+
+/**
+ * handles a subscribe or unsubscribe from a client, anything else is ignored
+ */
+static void handle_client_msg(int fd, const char *msg) {
+  cJSON *root = cJSON_Parse(msg);
+  if (root == NULL) {
+    ESP_LOGW(TAG, "client sent something that wasn't json");
+    return;
+  }
+  const cJSON *op = cJSON_GetObjectItem(root, "op");
+  std::lock_guard<std::mutex> lock(clients_mutex);
+  Client *client = find_client(fd);
+  if (client != NULL && cJSON_IsString(op)) {
+    const cJSON *item;
+    if (strcmp(op->valuestring, "subscribe") == 0) {
+      cJSON_ArrayForEach(item, cJSON_GetObjectItem(root, "subscriptions")) {
+        const cJSON *id = cJSON_GetObjectItem(item, "id");
+        const cJSON *channel_id = cJSON_GetObjectItem(item, "channelId");
+        if (cJSON_IsNumber(id) && cJSON_IsNumber(channel_id)) {
+          client->subscriptions.push_back(Subscription{
+              (uint32_t)id->valuedouble, (uint32_t)channel_id->valuedouble});
+        }
+      }
+    } else if (strcmp(op->valuestring, "unsubscribe") == 0) {
+      cJSON_ArrayForEach(item, cJSON_GetObjectItem(root, "subscriptionIds")) {
+        if (!cJSON_IsNumber(item)) {
+          continue;
+        }
+        std::vector<Subscription> &subs = client->subscriptions;
+        for (auto it = subs.begin(); it != subs.end(); it++) {
+          if (it->id == (uint32_t)item->valuedouble) {
+            subs.erase(it);
+            break;
+          }
+        }
+      }
+    }
+  }
+  cJSON_Delete(root);
+}
+
+static esp_err_t foxglove_ws_handler(httpd_req_t *req) {
+  foxglove_functions *funcs = (foxglove_functions *)req->user_ctx;
+  const int fd = httpd_req_to_sockfd(req);
+  if (req->method == HTTP_GET) {
+    ESP_LOGI(TAG, "Foxglove client connected");
+    {
+      std::lock_guard<std::mutex> lock(clients_mutex);
+      if (find_client(fd) == NULL) {
+        clients.push_back(Client{fd, {}});
+      }
+    }
+    queue.add_client(fd, false);
+    queue.send(fd, std::make_shared<const std::string>(server_info_msg()),
+               false);
+    if (funcs->get_adv_msg) {
+      queue.send(fd, std::make_shared<const std::string>(funcs->get_adv_msg()),
+                 false);
+    }
+    return ESP_OK;
+  }
+
+  httpd_ws_frame_t ws_pkt;
+  memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
+  /* Set max_len = 0 to get the frame len */
+  esp_err_t ret = httpd_ws_recv_frame(req, &ws_pkt, 0);
+  if (ret != ESP_OK || ws_pkt.len == 0) {
+    return ret;
+  }
+  /* ws_pkt.len + 1 is for NULL termination as we are expecting a string */
+  std::string buf(ws_pkt.len + 1, '\0');
+  ws_pkt.payload = (uint8_t *)&buf[0];
+  ret = httpd_ws_recv_frame(req, &ws_pkt, ws_pkt.len);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "httpd_ws_recv_frame failed with %d", ret);
+    return ret;
+  }
+  // the only binary messages clients send are for capabilities we don't
+  // advertise
+  if (ws_pkt.type == HTTPD_WS_TYPE_TEXT) {
+    handle_client_msg(fd, buf.c_str());
+  }
+  return ESP_OK;
+}
+
+static httpd_uri_t ws = {
+    .uri = "/",
     .method = HTTP_GET,
     .handler = foxglove_ws_handler,
     .user_ctx = NULL,
     .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = SUBPROTOCOL,
 };
 
-void foxglove_init_ws(void *arg_server) {
+/*
+ * forgets a client when its socket closes, whichever end closed it
+ */
+static void foxglove_close_fn(httpd_handle_t hd, int fd) {
+  queue.remove_client(fd);
+  {
+    std::lock_guard<std::mutex> lock(clients_mutex);
+    for (auto it = clients.begin(); it != clients.end(); it++) {
+      if (it->fd == fd) {
+        clients.erase(it);
+        break;
+      }
+    }
+  }
+  close(fd);
+}
+
+void foxglove_init_ws(void *arg_server, foxglove_functions *funcs) {
   httpd_handle_t *server = (httpd_handle_t *)arg_server;
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
 
   config.server_port = 8765;
+  // the webserver on port 80 already has the default control port
+  config.ctrl_port = ESP_HTTPD_DEF_CTRL_PORT + 1;
+  // a few Foxglove windows at once, the rest of the sockets are the
+  // webserver's
+  config.max_open_sockets = 3;
+  config.close_fn = foxglove_close_fn;
+  session_id = esp_timer_get_time();
 
   ESP_LOGI(TAG, "Starting websocket");
 
   esp_err_t retval = httpd_start(server, &config);
   if (retval == ESP_OK) {
     ESP_LOGI(TAG, "Registering URI Handlers");
+    ws.user_ctx = (void *)funcs;
     httpd_register_uri_handler(*server, &ws);
+    queue.set_handle(*server);
+    foxglove_handle = *server;
   } else {
     ESP_ERROR_CHECK(retval);
   }
@@ -33,4 +212,92 @@ void foxglove_init_ws(void *arg_server) {
 void foxglove_end_ws(void *arg_server) {
   httpd_handle_t *server = (httpd_handle_t *)arg_server;
   httpd_stop(*server);
+  foxglove_handle = NULL;
+}
+
+void foxglove_advertise(const std::string &advertise_msg) {
+  if (foxglove_handle == NULL) {
+    return;
+  }
+  send_to_all(advertise_msg);
+}
+
+void foxglove_unadvertise(const std::vector<uint32_t> &channel_ids) {
+  if (foxglove_handle == NULL || channel_ids.empty()) {
+    return;
+  }
+  std::string msg = "{\"op\":\"unadvertise\",\"channelIds\":[";
+  for (size_t i = 0; i < channel_ids.size(); i++) {
+    if (i > 0) {
+      msg += ',';
+    }
+    msg += std::to_string(channel_ids[i]);
+  }
+  msg += "]}";
+  {
+    std::lock_guard<std::mutex> lock(clients_mutex);
+    for (Client &client : clients) {
+      std::vector<Subscription> &subs = client.subscriptions;
+      for (auto it = subs.begin(); it != subs.end();) {
+        bool gone = false;
+        for (uint32_t id : channel_ids) {
+          gone = gone || it->channel_id == id;
+        }
+        it = gone ? subs.erase(it) : it + 1;
+      }
+    }
+  }
+  send_to_all(msg);
+}
+
+bool foxglove_subscribed(uint32_t channel_id) {
+  std::lock_guard<std::mutex> lock(clients_mutex);
+  for (const Client &client : clients) {
+    for (const Subscription &sub : client.subscriptions) {
+      if (sub.channel_id == channel_id) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool foxglove_any_subscribed() {
+  std::lock_guard<std::mutex> lock(clients_mutex);
+  for (const Client &client : clients) {
+    if (!client.subscriptions.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void foxglove_send_message(uint32_t channel_id, uint64_t timestamp_ns,
+                           const std::string &payload) {
+  if (foxglove_handle == NULL) {
+    return;
+  }
+  // the payload is shared, each subscription only gets its own header
+  // since its id is in it
+  ws_message msg;
+  uint8_t header[MESSAGE_DATA_HEADER_SIZE];
+  header[0] = OP_MESSAGE_DATA;
+  for (int i = 0; i < 8; i++) {
+    header[5 + i] = (uint8_t)(timestamp_ns >> (8 * i));
+  }
+  std::lock_guard<std::mutex> lock(clients_mutex);
+  for (const Client &client : clients) {
+    for (const Subscription &sub : client.subscriptions) {
+      if (sub.channel_id != channel_id) {
+        continue;
+      }
+      if (!msg) {
+        msg = std::make_shared<const std::string>(payload);
+      }
+      for (int i = 0; i < 4; i++) {
+        header[1 + i] = (uint8_t)(sub.id >> (8 * i));
+      }
+      queue.send_with_header(client.fd, header, sizeof(header), msg);
+    }
+  }
 }
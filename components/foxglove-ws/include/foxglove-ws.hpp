@@ -3,8 +3,42 @@
 
 #include "esp_http_server.h"
 #include "esp_log.h"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
 
-void foxglove_init_ws(void* arg_server);
-void foxglove_end_ws(void* arg_server);
+struct foxglove_functions {
+  // the advertise message for every channel announced so far, sent to each
+  // new client after serverInfo
+  std::function<std::string()> get_adv_msg;
+};
 
-#endif
\ No newline at end of file
+/// @brief starts a Foxglove websocket protocol (foxglove.websocket.v1)
+/// server on port 8765, for Foxglove's "Foxglove WebSocket" connection
+/// @param arg_server where to put the server's handle, an httpd_handle_t*
+/// @param funcs what the server asks the rest of the board for
+void foxglove_init_ws(void *arg_server, foxglove_functions *funcs);
+void foxglove_end_ws(void *arg_server);
+
+/// @brief sends an advertise message to every client
+void foxglove_advertise(const std::string &advertise_msg);
+/// @brief tells every client the channels are gone and drops their
+/// subscriptions to them
+void foxglove_unadvertise(const std::vector<uint32_t> &channel_ids);
+
+/// @return whether any client is subscribed to the channel, so messages for
+/// channels nobody is watching don't have to be written
+bool foxglove_subscribed(uint32_t channel_id);
+/// @return whether any client is subscribed to anything
+bool foxglove_any_subscribed();
+/// @brief sends a message as a messageData frame to every client subscribed
+/// to its channel. The payload is copied once and shared by every
+/// subscription, and a client that has fallen too far behind skips it
+/// @param channel_id the channel the message is on
+/// @param timestamp_ns when the message was recorded, in nanoseconds
+/// @param payload the message, in the channel's encoding
+void foxglove_send_message(uint32_t channel_id, uint64_t timestamp_ns,
+                           const std::string &payload);
+
+#endif
@@ -1,14 +1,32 @@
 #include "esp_http_server.h"
+#include "ws-queue.hpp"
 #include <functional>
+#include <memory>
 #include <string>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// every websocket client, for num_ws_clients
+static const int WS_ALL_CLIENTS = -1;
+
 struct ws_functions {
-  std::function<void(std::string)> rec_cb;
-  std::function<std::string()> get_adv_msg;
+  // called with each text message a client sends and the client's socket
+  std::function<void(int fd, std::string)> rec_cb;
+  // called with a new connection's socket, the query string of its url, like
+  // format=compact, and the subprotocol it speaks, before the advertisement
+  // is sent. Returns the group the client goes in: clients that want the
+  // same messages share a group, and each message is sent to a group
+  std::function<int(int fd, const std::string &query,
+                    const std::string &protocol)>
+      on_open;
+  // the advertisement for a new client in a group, or nothing to send none
+  std::function<std::string(int group)> get_adv_msg;
+  // called with a client's socket when it closes
+  std::function<void(int fd)> on_close;
+  // served at /api/linkstats
+  std::function<std::string()> get_link_stats;
 };
 
 /// @brief begin the http log that can be accessed at hostname.local/log
@@ -20,7 +38,19 @@ httpd_handle_t webserver_start(uint16_t port, ws_functions *funcs);
 /// @param server the server to be destoyed
 void webserver_stop(httpd_handle_t server);
 
-esp_err_t send_string_to_ws(const std::string &str);
+/// @brief queues a message to every websocket client in a group, as a
+/// binary frame for clients that connected at /ws/cbor or /ws/raw and a text
+/// frame otherwise
+/// @param droppable whether a client that has fallen too far behind can skip
+/// it. Data can be skipped, advertisements and broadcasts can't
+void broadcast_to_ws(ws_message msg, int group, bool droppable);
+/// @brief queues a message to one websocket client
+/// @param fd the client's socket, as given to on_open
+/// @param droppable whether the client can skip it if it is too far behind
+esp_err_t send_to_ws_client(int fd, ws_message msg, bool droppable);
+/// @return how many websocket clients are in a group, or connected at all
+/// for WS_ALL_CLIENTS
+size_t num_ws_clients(int group);
 
 #ifdef __cplusplus
 }
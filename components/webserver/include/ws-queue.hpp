@@ -0,0 +1,128 @@
+#pragma once
+#include "esp_http_server.h"
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// a message written once and queued to any number of clients without
+// copying it
+using ws_message = std::shared_ptr<const std::string>;
+
+/**
+ * The websocket clients of one httpd server and the messages waiting to go
+ * out to each of them. Each client has its own queue, sent from the httpd
+ * task one message per turn so clients take turns. A message is written once
+ * and every client it goes to shares it. A client that falls MAX_QUEUED
+ * messages behind skips data until it catches up, so one slow laptop can't
+ * use up the board's memory
+ */
+class WsQueue {
+public:
+  static const size_t MAX_QUEUED = 16;
+  // longest header send_with_header puts ahead of a shared message
+  static const size_t MAX_HEADER = 16;
+
+  /**
+   * @param tag what to log as
+   */
+  explicit WsQueue(const char *tag);
+
+  /**
+   * @param handle the server whose work queue sends go through, set before
+   * anything is sent
+   */
+  void set_handle(httpd_handle_t handle);
+
+  /**
+   * adds a client in no group, or resets one on a reused socket
+   * @param binary send its messages as binary frames instead of text
+   */
+  void add_client(int fd, bool binary);
+  /**
+   * @param group whatever the owner sorts clients into, like the messages
+   * they want
+   */
+  void set_group(int fd, int group);
+  /**
+   * forgets a client and what was waiting for it
+   * @return false if it wasn't a client
+   */
+  bool remove_client(int fd);
+
+  /**
+   * queues a message to one client
+   * @param droppable false for messages the client can't do without, like
+   * an advertisement, which go in even when it is behind
+   * @return ESP_ERR_NO_MEM if it was skipped for being too far behind
+   */
+  esp_err_t send(int fd, const ws_message &msg, bool droppable = true);
+  /**
+   * queues a message to one client with a few bytes of its own in front, as
+   * one binary message. The header goes out as the first fragment and the
+   * shared message as the second, so neither is copied into the other
+   * @return ESP_ERR_NO_MEM if it was skipped for being too far behind
+   */
+  esp_err_t send_with_header(int fd, const uint8_t *header, size_t header_len,
+                             const ws_message &msg);
+  /**
+   * queues a message to every client in a group
+   */
+  void broadcast(const ws_message &msg, int group, bool droppable = true);
+  /**
+   * queues a message to every client, whatever group it is in
+   */
+  void broadcast_all(const ws_message &msg, bool droppable = true);
+  /**
+   * @return how many clients are in a group, or in any group for a negative
+   * one
+   */
+  size_t num_clients(int group) const;
+
+private:
+  struct Frame {
+    ws_message msg;
+    uint8_t header[MAX_HEADER];
+    uint8_t header_len;
+  };
+  struct Client {
+    int fd;
+    // -1 until the owner puts it in one
+    int group;
+    bool binary;
+    std::deque<Frame> queue;
+    // whether a send_next for it is in the httpd work queue
+    bool sending;
+    // messages it skipped for being too far behind
+    int dropped;
+  };
+  // what a queued send_next works on
+  struct Work {
+    WsQueue *queue;
+    int fd;
+  };
+
+  /**
+   * @return the client on a socket, or NULL if it isn't one. Hold mutex
+   * while using it
+   */
+  Client *find_client(int fd);
+  /**
+   * adds a frame to a client's queue and makes sure something is sending
+   * it. Hold mutex
+   */
+  esp_err_t enqueue(Client &client, Frame frame, bool droppable);
+  /**
+   * sends the next frame queued for a client, from the httpd work queue
+   */
+  static void send_next(void *arg);
+
+  const char *tag;
+  httpd_handle_t handle = NULL;
+  // the httpd task adds and removes clients while the main task sends
+  mutable std::mutex mutex;
+  std::vector<Client> clients;
+};
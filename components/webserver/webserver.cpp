@@ -5,6 +5,7 @@
 #include <esp_log.h>
 #include <mdns.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <vector>
 
 #include "freertos/semphr.h"
@@ -18,64 +19,71 @@ esp_err_t http_404_error_handler(httpd_req_t *req, httpd_err_code_t err) {
   return ESP_FAIL;
 }
 
-/*
- * Structure holding server handle
- * and internal socket fd in order
- * to use out of request send
- */
-struct async_resp_arg {
-  httpd_handle_t hd;
-  int fd;
-  std::string str;
-};
+static ws_functions *global_funcs;
+// the websocket clients and what is waiting to go out to each, grouped by
+// what on_open said they want
+static WsQueue ws_queue{TAG};
 
 /*
- * async send function, which we put into the httpd work queue
+ * forgets a websocket client when its socket closes, whichever end closed it
  */
-static void ws_async_send(void *arg) {
-  struct async_resp_arg *resp_arg = (struct async_resp_arg *)arg;
-  httpd_handle_t hd = resp_arg->hd;
-  int fd = resp_arg->fd;
-  httpd_ws_frame_t ws_pkt;
-  memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
-  ws_pkt.payload = (uint8_t *)resp_arg->str.c_str(); // (uint8_t *)data;
-  ws_pkt.len = resp_arg->str.size();                 // strlen(data);
-  ws_pkt.type = HTTPD_WS_TYPE_TEXT;
-
-  httpd_ws_send_frame_async(hd, fd, &ws_pkt);
-  delete resp_arg;
+static void ws_close_fn(httpd_handle_t hd, int fd) {
+  if (ws_queue.remove_client(fd) && global_funcs->on_close) {
+    global_funcs->on_close(fd);
+  }
+  close(fd);
 }
 
-static esp_err_t trigger_async_send(httpd_handle_t handle, int fd,
-                                    std::string str) {
-  struct async_resp_arg *resp_arg = new async_resp_arg{};
-  if (resp_arg == NULL) {
-    return ESP_ERR_NO_MEM;
-  }
-  resp_arg->hd = handle;
-  resp_arg->fd = fd;
-  resp_arg->str = str;
+// esp_http_server only agrees to one subprotocol per uri, so each encoding
+// gets its own
+static const char CBOR_URI[] = "/ws/cbor";
+static const char CBOR_SUBPROTOCOL[] = "vdb.cbor";
+static const char RAW_URI[] = "/ws/raw";
+static const char RAW_SUBPROTOCOL[] = "vdb.raw";
 
-  esp_err_t ret = httpd_queue_work(handle, ws_async_send, resp_arg);
-  if (ret != ESP_OK) {
-    delete resp_arg;
+/**
+ * @return the subprotocol that goes with the uri a client connected to
+ */
+static const char *uri_subprotocol(const char *uri) {
+  if (strncmp(uri, CBOR_URI, strlen(CBOR_URI)) == 0) {
+    return CBOR_SUBPROTOCOL;
   }
-  return ret;
+  if (strncmp(uri, RAW_URI, strlen(RAW_URI)) == 0) {
+    return RAW_SUBPROTOCOL;
+  }
+  return "chat";
 }
 
-static httpd_handle_t global_handle;
-static int global_fd = 0;
-
 esp_err_t ws_handler(httpd_req_t *req) {
   ws_functions *funcs = (ws_functions *)req->user_ctx;
   if (req->method == HTTP_GET) {
-    global_handle = req->handle;
-    global_fd = httpd_req_to_sockfd(req);
+    const int fd = httpd_req_to_sockfd(req);
 
     ESP_LOGI(TAG, "Handshake done, the new connection was opened");
-    std::string advertisementStr = (funcs->get_adv_msg)();
-    ESP_LOGI(TAG, "%s", advertisementStr.c_str());
-    esp_err_t edos = send_string_to_ws(advertisementStr);
+    std::string query;
+    const size_t query_len = httpd_req_get_url_query_len(req);
+    if (query_len > 0) {
+      query.resize(query_len + 1);
+      httpd_req_get_url_query_str(req, &query[0], query.size());
+      query.resize(query_len);
+    }
+    const char *protocol = uri_subprotocol(req->uri);
+    const bool binary = strcmp(protocol, "chat") != 0;
+    // in no group until on_open says, so it only gets what on_open sends it
+    ws_queue.add_client(fd, binary);
+    const int group = funcs->on_open ? funcs->on_open(fd, query, protocol) : 0;
+    ws_queue.set_group(fd, group);
+    // raw clients got their broadcast packets from on_open instead
+    std::string advertisementStr = (funcs->get_adv_msg)(group);
+    if (!advertisementStr.empty()) {
+      if (!binary) {
+        ESP_LOGI(TAG, "%s", advertisementStr.c_str());
+      }
+      // without it the client can't read anything that follows
+      send_to_ws_client(
+          fd, std::make_shared<const std::string>(std::move(advertisementStr)),
+          false);
+    }
 
     return ESP_OK;
   }
@@ -112,7 +120,7 @@ esp_err_t ws_handler(httpd_req_t *req) {
       return ret;
     }
     printf("data received from websocket: \n\n\n%s\n\n\n", (char*)ws_pkt.payload);
-    funcs->rec_cb((char *)ws_pkt.payload);
+    funcs->rec_cb(httpd_req_to_sockfd(req), (char *)ws_pkt.payload);
 
     ESP_LOGI(TAG, "Got packet with message: %s", ws_pkt.payload);
   }
@@ -142,6 +150,42 @@ static httpd_uri_t ws = {
     .supported_subprotocol = "chat",
 };
 
+// the same websocket, with CBOR messages in binary frames
+static httpd_uri_t ws_cbor = {
+    .uri = CBOR_URI,
+    .method = HTTP_GET,
+    .handler = ws_handler,
+    .user_ctx = NULL,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = CBOR_SUBPROTOCOL,
+};
+
+// the brain's VDP packets as they come in, one per binary frame
+static httpd_uri_t ws_raw = {
+    .uri = RAW_URI,
+    .method = HTTP_GET,
+    .handler = ws_handler,
+    .user_ctx = NULL,
+    .is_websocket = true,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = RAW_SUBPROTOCOL,
+};
+
+esp_err_t link_stats_handler(httpd_req_t *req) {
+  ws_functions *funcs = (ws_functions *)req->user_ctx;
+  std::string json_str = (funcs->get_link_stats)();
+
+  ESP_ERROR_CHECK(httpd_resp_set_type(req, "application/json"));
+  return httpd_resp_send(req, json_str.c_str(), json_str.size());
+}
+static httpd_uri_t link_stats_get = {
+    .uri = "/api/linkstats",
+    .method = HTTP_GET,
+    .handler = link_stats_handler,
+    .user_ctx = NULL,
+};
+
 /**
  * @brief Function for starting the webserver
  * @pre mDNS is initialized
@@ -151,6 +195,10 @@ httpd_handle_t webserver_start(uint16_t port, ws_functions *funcs) {
   /* Generate default configuration */
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
   config.server_port = port;
+  // three websockets, link stats, the rest api and the static files are
+  // past the default of 8
+  config.max_uri_handlers = 12;
+  config.close_fn = ws_close_fn;
 
   ESP_LOGI(TAG, "Starting http log server on port: '%d'", config.server_port);
 
@@ -165,9 +213,18 @@ httpd_handle_t webserver_start(uint16_t port, ws_functions *funcs) {
     ESP_LOGE(TAG, "Failed to start HTTP server");
     return NULL;
   }
+  ws_queue.set_handle(server);
+  global_funcs = funcs;
   ws.user_ctx = (void *)funcs;
 
   ESP_ERROR_CHECK(httpd_register_uri_handler(server, &ws));
+  ws_cbor.user_ctx = (void *)funcs;
+  ESP_ERROR_CHECK(httpd_register_uri_handler(server, &ws_cbor));
+  ws_raw.user_ctx = (void *)funcs;
+  ESP_ERROR_CHECK(httpd_register_uri_handler(server, &ws_raw));
+
+  link_stats_get.user_ctx = (void *)funcs;
+  ESP_ERROR_CHECK(httpd_register_uri_handler(server, &link_stats_get));
 
   // 404 Page
   ESP_ERROR_CHECK(httpd_register_err_handler(server, HTTPD_404_NOT_FOUND,
@@ -178,24 +235,32 @@ httpd_handle_t webserver_start(uint16_t port, ws_functions *funcs) {
   return server;
 }
 
-esp_err_t send_string_to_ws(const std::string &str) {
-  if (global_fd == 0) {
-    ESP_LOGI(TAG, "Not sending to ws bc websocket unopened");
-    return ESP_OK;
-  }
-
-  return trigger_async_send(global_handle, global_fd, str);
+/**
+ * queues a message to every websocket client in a group, as a binary frame
+ * for clients that connected at /ws/cbor or /ws/raw and a text frame
+ * otherwise
+ * @param droppable whether a client that has fallen too far behind can skip
+ * it. Data can be skipped, advertisements and broadcasts can't
+ */
+void broadcast_to_ws(ws_message msg, int group, bool droppable) {
+  ws_queue.broadcast(msg, group, droppable);
 }
 
-esp_err_t get_string_from_ws(const std::string &str) {
-  if (global_fd == 0) {
-    ESP_LOGI(TAG, "Not sending to ws bc websocket unopened");
-    return ESP_OK;
-  }
-
-  return trigger_async_send(global_handle, global_fd, str);
+/**
+ * queues a message to one websocket client
+ * @param fd the client's socket, as given to on_open
+ * @param droppable whether the client can skip it if it is too far behind
+ */
+esp_err_t send_to_ws_client(int fd, ws_message msg, bool droppable) {
+  return ws_queue.send(fd, msg, droppable);
 }
 
+/**
+ * @return how many websocket clients are in a group, or connected at all for
+ * WS_ALL_CLIENTS
+ */
+size_t num_ws_clients(int group) { return ws_queue.num_clients(group); }
+
 /* Function for stopping the webserver */
 void webserver_stop(httpd_handle_t server) {
   if (server) {
@@ -0,0 +1,238 @@
+#include "ws-queue.hpp"
+
+#include <esp_log.h>
+#include <string.h>
+
+/**
+ * @param tag what to log as
+ */
+WsQueue::WsQueue(const char *tag) : tag(tag) {}
+
+/**
+ * @param handle the server whose work queue sends go through, set before
+ * anything is sent
+ */
+void WsQueue::set_handle(httpd_handle_t handle) { this->handle = handle; }
+
+/**
+ * adds a client in no group, or resets one on a reused socket
+ * @param binary send its messages as binary frames instead of text
+ */
+void WsQueue::add_client(int fd, bool binary) {
+  std::lock_guard<std::mutex> lock(mutex);
+  // a socket that was closed without close_fn hearing about it
+  Client *old = find_client(fd);
+  if (old != NULL) {
+    *old = Client{fd, -1, binary, {}, old->sending, 0};
+  } else {
+    clients.push_back(Client{fd, -1, binary, {}, false, 0});
+  }
+}
+
+void WsQueue::set_group(int fd, int group) {
+  std::lock_guard<std::mutex> lock(mutex);
+  Client *client = find_client(fd);
+  if (client != NULL) {
+    client->group = group;
+  }
+}
+
+/**
+ * forgets a client and what was waiting for it
+ * @return false if it wasn't a client
+ */
+bool WsQueue::remove_client(int fd) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto it = clients.begin(); it != clients.end(); it++) {
+    if (it->fd == fd) {
+      if (it->dropped > 0) {
+        ESP_LOGW(tag, "websocket client %d skipped %d messages", fd,
+                 it->dropped);
+      }
+      clients.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * queues a message to one client
+ * @param droppable false for messages the client can't do without, like an
+ * advertisement, which go in even when it is behind
+ * @return ESP_ERR_NO_MEM if it was skipped for being too far behind
+ */
+esp_err_t WsQueue::send(int fd, const ws_message &msg, bool droppable) {
+  std::lock_guard<std::mutex> lock(mutex);
+  Client *client = find_client(fd);
+  if (client == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  return enqueue(*client, Frame{msg, {}, 0}, droppable);
+}
+
+/**
+ * queues a message to one client with a few bytes of its own in front, as
+ * one binary message. The header goes out as the first fragment and the
+ * shared message as the second, so neither is copied into the other
+ * @return ESP_ERR_NO_MEM if it was skipped for being too far behind
+ */
+esp_err_t WsQueue::send_with_header(int fd, const uint8_t *header,
+                                    size_t header_len, const ws_message &msg) {
+  if (header_len > MAX_HEADER) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  Frame frame{msg, {}, (uint8_t)header_len};
+  memcpy(frame.header, header, header_len);
+  std::lock_guard<std::mutex> lock(mutex);
+  Client *client = find_client(fd);
+  if (client == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  return enqueue(*client, std::move(frame), true);
+}
+
+/**
+ * queues a message to every client in a group
+ */
+void WsQueue::broadcast(const ws_message &msg, int group, bool droppable) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (Client &client : clients) {
+    if (client.group == group) {
+      enqueue(client, Frame{msg, {}, 0}, droppable);
+    }
+  }
+}
+
+/**
+ * queues a message to every client, whatever group it is in
+ */
+void WsQueue::broadcast_all(const ws_message &msg, bool droppable) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (Client &client : clients) {
+    enqueue(client, Frame{msg, {}, 0}, droppable);
+  }
+}
+
+/**
+ * @return how many clients are in a group, or in any group for a negative one
+ */
+size_t WsQueue::num_clients(int group) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  size_t count = 0;
+  for (const Client &client : clients) {
+    if (group < 0 ? client.group >= 0 : client.group == group) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/**
+ * @return the client on a socket, or NULL if it isn't one. Hold mutex while
+ * using it
+ */
+WsQueue::Client *WsQueue::find_client(int fd) {
+  for (Client &client : clients) {
+    if (client.fd == fd) {
+      return &client;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * adds a frame to a client's queue and makes sure something is sending it.
+ * Hold mutex
+ */
+esp_err_t WsQueue::enqueue(Client &client, Frame frame, bool droppable) {
+  if (droppable && client.queue.size() >= MAX_QUEUED) {
+    client.dropped++;
+    return ESP_ERR_NO_MEM;
+  }
+  client.queue.push_back(std::move(frame));
+  if (client.sending) {
+    return ESP_OK;
+  }
+  // kept across turns while the client has more waiting
+  Work *work = new Work{this, client.fd};
+  esp_err_t ret = httpd_queue_work(handle, send_next, work);
+  if (ret == ESP_OK) {
+    client.sending = true;
+  } else {
+    delete work;
+    client.queue.pop_back();
+  }
+  return ret;
+}
+
+/*
+ * sends the next frame queued for a client, which we put into the httpd work
+ * queue. One frame per turn, so clients take turns
+ */
+void WsQueue::send_next(void *arg) {
+  Work *work = (Work *)arg;
+  WsQueue &self = *work->queue;
+  const int fd = work->fd;
+  Frame frame;
+  bool binary;
+  {
+    std::lock_guard<std::mutex> lock(self.mutex);
+    Client *client = self.find_client(fd);
+    if (client == NULL) {
+      delete work;
+      return;
+    }
+    if (client->queue.empty()) {
+      client->sending = false;
+      delete work;
+      return;
+    }
+    frame = std::move(client->queue.front());
+    client->queue.pop_front();
+    binary = client->binary;
+  }
+
+  httpd_ws_frame_t ws_pkt;
+  memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
+  esp_err_t ret = ESP_OK;
+  if (frame.header_len > 0) {
+    // the header opens a fragmented binary message, the shared part
+    // finishes it
+    ws_pkt.fragmented = true;
+    ws_pkt.final = false;
+    ws_pkt.type = HTTPD_WS_TYPE_BINARY;
+    ws_pkt.payload = frame.header;
+    ws_pkt.len = frame.header_len;
+    ret = httpd_ws_send_frame_async(self.handle, fd, &ws_pkt);
+    ws_pkt.final = true;
+    ws_pkt.type = HTTPD_WS_TYPE_CONTINUE;
+  } else {
+    ws_pkt.type = binary ? HTTPD_WS_TYPE_BINARY : HTTPD_WS_TYPE_TEXT;
+  }
+  ws_pkt.payload = (uint8_t *)frame.msg->data();
+  ws_pkt.len = frame.msg->size();
+  if (ret == ESP_OK) {
+    ret = httpd_ws_send_frame_async(self.handle, fd, &ws_pkt);
+  }
+  if (ret != ESP_OK) {
+    // the client went away without saying so, closing it drops it from
+    // clients in the server's close_fn
+    ESP_LOGW(self.tag, "websocket client %d stopped taking messages", fd);
+    httpd_sess_trigger_close(self.handle, fd);
+    delete work;
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(self.mutex);
+  Client *client = self.find_client(fd);
+  if (client == NULL) {
+    delete work;
+    return;
+  }
+  if (client->queue.empty() ||
+      httpd_queue_work(self.handle, send_next, work) != ESP_OK) {
+    client->sending = false;
+    delete work;
+  }
+}
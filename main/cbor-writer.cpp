@@ -0,0 +1,133 @@
+#include "cbor-writer.hpp"
+
+#include <cstring>
+
+namespace {
+// major types
+constexpr uint8_t CBOR_UINT = 0;
+constexpr uint8_t CBOR_NEGINT = 1;
+constexpr uint8_t CBOR_TEXT = 3;
+constexpr uint8_t CBOR_ARRAY = 4;
+constexpr uint8_t CBOR_MAP = 5;
+// simple values and floats, the low bits say which
+constexpr uint8_t CBOR_FALSE = 0xf4;
+constexpr uint8_t CBOR_TRUE = 0xf5;
+constexpr uint8_t CBOR_NULL = 0xf6;
+constexpr uint8_t CBOR_FLOAT32 = 0xfa;
+constexpr uint8_t CBOR_FLOAT64 = 0xfb;
+constexpr uint8_t CBOR_BREAK = 0xff;
+// what goes in the low bits for an indefinite length
+constexpr uint8_t CBOR_INDEFINITE = 31;
+} // namespace
+
+/**
+ * @param out the string to add to
+ */
+CBORWriter::CBORWriter(std::string &out) : out(out) {}
+
+/**
+ * @param pairs how many keys and values follow
+ */
+void CBORWriter::begin_map(size_t pairs) { head(CBOR_MAP, pairs); }
+/**
+ * @param items how many values follow
+ */
+void CBORWriter::begin_array(size_t items) { head(CBOR_ARRAY, items); }
+/**
+ * starts an array whose length isn't known yet, close it with end_indefinite
+ */
+void CBORWriter::begin_array_indefinite() {
+  out.push_back((char)((CBOR_ARRAY << 5) | CBOR_INDEFINITE));
+}
+void CBORWriter::end_indefinite() { out.push_back((char)CBOR_BREAK); }
+
+void CBORWriter::key(const std::string &name) {
+  write_text(name.data(), name.size());
+}
+void CBORWriter::key(const char *name) { write_text(name, strlen(name)); }
+
+void CBORWriter::value(const std::string &str) {
+  write_text(str.data(), str.size());
+}
+void CBORWriter::value(const char *str) { write_text(str, strlen(str)); }
+void CBORWriter::value(bool b) {
+  out.push_back((char)(b ? CBOR_TRUE : CBOR_FALSE));
+}
+/**
+ * written in as few bytes as hold num
+ */
+void CBORWriter::value(int64_t num) {
+  if (num < 0) {
+    // negative numbers are stored as -1 - n
+    head(CBOR_NEGINT, (uint64_t)(-1 - num));
+  } else {
+    head(CBOR_UINT, (uint64_t)num);
+  }
+}
+void CBORWriter::value(uint64_t num) { head(CBOR_UINT, num); }
+/**
+ * written as a 4 byte float
+ */
+void CBORWriter::value(float num) {
+  uint32_t bits;
+  memcpy(&bits, &num, sizeof(bits));
+  char buf[5] = {(char)CBOR_FLOAT32, (char)(bits >> 24), (char)(bits >> 16),
+                 (char)(bits >> 8), (char)bits};
+  out.append(buf, sizeof(buf));
+}
+/**
+ * written as an 8 byte double
+ */
+void CBORWriter::value(double num) {
+  uint64_t bits;
+  memcpy(&bits, &num, sizeof(bits));
+  char buf[9];
+  buf[0] = (char)CBOR_FLOAT64;
+  for (int i = 0; i < 8; i++) {
+    buf[1 + i] = (char)(bits >> (56 - 8 * i));
+  }
+  out.append(buf, sizeof(buf));
+}
+void CBORWriter::value_null() { out.push_back((char)CBOR_NULL); }
+
+/**
+ * @return the string being written to
+ */
+std::string &CBORWriter::str() { return out; }
+
+/**
+ * writes an item's first byte and its argument in as few bytes as hold it
+ * @param major the item's major type, 0 to 7
+ * @param arg the value, length or count that goes with it
+ */
+void CBORWriter::head(uint8_t major, uint64_t arg) {
+  const uint8_t type = (uint8_t)(major << 5);
+  char buf[9];
+  size_t len;
+  if (arg < 24) {
+    buf[0] = (char)(type | arg);
+    len = 1;
+  } else if (arg <= 0xff) {
+    buf[0] = (char)(type | 24);
+    len = 2;
+  } else if (arg <= 0xffff) {
+    buf[0] = (char)(type | 25);
+    len = 3;
+  } else if (arg <= 0xffffffff) {
+    buf[0] = (char)(type | 26);
+    len = 5;
+  } else {
+    buf[0] = (char)(type | 27);
+    len = 9;
+  }
+  // the argument follows big endian
+  for (size_t i = 1; i < len; i++) {
+    buf[i] = (char)(arg >> (8 * (len - 1 - i)));
+  }
+  out.append(buf, len);
+}
+
+void CBORWriter::write_text(const char *str, size_t len) {
+  head(CBOR_TEXT, len);
+  out.append(str, len);
+}
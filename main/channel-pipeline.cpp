@@ -0,0 +1,193 @@
+#include "channel-pipeline.hpp"
+#include "cJSON.h"
+
+#include <cstring>
+
+const ChannelPipeline::Group ChannelPipeline::GROUPS[] = {
+    {DataFormat::Json, DataEncoding::Json},
+    {DataFormat::Compact, DataEncoding::Json},
+    {DataFormat::Json, DataEncoding::Cbor},
+    {DataFormat::Compact, DataEncoding::Cbor},
+    {DataFormat::Json, DataEncoding::Raw},
+};
+const int ChannelPipeline::NUM_GROUPS = sizeof(GROUPS) / sizeof(GROUPS[0]);
+const int ChannelPipeline::RAW_GROUP = NUM_GROUPS - 1;
+
+/**
+ * @return the group for clients that want a format and an encoding
+ */
+int ChannelPipeline::group_for(DataFormat format, DataEncoding encoding) {
+  if (encoding == DataEncoding::Raw) {
+    return RAW_GROUP;
+  }
+  for (int group = 0; group < RAW_GROUP; group++) {
+    if (GROUPS[group].format == format && GROUPS[group].encoding == encoding) {
+      return group;
+    }
+  }
+  return 0;
+}
+
+ChannelPipeline::ChannelPipeline(SendToEncoding send_to_encoding,
+                                 SendToClient send_to_client)
+    : send_to_encoding(std::move(send_to_encoding)),
+      send_to_client(std::move(send_to_client)) {}
+
+// replaces the channel with the same id in a list, or adds it
+static void upsert_channel(std::vector<VDP::Channel> &list,
+                           const VDP::Channel &chan) {
+  for (VDP::Channel &existing : list) {
+    if (existing.getID() == chan.getID()) {
+      existing = chan;
+      return;
+    }
+  }
+  list.push_back(chan);
+}
+
+// removes the channel with an id from a list if it is there
+static void erase_channel(std::vector<VDP::Channel> &list, VDP::ChannelID id) {
+  for (auto it = list.begin(); it != list.end(); it++) {
+    if (it->getID() == id) {
+      list.erase(it);
+      return;
+    }
+  }
+}
+
+/**
+ * from the registry's broadcast callback
+ */
+void ChannelPipeline::on_broadcast(const VDP::Channel &chan,
+                                   VDP::BroadcastChange change) {
+  data_mode = false;
+  switch (change) {
+  case VDP::BroadcastChange::Unchanged:
+    // same id and schema as before, clients keep what they have
+    break;
+  case VDP::BroadcastChange::Added:
+  case VDP::BroadcastChange::Changed:
+    upsert_channel(active_channels, chan);
+    upsert_channel(changed_channels, chan);
+    templates.set(chan);
+    subscriptions.set_channel(chan);
+    break;
+  case VDP::BroadcastChange::Removed:
+    erase_channel(active_channels, chan.getID());
+    erase_channel(changed_channels, chan.getID());
+    removed_channels.push_back(chan.getID());
+    templates.remove(chan.getID());
+    subscriptions.remove_channel(chan.getID());
+    break;
+  }
+}
+
+/**
+ * from the registry's data callback
+ * @return whether any client was sent the data
+ */
+bool ChannelPipeline::on_data(const VDP::Channel &chan) {
+  if (has_pending) {
+    std::vector<std::pair<std::string, int>> fields;
+    {
+      std::lock_guard<std::mutex> lock(pending_mutex);
+      fields.swap(pending_decimals);
+      has_pending = false;
+    }
+    for (const auto &field : fields) {
+      set_decimals(field.first, field.second);
+    }
+  }
+  // if we aren't in data mode, tell clients what changed and switch to data
+  // mode
+  if (!data_mode) {
+    data_mode = true;
+    for (DataEncoding encoding : {DataEncoding::Json, DataEncoding::Cbor}) {
+      std::string advertisement;
+      if (!advertised) {
+        advertisement = send_advertisement_msg(active_channels, encoding);
+      } else if (!changed_channels.empty() || !removed_channels.empty()) {
+        advertisement = send_advertisement_update_msg(
+            changed_channels, removed_channels, encoding);
+      }
+      if (!advertisement.empty()) {
+        send_to_encoding(
+            std::make_shared<const std::string>(std::move(advertisement)),
+            encoding);
+      }
+    }
+    advertised = true;
+    changed_channels.clear();
+    removed_channels.clear();
+  }
+  // each group's message is written once, and only if someone in it
+  // subscribed to the channel. Raw clients get the packet from the raw
+  // callback instead
+  subscriptions.subscribers(chan.getID(), subscribers);
+  bool sent = false;
+  for (int group = 0; group < RAW_GROUP && !subscribers.empty(); group++) {
+    Message msg;
+    for (const ChannelSubscriptions::Subscriber &sub : subscribers) {
+      if (sub.group != group) {
+        continue;
+      }
+      if (!msg) {
+        templates.write(chan, GROUPS[group].format, GROUPS[group].encoding,
+                        data_str);
+        msg = std::make_shared<const std::string>(data_str);
+      }
+      send_to_client(sub.fd, msg, group);
+    }
+    sent = sent || msg;
+  }
+  return sent;
+}
+
+/**
+ * @return every channel the brain has announced and not taken away
+ */
+const std::vector<VDP::Channel> &ChannelPipeline::channels() const {
+  return active_channels;
+}
+
+/**
+ * writes a float field with a fixed number of digits after the point, in
+ * every format and encoding, for channels already broadcast too. Call from
+ * the registry's task
+ * @param path the field's path from its channel's top part, like
+ * "odometry.x"
+ * @param digits digits after the point, or -1 to go back to all of them
+ */
+void ChannelPipeline::set_decimals(const std::string &path, int digits) {
+  templates.set_decimals(path, digits);
+  for (const VDP::Channel &chan : active_channels) {
+    templates.set(chan);
+  }
+}
+
+/**
+ * handles a client's {"type":"decimals","fields":{"odometry.x":3}}, which
+ * calls set_decimals for each field once the next data packet comes in
+ * @return false if msg isn't one
+ */
+bool ChannelPipeline::handle_message(const std::string &msg) {
+  cJSON *root = cJSON_Parse(msg.c_str());
+  if (root == NULL) {
+    return false;
+  }
+  const cJSON *type = cJSON_GetObjectItem(root, "type");
+  if (!cJSON_IsString(type) || strcmp(type->valuestring, "decimals") != 0) {
+    cJSON_Delete(root);
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(pending_mutex);
+  const cJSON *field;
+  cJSON_ArrayForEach(field, cJSON_GetObjectItem(root, "fields")) {
+    if (field->string != NULL && cJSON_IsNumber(field)) {
+      pending_decimals.emplace_back(field->string, field->valueint);
+    }
+  }
+  has_pending = !pending_decimals.empty();
+  cJSON_Delete(root);
+  return true;
+}
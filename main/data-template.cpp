@@ -0,0 +1,312 @@
+#include "data-template.hpp"
+#include "message-format.hpp"
+
+namespace {
+/**
+ * Writes a channel's data the way DataJSONWriter does, but cuts the text
+ * into a new piece wherever a value would go
+ */
+class TemplateBuilder : public VDP::UpcastNumbersVisitor {
+public:
+  /**
+   * @param keyed false to leave the keys out and flatten records, like
+   * DataJSONWriter
+   */
+  TemplateBuilder(JSONWriter &writer, std::vector<std::string> &pieces,
+                  std::vector<int8_t> &decimals,
+                  const FieldDecimals &field_decimals,
+                  bool keyed)
+      : writer(writer), pieces(pieces), decimals(decimals),
+        field_decimals(field_decimals), keyed(keyed) {}
+
+  void VisitRecord(VDP::Record *record) {
+    if (keyed) {
+      writer.key(record->get_name());
+      writer.begin_object();
+    }
+    const size_t path_len = path.size();
+    path += record->get_name();
+    path += '.';
+    for (const VDP::PartPtr &field : record->get_fields()) {
+      field->Visit(this);
+    }
+    path.resize(path_len);
+    if (keyed) {
+      writer.end_object();
+    }
+  }
+  void VisitString(VDP::String *str) {
+    key(str->get_name());
+    hole();
+  }
+  void VisitBoolean(VDP::Boolean *bool_part) {
+    key(bool_part->get_name());
+    hole();
+  }
+  void VisitAnyFloat(const std::string &name, double, const VDP::Part *) {
+    key(name);
+    int digits = -1;
+    if (!field_decimals.empty()) {
+      auto found = field_decimals.find(path + name);
+      if (found != field_decimals.end()) {
+        digits = found->second;
+      }
+    }
+    hole(digits);
+  }
+  void VisitAnyInt(const std::string &name, int64_t, const VDP::Part *) {
+    key(name);
+    hole();
+  }
+  void VisitAnyUint(const std::string &name, uint64_t, const VDP::Part *) {
+    key(name);
+    hole();
+  }
+
+  /**
+   * ends the current piece where a value goes
+   * @param digits digits after the point for the value, or -1 for all
+   */
+  void hole(int digits = -1) {
+    // the comma before an array item belongs to the piece, not the value
+    writer.skip_value();
+    pieces.push_back(writer.str());
+    writer.str().clear();
+    decimals.push_back((int8_t)digits);
+  }
+
+private:
+  void key(const std::string &name) {
+    if (keyed) {
+      writer.key(name);
+    }
+  }
+
+  JSONWriter &writer;
+  std::vector<std::string> &pieces;
+  std::vector<int8_t> &decimals;
+  const FieldDecimals &field_decimals;
+  bool keyed;
+  // names of the records we are in, each followed by a dot
+  std::string path;
+};
+
+/**
+ * Writes a data packet's values, each after its piece of the template
+ */
+class TemplateFiller : public VDP::UpcastNumbersVisitor {
+public:
+  /**
+   * @param first the piece that comes before the first value visited
+   */
+  TemplateFiller(JSONWriter &writer, const std::vector<std::string> &pieces,
+                 const std::vector<int8_t> &decimals, size_t first)
+      : writer(writer), pieces(pieces), decimals(decimals), next(first) {}
+
+  void VisitRecord(VDP::Record *record) {
+    for (const VDP::PartPtr &field : record->get_fields()) {
+      field->Visit(this);
+    }
+  }
+  void VisitString(VDP::String *str) {
+    if (next_piece()) {
+      writer.value(str->get_value());
+    }
+  }
+  void VisitBoolean(VDP::Boolean *bool_part) {
+    if (next_piece()) {
+      writer.value(bool_part->get_value());
+    }
+  }
+  void VisitFloat(VDP::Float *float_part) override {
+    if (!next_piece()) {
+      return;
+    }
+    if (decimals[next - 1] < 0) {
+      writer.value(float_part->get_value());
+    } else {
+      writer.value((double)float_part->get_value(), decimals[next - 1]);
+    }
+  }
+  void VisitAnyFloat(const std::string &, double value, const VDP::Part *) {
+    if (!next_piece()) {
+      return;
+    }
+    if (decimals[next - 1] < 0) {
+      writer.value(value);
+    } else {
+      writer.value(value, decimals[next - 1]);
+    }
+  }
+  void VisitAnyInt(const std::string &, int64_t value, const VDP::Part *) {
+    if (next_piece()) {
+      writer.value(value);
+    }
+  }
+  void VisitAnyUint(const std::string &, uint64_t value, const VDP::Part *) {
+    if (next_piece()) {
+      writer.value(value);
+    }
+  }
+
+  /**
+   * @return true if every value had a hole and every hole got a value
+   */
+  bool filled() const { return fits && next == pieces.size() - 1; }
+
+private:
+  /**
+   * writes the piece before the next value
+   * @return false if the packet has more values than the template has holes
+   */
+  bool next_piece() {
+    if (next >= pieces.size() - 1) {
+      fits = false;
+      return false;
+    }
+    writer.splice(pieces[next]);
+    next++;
+    return true;
+  }
+
+  JSONWriter &writer;
+  const std::vector<std::string> &pieces;
+  const std::vector<int8_t> &decimals;
+  size_t next;
+  bool fits = true;
+};
+
+} // namespace
+
+/**
+ * @param channel a broadcast channel, only its id and schema are used
+ * @param format which kind of data message to make a template of
+ * @param field_decimals digits after the point for float fields that
+ * shouldn't be written in full, by path from the channel's top part, like
+ * "odometry.x"
+ */
+DataTemplate::DataTemplate(const VDP::Channel &channel, DataFormat format,
+                           const FieldDecimals &field_decimals)
+    : format(format) {
+  std::string text;
+  JSONWriter writer{text};
+  TemplateBuilder builder{writer, pieces, decimals, field_decimals,
+                          format == DataFormat::Json};
+  writer.begin_object();
+  switch (format) {
+  case DataFormat::Json:
+    writer.key("type");
+    writer.value("data");
+    writer.key("channel_id");
+    writer.value((uint64_t)channel.getID());
+    writer.key("rec_time");
+    builder.hole();
+    writer.key("rx_time");
+    builder.hole();
+    writer.key("data");
+    writer.begin_object();
+    channel.data->Visit(&builder);
+    writer.end_object();
+    break;
+  case DataFormat::Compact:
+    writer.key("c");
+    writer.value((uint64_t)channel.getID());
+    writer.key("t");
+    builder.hole();
+    writer.key("v");
+    writer.begin_array();
+    channel.data->Visit(&builder);
+    writer.end_array();
+    break;
+  }
+  writer.end_object();
+  pieces.push_back(text);
+}
+
+/**
+ * writes channel's data message over out, the same text write_data_msg
+ * gives in this template's format
+ * @param channel a data packet for the channel this was made from
+ * @param out where to write, reuse it so nothing is allocated
+ * @return false if channel's parts don't line up with the template, out
+ * is left half written then
+ */
+bool DataTemplate::write(const VDP::Channel &channel, std::string &out) const {
+  out.clear();
+  JSONWriter writer{out};
+  writer.splice(pieces[0]);
+  writer.value(data_rec_time(channel));
+  size_t first_data_piece = 1;
+  if (format == DataFormat::Json) {
+    writer.splice(pieces[1]);
+    writer.value((int64_t)channel.info.rx_time_us);
+    first_data_piece = 2;
+  }
+
+  TemplateFiller filler{writer, pieces, decimals, first_data_piece};
+  channel.data->Visit(&filler);
+  if (!filler.filled()) {
+    return false;
+  }
+  out.append(pieces.back());
+  return true;
+}
+
+/**
+ * makes or replaces the templates for a channel that was added or changed
+ */
+void DataTemplates::set(const VDP::Channel &channel) {
+  templates.erase(channel.getID());
+  templates.emplace(channel.getID(),
+                    ChannelTemplates{{channel, DataFormat::Json, decimals},
+                                     {channel, DataFormat::Compact, decimals}});
+}
+/**
+ * forgets a channel that went away
+ */
+void DataTemplates::remove(VDP::ChannelID id) { templates.erase(id); }
+/**
+ * writes a float field with a fixed number of digits after the point instead
+ * of all the ones it takes to read back exactly. Templates take it up for
+ * channels set after this, and messages written without one right away
+ * @param path the field's path from its channel's top part, like
+ * "odometry.x"
+ * @param digits digits after the point, or -1 to go back to all of them
+ */
+void DataTemplates::set_decimals(const std::string &path, int digits) {
+  if (digits < 0) {
+    decimals.erase(path);
+  } else {
+    // templates keep it in a byte, and more digits than that is just noise
+    decimals[path] = digits > 20 ? 20 : digits;
+  }
+}
+
+/**
+ * writes a data message over out from the channel's template, or the slow
+ * way if there isn't one or it doesn't fit. CBOR has no text to template and
+ * is always written directly, and Raw has no message at all
+ */
+void DataTemplates::write(const VDP::Channel &channel, DataFormat format,
+                          DataEncoding encoding, std::string &out) {
+  if (encoding == DataEncoding::Cbor) {
+    write_cbor_data_msg(channel, format, out, &decimals);
+    return;
+  }
+  if (encoding == DataEncoding::Raw) {
+    // raw clients get the packet itself from the registry
+    out.clear();
+    return;
+  }
+  auto found = templates.find(channel.getID());
+  if (found != templates.end()) {
+    const DataTemplate &tmpl = format == DataFormat::Compact
+                                   ? found->second.compact
+                                   : found->second.json;
+    if (tmpl.write(channel, out)) {
+      return;
+    }
+  }
+  num_fallbacks++;
+  write_data_msg(channel, format, out, &decimals);
+}
@@ -0,0 +1,154 @@
+#include "foxglove-format.hpp"
+#include "foxglove-mapping.hpp"
+#include "json-writer.hpp"
+#include "visitor.hpp"
+
+namespace {
+/**
+ * Writes the JSON Schema of a channel's data as write_foxglove_message lays
+ * it out: the members of the top object, with nested records as objects
+ */
+class JSONSchemaWriter : public VDP::UpcastNumbersVisitor {
+public:
+  /**
+   * @param writer where to write, inside the top object's properties
+   */
+  explicit JSONSchemaWriter(JSONWriter &writer) : writer(writer) {}
+
+  void VisitRecord(VDP::Record *record) {
+    // the top record's fields are the top object's members
+    const bool nested = !top;
+    top = false;
+    if (nested) {
+      writer.key(record->get_name());
+      writer.begin_object();
+      writer.key("type");
+      writer.value("object");
+      writer.key("properties");
+      writer.begin_object();
+    }
+    for (const VDP::PartPtr &field : record->get_fields()) {
+      field->Visit(this);
+    }
+    if (nested) {
+      writer.end_object();
+      writer.end_object();
+    }
+  }
+  void VisitString(VDP::String *str) { leaf(str->get_name(), "string"); }
+  void VisitBoolean(VDP::Boolean *bool_part) {
+    leaf(bool_part->get_name(), "boolean");
+  }
+  void VisitAnyFloat(const std::string &name, double, const VDP::Part *) {
+    leaf(name, "number");
+  }
+  void VisitAnyInt(const std::string &name, int64_t, const VDP::Part *) {
+    leaf(name, "integer");
+  }
+  void VisitAnyUint(const std::string &name, uint64_t, const VDP::Part *) {
+    leaf(name, "integer");
+  }
+
+private:
+  void leaf(const std::string &name, const char *type) {
+    top = false;
+    writer.key(name);
+    writer.begin_object();
+    writer.key("type");
+    writer.value(type);
+    writer.end_object();
+  }
+
+  JSONWriter &writer;
+  bool top = true;
+};
+
+/**
+ * DataJSONWriter with the top record's fields written straight into the
+ * message object instead of under the record's name, since the topic already
+ * says which record it is
+ */
+class FoxgloveMessageWriter : public DataJSONWriter {
+public:
+  explicit FoxgloveMessageWriter(JSONWriter &writer)
+      : DataJSONWriter(writer) {}
+
+  void VisitRecord(VDP::Record *record) override {
+    if (!top) {
+      DataJSONWriter::VisitRecord(record);
+      return;
+    }
+    top = false;
+    for (const VDP::PartPtr &field : record->get_fields()) {
+      field->Visit(this);
+    }
+  }
+
+private:
+  bool top = true;
+};
+} // namespace
+
+std::string
+send_foxglove_advertise_msg(const std::vector<VDP::Channel> &channels) {
+  std::string str;
+  JSONWriter writer{str};
+  writer.begin_object();
+  writer.key("op");
+  writer.value("advertise");
+  writer.key("channels");
+  writer.begin_array();
+  // reused for each channel's schema, which goes in as a string
+  std::string schema;
+  for (const VDP::Channel &channel : channels) {
+    const std::string &name = channel.data->get_name();
+    // the same rules FoxgloveMappings uses, so the schema matches the
+    // messages
+    FoxgloveMapping mapping;
+    const bool mapped = mapping.compile(channel);
+    writer.begin_object();
+    writer.key("id");
+    writer.value((uint64_t)channel.getID());
+    writer.key("topic");
+    writer.value("/" + name);
+    writer.key("encoding");
+    writer.value("json");
+    writer.key("schemaName");
+    writer.value(mapped ? std::string(mapping.schema_name()) : name);
+    writer.key("schemaEncoding");
+    writer.value("jsonschema");
+    if (mapped) {
+      writer.key("schema");
+      writer.value(mapping.schema());
+      writer.end_object();
+      continue;
+    }
+
+    schema.clear();
+    JSONWriter schema_writer{schema};
+    schema_writer.begin_object();
+    schema_writer.key("type");
+    schema_writer.value("object");
+    schema_writer.key("properties");
+    schema_writer.begin_object();
+    JSONSchemaWriter visitor{schema_writer};
+    channel.data->Visit(&visitor);
+    schema_writer.end_object();
+    schema_writer.end_object();
+    writer.key("schema");
+    writer.value(schema);
+    writer.end_object();
+  }
+  writer.end_array();
+  writer.end_object();
+  return str;
+}
+
+void write_foxglove_message(const VDP::Channel &channel, std::string &out) {
+  out.clear();
+  JSONWriter writer{out};
+  writer.begin_object();
+  FoxgloveMessageWriter visitor{writer};
+  channel.data->Visit(&visitor);
+  writer.end_object();
+}
@@ -0,0 +1,469 @@
+#include "foxglove-mapping.hpp"
+#include "foxglove-format.hpp"
+#include "json-writer.hpp"
+#include "vdb/types.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+namespace {
+using Source = FoxgloveMapping::Source;
+
+// field inches to the meters Foxglove's 3D panel works in
+constexpr double INCHES = 0.0254;
+constexpr double DEGREES = M_PI / 180;
+
+/**
+ * where one value of a well-known message comes from
+ */
+struct Binding {
+  // where it goes in the message, with dots between nested objects
+  const char *path;
+  Source source;
+  // "number", "integer" or "string"
+  const char *type;
+  // names of the fields that can fill it, separated by '|', or nullptr for a
+  // constant
+  const char *fields;
+  double scale;
+  // whether the rule only fits records that have one of the fields
+  bool required;
+  // the value when there is no field, as text
+  const char *constant;
+};
+
+Binding field(const char *path, const char *type, const char *fields,
+              double scale = 1) {
+  return {path, Source::Field, type, fields, scale, true, nullptr};
+}
+Binding optional(const char *path, const char *type, const char *fields,
+                 const char *constant, double scale = 1) {
+  return {path, Source::Field, type, fields, scale, false, constant};
+}
+Binding constant(const char *path, const char *type, const char *value) {
+  return {path, Source::Field, type, nullptr, 1, false, value};
+}
+Binding time(const char *path, Source part) {
+  return {path, part, "integer", nullptr, 1, false, nullptr};
+}
+// a heading in degrees, where the quaternion is the identity without one
+Binding yaw(const char *path, Source part) {
+  return {path,    part,  "number",
+          "rot|rotation|heading|theta|yaw", DEGREES, false,
+          part == Source::YawQuatW ? "1" : "0"};
+}
+
+/**
+ * a well-known schema and the records that look like it. Bindings that
+ * share an object have to be next to each other
+ */
+struct Rule {
+  const char *schema;
+  // names of the records it applies to, separated by '|'
+  const char *records;
+  std::vector<Binding> bindings;
+};
+
+const std::vector<Rule> &rules() {
+  static const std::vector<Rule> rules = {
+      {"foxglove.PoseInFrame",
+       "odometry|odom|pose",
+       {
+           time("timestamp.sec", Source::TimeSec),
+           time("timestamp.nsec", Source::TimeNsec),
+           constant("frame_id", "string", "field"),
+           field("pose.position.x", "number", "x", INCHES),
+           field("pose.position.y", "number", "y", INCHES),
+           optional("pose.position.z", "number", "z", "0", INCHES),
+           constant("pose.orientation.x", "number", "0"),
+           constant("pose.orientation.y", "number", "0"),
+           yaw("pose.orientation.z", Source::YawQuatZ),
+           yaw("pose.orientation.w", Source::YawQuatW),
+       }},
+      {"foxglove.FrameTransform",
+       "transform|tf",
+       {
+           time("timestamp.sec", Source::TimeSec),
+           time("timestamp.nsec", Source::TimeNsec),
+           constant("parent_frame_id", "string", "field"),
+           optional("child_frame_id", "string", "frame|child_frame_id",
+                    "robot"),
+           field("translation.x", "number", "x", INCHES),
+           field("translation.y", "number", "y", INCHES),
+           optional("translation.z", "number", "z", "0", INCHES),
+           constant("rotation.x", "number", "0"),
+           constant("rotation.y", "number", "0"),
+           yaw("rotation.z", Source::YawQuatZ),
+           yaw("rotation.w", Source::YawQuatW),
+       }},
+      {"foxglove.Log",
+       "log|print|console",
+       {
+           time("timestamp.sec", Source::TimeSec),
+           time("timestamp.nsec", Source::TimeNsec),
+           // INFO
+           optional("level", "integer", "level", "2"),
+           field("message", "string", "message|msg|text"),
+           optional("name", "string", "name|source", "brain"),
+           optional("file", "string", "file", ""),
+           optional("line", "integer", "line", "0"),
+       }},
+  };
+  return rules;
+}
+
+/**
+ * @param list names separated by '|'
+ * @return whether name is one of them, ignoring case
+ */
+bool name_in(const std::string &name, const char *list) {
+  const char *start = list;
+  while (true) {
+    const char *end = strchr(start, '|');
+    const size_t len = end ? (size_t)(end - start) : strlen(start);
+    if (len == name.size() && strncasecmp(start, name.c_str(), len) == 0) {
+      return true;
+    }
+    if (end == nullptr) {
+      return false;
+    }
+    start = end + 1;
+  }
+}
+
+enum class FieldType { Number, Boolean, String };
+// a field that isn't a record, by its path from the top record
+struct FieldInfo {
+  std::string path;
+  FieldType type;
+};
+
+/**
+ * Lists a channel's fields in schema order with records flattened, the order
+ * FieldReader reads them in
+ */
+class FieldLister : public VDP::UpcastNumbersVisitor {
+public:
+  void VisitRecord(VDP::Record *record) {
+    const size_t path_len = path.size();
+    if (top_is_record) {
+      path += record->get_name();
+      path += '.';
+    }
+    top_is_record = true;
+    for (const VDP::PartPtr &field : record->get_fields()) {
+      field->Visit(this);
+    }
+    path.resize(path_len);
+  }
+  void VisitString(VDP::String *str) {
+    add(str->get_name(), FieldType::String);
+  }
+  void VisitBoolean(VDP::Boolean *bool_part) {
+    add(bool_part->get_name(), FieldType::Boolean);
+  }
+  void VisitAnyFloat(const std::string &name, double, const VDP::Part *) {
+    add(name, FieldType::Number);
+  }
+  void VisitAnyInt(const std::string &name, int64_t, const VDP::Part *) {
+    add(name, FieldType::Number);
+  }
+  void VisitAnyUint(const std::string &name, uint64_t, const VDP::Part *) {
+    add(name, FieldType::Number);
+  }
+
+  std::vector<FieldInfo> fields;
+  // rules only apply to records
+  bool top_is_record = false;
+
+private:
+  void add(const std::string &name, FieldType type) {
+    fields.push_back({path + name, type});
+  }
+  // names of the records we are in below the top one, each followed by a dot
+  std::string path;
+};
+
+/**
+ * Reads a data packet's values into a list, in the order FieldLister lists
+ * them
+ */
+class FieldReader : public VDP::UpcastNumbersVisitor {
+public:
+  explicit FieldReader(std::vector<FoxgloveMapping::FieldValue> &values)
+      : values(values) {}
+
+  void VisitRecord(VDP::Record *record) {
+    for (const VDP::PartPtr &field : record->get_fields()) {
+      field->Visit(this);
+    }
+  }
+  void VisitString(VDP::String *str) {
+    values.push_back({0, &str->get_value()});
+  }
+  void VisitBoolean(VDP::Boolean *bool_part) {
+    values.push_back({bool_part->get_value() ? 1.0 : 0.0, nullptr});
+  }
+  void VisitAnyFloat(const std::string &, double value, const VDP::Part *) {
+    values.push_back({value, nullptr});
+  }
+  void VisitAnyInt(const std::string &, int64_t value, const VDP::Part *) {
+    values.push_back({(double)value, nullptr});
+  }
+  void VisitAnyUint(const std::string &, uint64_t value, const VDP::Part *) {
+    values.push_back({(double)value, nullptr});
+  }
+
+private:
+  std::vector<FoxgloveMapping::FieldValue> &values;
+};
+
+/**
+ * @return the index of the first field named in the list that a binding of
+ * the type can take, or -1 if there isn't one
+ */
+int find_field(const std::vector<FieldInfo> &fields, const char *names,
+               bool string) {
+  for (size_t i = 0; i < fields.size(); i++) {
+    const bool is_string = fields[i].type == FieldType::String;
+    if (is_string == string && name_in(fields[i].path, names)) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Writes the message template and its JSON Schema side by side, opening and
+ * closing objects as the bindings' paths go in and out of them
+ */
+class RuleWriter {
+public:
+  RuleWriter(JSONWriter &writer, JSONWriter &schema)
+      : writer(writer), schema(schema) {
+    writer.begin_object();
+    begin_schema_object();
+  }
+
+  /**
+   * goes into the objects on the way to a binding's path and writes its key
+   */
+  void key(const char *path) {
+    std::vector<std::string> objects;
+    const char *start = path;
+    for (const char *dot = strchr(start, '.'); dot != nullptr;
+         dot = strchr(start, '.')) {
+      objects.emplace_back(start, dot - start);
+      start = dot + 1;
+    }
+    size_t common = 0;
+    while (common < open.size() && common < objects.size() &&
+           open[common] == objects[common]) {
+      common++;
+    }
+    while (open.size() > common) {
+      close();
+    }
+    for (size_t i = common; i < objects.size(); i++) {
+      writer.key(objects[i]);
+      writer.begin_object();
+      schema.key(objects[i]);
+      begin_schema_object();
+      open.push_back(objects[i]);
+    }
+    writer.key(start);
+    schema.key(start);
+  }
+  /**
+   * says what type goes at the key just written
+   */
+  void type(const char *type) {
+    schema.begin_object();
+    schema.key("type");
+    schema.value(type);
+    schema.end_object();
+  }
+  void finish() {
+    while (!open.empty()) {
+      close();
+    }
+    writer.end_object();
+    schema.end_object();
+    schema.end_object();
+  }
+
+private:
+  void begin_schema_object() {
+    schema.begin_object();
+    schema.key("type");
+    schema.value("object");
+    schema.key("properties");
+    schema.begin_object();
+  }
+  void close() {
+    writer.end_object();
+    schema.end_object();
+    schema.end_object();
+    open.pop_back();
+  }
+
+  JSONWriter &writer;
+  JSONWriter &schema;
+  std::vector<std::string> open;
+};
+} // namespace
+
+/**
+ * matches the channel against the rules and builds the template for the
+ * first one that fits
+ * @param channel a broadcast channel, only its schema is used
+ * @return false if no rule fits
+ */
+bool FoxgloveMapping::compile(const VDP::Channel &channel) {
+  FieldLister lister;
+  channel.data->Visit(&lister);
+  if (!lister.top_is_record) {
+    return false;
+  }
+  for (const Rule &rule : rules()) {
+    if (!name_in(channel.data->get_name(), rule.records)) {
+      continue;
+    }
+    pieces.clear();
+    holes.clear();
+    json_schema.clear();
+    std::string text;
+    JSONWriter writer{text};
+    JSONWriter schema_writer{json_schema};
+    RuleWriter rule_writer{writer, schema_writer};
+    bool fits = true;
+    for (const Binding &binding : rule.bindings) {
+      const bool string = strcmp(binding.type, "string") == 0;
+      const bool integer = strcmp(binding.type, "integer") == 0;
+      rule_writer.key(binding.path);
+      rule_writer.type(binding.type);
+      int index = -1;
+      if (binding.fields != nullptr) {
+        index = find_field(lister.fields, binding.fields, string);
+        if (index < 0 && binding.required) {
+          fits = false;
+          break;
+        }
+      }
+      if (index < 0 && binding.constant != nullptr) {
+        if (string) {
+          writer.value(binding.constant);
+        } else if (integer) {
+          writer.value((int64_t)strtoll(binding.constant, nullptr, 10));
+        } else {
+          writer.value(strtod(binding.constant, nullptr));
+        }
+        continue;
+      }
+      // the comma before the value belongs to the piece, like DataTemplate
+      writer.skip_value();
+      pieces.push_back(text);
+      text.clear();
+      holes.push_back({binding.source, index, binding.scale, integer, string});
+    }
+    if (!fits) {
+      continue;
+    }
+    rule_writer.finish();
+    pieces.push_back(text);
+    name = rule.schema;
+    num_fields = lister.fields.size();
+    return true;
+  }
+  return false;
+}
+
+/**
+ * @return the well-known schema's name, like "foxglove.PoseInFrame"
+ */
+const char *FoxgloveMapping::schema_name() const { return name; }
+/**
+ * @return the JSON Schema of the messages write makes
+ */
+const std::string &FoxgloveMapping::schema() const { return json_schema; }
+
+/**
+ * writes a data packet as the well-known schema's JSON over out
+ * @param channel a data packet for the channel this was compiled from
+ * @param timestamp_ns when the data was recorded, for the message's timestamp
+ * @param out where to write, reuse it so nothing is allocated
+ * @return false if channel's fields don't line up with the ones this was
+ * compiled from
+ */
+bool FoxgloveMapping::write(const VDP::Channel &channel,
+                            uint64_t timestamp_ns, std::string &out) {
+  values.clear();
+  FieldReader reader{values};
+  channel.data->Visit(&reader);
+  if (values.size() != num_fields) {
+    return false;
+  }
+  out.clear();
+  JSONWriter writer{out};
+  for (size_t i = 0; i < holes.size(); i++) {
+    const Hole &hole = holes[i];
+    writer.splice(pieces[i]);
+    switch (hole.source) {
+    case Source::Field:
+      if (hole.string) {
+        writer.value(*values[hole.field].str);
+      } else if (hole.integer) {
+        writer.value((int64_t)(values[hole.field].num * hole.scale));
+      } else {
+        writer.value(values[hole.field].num * hole.scale);
+      }
+      break;
+    case Source::TimeSec:
+      writer.value((uint64_t)(timestamp_ns / 1000000000));
+      break;
+    case Source::TimeNsec:
+      writer.value((uint64_t)(timestamp_ns % 1000000000));
+      break;
+    case Source::YawQuatZ:
+      writer.value(sin(values[hole.field].num * hole.scale / 2));
+      break;
+    case Source::YawQuatW:
+      writer.value(cos(values[hole.field].num * hole.scale / 2));
+      break;
+    }
+  }
+  out.append(pieces.back());
+  return true;
+}
+
+/**
+ * compiles or replaces the mapping for a channel that was added or changed
+ */
+void FoxgloveMappings::set(const VDP::Channel &channel) {
+  mappings.erase(channel.getID());
+  FoxgloveMapping mapping;
+  if (mapping.compile(channel)) {
+    mappings.emplace(channel.getID(), std::move(mapping));
+  }
+}
+/**
+ * forgets a channel that went away
+ */
+void FoxgloveMappings::remove(VDP::ChannelID id) { mappings.erase(id); }
+
+/**
+ * writes the payload of a channel's messageData frame over out, as its
+ * well-known schema if it has a mapping, or like write_foxglove_message if not
+ * @return false if there is nothing to send
+ */
+bool FoxgloveMappings::write(const VDP::Channel &channel,
+                             uint64_t timestamp_ns, std::string &out) {
+  auto found = mappings.find(channel.getID());
+  if (found != mappings.end()) {
+    return found->second.write(channel, timestamp_ns, out);
+  }
+  write_foxglove_message(channel, out);
+  return true;
+}
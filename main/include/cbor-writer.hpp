@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Writes CBOR (RFC 8949) straight onto the end of a string, the binary
+ * counterpart to JSONWriter. Maps and arrays say up front how many items
+ * they hold, or use begin_array_indefinite when that isn't known yet. Keys
+ * are just string values. Numbers go out in binary, so nothing is formatted
+ * on the way out or parsed on the way in
+ */
+class CBORWriter {
+public:
+  /**
+   * @param out the string to add to
+   */
+  explicit CBORWriter(std::string &out);
+
+  /**
+   * @param pairs how many keys and values follow
+   */
+  void begin_map(size_t pairs);
+  /**
+   * @param items how many values follow
+   */
+  void begin_array(size_t items);
+  /**
+   * starts an array whose length isn't known yet, close it with
+   * end_indefinite
+   */
+  void begin_array_indefinite();
+  void end_indefinite();
+
+  void key(const std::string &name);
+  void key(const char *name);
+
+  void value(const std::string &str);
+  void value(const char *str);
+  void value(bool b);
+  /**
+   * written in as few bytes as hold num
+   */
+  void value(int64_t num);
+  void value(uint64_t num);
+  /**
+   * written as a 4 byte float
+   */
+  void value(float num);
+  /**
+   * written as an 8 byte double
+   */
+  void value(double num);
+  void value_null();
+
+  /**
+   * @return the string being written to
+   */
+  std::string &str();
+
+private:
+  /**
+   * writes an item's first byte and its argument in as few bytes as hold it
+   * @param major the item's major type, 0 to 7
+   * @param arg the value, length or count that goes with it
+   */
+  void head(uint8_t major, uint64_t arg);
+  void write_text(const char *str, size_t len);
+
+  std::string &out;
+};
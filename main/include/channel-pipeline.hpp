@@ -0,0 +1,113 @@
+#pragma once
+#include "data-template.hpp"
+#include "message-format.hpp"
+#include "subscriptions.hpp"
+#include "vdb/protocol.hpp"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * What the board and the gateway both do with what the registry listener
+ * hears. As the brain broadcasts it keeps the channel list, the data
+ * templates and the subscriptions up to date. Once data starts it tells
+ * clients what changed, then writes each data packet once for every group of
+ * clients subscribed to it. Where messages go is up to whoever owns the
+ * clients, through the two send functions
+ */
+class ChannelPipeline {
+public:
+  // one message, shared by every client it goes to
+  using Message = std::shared_ptr<const std::string>;
+  // sends an advertisement to every client that wants an encoding, in any
+  // format. Clients can't read data without it, so it shouldn't be dropped
+  using SendToEncoding =
+      std::function<void(const Message &msg, DataEncoding encoding)>;
+  // sends data to one client, in the group it was written for. A client
+  // that is behind can skip it
+  using SendToClient =
+      std::function<void(int fd, const Message &msg, int group)>;
+
+  // how a group of clients wants messages written
+  struct Group {
+    DataFormat format;
+    DataEncoding encoding;
+  };
+  static const Group GROUPS[];
+  static const int NUM_GROUPS;
+  // raw clients get packets instead of messages, so they have no format.
+  // They are the last group
+  static const int RAW_GROUP;
+  /**
+   * @return the group for clients that want a format and an encoding
+   */
+  static int group_for(DataFormat format, DataEncoding encoding);
+
+  ChannelPipeline(SendToEncoding send_to_encoding, SendToClient send_to_client);
+
+  /**
+   * from the registry's broadcast callback
+   */
+  void on_broadcast(const VDP::Channel &chan, VDP::BroadcastChange change);
+  /**
+   * from the registry's data callback
+   * @return whether any client was sent the data
+   */
+  bool on_data(const VDP::Channel &chan);
+
+  /**
+   * @return every channel the brain has announced and not taken away
+   */
+  const std::vector<VDP::Channel> &channels() const;
+
+  /**
+   * writes a float field with a fixed number of digits after the point, in
+   * every format and encoding, for channels already broadcast too. Call
+   * from the registry's task
+   * @param path the field's path from its channel's top part, like
+   * "odometry.x"
+   * @param digits digits after the point, or -1 to go back to all of them
+   */
+  void set_decimals(const std::string &path, int digits);
+  /**
+   * handles a client's
+   *   {"type":"decimals","fields":{"odometry.x":3,"odometry.y":-1}}
+   * which calls set_decimals for each field. Can be called from another
+   * task, it takes effect with the next data packet
+   * @return false if msg isn't one
+   */
+  bool handle_message(const std::string &msg);
+
+  // every channel's data message with holes for the values, so writing one
+  // is mostly number formatting
+  DataTemplates templates;
+  // which channels each client wants data from. Clients are added in the
+  // group that group_for gives them
+  ChannelSubscriptions subscriptions;
+
+private:
+  SendToEncoding send_to_encoding;
+  SendToClient send_to_client;
+
+  std::vector<VDP::Channel> active_channels;
+  bool data_mode = false;
+  // whether clients have been sent a full advertisement yet
+  bool advertised = false;
+  // what changed since the last advertisement, sent as an update once the
+  // brain is done broadcasting
+  std::vector<VDP::Channel> changed_channels;
+  std::vector<VDP::ChannelID> removed_channels;
+
+  // decimals from handle_message, waiting for the registry's task
+  std::mutex pending_mutex;
+  std::vector<std::pair<std::string, int>> pending_decimals;
+  std::atomic<bool> has_pending{false};
+
+  // reused for every data message so writing one doesn't allocate
+  std::string data_str;
+  std::vector<ChannelSubscriptions::Subscriber> subscribers;
+};
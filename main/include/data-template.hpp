@@ -0,0 +1,89 @@
+#pragma once
+#include "json-writer.hpp"
+#include "message-format.hpp"
+#include "vdb/protocol.hpp"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A channel's data message with the values taken out. Everything but the
+ * values (keys, nesting, quoting, the channel id) only changes when the
+ * schema does, so it is written once when the channel is broadcast and each
+ * data packet just splices its values into the gaps
+ */
+class DataTemplate {
+public:
+  /**
+   * @param channel a broadcast channel, only its id and schema are used
+   * @param format which kind of data message to make a template of
+   * @param field_decimals digits after the point for float fields that
+   * shouldn't be written in full, by path from the channel's top part, like
+   * "odometry.x"
+   */
+  DataTemplate(const VDP::Channel &channel, DataFormat format,
+               const FieldDecimals &field_decimals = {});
+
+  /**
+   * writes channel's data message over out, the same text write_data_msg
+   * gives in this template's format
+   * @param channel a data packet for the channel this was made from
+   * @param out where to write, reuse it so nothing is allocated
+   * @return false if channel's parts don't line up with the template, out
+   * is left half written then
+   */
+  bool write(const VDP::Channel &channel, std::string &out) const;
+
+private:
+  DataFormat format;
+  // pieces[i] comes right before value i, and the last piece closes
+  // everything after the last value
+  std::vector<std::string> pieces;
+  // digits after the point for value i, or -1 for as many as it takes
+  std::vector<int8_t> decimals;
+};
+
+/**
+ * Templates in each format for every channel the brain has broadcast, kept
+ * up to date from the registry's broadcast callback
+ */
+class DataTemplates {
+public:
+  /**
+   * makes or replaces the templates for a channel that was added or changed
+   */
+  void set(const VDP::Channel &channel);
+  /**
+   * forgets a channel that went away
+   */
+  void remove(VDP::ChannelID id);
+  /**
+   * writes a float field with a fixed number of digits after the point
+   * instead of all the ones it takes to read back exactly, in every format
+   * and encoding. Templates take it up for channels set after this, and
+   * messages written without one right away
+   * @param path the field's path from its channel's top part, like
+   * "odometry.x"
+   * @param digits digits after the point, or -1 to go back to all of them
+   */
+  void set_decimals(const std::string &path, int digits);
+
+  /**
+   * writes a data message over out from the channel's template, or the slow
+   * way if there isn't one or it doesn't fit. CBOR has no text to template
+   * and is always written directly, and Raw has no message at all
+   */
+  void write(const VDP::Channel &channel, DataFormat format,
+             DataEncoding encoding, std::string &out);
+
+  // messages that had to be written without a template
+  int num_fallbacks = 0;
+
+private:
+  struct ChannelTemplates {
+    DataTemplate json;
+    DataTemplate compact;
+  };
+  std::unordered_map<VDP::ChannelID, ChannelTemplates> templates;
+  FieldDecimals decimals;
+};
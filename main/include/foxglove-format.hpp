@@ -0,0 +1,20 @@
+#pragma once
+#include "vdb/protocol.hpp"
+#include <string>
+#include <vector>
+
+// Messages for the Foxglove websocket protocol (foxglove.websocket.v1). Each
+// VDP channel is a Foxglove channel with the same id, on the topic
+// "/<top part's name>", with JSON messages described by a JSON Schema.
+// Records that look like one of Foxglove's well-known schemas are sent as
+// that schema instead, see foxglove-mapping.hpp
+
+// an advertise message for the channels, for new clients or for channels the
+// brain just broadcast
+std::string
+send_foxglove_advertise_msg(const std::vector<VDP::Channel> &channels);
+
+// a channel's data as the JSON payload of a messageData frame, written over
+// out. A record's fields are the members of the object, anything else is a
+// single member named after it
+void write_foxglove_message(const VDP::Channel &channel, std::string &out);
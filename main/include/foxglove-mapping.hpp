@@ -0,0 +1,113 @@
+#pragma once
+#include "vdb/protocol.hpp"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * A channel's record sent as one of Foxglove's well-known schemas, like
+ * foxglove.PoseInFrame, so Foxglove's 3D panel can draw it. Rules in
+ * foxglove-mapping.cpp say which records look like which schema, by the
+ * record's name and the names and types of its fields. When one matches, the
+ * message is made into a template like DataTemplate, with each hole bound to
+ * the index of the field that fills it, so converting a message is one pass
+ * over the record and one over the holes
+ */
+class FoxgloveMapping {
+public:
+  /**
+   * matches the channel against the rules and builds the template for the
+   * first one that fits
+   * @param channel a broadcast channel, only its schema is used
+   * @return false if no rule fits
+   */
+  bool compile(const VDP::Channel &channel);
+
+  /**
+   * @return the well-known schema's name, like "foxglove.PoseInFrame"
+   */
+  const char *schema_name() const;
+  /**
+   * @return the JSON Schema of the messages write makes
+   */
+  const std::string &schema() const;
+
+  /**
+   * writes a data packet as the well-known schema's JSON over out
+   * @param channel a data packet for the channel this was compiled from
+   * @param timestamp_ns when the data was recorded, for the message's
+   * timestamp
+   * @param out where to write, reuse it so nothing is allocated
+   * @return false if channel's fields don't line up with the ones this was
+   * compiled from
+   */
+  bool write(const VDP::Channel &channel, uint64_t timestamp_ns,
+             std::string &out);
+
+  // where a value in the message comes from
+  enum class Source {
+    // a field of the record, times a scale
+    Field,
+    // the timestamp's seconds and the nanoseconds past them
+    TimeSec,
+    TimeNsec,
+    // the z and w of the quaternion for a heading about the z axis, from a
+    // field times a scale to radians
+    YawQuatZ,
+    YawQuatW,
+  };
+  // a value the template leaves out
+  struct Hole {
+    Source source;
+    // the field's index in schema order, records flattened
+    int field;
+    double scale;
+    bool integer;
+    bool string;
+  };
+  // a field's value as read from a data packet
+  struct FieldValue {
+    double num;
+    // points into the packet's part, for strings
+    const std::string *str;
+  };
+
+private:
+  const char *name = "";
+  std::string json_schema;
+  // pieces[i] comes right before holes[i], the last piece after everything
+  std::vector<std::string> pieces;
+  std::vector<Hole> holes;
+  size_t num_fields = 0;
+  // reused for every message
+  std::vector<FieldValue> values;
+};
+
+/**
+ * The mapping for every channel the brain has broadcast that one of the rules
+ * fits, kept up to date from the registry's broadcast callback like
+ * DataTemplates
+ */
+class FoxgloveMappings {
+public:
+  /**
+   * compiles or replaces the mapping for a channel that was added or changed
+   */
+  void set(const VDP::Channel &channel);
+  /**
+   * forgets a channel that went away
+   */
+  void remove(VDP::ChannelID id);
+
+  /**
+   * writes the payload of a channel's messageData frame over out, as its
+   * well-known schema if it has a mapping, or like write_foxglove_message if
+   * not
+   * @return false if there is nothing to send
+   */
+  bool write(const VDP::Channel &channel, uint64_t timestamp_ns,
+             std::string &out);
+
+private:
+  std::unordered_map<VDP::ChannelID, FoxgloveMapping> mappings;
+};
@@ -0,0 +1,78 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+/**
+ * Writes compact JSON straight onto the end of a string, with no tree in
+ * between. Commas are put in automatically, the caller just has to open and
+ * close things in the right order and give every object member a key.
+ * Reuse the same string across messages (clear() keeps its capacity) and
+ * nothing gets allocated once it is big enough
+ */
+class JSONWriter {
+public:
+  /**
+   * @param out the string to add to
+   */
+  explicit JSONWriter(std::string &out);
+
+  void begin_object();
+  void end_object();
+  void begin_array();
+  void end_array();
+  /**
+   * writes an object member's key, the value comes next
+   */
+  void key(const std::string &name);
+  void key(const char *name);
+
+  void value(const std::string &str);
+  void value(const char *str);
+  void value(bool b);
+  void value(int64_t num);
+  void value(uint64_t num);
+  /**
+   * written with the fewest digits that read back as exactly num, and null
+   * for nan and infinity, which JSON doesn't have
+   */
+  void value(double num);
+  /**
+   * like value(double), but with the fewest digits that read back as num as
+   * a float, so 0.1f comes out as 0.1 instead of 0.10000000149011612
+   */
+  void value(float num);
+  /**
+   * written with a fixed number of digits after the point, for values whose
+   * last few digits are noise
+   * @param num the value
+   * @param decimals digits after the point
+   */
+  void value(double num, int decimals);
+  void value_null();
+
+  /**
+   * counts as a value without writing one, so a template can leave a hole
+   * there and fill it in later
+   */
+  void skip_value();
+  /**
+   * appends text that is already JSON and ends where a value goes, like a
+   * piece of a template
+   */
+  void splice(const std::string &text);
+
+  /**
+   * @return the string being written to
+   */
+  std::string &str();
+
+private:
+  /**
+   * puts a comma before anything but the first item in an object or array
+   */
+  void separate();
+  void write_escaped(const char *str, size_t len);
+
+  std::string &out;
+  bool need_comma = false;
+};
@@ -0,0 +1,87 @@
+#pragma once
+#include "vdb/protocol.hpp"
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Which channels each websocket client wants data from. Clients start out
+ * subscribed to everything, the name pattern "*", and change that with
+ *   {"type":"subscribe","channels":[3,4],"names":["odometry","drive*"]}
+ *   {"type":"unsubscribe","names":["*"]}
+ * by channel id or by name, where * matches any run of characters and ? any
+ * one. Name patterns also pick up channels broadcast later. Ids win over
+ * names: unsubscribing from an id leaves that channel out even while a
+ * pattern like "*" matches it, until the client subscribes to the id again.
+ * Ids that can't be a channel are ignored. Each channel's
+ * subscribers are worked out when a client or channel changes, so a data
+ * packet only has to look up its channel, and a channel nobody subscribed to
+ * doesn't have to be written at all.
+ *
+ * Messages come in on the webserver's task while data goes out on the main
+ * one, so everything here locks
+ */
+class ChannelSubscriptions {
+public:
+  // a client that wants a channel's data
+  struct Subscriber {
+    int fd;
+    // whatever the caller sorts clients into, like a websocket group
+    int group;
+  };
+
+  /**
+   * adds a client subscribed to everything, or resets one on a reused socket
+   */
+  void add_client(int fd, int group);
+  void remove_client(int fd);
+
+  /**
+   * handles a subscribe or unsubscribe message from a client
+   * @return false if msg isn't one, so it is meant for the brain
+   */
+  bool handle_message(int fd, const std::string &msg);
+
+  /**
+   * adds or replaces a channel the brain broadcast, matching it against
+   * everyone's name patterns
+   */
+  void set_channel(const VDP::Channel &channel);
+  void remove_channel(VDP::ChannelID id);
+
+  /**
+   * copies the clients that want a channel's data over out, reuse it so
+   * nothing is allocated
+   */
+  void subscribers(VDP::ChannelID id, std::vector<Subscriber> &out) const;
+
+private:
+  struct Client {
+    int fd;
+    int group;
+    std::vector<VDP::ChannelID> ids;
+    // unsubscribed by id, so left out whatever the patterns say
+    std::vector<VDP::ChannelID> excluded;
+    std::vector<std::string> patterns;
+  };
+  struct ChannelSubscribers {
+    std::string name;
+    std::vector<Subscriber> subscribers;
+  };
+  /**
+   * works out a channel's subscribers again. Hold mutex
+   */
+  void update(VDP::ChannelID id, ChannelSubscribers &channel);
+  void update_all();
+
+  mutable std::mutex mutex;
+  std::vector<Client> clients;
+  std::unordered_map<VDP::ChannelID, ChannelSubscribers> channels;
+};
+
+/**
+ * @return whether name matches a pattern where * matches any run of
+ * characters and ? any one
+ */
+bool name_matches(const char *pattern, const char *name);
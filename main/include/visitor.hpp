@@ -1,27 +1,134 @@
 #pragma once
 #include "cJSON.h"
+#include "cbor-writer.hpp"
+#include "json-writer.hpp"
 #include "vdb/protocol.hpp"
 #include "vdb/registry-listener.hpp"
 #include "vdb/types.hpp"
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// digits after the point for float fields that shouldn't be written in full,
+// by path from the channel's top part, like "odometry.x"
+using FieldDecimals = std::unordered_map<std::string, int>;
+
+/**
+ * Keeps the path to the part being visited, for looking fields up in a
+ * FieldDecimals. Does nothing without one, so writers that don't need it
+ * don't pay for it
+ */
+class FieldPath {
+public:
+  explicit FieldPath(const FieldDecimals *decimals);
+  void enter(const std::string &record);
+  void leave(const std::string &record);
+  /**
+   * @return digits after the point for a field of the record we are in, or
+   * -1 to write all of them
+   */
+  int digits(const std::string &name);
+
+private:
+  const FieldDecimals *decimals;
+  // names of the records we are in, each followed by a dot
+  std::string path;
+};
 
-class DataJSONVisitor : public VDP::UpcastNumbersVisitor {
+/**
+ * Writes a channel's data as compact JSON in one pass over its parts. Every
+ * part is a member named after it and records are nested objects, or with
+ * keyed off, just the values one after another
+ */
+class DataJSONWriter : public VDP::UpcastNumbersVisitor {
 public:
-  DataJSONVisitor();
-  ~DataJSONVisitor();
+  /**
+   * @param writer where to write, positioned inside an object, or inside an
+   * array without keys
+   * @param keyed false to write only the values, in schema order with
+   * records flattened, for the compact data format
+   * @param decimals float fields to write with fixed decimals, kept by the
+   * caller while this is in use
+   */
+  explicit DataJSONWriter(JSONWriter &writer, bool keyed = true,
+                          const FieldDecimals *decimals = nullptr);
 
   void VisitRecord(VDP::Record *record);
   void VisitString(VDP::String *str);
   void VisitBoolean(VDP::Boolean *bool_part);
+  // floats are written as floats so they don't pick up digits from the
+  // conversion to double
+  void VisitFloat(VDP::Float *float_part) override;
   void VisitAnyFloat(const std::string &name, double value, const VDP::Part *);
   void VisitAnyInt(const std::string &name, int64_t value, const VDP::Part *);
   void VisitAnyUint(const std::string &name, uint64_t value, const VDP::Part *);
 
-  cJSON *current_node();
-  std::string get_string();
+private:
+  void key(const std::string &name);
 
-  // private:
-  cJSON *root;
-  std::vector<cJSON *> node_stack;
+  JSONWriter &writer;
+  bool keyed;
+  FieldPath path;
+};
+
+/**
+ * DataJSONWriter for CBOR: the same layout, keyed or just the values, with
+ * numbers written in binary. Floats stay 4 bytes and doubles 8
+ */
+class DataCBORWriter : public VDP::UpcastNumbersVisitor {
+public:
+  /**
+   * @param writer where to write, inside a map, or inside an array without
+   * keys
+   * @param keyed false to write only the values, in schema order with
+   * records flattened, for the compact data format
+   * @param decimals float fields to round to fixed decimals, written as the
+   * double a JSON reader gets from DataJSONWriter's text
+   */
+  explicit DataCBORWriter(CBORWriter &writer, bool keyed = true,
+                          const FieldDecimals *decimals = nullptr);
+
+  void VisitRecord(VDP::Record *record);
+  void VisitString(VDP::String *str);
+  void VisitBoolean(VDP::Boolean *bool_part);
+  void VisitFloat(VDP::Float *float_part) override;
+  void VisitAnyFloat(const std::string &name, double value, const VDP::Part *);
+  void VisitAnyInt(const std::string &name, int64_t value, const VDP::Part *);
+  void VisitAnyUint(const std::string &name, uint64_t value, const VDP::Part *);
+
+private:
+  void key(const std::string &name);
+
+  CBORWriter &writer;
+  bool keyed;
+  FieldPath path;
+};
+
+/**
+ * Writes a channel's schema as CBOR, the same maps of name, type and fields
+ * that ChannelVisitor builds in cJSON
+ */
+class ChannelCBORWriter : public VDP::UpcastNumbersVisitor {
+public:
+  /**
+   * @param writer where to write the schema's top map
+   */
+  explicit ChannelCBORWriter(CBORWriter &writer);
+
+  void VisitRecord(VDP::Record *record);
+  void VisitString(VDP::String *str);
+  void VisitBoolean(VDP::Boolean *bool_part);
+  void VisitAnyFloat(const std::string &name, double value, const VDP::Part *);
+  void VisitAnyInt(const std::string &name, int64_t value, const VDP::Part *);
+  void VisitAnyUint(const std::string &name, uint64_t value, const VDP::Part *);
+
+private:
+  /**
+   * writes a field that isn't a record
+   */
+  void leaf(const std::string &name, const char *type);
+
+  CBORWriter &writer;
 };
 
 class ChannelVisitor : public VDP::UpcastNumbersVisitor {
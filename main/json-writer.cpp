@@ -0,0 +1,206 @@
+#include "json-writer.hpp"
+
+#include <charconv>
+#include <cmath>
+#include <cstring>
+
+/**
+ * @param out the string to add to
+ */
+JSONWriter::JSONWriter(std::string &out) : out(out) {}
+
+void JSONWriter::separate() {
+  if (need_comma) {
+    out.push_back(',');
+  }
+}
+
+void JSONWriter::begin_object() {
+  separate();
+  out.push_back('{');
+  need_comma = false;
+}
+void JSONWriter::end_object() {
+  out.push_back('}');
+  need_comma = true;
+}
+void JSONWriter::begin_array() {
+  separate();
+  out.push_back('[');
+  need_comma = false;
+}
+void JSONWriter::end_array() {
+  out.push_back(']');
+  need_comma = true;
+}
+
+/**
+ * writes an object member's key, the value comes next
+ */
+void JSONWriter::key(const std::string &name) {
+  separate();
+  write_escaped(name.data(), name.size());
+  out.push_back(':');
+  need_comma = false;
+}
+void JSONWriter::key(const char *name) {
+  separate();
+  write_escaped(name, strlen(name));
+  out.push_back(':');
+  need_comma = false;
+}
+
+void JSONWriter::value(const std::string &str) {
+  separate();
+  write_escaped(str.data(), str.size());
+  need_comma = true;
+}
+void JSONWriter::value(const char *str) {
+  separate();
+  write_escaped(str, strlen(str));
+  need_comma = true;
+}
+void JSONWriter::value(bool b) {
+  separate();
+  out.append(b ? "true" : "false");
+  need_comma = true;
+}
+void JSONWriter::value(int64_t num) {
+  separate();
+  char buf[24];
+  const std::to_chars_result res = std::to_chars(buf, buf + sizeof(buf), num);
+  out.append(buf, res.ptr - buf);
+  need_comma = true;
+}
+void JSONWriter::value(uint64_t num) {
+  separate();
+  char buf[24];
+  const std::to_chars_result res = std::to_chars(buf, buf + sizeof(buf), num);
+  out.append(buf, res.ptr - buf);
+  need_comma = true;
+}
+/**
+ * written with the fewest digits that read back as exactly num, and null
+ * for nan and infinity, which JSON doesn't have
+ */
+void JSONWriter::value(double num) {
+  separate();
+  need_comma = true;
+  if (!std::isfinite(num)) {
+    out.append("null");
+    return;
+  }
+  char buf[32];
+  const std::to_chars_result res = std::to_chars(buf, buf + sizeof(buf), num);
+  out.append(buf, res.ptr - buf);
+}
+/**
+ * like value(double), but with the fewest digits that read back as num as a
+ * float, so 0.1f comes out as 0.1 instead of 0.10000000149011612
+ */
+void JSONWriter::value(float num) {
+  separate();
+  need_comma = true;
+  if (!std::isfinite(num)) {
+    out.append("null");
+    return;
+  }
+  char buf[24];
+  const std::to_chars_result res = std::to_chars(buf, buf + sizeof(buf), num);
+  out.append(buf, res.ptr - buf);
+}
+/**
+ * written with a fixed number of digits after the point, for values whose
+ * last few digits are noise
+ * @param num the value
+ * @param decimals digits after the point
+ */
+void JSONWriter::value(double num, int decimals) {
+  char buf[64];
+  std::to_chars_result res{buf, std::errc::value_too_large};
+  if (std::isfinite(num)) {
+    res = std::to_chars(buf, buf + sizeof(buf), num, std::chars_format::fixed,
+                        decimals);
+  }
+  if (res.ec != std::errc()) {
+    // nan and infinity, or too big to write out in full (past about 1e40)
+    value(num);
+    return;
+  }
+  separate();
+  out.append(buf, res.ptr - buf);
+  need_comma = true;
+}
+void JSONWriter::value_null() {
+  separate();
+  out.append("null");
+  need_comma = true;
+}
+
+/**
+ * counts as a value without writing one, so a template can leave a hole
+ * there and fill it in later
+ */
+void JSONWriter::skip_value() {
+  separate();
+  need_comma = true;
+}
+/**
+ * appends text that is already JSON and ends where a value goes, like a
+ * piece of a template
+ */
+void JSONWriter::splice(const std::string &text) {
+  out.append(text);
+  need_comma = false;
+}
+
+/**
+ * @return the string being written to
+ */
+std::string &JSONWriter::str() { return out; }
+
+void JSONWriter::write_escaped(const char *str, size_t len) {
+  static const char *hex = "0123456789abcdef";
+  out.push_back('"');
+  size_t start = 0;
+  for (size_t i = 0; i < len; i++) {
+    const unsigned char c = (unsigned char)str[i];
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    // copy the run of plain characters before this one in one go
+    out.append(str + start, i - start);
+    start = i + 1;
+    out.push_back('\\');
+    switch (c) {
+    case '"':
+      out.push_back('"');
+      break;
+    case '\\':
+      out.push_back('\\');
+      break;
+    case '\b':
+      out.push_back('b');
+      break;
+    case '\f':
+      out.push_back('f');
+      break;
+    case '\n':
+      out.push_back('n');
+      break;
+    case '\r':
+      out.push_back('r');
+      break;
+    case '\t':
+      out.push_back('t');
+      break;
+    default:
+      out.append("u00");
+      out.push_back(hex[c >> 4]);
+      out.push_back(hex[c & 0xf]);
+      break;
+    }
+  }
+  out.append(str + start, len - start);
+  out.push_back('"');
+}
@@ -1,12 +1,17 @@
+#include "channel-pipeline.hpp"
 #include "common.hpp"
 #include "connection_manager.h"
 #include "defines.h"
+#include "foxglove-format.hpp"
+#include "foxglove-mapping.hpp"
 #include "foxglove-ws.hpp"
 #include "status_led.hpp"
+#include "subscriptions.hpp"
 #include "visitor.hpp"
 #include "webserver.hpp"
 
 #include "message-format.hpp"
+#include "vdb/bus-scheduler.hpp"
 #include "vdb/registry-listener.hpp"
 #include "vdb/types.hpp"
 
@@ -16,6 +21,7 @@
 #include <esp_err.h>
 #include <esp_http_server.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 
 static const char *TAG = "main";
 
@@ -23,7 +29,26 @@ bool setup_finished = false;
 
 #include "cJSON.h"
 
-std::vector<VDP::Channel> activeChannels{};
+// websocket groups are the pipeline's groups, each message is written once
+// per group and the same buffer goes to everyone in it
+static const int RAW_WS_GROUP = ChannelPipeline::RAW_GROUP;
+
+/**
+ * queues a message to every websocket client that wants an encoding, in any
+ * format. The pipeline only sends advertisements this way, which clients
+ * can't do without, so even a client that is behind gets them
+ */
+static void broadcast_to_ws_encoding(const ws_message &msg,
+                                     DataEncoding encoding) {
+  if (encoding == DataEncoding::Json) {
+    ESP_LOGI(TAG, "%s", msg->c_str());
+  }
+  for (int group = 0; group < ChannelPipeline::NUM_GROUPS; group++) {
+    if (ChannelPipeline::GROUPS[group].encoding == encoding) {
+      broadcast_to_ws(msg, group, false);
+    }
+  }
+}
 
 extern "C" void app_main(void) {
 
@@ -35,7 +60,6 @@ extern "C" void app_main(void) {
   // init_wifi_ap();
 
   init_wifi_sta("RIT-WiFi", "", true);
-  void foxglove_init_ws(void *arg_server);
 
   // ESP_LOGI(TAG, "Initializing MDNS...");
   // init_mdns();
@@ -50,10 +74,27 @@ extern "C" void app_main(void) {
 
   VDBDevice dev{BRAIN_UART, BRAIN_UART_TXD, BRAIN_UART_RXD, BRAIN_UART_RTS,
                 BRAIN_BAUD_RATE};
-  VDP::RegistryListener<std::mutex> reg{&dev};
+  // the bus is half duplex, so replies wait for the brain to hand it over
+  VDP::BusScheduler<std::mutex> bus{&dev, BRAIN_BAUD_RATE};
+  VDP::RegistryListener<std::mutex> reg{&bus};
+
+  // keeps the channels, templates and subscriptions, and writes what the
+  // websocket clients get
+  ChannelPipeline pipeline{
+      broadcast_to_ws_encoding,
+      // data, a client that is behind can skip some
+      [](int fd, const ws_message &msg, int) {
+        send_to_ws_client(fd, msg, true);
+      }};
+  ChannelSubscriptions &subscriptions = pipeline.subscriptions;
 
   //callback for when we get data from the websocket to send to the brain
-  std::function<void(std::string)> receive_callback =[&reg](std::string json_string) {
+  std::function<void(int, std::string)> receive_callback =
+      [&reg, &pipeline, &subscriptions](int fd, std::string json_string) {
+    if (subscriptions.handle_message(fd, json_string) ||
+        pipeline.handle_message(json_string)) {
+      return;
+    }
     ResponseJSONVisitor RV(json_string, reg);
     printf("setting the data from the websocket...\n");
     RV.set_data();
@@ -61,14 +102,50 @@ extern "C" void app_main(void) {
     RV.send_to_reg();
   };
   
+  // puts a new client in the group for the data format it asked for in its
+  // url and the encoding that goes with the subprotocol it connected with
+  std::function<int(int, const std::string &, const std::string &)> ws_opened =
+      [&pipeline, &subscriptions](int fd, const std::string &query,
+                                  const std::string &protocol) {
+        const int group = ChannelPipeline::group_for(
+            data_format_from_query(query), data_encoding_from_protocol(protocol));
+        if (group == RAW_WS_GROUP) {
+          for (const std::string &packet :
+               send_raw_broadcasts(pipeline.channels())) {
+            send_to_ws_client(fd, std::make_shared<const std::string>(packet),
+                              false);
+          }
+          return RAW_WS_GROUP;
+        }
+        subscriptions.add_client(fd, group);
+        return group;
+      };
+  std::function<void(int)> ws_closed = [&subscriptions](int fd) {
+    subscriptions.remove_client(fd);
+  };
+
   //sends the advertisement message and returns the message sent
-  std::function<std::string()> get_advertisement_message = []() {
-    return send_advertisement_msg(activeChannels);
+  std::function<std::string(int)> get_advertisement_message =
+      [&pipeline](int group) {
+        return send_advertisement_msg(pipeline.channels(),
+                                      ChannelPipeline::GROUPS[group].encoding);
+      };
+
+  // from a data frame arriving to its message being queued for the websocket
+  VDP::LatencyStats output_latency;
+
+  // loss counters for /api/linkstats
+  std::function<std::string()> get_link_stats = [&dev, &reg, &bus,
+                                                 &output_latency]() {
+    return send_link_stats_msg(dev, reg, bus.get_stats(), output_latency);
   };
 
   ws_functions funcs{
       .rec_cb = receive_callback,
+      .on_open = ws_opened,
       .get_adv_msg = get_advertisement_message,
+      .on_close = ws_closed,
+      .get_link_stats = get_link_stats,
   };
 
   httpd_handle_t server_handle = webserver_start(80, &funcs);
@@ -76,37 +153,74 @@ extern "C" void app_main(void) {
     ESP_LOGE(TAG, "Failed to initialize log endpoint");
   }
 
-  bool data_mode = false;
+  // Foxglove's own websocket protocol on port 8765
+  foxglove_functions foxglove_funcs{
+      .get_adv_msg =
+          [&pipeline]() {
+            return send_foxglove_advertise_msg(pipeline.channels());
+          },
+  };
+  httpd_handle_t foxglove_handle = NULL;
+  foxglove_init_ws(&foxglove_handle, &foxglove_funcs);
+
+  // records Foxglove has a well-known schema for, converted straight to it
+  FoxgloveMappings foxglove_mappings;
   // what the webserver does when it recieves a new channel from the brain
-  reg.install_broadcast_callback([&data_mode](VDP::Channel new_chan) {
-    //if we are in data mode
-    if (data_mode) {
-      // clear old channels
-      data_mode = false;
-      activeChannels = {};
+  reg.install_broadcast_callback([&](const VDP::Channel &new_chan,
+                                     VDP::BroadcastChange change) {
+    pipeline.on_broadcast(new_chan, change);
+    switch (change) {
+    case VDP::BroadcastChange::Unchanged:
+      break;
+    case VDP::BroadcastChange::Added:
+    case VDP::BroadcastChange::Changed:
+      foxglove_mappings.set(new_chan);
+      // Foxglove clients find out right away, a changed channel is taken
+      // away and advertised again so they pick up its new schema
+      if (change == VDP::BroadcastChange::Changed) {
+        foxglove_unadvertise({new_chan.getID()});
+      }
+      foxglove_advertise(send_foxglove_advertise_msg({new_chan}));
+      break;
+    case VDP::BroadcastChange::Removed:
+      foxglove_mappings.remove(new_chan.getID());
+      foxglove_unadvertise({new_chan.getID()});
+      break;
+    }
+  });
+
+  // forwards the brain's packets untouched to raw clients. Raw clients
+  // decode the packets themselves, so if they are the only ones connected
+  // and Foxglove doesn't want anything the board only has to check and
+  // forward them
+  reg.install_raw_callback([&reg](const VDP::Packet &packet) {
+    const size_t num_raw = num_ws_clients(RAW_WS_GROUP);
+    reg.set_decode_data(num_raw == 0 || num_raw < num_ws_clients(WS_ALL_CLIENTS) ||
+                        foxglove_any_subscribed());
+    if (num_raw > 0) {
+      // raw clients need every broadcast to decode the data after it
+      const bool data = VDP::decode_header_byte(packet[0]).type ==
+                        VDP::PacketType::Data;
+      broadcast_to_ws(
+          std::make_shared<const std::string>(packet.begin(), packet.end()),
+          RAW_WS_GROUP, data);
     }
-    // add new channel to list of active channels
-    activeChannels.push_back(new_chan);
   });
 
+  // reused for every Foxglove message so writing one doesn't allocate
+  std::string foxgloveStr;
   // the webserver sending data it gets from the brain to the websocket
-  reg.install_data_callback([&data_mode](const VDP::Channel &chan) {
-    DataJSONVisitor visitor;
-    chan.data->Visit(&visitor);
-    std::string dataStr = send_data_msg(chan);
-    ESP_LOGI(TAG, "%s", dataStr.c_str());
-    esp_err_t e = send_string_to_ws(dataStr);
-    if (e != ESP_OK) {
-      ESP_LOGW(TAG, "couldnt send to websocket");
+  reg.install_data_callback([&](const VDP::Channel &chan) {
+    // only written for Foxglove if someone there subscribed to it
+    if (foxglove_subscribed(chan.getID())) {
+      const uint64_t timestamp_ns = (uint64_t)data_rec_time(chan) * 1000;
+      if (foxglove_mappings.write(chan, timestamp_ns, foxgloveStr)) {
+        foxglove_send_message(chan.getID(), timestamp_ns, foxgloveStr);
+      }
     }
-    //if we aren't in data mode, send an advertisement and switch to data mode
-    if (!data_mode) {
-      data_mode = true;
-      std::string advertisementStr = send_advertisement_msg(activeChannels);
-      ESP_LOGI(TAG, "%s", advertisementStr.c_str());
-      esp_err_t edos = send_string_to_ws(advertisementStr);
+    if (pipeline.on_data(chan)) {
+      output_latency.add(esp_timer_get_time() - chan.info.rx_time_us);
     }
-    // send_to_ws(data_json);
   });
 
   ESP_LOGI(TAG, "Finished Initialization.");
@@ -115,7 +229,9 @@ extern "C" void app_main(void) {
   status_led_signal_wifi_conn();
 
   while (true) {
-
-    delay(1000);
+    // sends replies that have waited too long for the brain to give us the
+    // bus
+    bus.poll();
+    delay(10);
   }
 }
\ No newline at end of file
@@ -1,15 +1,16 @@
 #include "message-format.hpp"
 
-std::string
-send_advertisement_msg(const std::vector<VDP::Channel> &activeChannels) {
-  cJSON *root = cJSON_CreateObject();
-  cJSON_AddStringToObject(root, "type", "advertisement");
-
-  cJSON *channelArray = cJSON_AddArrayToObject(root, "channels");
-
-  std::vector<ChannelVisitor *> visitors;
-
-  for (VDP::Channel channel : activeChannels) {
+/**
+ * adds an entry with the id and schema of each channel to a json array
+ * @param channelArray the array to add to
+ * @param channels the channels to describe
+ * @param visitors holds the visitors whose nodes the array references, delete
+ * them after printing
+ */
+static void add_channel_schemas(cJSON *channelArray,
+                                const std::vector<VDP::Channel> &channels,
+                                std::vector<ChannelVisitor *> &visitors) {
+  for (VDP::Channel channel : channels) {
     visitors.emplace_back(new ChannelVisitor());
     channel.data->Visit(visitors[visitors.size() - 1]);
     cJSON *subObject = visitors[visitors.size() - 1]->current_node();
@@ -21,6 +22,17 @@ send_advertisement_msg(const std::vector<VDP::Channel> &activeChannels) {
 
     cJSON_AddItemToArray(channelArray, newObject);
   }
+}
+
+std::string
+send_advertisement_msg(const std::vector<VDP::Channel> &activeChannels) {
+  cJSON *root = cJSON_CreateObject();
+  cJSON_AddStringToObject(root, "type", "advertisement");
+
+  cJSON *channelArray = cJSON_AddArrayToObject(root, "channels");
+
+  std::vector<ChannelVisitor *> visitors;
+  add_channel_schemas(channelArray, activeChannels, visitors);
 
   const char *json_str = cJSON_Print(root);
   std::string str(json_str);
@@ -33,23 +45,343 @@ send_advertisement_msg(const std::vector<VDP::Channel> &activeChannels) {
   return str;
 }
 
+std::string
+send_advertisement_update_msg(const std::vector<VDP::Channel> &changedChannels,
+                              const std::vector<VDP::ChannelID> &removedIds) {
+  cJSON *root = cJSON_CreateObject();
+  cJSON_AddStringToObject(root, "type", "advertisement_update");
+
+  cJSON *channelArray = cJSON_AddArrayToObject(root, "channels");
+
+  std::vector<ChannelVisitor *> visitors;
+  add_channel_schemas(channelArray, changedChannels, visitors);
+
+  cJSON *removedArray = cJSON_AddArrayToObject(root, "removed");
+  for (VDP::ChannelID id : removedIds) {
+    cJSON_AddItemToArray(removedArray, cJSON_CreateNumber(id));
+  }
+
+  const char *json_str = cJSON_Print(root);
+  std::string str(json_str);
+  cJSON_free((void *)json_str);
+  for (auto *v : visitors) {
+    delete v;
+  }
+  cJSON_Delete(root);
+  return str;
+}
+
+/**
+ * adds the id and schema of each channel to a cbor array
+ * @param writer where to write the array
+ * @param channels the channels to describe
+ */
+static void add_channel_schemas_cbor(CBORWriter &writer,
+                                     const std::vector<VDP::Channel> &channels) {
+  writer.begin_array(channels.size());
+  for (const VDP::Channel &channel : channels) {
+    writer.begin_map(2);
+    writer.key("channel_id");
+    writer.value((uint64_t)channel.getID());
+    writer.key("schema");
+    ChannelCBORWriter visitor{writer};
+    channel.data->Visit(&visitor);
+  }
+}
+
+std::string
+send_advertisement_cbor(const std::vector<VDP::Channel> &activeChannels) {
+  std::string str;
+  CBORWriter writer{str};
+  writer.begin_map(2);
+  writer.key("type");
+  writer.value("advertisement");
+  writer.key("channels");
+  add_channel_schemas_cbor(writer, activeChannels);
+  return str;
+}
+
+std::string
+send_advertisement_update_cbor(const std::vector<VDP::Channel> &changedChannels,
+                               const std::vector<VDP::ChannelID> &removedIds) {
+  std::string str;
+  CBORWriter writer{str};
+  writer.begin_map(3);
+  writer.key("type");
+  writer.value("advertisement_update");
+  writer.key("channels");
+  add_channel_schemas_cbor(writer, changedChannels);
+  writer.key("removed");
+  writer.begin_array(removedIds.size());
+  for (VDP::ChannelID id : removedIds) {
+    writer.value((uint64_t)id);
+  }
+  return str;
+}
+
+void write_cbor_data_msg(const VDP::Channel &channel, DataFormat format,
+                         std::string &out, const FieldDecimals *decimals) {
+  out.clear();
+  CBORWriter writer{out};
+  switch (format) {
+  case DataFormat::Json:
+    writer.begin_map(5);
+    writer.key("type");
+    writer.value("data");
+    writer.key("channel_id");
+    writer.value((uint64_t)channel.getID());
+    writer.key("rec_time");
+    writer.value(data_rec_time(channel));
+    writer.key("rx_time");
+    writer.value((int64_t)channel.info.rx_time_us);
+    writer.key("data");
+    writer.begin_map(1);
+    {
+      DataCBORWriter visitor{writer, true, decimals};
+      channel.data->Visit(&visitor);
+    }
+    break;
+  case DataFormat::Compact:
+    writer.begin_map(3);
+    writer.key("c");
+    writer.value((uint64_t)channel.getID());
+    writer.key("t");
+    writer.value(data_rec_time(channel));
+    writer.key("v");
+    // counting the values first would take another pass
+    writer.begin_array_indefinite();
+    {
+      DataCBORWriter visitor{writer, false, decimals};
+      channel.data->Visit(&visitor);
+    }
+    writer.end_indefinite();
+    break;
+  }
+}
+
+std::string send_advertisement_msg(const std::vector<VDP::Channel> &activeChannels,
+                                   DataEncoding encoding) {
+  switch (encoding) {
+  case DataEncoding::Json:
+    return send_advertisement_msg(activeChannels);
+  case DataEncoding::Cbor:
+    return send_advertisement_cbor(activeChannels);
+  case DataEncoding::Raw:
+    break;
+  }
+  return "";
+}
+
+std::string
+send_advertisement_update_msg(const std::vector<VDP::Channel> &changedChannels,
+                              const std::vector<VDP::ChannelID> &removedIds,
+                              DataEncoding encoding) {
+  switch (encoding) {
+  case DataEncoding::Json:
+    return send_advertisement_update_msg(changedChannels, removedIds);
+  case DataEncoding::Cbor:
+    return send_advertisement_update_cbor(changedChannels, removedIds);
+  case DataEncoding::Raw:
+    break;
+  }
+  return "";
+}
+
+std::vector<std::string>
+send_raw_broadcasts(const std::vector<VDP::Channel> &activeChannels) {
+  std::vector<std::string> packets;
+  VDP::Packet scratch;
+  for (const VDP::Channel &channel : activeChannels) {
+    VDP::PacketWriter writer{scratch};
+    // ids past a byte need a varint, the header says which one it is
+    writer.set_varint_channel_ids(channel.getID() > 0xff);
+    writer.write_channel_broadcast(channel);
+    const VDP::Packet &packet = writer.get_packet();
+    packets.emplace_back(packet.begin(), packet.end());
+  }
+  return packets;
+}
+
+DataEncoding data_encoding_from_protocol(const std::string &protocol) {
+  if (protocol == "vdb.cbor") {
+    return DataEncoding::Cbor;
+  }
+  if (protocol == "vdb.raw") {
+    return DataEncoding::Raw;
+  }
+  return DataEncoding::Json;
+}
+
+int64_t data_rec_time(const VDP::Channel &channel) {
+  // the brain's sample time if it sent one, in the board's clock
+  if (channel.info.time_us != 0) {
+    return channel.info.time_us;
+  }
+  return (int64_t)VDB::time_us();
+}
+
+void write_data_msg(const VDP::Channel &channel, std::string &out,
+                    const FieldDecimals *decimals) {
+  out.clear();
+  JSONWriter writer{out};
+  writer.begin_object();
+  writer.key("type");
+  writer.value("data");
+  writer.key("channel_id");
+  writer.value((uint64_t)channel.getID());
+  writer.key("rec_time");
+  writer.value(data_rec_time(channel));
+  // when the frame came off the uart
+  writer.key("rx_time");
+  writer.value((int64_t)channel.info.rx_time_us);
+
+  writer.key("data");
+  writer.begin_object();
+  DataJSONWriter visitor{writer, true, decimals};
+  channel.data->Visit(&visitor);
+  writer.end_object();
+  writer.end_object();
+}
+
+void write_compact_data_msg(const VDP::Channel &channel, std::string &out,
+                            const FieldDecimals *decimals) {
+  out.clear();
+  JSONWriter writer{out};
+  writer.begin_object();
+  writer.key("c");
+  writer.value((uint64_t)channel.getID());
+  writer.key("t");
+  writer.value(data_rec_time(channel));
+  writer.key("v");
+  writer.begin_array();
+  DataJSONWriter visitor{writer, false, decimals};
+  channel.data->Visit(&visitor);
+  writer.end_array();
+  writer.end_object();
+}
+
+void write_data_msg(const VDP::Channel &channel, DataFormat format,
+                    std::string &out, const FieldDecimals *decimals) {
+  switch (format) {
+  case DataFormat::Json:
+    write_data_msg(channel, out, decimals);
+    break;
+  case DataFormat::Compact:
+    write_compact_data_msg(channel, out, decimals);
+    break;
+  }
+}
+
+DataFormat data_format_from_query(const std::string &query) {
+  size_t start = 0;
+  while (start < query.size()) {
+    size_t end = query.find('&', start);
+    if (end == std::string::npos) {
+      end = query.size();
+    }
+    if (query.compare(start, end - start, "format=compact") == 0) {
+      return DataFormat::Compact;
+    }
+    start = end + 1;
+  }
+  return DataFormat::Json;
+}
+
 std::string send_data_msg(const VDP::Channel &channel) {
+  std::string str;
+  write_data_msg(channel, str);
+  return str;
+}
 
+#ifdef ESP_PLATFORM
+/**
+ * adds the count, mean and max of a latency to a json object
+ */
+static void add_latency(cJSON *parent, const char *name,
+                        const VDP::LatencyStats &latency) {
+  cJSON *obj = cJSON_AddObjectToObject(parent, name);
+  cJSON_AddNumberToObject(obj, "count", latency.count);
+  cJSON_AddNumberToObject(obj, "mean_us", latency.mean_us());
+  cJSON_AddNumberToObject(obj, "max_us", latency.max_us);
+}
+
+std::string send_link_stats_msg(const VDBDevice &dev,
+                                const VDP::RegistryListener<std::mutex> &reg,
+                                const VDP::BusStats &bus,
+                                const VDP::LatencyStats &output_latency) {
   cJSON *root = cJSON_CreateObject();
-  DataJSONVisitor visitor;
-  channel.data->Visit(&visitor);
-  cJSON_AddStringToObject(root, "type", "data");
-  cJSON_AddNumberToObject(root, "channel_id", channel.getID());
-  cJSON_AddNumberToObject(root, "rec_time", esp_timer_get_time());
-  
-  cJSON_AddItemReferenceToObject(root, "data", visitor.node_stack[visitor.node_stack.size() - 1]);
-  // printf("data in send message - 1: %s\n", cJSON_Print(visitor.node_stack[visitor.node_stack.size() - 1]));
-  // printf("full data message: %s\n", cJSON_Print(root));
+  cJSON_AddStringToObject(root, "type", "link_stats");
+  cJSON_AddNumberToObject(root, "bad_checksum", reg.num_bad);
+  cJSON_AddNumberToObject(root, "too_small", reg.num_small);
+  cJSON_AddNumberToObject(root, "lost", reg.num_lost);
+  cJSON_AddNumberToObject(root, "reordered", reg.num_reordered);
+  cJSON_AddNumberToObject(root, "send_busy", reg.num_send_busy);
+
+  const VDP::FragmentStats fragment_stats = reg.get_fragment_stats();
+  cJSON *fragments = cJSON_AddObjectToObject(root, "fragments");
+  cJSON_AddNumberToObject(fragments, "received", fragment_stats.received);
+  cJSON_AddNumberToObject(fragments, "reassembled",
+                          fragment_stats.reassembled);
+  cJSON_AddNumberToObject(fragments, "timeouts", fragment_stats.timeouts);
+  cJSON_AddNumberToObject(fragments, "bad", fragment_stats.bad);
+
+  cJSON *device = cJSON_AddObjectToObject(root, "device");
+  cJSON_AddNumberToObject(device, "queue_full", dev.num_queue_full);
+  cJSON_AddNumberToObject(device, "pool_exhausted", dev.num_pool_exhausted);
+  cJSON_AddNumberToObject(device, "dropped_newest", dev.num_dropped_newest);
+  cJSON_AddNumberToObject(device, "dropped_oldest", dev.num_dropped_oldest);
+  cJSON_AddNumberToObject(device, "dropped_control", dev.num_dropped_control);
+  cJSON_AddNumberToObject(device, "superseded", dev.num_superseded);
+  cJSON_AddNumberToObject(device, "bad_checksum", dev.num_bad_checksum);
+  cJSON_AddNumberToObject(device, "too_small", dev.num_too_small);
+  cJSON_AddNumberToObject(device, "too_large", dev.num_too_large);
+  cJSON_AddNumberToObject(device, "truncated", dev.num_truncated);
+  cJSON_AddNumberToObject(device, "fifo_overflow", dev.num_fifo_overflow);
+  cJSON_AddNumberToObject(device, "buffer_full", dev.num_buffer_full);
+  cJSON_AddNumberToObject(device, "tx_busy", dev.num_tx_busy);
+  cJSON_AddNumberToObject(device, "fec_corrected", dev.num_fec_corrected);
+  cJSON_AddNumberToObject(device, "fec_failed", dev.num_fec_failed);
+  cJSON_AddNumberToObject(device, "uart_stack_free", dev.uart_stack_free);
+
+  // how long a frame waits at each stage, all measured from when its
+  // delimiter arrived
+  cJSON *latency = cJSON_AddObjectToObject(root, "latency");
+  add_latency(latency, "queue", dev.queue_latency);
+  add_latency(latency, "decode", reg.decode_latency);
+  add_latency(latency, "output", output_latency);
+
+  // how our sending fits around the brain's on the half-duplex bus
+  cJSON *busObject = cJSON_AddObjectToObject(root, "bus");
+  cJSON_AddNumberToObject(busObject, "grants", bus.grants);
+  cJSON_AddNumberToObject(busObject, "scheduled", bus.scheduled);
+  cJSON_AddNumberToObject(busObject, "unscheduled", bus.unscheduled);
+  cJSON_AddNumberToObject(busObject, "deferred", bus.deferred);
+  cJSON_AddNumberToObject(busObject, "queue_full", bus.queue_full);
+  cJSON_AddNumberToObject(busObject, "collisions", bus.collisions);
+  add_latency(busObject, "turnaround", bus.turnaround);
+  add_latency(busObject, "queue_wait", bus.queue_wait);
+
+  const VDP::ClockSync clock = reg.get_clock_sync();
+  cJSON *clockObject = cJSON_AddObjectToObject(root, "clock");
+  cJSON_AddBoolToObject(clockObject, "synced", clock.synced());
+  cJSON_AddNumberToObject(clockObject, "offset_us", clock.offset_us());
+  cJSON_AddNumberToObject(clockObject, "drift_ppm", clock.drift_ppm());
+
+  cJSON *channelArray = cJSON_AddArrayToObject(root, "channels");
+  std::vector<VDP::ChannelStats> stats = reg.get_channel_stats();
+  for (size_t id = 0; id < stats.size(); id++) {
+    cJSON *chan = cJSON_CreateObject();
+    cJSON_AddNumberToObject(chan, "channel_id", id);
+    cJSON_AddNumberToObject(chan, "received", stats[id].received);
+    cJSON_AddNumberToObject(chan, "lost", stats[id].lost);
+    cJSON_AddNumberToObject(chan, "reordered", stats[id].reordered);
+    cJSON_AddItemToArray(channelArray, chan);
+  }
+
   const char *json_str = cJSON_Print(root);
   std::string str(json_str);
   cJSON_free((void *)json_str);
-
   cJSON_Delete(root);
-  // ESP_LOGI(TAG, "size: %d", (int)visitors[0].node_stack.size());
   return str;
-}
\ No newline at end of file
+}
+#endif
@@ -1,7 +1,10 @@
 #pragma once
 #include "cJSON.h"
-#include "esp_timer.h"
+#include "vdb/bus-scheduler.hpp"
 #include "vdb/protocol.hpp"
+#ifdef ESP_PLATFORM
+#include "vdb_device.h"
+#endif
 #include "visitor.hpp"
 #include <string>
 #include <vector>
@@ -10,4 +13,83 @@
 std::string
 send_advertisement_msg(const std::vector<VDP::Channel> &activeChannels);
 
-std::string send_data_msg(const VDP::Channel &channel);
\ No newline at end of file
+// only the channels that were added or changed, plus the ids of channels that
+// went away, so clients can keep state for everything else
+std::string
+send_advertisement_update_msg(const std::vector<VDP::Channel> &changedChannels,
+                              const std::vector<VDP::ChannelID> &removedIds);
+
+// how a client wants data messages written
+enum class DataFormat {
+  // {"type":"data","channel_id":..,"data":{"name":value,...}}
+  Json,
+  // {"c":channel_id,"t":rec_time,"v":[value,...]}, the values in schema order
+  // with records flattened, names come from the advertisement
+  Compact,
+};
+// the format a client asked for in its websocket url, like /ws?format=compact,
+// Json if it didn't ask
+DataFormat data_format_from_query(const std::string &query);
+
+// how a client wants every message encoded
+enum class DataEncoding {
+  // text frames of JSON
+  Json,
+  // binary frames of CBOR, laid out the same as the JSON
+  Cbor,
+  // binary frames holding the brain's VDP packets as they came in, one
+  // packet per frame, for clients that decode VDP themselves
+  Raw,
+};
+// the encoding that goes with the websocket subprotocol a client agreed to,
+// Cbor for "vdb.cbor", Raw for "vdb.raw" and Json for anything else
+DataEncoding data_encoding_from_protocol(const std::string &protocol);
+
+// a broadcast packet for each channel, for raw clients that just connected.
+// After that they get the brain's own broadcasts as they come in
+std::vector<std::string>
+send_raw_broadcasts(const std::vector<VDP::Channel> &activeChannels);
+
+std::string
+send_advertisement_cbor(const std::vector<VDP::Channel> &activeChannels);
+std::string
+send_advertisement_update_cbor(const std::vector<VDP::Channel> &changedChannels,
+                               const std::vector<VDP::ChannelID> &removedIds);
+// a data message in either format as CBOR, written over out, with the
+// float fields in decimals rounded to that many digits after the point
+void write_cbor_data_msg(const VDP::Channel &channel, DataFormat format,
+                         std::string &out,
+                         const FieldDecimals *decimals = nullptr);
+// the advertisement and its update in either encoding, nothing for Raw
+std::string send_advertisement_msg(const std::vector<VDP::Channel> &activeChannels,
+                                   DataEncoding encoding);
+std::string
+send_advertisement_update_msg(const std::vector<VDP::Channel> &changedChannels,
+                              const std::vector<VDP::ChannelID> &removedIds,
+                              DataEncoding encoding);
+
+// when a data message says its data was recorded: the brain's sample time in
+// the board's clock if it sent one, otherwise now
+int64_t data_rec_time(const VDP::Channel &channel);
+
+std::string send_data_msg(const VDP::Channel &channel);
+// the same message written over whatever out held, so a caller that keeps
+// out around doesn't allocate once it is big enough. Float fields in
+// decimals get that many digits after the point
+void write_data_msg(const VDP::Channel &channel, std::string &out,
+                    const FieldDecimals *decimals = nullptr);
+// a data message in the compact format, written over out
+void write_compact_data_msg(const VDP::Channel &channel, std::string &out,
+                            const FieldDecimals *decimals = nullptr);
+// a data message in either format, written over out
+void write_data_msg(const VDP::Channel &channel, DataFormat format,
+                    std::string &out, const FieldDecimals *decimals = nullptr);
+
+#ifdef ESP_PLATFORM
+// loss counters from the uart device and the registry, for tuning baud rate
+// and channel rates
+std::string send_link_stats_msg(const VDBDevice &dev,
+                                const VDP::RegistryListener<std::mutex> &reg,
+                                const VDP::BusStats &bus,
+                                const VDP::LatencyStats &output_latency);
+#endif
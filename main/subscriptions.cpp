@@ -0,0 +1,191 @@
+#include "subscriptions.hpp"
+#include "cJSON.h"
+
+#include <algorithm>
+#include <cstring>
+
+/**
+ * adds a client subscribed to everything, or resets one on a reused socket
+ */
+void ChannelSubscriptions::add_client(int fd, int group) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto it = clients.begin(); it != clients.end(); it++) {
+    if (it->fd == fd) {
+      clients.erase(it);
+      break;
+    }
+  }
+  clients.push_back(Client{fd, group, {}, {}, {"*"}});
+  update_all();
+}
+
+void ChannelSubscriptions::remove_client(int fd) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto it = clients.begin(); it != clients.end(); it++) {
+    if (it->fd == fd) {
+      clients.erase(it);
+      update_all();
+      return;
+    }
+  }
+}
+
+// adds an id to a list if it isn't there yet
+static void add_id(std::vector<VDP::ChannelID> &list, VDP::ChannelID id) {
+  if (std::find(list.begin(), list.end(), id) == list.end()) {
+    list.push_back(id);
+  }
+}
+
+// removes an id from a list if it is there
+static void remove_id(std::vector<VDP::ChannelID> &list, VDP::ChannelID id) {
+  auto found = std::find(list.begin(), list.end(), id);
+  if (found != list.end()) {
+    list.erase(found);
+  }
+}
+
+/**
+ * handles a subscribe or unsubscribe message from a client
+ * @return false if msg isn't one, so it is meant for the brain
+ */
+bool ChannelSubscriptions::handle_message(int fd, const std::string &msg) {
+  cJSON *root = cJSON_Parse(msg.c_str());
+  if (root == NULL) {
+    return false;
+  }
+  const cJSON *type = cJSON_GetObjectItem(root, "type");
+  const bool subscribe =
+      cJSON_IsString(type) && strcmp(type->valuestring, "subscribe") == 0;
+  const bool unsubscribe =
+      cJSON_IsString(type) && strcmp(type->valuestring, "unsubscribe") == 0;
+  if (!subscribe && !unsubscribe) {
+    cJSON_Delete(root);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for (Client &client : clients) {
+    if (client.fd != fd) {
+      continue;
+    }
+    const cJSON *item;
+    cJSON_ArrayForEach(item, cJSON_GetObjectItem(root, "channels")) {
+      // valueint saturates, so check the double for an id that fits
+      if (!cJSON_IsNumber(item) || item->valuedouble < 0 ||
+          item->valuedouble >= (double)VDP::MAX_CHANNELS ||
+          item->valuedouble != (double)item->valueint) {
+        continue;
+      }
+      const VDP::ChannelID id = (VDP::ChannelID)item->valueint;
+      if (subscribe) {
+        add_id(client.ids, id);
+        remove_id(client.excluded, id);
+      } else {
+        remove_id(client.ids, id);
+        add_id(client.excluded, id);
+      }
+    }
+    cJSON_ArrayForEach(item, cJSON_GetObjectItem(root, "names")) {
+      if (!cJSON_IsString(item)) {
+        continue;
+      }
+      auto found = std::find(client.patterns.begin(), client.patterns.end(),
+                             item->valuestring);
+      if (subscribe && found == client.patterns.end()) {
+        client.patterns.push_back(item->valuestring);
+      } else if (unsubscribe && found != client.patterns.end()) {
+        client.patterns.erase(found);
+      }
+    }
+    update_all();
+    break;
+  }
+  cJSON_Delete(root);
+  return true;
+}
+
+/**
+ * adds or replaces a channel the brain broadcast, matching it against
+ * everyone's name patterns
+ */
+void ChannelSubscriptions::set_channel(const VDP::Channel &channel) {
+  std::lock_guard<std::mutex> lock(mutex);
+  ChannelSubscribers &entry = channels[channel.getID()];
+  entry.name = channel.data->get_name();
+  update(channel.getID(), entry);
+}
+void ChannelSubscriptions::remove_channel(VDP::ChannelID id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  channels.erase(id);
+}
+
+/**
+ * copies the clients that want a channel's data over out, reuse it so nothing
+ * is allocated
+ */
+void ChannelSubscriptions::subscribers(VDP::ChannelID id,
+                                       std::vector<Subscriber> &out) const {
+  out.clear();
+  std::lock_guard<std::mutex> lock(mutex);
+  auto found = channels.find(id);
+  if (found != channels.end()) {
+    out.insert(out.end(), found->second.subscribers.begin(),
+               found->second.subscribers.end());
+  }
+}
+
+/**
+ * works out a channel's subscribers again. Hold mutex
+ */
+void ChannelSubscriptions::update(VDP::ChannelID id,
+                                  ChannelSubscribers &channel) {
+  channel.subscribers.clear();
+  for (const Client &client : clients) {
+    bool wants = std::find(client.ids.begin(), client.ids.end(), id) !=
+                 client.ids.end();
+    for (const std::string &pattern : client.patterns) {
+      wants = wants || name_matches(pattern.c_str(), channel.name.c_str());
+    }
+    // an id unsubscribed from wins over any pattern
+    wants = wants && std::find(client.excluded.begin(), client.excluded.end(),
+                               id) == client.excluded.end();
+    if (wants) {
+      channel.subscribers.push_back(Subscriber{client.fd, client.group});
+    }
+  }
+}
+void ChannelSubscriptions::update_all() {
+  for (auto &entry : channels) {
+    update(entry.first, entry.second);
+  }
+}
+
+/**
+ * @return whether name matches a pattern where * matches any run of
+ * characters and ? any one
+ */
+bool name_matches(const char *pattern, const char *name) {
+  // where to go back to if what follows the last * stops matching
+  const char *star = nullptr;
+  const char *star_name = nullptr;
+  while (*name != '\0') {
+    if (*pattern == '*') {
+      star = pattern++;
+      star_name = name;
+    } else if (*pattern == '?' || *pattern == *name) {
+      pattern++;
+      name++;
+    } else if (star != nullptr) {
+      // let the * take one more character
+      pattern = star + 1;
+      name = ++star_name;
+    } else {
+      return false;
+    }
+  }
+  while (*pattern == '*') {
+    pattern++;
+  }
+  return *pattern == '\0';
+}
@@ -1,64 +1,226 @@
 #include "visitor.hpp"
 #include "cJSON_Utils.h"
+#include <cmath>
+#include <cstdlib>
 #include <limits>
 
-DataJSONVisitor::DataJSONVisitor() {
-  root = cJSON_CreateObject();
-  node_stack.push_back(root);
+FieldPath::FieldPath(const FieldDecimals *decimals)
+    : decimals(decimals != nullptr && !decimals->empty() ? decimals
+                                                         : nullptr) {}
+void FieldPath::enter(const std::string &record) {
+  if (decimals != nullptr) {
+    path += record;
+    path += '.';
+  }
+}
+void FieldPath::leave(const std::string &record) {
+  if (decimals != nullptr) {
+    path.resize(path.size() - record.size() - 1);
+  }
+}
+/**
+ * @return digits after the point for a field of the record we are in, or -1
+ * to write all of them
+ */
+int FieldPath::digits(const std::string &name) {
+  if (decimals == nullptr) {
+    return -1;
+  }
+  const size_t len = path.size();
+  path += name;
+  auto found = decimals->find(path);
+  path.resize(len);
+  return found == decimals->end() ? -1 : found->second;
+}
+
+/**
+ * @return what a JSON reader gets from num written with fixed decimals
+ */
+static double round_decimals(double num, int decimals) {
+  if (!std::isfinite(num)) {
+    return num;
+  }
+  // short enough to stay in the string's own buffer
+  std::string text;
+  JSONWriter writer{text};
+  writer.value(num, decimals);
+  return strtod(text.c_str(), nullptr);
+}
+
+/**
+ * @param writer where to write, positioned inside an object, or inside an
+ * array without keys
+ * @param keyed false to write only the values, in schema order with records
+ * flattened, for the compact data format
+ * @param decimals float fields to write with fixed decimals, kept by the
+ * caller while this is in use
+ */
+DataJSONWriter::DataJSONWriter(JSONWriter &writer, bool keyed,
+                               const FieldDecimals *decimals)
+    : writer(writer), keyed(keyed), path(decimals) {}
+
+void DataJSONWriter::VisitRecord(VDP::Record *record) {
+  if (keyed) {
+    writer.key(record->get_name());
+    writer.begin_object();
+  }
+  path.enter(record->get_name());
+  for (const VDP::PartPtr &field : record->get_fields()) {
+    field->Visit(this);
+  }
+  path.leave(record->get_name());
+  if (keyed) {
+    writer.end_object();
+  }
+}
+void DataJSONWriter::VisitString(VDP::String *str) {
+  key(str->get_name());
+  writer.value(str->get_value());
+}
+void DataJSONWriter::VisitBoolean(VDP::Boolean *bool_part) {
+  key(bool_part->get_name());
+  writer.value(bool_part->get_value());
+}
+void DataJSONWriter::VisitFloat(VDP::Float *float_part) {
+  key(float_part->get_name());
+  const int digits = path.digits(float_part->get_name());
+  if (digits < 0) {
+    writer.value(float_part->get_value());
+  } else {
+    writer.value((double)float_part->get_value(), digits);
+  }
+}
+void DataJSONWriter::VisitAnyFloat(const std::string &name, double value,
+                                   const VDP::Part *) {
+  key(name);
+  const int digits = path.digits(name);
+  if (digits < 0) {
+    writer.value(value);
+  } else {
+    writer.value(value, digits);
+  }
+}
+void DataJSONWriter::VisitAnyInt(const std::string &name, int64_t value,
+                                 const VDP::Part *) {
+  key(name);
+  writer.value(value);
+}
+void DataJSONWriter::VisitAnyUint(const std::string &name, uint64_t value,
+                                  const VDP::Part *) {
+  key(name);
+  writer.value(value);
+}
+void DataJSONWriter::key(const std::string &name) {
+  if (keyed) {
+    writer.key(name);
+  }
 }
-DataJSONVisitor::~DataJSONVisitor() { cJSON_Delete(root); }
 
-void DataJSONVisitor::VisitRecord(VDP::Record *record) {
-  cJSON *oldroot = current_node();
-  cJSON *newroot = cJSON_CreateObject();
-  node_stack.push_back(newroot);
+/**
+ * @param writer where to write, inside a map, or inside an array without keys
+ * @param keyed false to write only the values, in schema order with records
+ * flattened, for the compact data format
+ * @param decimals float fields to round to fixed decimals, written as the
+ * double a JSON reader gets from DataJSONWriter's text
+ */
+DataCBORWriter::DataCBORWriter(CBORWriter &writer, bool keyed,
+                               const FieldDecimals *decimals)
+    : writer(writer), keyed(keyed), path(decimals) {}
 
+void DataCBORWriter::VisitRecord(VDP::Record *record) {
+  if (keyed) {
+    writer.key(record->get_name());
+    writer.begin_map(record->get_fields().size());
+  }
+  path.enter(record->get_name());
   for (const VDP::PartPtr &field : record->get_fields()) {
     field->Visit(this);
   }
-  node_stack.pop_back();
-
-  std::string name = record->get_name();
-  cJSON_AddItemToObject(oldroot, name.c_str(), newroot);
+  path.leave(record->get_name());
 }
-
-void DataJSONVisitor::VisitString(VDP::String *str) {
-  std::string name = str->get_name();
-  std::string value = str->get_value();
-
-  cJSON *oldroot = current_node();
-  cJSON_AddStringToObject(oldroot, name.c_str(), value.c_str());
+void DataCBORWriter::VisitString(VDP::String *str) {
+  key(str->get_name());
+  writer.value(str->get_value());
 }
-
-void DataJSONVisitor::VisitBoolean(VDP::Boolean *bool_part) {
-  std::string name = bool_part->get_name();
-  bool value = bool_part->get_value();
-
-  cJSON *oldroot = current_node();
-  cJSON_AddBoolToObject(oldroot, name.c_str(), value);
+void DataCBORWriter::VisitBoolean(VDP::Boolean *bool_part) {
+  key(bool_part->get_name());
+  writer.value(bool_part->get_value());
 }
-
-void DataJSONVisitor::VisitAnyFloat(const std::string &name, double value,
-                                    const VDP::Part *) {
-  cJSON_AddNumberToObject(current_node(), name.c_str(), value);
+void DataCBORWriter::VisitFloat(VDP::Float *float_part) {
+  key(float_part->get_name());
+  const int digits = path.digits(float_part->get_name());
+  if (digits < 0) {
+    writer.value(float_part->get_value());
+  } else {
+    writer.value(round_decimals(float_part->get_value(), digits));
+  }
+}
+void DataCBORWriter::VisitAnyFloat(const std::string &name, double value,
+                                   const VDP::Part *) {
+  key(name);
+  const int digits = path.digits(name);
+  writer.value(digits < 0 ? value : round_decimals(value, digits));
 }
-void DataJSONVisitor::VisitAnyInt(const std::string &name, int64_t value,
+void DataCBORWriter::VisitAnyInt(const std::string &name, int64_t value,
+                                 const VDP::Part *) {
+  key(name);
+  writer.value(value);
+}
+void DataCBORWriter::VisitAnyUint(const std::string &name, uint64_t value,
                                   const VDP::Part *) {
-  cJSON_AddNumberToObject(current_node(), name.c_str(), (double)value);
+  key(name);
+  writer.value(value);
 }
-void DataJSONVisitor::VisitAnyUint(const std::string &name, uint64_t value,
-                                   const VDP::Part *) {
-  cJSON_AddNumberToObject(current_node(), name.c_str(), (double)value);
+void DataCBORWriter::key(const std::string &name) {
+  if (keyed) {
+    writer.key(name);
+  }
 }
 
-cJSON *DataJSONVisitor::current_node() {
-  return node_stack[node_stack.size() - 1];
+/**
+ * @param writer where to write the schema's top map
+ */
+ChannelCBORWriter::ChannelCBORWriter(CBORWriter &writer) : writer(writer) {}
+
+void ChannelCBORWriter::VisitRecord(VDP::Record *record) {
+  writer.begin_map(3);
+  writer.key("name");
+  writer.value(record->get_name());
+  writer.key("type");
+  writer.value("record");
+  writer.key("fields");
+  writer.begin_array(record->get_fields().size());
+  for (const VDP::PartPtr &field : record->get_fields()) {
+    field->Visit(this);
+  }
 }
-std::string DataJSONVisitor::get_string() {
-  const char *json_str = cJSON_Print(root);
-  std::string str{json_str};
-  cJSON_free((void *)json_str);
-  return str;
+void ChannelCBORWriter::VisitString(VDP::String *str) {
+  leaf(str->get_name(), "string");
+}
+void ChannelCBORWriter::VisitBoolean(VDP::Boolean *bool_part) {
+  leaf(bool_part->get_name(), "bool");
+}
+void ChannelCBORWriter::VisitAnyFloat(const std::string &name, double,
+                                      const VDP::Part *) {
+  leaf(name, "float");
+}
+void ChannelCBORWriter::VisitAnyInt(const std::string &name, int64_t,
+                                    const VDP::Part *) {
+  leaf(name, "int");
+}
+void ChannelCBORWriter::VisitAnyUint(const std::string &name, uint64_t,
+                                     const VDP::Part *) {
+  leaf(name, "uint");
+}
+/**
+ * writes a field that isn't a record
+ */
+void ChannelCBORWriter::leaf(const std::string &name, const char *type) {
+  writer.begin_map(2);
+  writer.key("name");
+  writer.value(name);
+  writer.key("type");
+  writer.value(type);
 }
 
 ChannelVisitor::ChannelVisitor() {
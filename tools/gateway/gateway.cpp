@@ -0,0 +1,217 @@
+/**
+ * Runs the board's pipeline on a Linux computer plugged into the brain's USB
+ * serial port: the registry listener, the JSON visitors and the /ws
+ * websocket, served to as many dashboard clients as the computer can keep
+ * up with.
+ *
+ *   gateway <serial port> [--baud N] [--port N] [--decimals FIELD=N]...
+ *
+ * --decimals writes a float field with N digits after the point instead of
+ * all of them, for fields whose last digits are noise. FIELD is the path
+ * from the channel's top part, like odometry.x.
+ *
+ * Everything runs on one epoll loop. To try it without a brain, make a
+ * pseudo terminal pair with
+ *   socat -d -d pty,raw,echo=0 pty,raw,echo=0
+ * and point the gateway at one end and a simulated brain at the other.
+ */
+#include "channel-pipeline.hpp"
+#include "message-format.hpp"
+#include "visitor.hpp"
+#include "vdb/posix-serial.hpp"
+#include "vdb/registry-listener.hpp"
+#include "ws-server.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/epoll.h>
+#include <thread>
+#include <vector>
+
+namespace VDB {
+uint32_t time_ms() { return (uint32_t)(time_us() / 1000); }
+uint64_t time_us() {
+  static const auto start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+void delay_ms(uint32_t ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+} // namespace VDB
+
+static volatile std::sig_atomic_t running = 1;
+
+static void usage() {
+  fprintf(stderr, "usage: gateway <serial port> [--baud N] [--port N] "
+                  "[--decimals FIELD=N]...\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+  const char *serial_path = argv[1];
+  uint32_t baud = 115200 * 2;
+  uint16_t port = 8080;
+  // float fields written with fewer digits, by path
+  std::vector<std::pair<std::string, int>> decimals;
+  for (int i = 2; i < argc; i += 2) {
+    if (i + 1 == argc) {
+      // every flag takes a value
+      usage();
+      return 1;
+    }
+    if (strcmp(argv[i], "--baud") == 0) {
+      baud = (uint32_t)atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--port") == 0) {
+      port = (uint16_t)atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--decimals") == 0 &&
+               strchr(argv[i + 1], '=') != nullptr) {
+      const char *eq = strchr(argv[i + 1], '=');
+      decimals.emplace_back(std::string(argv[i + 1], eq - argv[i + 1]),
+                            atoi(eq + 1));
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  signal(SIGINT, [](int) { running = 0; });
+  signal(SIGTERM, [](int) { running = 0; });
+
+  const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    perror("epoll_create1");
+    return 1;
+  }
+  VDB::PosixSerialDevice dev{serial_path, baud};
+  if (!dev.is_open()) {
+    return 1;
+  }
+  VDP::RegistryListener<std::mutex> reg{&dev};
+  // "vdb.cbor" clients get binary CBOR, "vdb.raw" clients VDP packets, and
+  // everyone else JSON like the board
+  WsServer server{epoll_fd, port, "/ws", {"vdb.cbor", "vdb.raw", "chat"}};
+  if (!server.is_open()) {
+    return 1;
+  }
+  printf("Serving %s on ws://0.0.0.0:%u/ws\n", serial_path, (unsigned)port);
+
+  epoll_event serial_ev{};
+  serial_ev.events = EPOLLIN;
+  serial_ev.data.fd = dev.fd();
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dev.fd(), &serial_ev);
+  bool watching_serial_write = false;
+
+  // the group each client is in, for the format it asked for in its url and
+  // the encoding that goes with its subprotocol
+  std::map<int, int> client_groups;
+  auto wants_encoding = [&](DataEncoding encoding) {
+    return [&client_groups, encoding](int client) {
+      auto found = client_groups.find(client);
+      return found != client_groups.end() &&
+             ChannelPipeline::GROUPS[found->second].encoding == encoding;
+    };
+  };
+  ChannelPipeline pipeline{
+      [&](const ChannelPipeline::Message &msg, DataEncoding encoding) {
+        server.broadcast(*msg, wants_encoding(encoding),
+                         encoding == DataEncoding::Cbor);
+      },
+      [&](int client, const ChannelPipeline::Message &msg, int group) {
+        server.send(client, *msg,
+                    ChannelPipeline::GROUPS[group].encoding ==
+                        DataEncoding::Cbor);
+      }};
+  for (const auto &field : decimals) {
+    pipeline.set_decimals(field.first, field.second);
+  }
+
+  // new clients get everything announced so far, later changes go out as
+  // updates
+  server.on_open([&](int client) {
+    const int group = ChannelPipeline::group_for(
+        data_format_from_query(server.query(client)),
+        data_encoding_from_protocol(server.protocol(client)));
+    client_groups[client] = group;
+    if (group == ChannelPipeline::RAW_GROUP) {
+      for (const std::string &packet :
+           send_raw_broadcasts(pipeline.channels())) {
+        server.send(client, packet, true);
+      }
+      return;
+    }
+    const DataEncoding encoding = ChannelPipeline::GROUPS[group].encoding;
+    pipeline.subscriptions.add_client(client, group);
+    server.send(client, send_advertisement_msg(pipeline.channels(), encoding),
+                encoding == DataEncoding::Cbor);
+  });
+  server.on_close([&](int client) {
+    client_groups.erase(client);
+    pipeline.subscriptions.remove_client(client);
+  });
+  server.on_message([&](int client, const std::string &json_string) {
+    if (pipeline.subscriptions.handle_message(client, json_string) ||
+        pipeline.handle_message(json_string)) {
+      return;
+    }
+    ResponseJSONVisitor RV(json_string, reg);
+    RV.set_data();
+    RV.send_to_reg();
+  });
+
+  reg.install_broadcast_callback(
+      [&](const VDP::Channel &new_chan, VDP::BroadcastChange change) {
+        pipeline.on_broadcast(new_chan, change);
+      });
+
+  // raw clients get the brain's packets untouched, and if they are the only
+  // ones connected nothing is decoded at all
+  const auto wants_raw = wants_encoding(DataEncoding::Raw);
+  reg.install_raw_callback([&](const VDP::Packet &packet) {
+    const size_t num_raw = server.num_clients(wants_raw);
+    reg.set_decode_data(num_raw == 0 || num_raw < server.num_clients());
+    if (num_raw > 0) {
+      server.broadcast(std::string(packet.begin(), packet.end()), wants_raw,
+                       true);
+    }
+  });
+
+  reg.install_data_callback(
+      [&](const VDP::Channel &chan) { pipeline.on_data(chan); });
+
+  epoll_event events[32];
+  while (running) {
+    const int n = epoll_wait(epoll_fd, events, 32, 100);
+    for (int i = 0; i < n; i++) {
+      const int fd = events[i].data.fd;
+      if (fd == dev.fd()) {
+        if ((events[i].events & EPOLLOUT) && !dev.handle_writable()) {
+          running = 0;
+        }
+        if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+            !dev.handle_readable()) {
+          fprintf(stderr, "Serial port closed\n");
+          running = 0;
+        }
+      } else if (server.owns(fd)) {
+        server.handle_event(fd, events[i].events);
+      }
+    }
+    // replies to the brain that didn't fit go out once the port drains
+    if (dev.is_open() && dev.wants_write() != watching_serial_write) {
+      watching_serial_write = !watching_serial_write;
+      serial_ev.events = EPOLLIN | (watching_serial_write ? (uint32_t)EPOLLOUT : 0);
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, dev.fd(), &serial_ev);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,602 @@
+#include "ws-server.hpp"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+constexpr uint8_t OP_CONTINUATION = 0x0;
+constexpr uint8_t OP_TEXT = 0x1;
+constexpr uint8_t OP_BINARY = 0x2;
+constexpr uint8_t OP_CLOSE = 0x8;
+constexpr uint8_t OP_PING = 0x9;
+constexpr uint8_t OP_PONG = 0xA;
+
+/**
+ * @return the SHA-1 digest of some bytes, only used for the handshake
+ */
+std::string sha1(const std::string &input) {
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                   0xC3D2E1F0};
+  std::string msg = input;
+  const uint64_t bits = (uint64_t)input.size() * 8;
+  msg.push_back((char)0x80);
+  while (msg.size() % 64 != 56) {
+    msg.push_back(0);
+  }
+  for (int i = 7; i >= 0; i--) {
+    msg.push_back((char)(bits >> (i * 8)));
+  }
+  auto rotl = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+  for (size_t chunk = 0; chunk < msg.size(); chunk += 64) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+      const uint8_t *p = (const uint8_t *)msg.data() + chunk + i * 4;
+      w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+             (uint32_t)p[2] << 8 | p[3];
+    }
+    for (int i = 16; i < 80; i++) {
+      w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      const uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rotl(b, 30);
+      b = a;
+      a = temp;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+  std::string digest;
+  for (uint32_t word : h) {
+    for (int i = 3; i >= 0; i--) {
+      digest.push_back((char)(word >> (i * 8)));
+    }
+  }
+  return digest;
+}
+
+std::string base64(const std::string &input) {
+  static const char *table =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  size_t i = 0;
+  for (; i + 2 < input.size(); i += 3) {
+    const uint32_t n = (uint8_t)input[i] << 16 | (uint8_t)input[i + 1] << 8 |
+                       (uint8_t)input[i + 2];
+    out += table[(n >> 18) & 63];
+    out += table[(n >> 12) & 63];
+    out += table[(n >> 6) & 63];
+    out += table[n & 63];
+  }
+  if (i < input.size()) {
+    uint32_t n = (uint8_t)input[i] << 16;
+    if (i + 1 < input.size()) {
+      n |= (uint8_t)input[i + 1] << 8;
+    }
+    out += table[(n >> 18) & 63];
+    out += table[(n >> 12) & 63];
+    out += i + 1 < input.size() ? table[(n >> 6) & 63] : '=';
+    out += '=';
+  }
+  return out;
+}
+
+/**
+ * @param request an http request's headers
+ * @param name a header name, any case
+ * @return the header's value, or empty if it isn't there
+ */
+std::string find_header(const std::string &request, const char *name) {
+  const size_t len = strlen(name);
+  size_t pos = request.find("\r\n");
+  while (pos != std::string::npos && pos + 2 < request.size()) {
+    const size_t line = pos + 2;
+    const size_t end = request.find("\r\n", line);
+    if (end == std::string::npos) {
+      break;
+    }
+    if (end - line > len && request[line + len] == ':' &&
+        strncasecmp(request.data() + line, name, len) == 0) {
+      size_t start = line + len + 1;
+      while (start < end && request[start] == ' ') {
+        start++;
+      }
+      return request.substr(start, end - start);
+    }
+    pos = end;
+  }
+  return "";
+}
+
+/**
+ * @param offered a Sec-WebSocket-Protocol header, like "vdb.cbor, chat"
+ * @param protocols the ones the server speaks
+ * @return the first offered one the server speaks, or nothing
+ */
+std::string pick_protocol(const std::string &offered,
+                          const std::vector<std::string> &protocols) {
+  size_t start = 0;
+  while (start < offered.size()) {
+    size_t end = offered.find(',', start);
+    if (end == std::string::npos) {
+      end = offered.size();
+    }
+    size_t first = start;
+    size_t last = end;
+    while (first < last && offered[first] == ' ') {
+      first++;
+    }
+    while (last > first && offered[last - 1] == ' ') {
+      last--;
+    }
+    for (const std::string &protocol : protocols) {
+      if (offered.compare(first, last - first, protocol) == 0) {
+        return protocol;
+      }
+    }
+    start = end + 1;
+  }
+  return "";
+}
+} // namespace
+
+/**
+ * starts listening
+ * @param epoll_fd the loop to add the server's sockets to
+ * @param port tcp port to listen on
+ * @param path where clients connect, like /ws. Paths under it, like /ws/cbor,
+ * lead to the same place
+ * @param protocols the subprotocols the server speaks. A client gets the
+ * first one it offers that is in the list
+ */
+WsServer::WsServer(int epoll_fd, uint16_t port, const std::string &path,
+                   const std::vector<std::string> &protocols)
+    : epoll_fd(epoll_fd), path(path), protocols(protocols) {
+  listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    perror("ws: socket");
+    return;
+  }
+  int one = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(listen_fd, 16) != 0) {
+    perror("ws: bind");
+    close(listen_fd);
+    listen_fd = -1;
+    return;
+  }
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+}
+
+WsServer::~WsServer() {
+  while (!clients.empty()) {
+    close_client(clients.begin()->first);
+  }
+  if (listen_fd >= 0) {
+    close(listen_fd);
+  }
+}
+
+bool WsServer::is_open() const { return listen_fd >= 0; }
+
+bool WsServer::owns(int fd) const {
+  return fd == listen_fd || clients.count(fd) != 0;
+}
+
+size_t WsServer::num_clients() const {
+  size_t n = 0;
+  for (const auto &entry : clients) {
+    n += entry.second.upgraded ? 1 : 0;
+  }
+  return n;
+}
+
+/**
+ * @param which returns true for the clients to count
+ * @return clients past the handshake that which picks
+ */
+size_t WsServer::num_clients(const ClientFilter &which) const {
+  size_t n = 0;
+  for (const auto &entry : clients) {
+    n += entry.second.upgraded && which(entry.first) ? 1 : 0;
+  }
+  return n;
+}
+
+/**
+ * @return the query string of the url a client connected to, like
+ * format=compact, or nothing if it isn't connected
+ */
+std::string WsServer::query(int client) const {
+  auto it = clients.find(client);
+  if (it == clients.end()) {
+    return "";
+  }
+  return it->second.query;
+}
+
+/**
+ * @return the subprotocol a client agreed to, or nothing if it didn't offer
+ * one the server speaks
+ */
+std::string WsServer::protocol(int client) const {
+  auto it = clients.find(client);
+  if (it == clients.end()) {
+    return "";
+  }
+  return it->second.protocol;
+}
+
+void WsServer::on_open(OpenFn fn) { open_fn = fn; }
+void WsServer::on_message(MessageFn fn) { message_fn = fn; }
+void WsServer::on_close(CloseFn fn) { close_fn = fn; }
+
+/**
+ * handles an epoll event on one of the server's sockets
+ */
+void WsServer::handle_event(int fd, uint32_t events) {
+  if (fd == listen_fd) {
+    while (true) {
+      const int client_fd =
+          accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (client_fd < 0) {
+        return;
+      }
+      int one = 1;
+      setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      clients[client_fd] = Client{};
+      epoll_event ev{};
+      ev.events = EPOLLIN | EPOLLRDHUP;
+      ev.data.fd = client_fd;
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev);
+    }
+  }
+
+  auto it = clients.find(fd);
+  if (it == clients.end()) {
+    return;
+  }
+  bool ok = true;
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    ok = false;
+  }
+  if (ok && (events & (EPOLLIN | EPOLLRDHUP))) {
+    ok = read_client(fd, it->second);
+  }
+  // reading can close other clients through the callbacks, look again
+  it = clients.find(fd);
+  if (ok && it != clients.end() && (events & EPOLLOUT)) {
+    ok = write_client(fd, it->second);
+  }
+  if (!ok) {
+    close_client(fd);
+  }
+}
+
+/**
+ * reads what a client sent and handles every whole request or frame
+ */
+bool WsServer::read_client(int fd, Client &client) {
+  char buf[4096];
+  while (true) {
+    const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n == 0) {
+      return false;
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return false;
+    }
+    client.in.append(buf, (size_t)n);
+    if (client.in.size() > MAX_MESSAGE_SIZE + 16) {
+      break;
+    }
+  }
+  if (!client.upgraded) {
+    return handle_handshake(fd, client);
+  }
+  return handle_frames(fd, client);
+}
+
+/**
+ * answers the http upgrade request once it has all arrived
+ */
+bool WsServer::handle_handshake(int fd, Client &client) {
+  const size_t end = client.in.find("\r\n\r\n");
+  if (end == std::string::npos) {
+    return client.in.size() < 8192;
+  }
+  const std::string request = client.in.substr(0, end + 2);
+  client.in.erase(0, end + 4);
+
+  const std::string key = find_header(request, "Sec-WebSocket-Key");
+  // the path can be followed by more path, like the board's /ws/cbor, or a
+  // query string, like /ws?format=compact
+  const size_t path_end = 4 + path.size();
+  const bool right_path =
+      request.compare(0, path_end, "GET " + path) == 0 &&
+      request.size() > path_end &&
+      (request[path_end] == ' ' || request[path_end] == '?' ||
+       request[path_end] == '/');
+  if (!right_path || key.empty()) {
+    const std::string reply = right_path
+                                  ? "HTTP/1.1 400 Bad Request\r\n"
+                                    "Content-Length: 0\r\n\r\n"
+                                  : "HTTP/1.1 404 Not Found\r\n"
+                                    "Content-Length: 0\r\n\r\n";
+    ::send(fd, reply.data(), reply.size(), MSG_NOSIGNAL);
+    return false;
+  }
+
+  std::string reply = "HTTP/1.1 101 Switching Protocols\r\n"
+                      "Upgrade: websocket\r\n"
+                      "Connection: Upgrade\r\n"
+                      "Sec-WebSocket-Accept: " +
+                      base64(sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11")) +
+                      "\r\n";
+  client.protocol = pick_protocol(
+      find_header(request, "Sec-WebSocket-Protocol"), protocols);
+  if (!client.protocol.empty()) {
+    reply += "Sec-WebSocket-Protocol: " + client.protocol + "\r\n";
+  }
+  reply += "\r\n";
+  const size_t query_start = request.find('?', path_end);
+  const size_t target_end = request.find(' ', path_end);
+  if (query_start < target_end) {
+    client.query =
+        request.substr(query_start + 1, target_end - query_start - 1);
+  }
+  client.upgraded = true;
+  if (!queue_bytes(fd, client, reply)) {
+    return false;
+  }
+  open_fn(fd);
+  auto it = clients.find(fd);
+  if (it == clients.end()) {
+    return true;
+  }
+  return handle_frames(fd, it->second);
+}
+
+/**
+ * handles every whole frame that has arrived
+ */
+bool WsServer::handle_frames(int fd, Client &client) {
+  while (client.in.size() >= 2) {
+    const uint8_t *p = (const uint8_t *)client.in.data();
+    const bool fin = p[0] & 0x80;
+    const uint8_t opcode = p[0] & 0x0F;
+    const bool masked = p[1] & 0x80;
+    uint64_t len = p[1] & 0x7F;
+    size_t header = 2;
+    if (len == 126) {
+      if (client.in.size() < 4) {
+        return true;
+      }
+      len = (uint64_t)p[2] << 8 | p[3];
+      header = 4;
+    } else if (len == 127) {
+      if (client.in.size() < 10) {
+        return true;
+      }
+      len = 0;
+      for (int i = 0; i < 8; i++) {
+        len = len << 8 | p[2 + i];
+      }
+      header = 10;
+    }
+    // clients always mask, and nothing the dashboard sends is this big
+    if (!masked || len > MAX_MESSAGE_SIZE) {
+      return false;
+    }
+    if (client.in.size() < header + 4 + len) {
+      return true;
+    }
+    const uint8_t *mask = p + header;
+    std::string payload = client.in.substr(header + 4, (size_t)len);
+    for (size_t i = 0; i < payload.size(); i++) {
+      payload[i] ^= mask[i % 4];
+    }
+    client.in.erase(0, header + 4 + (size_t)len);
+
+    switch (opcode) {
+    case OP_TEXT:
+    case OP_BINARY:
+    case OP_CONTINUATION:
+      client.message += payload;
+      if (client.message.size() > MAX_MESSAGE_SIZE) {
+        return false;
+      }
+      if (fin) {
+        std::string message;
+        message.swap(client.message);
+        if (opcode != OP_BINARY) {
+          message_fn(fd, message);
+        }
+        if (clients.count(fd) == 0) {
+          return true;
+        }
+      }
+      break;
+    case OP_PING:
+      if (!queue_frame(fd, client, OP_PONG, payload)) {
+        return false;
+      }
+      break;
+    case OP_CLOSE:
+      queue_frame(fd, client, OP_CLOSE, payload.substr(0, 2));
+      return false;
+    default:
+      break;
+    }
+  }
+  return true;
+}
+
+/**
+ * queues a frame and writes what the socket takes
+ */
+bool WsServer::queue_frame(int fd, Client &client, uint8_t opcode,
+                           const std::string &payload) {
+  std::string frame;
+  frame.push_back((char)(0x80 | opcode));
+  if (payload.size() < 126) {
+    frame.push_back((char)payload.size());
+  } else if (payload.size() <= 0xFFFF) {
+    frame.push_back((char)126);
+    frame.push_back((char)(payload.size() >> 8));
+    frame.push_back((char)payload.size());
+  } else {
+    frame.push_back((char)127);
+    for (int i = 7; i >= 0; i--) {
+      frame.push_back((char)((uint64_t)payload.size() >> (i * 8)));
+    }
+  }
+  frame += payload;
+  return queue_bytes(fd, client, frame);
+}
+
+/**
+ * queues bytes and writes what the socket takes
+ */
+bool WsServer::queue_bytes(int fd, Client &client, const std::string &bytes) {
+  if (client.out.size() - client.out_head + bytes.size() > MAX_BACKLOG) {
+    num_slow_clients++;
+    fprintf(stderr, "ws: client %d fell too far behind, closing it\n", fd);
+    return false;
+  }
+  client.out += bytes;
+  return write_client(fd, client);
+}
+
+/**
+ * writes what the socket takes and watches for writable if some is left
+ */
+bool WsServer::write_client(int fd, Client &client) {
+  while (client.out_head < client.out.size()) {
+    const ssize_t n = ::send(fd, client.out.data() + client.out_head,
+                             client.out.size() - client.out_head, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return false;
+    }
+    client.out_head += (size_t)n;
+  }
+  if (client.out_head == client.out.size()) {
+    client.out.clear();
+    client.out_head = 0;
+  } else if (client.out_head > MAX_BACKLOG / 4) {
+    client.out.erase(0, client.out_head);
+    client.out_head = 0;
+  }
+  const bool want_write = !client.out.empty();
+  if (want_write != client.watching_write) {
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? (uint32_t)EPOLLOUT : 0);
+    ev.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    client.watching_write = want_write;
+  }
+  return true;
+}
+
+void WsServer::close_client(int fd) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+  close(fd);
+  auto found = clients.find(fd);
+  if (found == clients.end()) {
+    return;
+  }
+  const bool upgraded = found->second.upgraded;
+  clients.erase(found);
+  if (upgraded) {
+    close_fn(fd);
+  }
+}
+
+/**
+ * sends a text message to every connected client
+ */
+void WsServer::broadcast(const std::string &text) {
+  broadcast(text, [](int) { return true; });
+}
+/**
+ * sends a message to some of the connected clients
+ * @param to returns true for the clients to send to
+ * @param binary send a binary frame instead of text
+ */
+void WsServer::broadcast(const std::string &data, const ClientFilter &to,
+                         bool binary) {
+  const uint8_t opcode = binary ? OP_BINARY : OP_TEXT;
+  std::vector<int> dead;
+  for (auto &entry : clients) {
+    if (entry.second.upgraded && to(entry.first) &&
+        !queue_frame(entry.first, entry.second, opcode, data)) {
+      dead.push_back(entry.first);
+    }
+  }
+  for (int fd : dead) {
+    close_client(fd);
+  }
+}
+
+/**
+ * sends a message to one client
+ * @param binary send a binary frame instead of text
+ */
+void WsServer::send(int client, const std::string &data, bool binary) {
+  auto it = clients.find(client);
+  if (it == clients.end() || !it->second.upgraded) {
+    return;
+  }
+  if (!queue_frame(client, it->second, binary ? OP_BINARY : OP_TEXT, data)) {
+    close_client(client);
+  }
+}
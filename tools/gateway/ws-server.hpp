@@ -0,0 +1,167 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * A small websocket server that runs off the gateway's epoll loop. It only
+ * does what the dashboard needs from the board's /ws endpoint: text messages
+ * both ways, pings and closes. Sending never blocks, a client that falls too
+ * far behind is disconnected instead of holding up everyone else
+ */
+class WsServer {
+public:
+  // bytes a client can have waiting to go out before it is cut off
+  static constexpr size_t MAX_BACKLOG = 1 << 20;
+  // longest message accepted from a client
+  static constexpr size_t MAX_MESSAGE_SIZE = 1 << 16;
+
+  // clients cut off for falling behind
+  int num_slow_clients = 0;
+
+  using OpenFn = std::function<void(int client)>;
+  using MessageFn = std::function<void(int client, const std::string &text)>;
+  using CloseFn = std::function<void(int client)>;
+  using ClientFilter = std::function<bool(int client)>;
+
+  /**
+   * starts listening
+   * @param epoll_fd the loop to add the server's sockets to
+   * @param port tcp port to listen on
+   * @param path where clients connect, like /ws. Paths under it, like
+   * /ws/cbor, lead to the same place
+   * @param protocols the subprotocols the server speaks. A client gets the
+   * first one it offers that is in the list
+   */
+  WsServer(int epoll_fd, uint16_t port, const std::string &path,
+           const std::vector<std::string> &protocols = {"chat"});
+  ~WsServer();
+  WsServer(const WsServer &) = delete;
+  WsServer &operator=(const WsServer &) = delete;
+
+  /**
+   * @return false if the server couldn't start listening
+   */
+  bool is_open() const;
+  /**
+   * @param fd a file descriptor epoll reported
+   * @return true if it is the server's, and should go to handle_event
+   */
+  bool owns(int fd) const;
+  /**
+   * handles an epoll event on one of the server's sockets
+   * @param fd the socket
+   * @param events what epoll reported
+   */
+  void handle_event(int fd, uint32_t events);
+
+  /**
+   * sends a text message to every connected client
+   */
+  void broadcast(const std::string &text);
+  /**
+   * sends a message to some of the connected clients
+   * @param to returns true for the clients to send to
+   * @param binary send a binary frame instead of text
+   */
+  void broadcast(const std::string &data, const ClientFilter &to,
+                 bool binary = false);
+  /**
+   * sends a message to one client
+   * @param binary send a binary frame instead of text
+   */
+  void send(int client, const std::string &data, bool binary = false);
+  /**
+   * @return clients past the handshake
+   */
+  size_t num_clients() const;
+  /**
+   * @param which returns true for the clients to count
+   * @return clients past the handshake that which picks
+   */
+  size_t num_clients(const ClientFilter &which) const;
+  /**
+   * @return the query string of the url a client connected to, like
+   * format=compact, or nothing if it isn't connected
+   */
+  std::string query(int client) const;
+  /**
+   * @return the subprotocol a client agreed to, or nothing if it didn't
+   * offer one the server speaks
+   */
+  std::string protocol(int client) const;
+
+  /**
+   * @param fn called when a client finishes its handshake
+   */
+  void on_open(OpenFn fn);
+  /**
+   * @param fn called with each text message a client sends
+   */
+  void on_message(MessageFn fn);
+  /**
+   * @param fn called when a client that finished its handshake goes away
+   */
+  void on_close(CloseFn fn);
+
+private:
+  struct Client {
+    bool upgraded = false;
+    // what came after the ? in the url
+    std::string query;
+    std::string protocol;
+    // bytes read but not handled yet
+    std::string in;
+    // a message being put back together from fragments
+    std::string message;
+    // bytes waiting to go out, starting at out_head
+    std::string out;
+    size_t out_head = 0;
+    bool watching_write = false;
+  };
+
+  /**
+   * reads what a client sent and handles every whole request or frame
+   * @return false if the client should be closed
+   */
+  bool read_client(int fd, Client &client);
+  /**
+   * answers the http upgrade request once it has all arrived
+   * @return false if the client should be closed
+   */
+  bool handle_handshake(int fd, Client &client);
+  /**
+   * handles every whole frame that has arrived
+   * @return false if the client should be closed
+   */
+  bool handle_frames(int fd, Client &client);
+  /**
+   * queues a frame and writes what the socket takes
+   * @return false if the client should be closed
+   */
+  bool queue_frame(int fd, Client &client, uint8_t opcode,
+                   const std::string &payload);
+  /**
+   * queues bytes and writes what the socket takes
+   * @return false if the client should be closed
+   */
+  bool queue_bytes(int fd, Client &client, const std::string &bytes);
+  /**
+   * writes what the socket takes and watches for writable if some is left
+   * @return false if the client should be closed
+   */
+  bool write_client(int fd, Client &client);
+  void close_client(int fd);
+
+  int epoll_fd;
+  int listen_fd = -1;
+  std::string path;
+  std::vector<std::string> protocols;
+  std::map<int, Client> clients;
+  OpenFn open_fn = [](int) {};
+  MessageFn message_fn = [](int, const std::string &) {};
+  CloseFn close_fn = [](int) {};
+};
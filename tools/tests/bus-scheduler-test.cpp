@@ -0,0 +1,303 @@
+// Runs BusScheduler on the board's end of a SimLink, with VDB::time_us()
+// reading the link's simulated clock, and checks when frames go out
+#include "check.hpp"
+#include "fake-clock.hpp"
+#include "sim-brain.hpp"
+#include "vdb/bus-scheduler.hpp"
+#include "vdb/registry-listener.hpp"
+#include "vdb/sim-link.hpp"
+#include "vdb/types.hpp"
+
+#include <memory>
+#include <mutex>
+
+using VDB::LinkModel;
+using VDB::SimLink;
+using VDP::BusScheduler;
+using VDP::BusStats;
+using VDP::Packet;
+
+namespace {
+constexpr uint32_t BAUD = 115200;
+constexpr uint32_t DEFAULT_WINDOW_US = 2000;
+constexpr uint32_t MAX_HOLD_US = 50000;
+
+/**
+ * a brain on one end of a link and a board sending through a BusScheduler
+ * on the other
+ */
+struct Bus {
+  SimLink link;
+  BusScheduler<std::mutex> bus;
+  // what the brain got, and when
+  std::vector<Packet> received;
+  std::vector<uint64_t> received_us;
+
+  explicit Bus(const LinkModel &model)
+      : link(model),
+        bus(&link.board(), model.baud, DEFAULT_WINDOW_US, MAX_HOLD_US) {
+    test::set_clock([this]() { return link.now_us(); });
+    link.brain().register_timed_receive_callback(
+        [this](const Packet &pac, uint64_t rx_time_us) {
+          received.push_back(pac);
+          received_us.push_back(rx_time_us);
+        });
+  }
+
+  /**
+   * the brain opens a window, the default length if window_us is 0
+   */
+  void request(uint32_t window_us = 0) {
+    Packet pac;
+    VDP::PacketWriter writer{pac};
+    if (window_us == 0) {
+      writer.write_request();
+    } else {
+      writer.write_request(window_us);
+    }
+    link.brain().send_packet(writer.get_packet());
+  }
+};
+
+/**
+ * a data-like packet of some size, with a checksum so it gets through
+ */
+Packet frame(size_t size, uint8_t fill, uint8_t header = 0) {
+  Packet pac;
+  VDP::PacketWriter writer{pac};
+  writer.write_byte(header);
+  for (size_t i = 1; i + 4 < size; i++) {
+    writer.write_byte(fill);
+  }
+  writer.write_number<uint32_t>(
+      CRC32::calculate(writer.get_packet().data(), writer.get_packet().size()));
+  return writer.get_packet();
+}
+
+LinkModel model() {
+  LinkModel m;
+  m.baud = BAUD;
+  return m;
+}
+
+/**
+ * nothing goes out until the brain asks, then it goes out right away
+ */
+void test_grant() {
+  Bus b{model()};
+  CHECK(b.bus.send_packet(frame(20, 1)));
+  b.link.run_until(10000);
+  CHECK(b.received.empty());
+
+  b.request();
+  b.link.run_until(20000);
+  CHECK(b.received.size() == 1);
+  const BusStats stats = b.bus.get_stats();
+  CHECK(stats.grants == 1);
+  CHECK(stats.scheduled == 1);
+  CHECK(stats.unscheduled == 0);
+  CHECK(stats.deferred == 0);
+  CHECK(stats.turnaround.count == 1);
+  // queued at 0, sent as soon as the request finished arriving
+  CHECK(stats.queue_wait.count == 1);
+  CHECK(stats.queue_wait.max_us >= 10000);
+}
+
+/**
+ * a reply sent from the receive callback goes out in the window the request
+ * just opened, with no wait
+ */
+void test_reply_in_window() {
+  Bus b{model()};
+  b.bus.register_timed_receive_callback([&](const Packet &pac, uint64_t) {
+    const VDP::PacketHeader header = VDP::decode_header_byte(pac[0]);
+    if (header.func == VDP::PacketFunction::Request) {
+      b.bus.send_packet(frame(20, 2));
+    }
+  });
+  b.request();
+  b.link.run_until(10000);
+  CHECK(b.received.size() == 1);
+  const BusStats stats = b.bus.get_stats();
+  CHECK(stats.scheduled == 1);
+  CHECK(stats.turnaround.count == 1);
+  CHECK(stats.turnaround.max_us == 0);
+}
+
+/**
+ * a frame too long for the window waits for one it fits in
+ */
+void test_deferred() {
+  Bus b{model()};
+  // about 18ms on the wire, the default window is 2ms
+  CHECK(b.bus.send_packet(frame(200, 3)));
+  b.request();
+  b.link.run_until(10000);
+  CHECK(b.received.empty());
+  BusStats stats = b.bus.get_stats();
+  CHECK(stats.grants == 1);
+  CHECK(stats.deferred == 1);
+  CHECK(stats.scheduled == 0);
+
+  b.request(30000);
+  b.link.run_until(40000);
+  CHECK(b.received.size() == 1);
+  stats = b.bus.get_stats();
+  CHECK(stats.grants == 2);
+  // counted once however many windows it misses
+  CHECK(stats.deferred == 1);
+  CHECK(stats.scheduled == 1);
+}
+
+/**
+ * whole packets go ahead of queued fragments
+ */
+void test_fragments_last() {
+  Bus b{model()};
+  CHECK(b.bus.send_packet(frame(20, 4, VDP::PacketFlags::Fragment)));
+  CHECK(b.bus.send_packet(frame(20, 5)));
+  b.request(10000);
+  b.link.run_until(20000);
+  CHECK(b.received.size() == 2);
+  if (b.received.size() == 2) {
+    CHECK(b.received[0][1] == 5);
+    CHECK(b.received[1][1] == 4);
+  }
+}
+
+/**
+ * a brain that never asks doesn't hold frames forever
+ */
+void test_overdue() {
+  Bus b{model()};
+  CHECK(b.bus.send_packet(frame(20, 6)));
+  b.link.run_until(MAX_HOLD_US - 1);
+  b.bus.poll();
+  b.link.run_until(MAX_HOLD_US + 5000);
+  CHECK(b.received.empty());
+
+  b.bus.poll();
+  b.link.run_until(MAX_HOLD_US + 10000);
+  CHECK(b.received.size() == 1);
+  const BusStats stats = b.bus.get_stats();
+  CHECK(stats.unscheduled == 1);
+  CHECK(stats.scheduled == 0);
+  CHECK(stats.grants == 0);
+}
+
+/**
+ * frames beyond MAX_QUEUED are turned away
+ */
+void test_queue_full() {
+  Bus b{model()};
+  for (size_t i = 0; i < BusScheduler<std::mutex>::MAX_QUEUED; i++) {
+    CHECK(b.bus.send_packet(frame(20, 7)));
+  }
+  CHECK(!b.bus.send_packet(frame(20, 7)));
+  CHECK(b.bus.get_stats().queue_full == 1);
+}
+
+/**
+ * a frame from the brain that finishes while an overdue frame of ours is
+ * still going out counts as a collision. The link is full duplex so the
+ * brain's frame survives to be counted
+ */
+void test_collision() {
+  LinkModel m = model();
+  m.half_duplex = false;
+  Bus b{m};
+  // about 18ms on the wire
+  CHECK(b.bus.send_packet(frame(200, 8)));
+  b.link.run_until(MAX_HOLD_US);
+  b.bus.poll();
+  b.link.run_until(MAX_HOLD_US + 1000);
+  // a short frame sent well inside ours
+  b.request();
+  b.link.run_until(MAX_HOLD_US + 40000);
+  CHECK(b.received.size() == 1);
+  BusStats stats = b.bus.get_stats();
+  CHECK(stats.unscheduled == 1);
+  CHECK(stats.collisions == 1);
+  CHECK(stats.grants == 1);
+
+  // once ours is done, the brain's frames don't collide
+  b.request();
+  b.link.run_until(MAX_HOLD_US + 60000);
+  stats = b.bus.get_stats();
+  CHECK(stats.collisions == 1);
+  CHECK(stats.grants == 2);
+}
+
+/**
+ * on a half-duplex link the same overlap garbles both frames, the link sees
+ * it even though the scheduler never gets the brain's frame
+ */
+void test_half_duplex_collision() {
+  Bus b{model()};
+  CHECK(b.bus.send_packet(frame(200, 9)));
+  b.link.run_until(MAX_HOLD_US);
+  b.bus.poll();
+  b.link.run_until(MAX_HOLD_US + 1000);
+  b.request();
+  b.link.run_until(MAX_HOLD_US + 40000);
+  CHECK(b.link.num_collisions == 2);
+  CHECK(b.received.empty());
+  CHECK(b.bus.get_stats().grants == 0);
+}
+/**
+ * with the board's listener behind the scheduler, acks and pongs go out in
+ * the window the broadcast or ping opened instead of waiting out
+ * max_hold_us
+ */
+void test_listener_replies() {
+  SimLink link{model()};
+  test::set_clock([&link]() { return link.now_us(); });
+  BusScheduler<std::mutex> bus{&link.board(), BAUD, DEFAULT_WINDOW_US,
+                               MAX_HOLD_US};
+  VDP::RegistryListener<std::mutex> reg{&bus};
+  reg.install_broadcast_callback([](const VDP::Channel &) {});
+  SimBrain brain{&link.brain()};
+
+  // the longest the answer could take: the request and answer on the wire
+  // and nothing held
+  constexpr uint64_t MAX_REPLY_US = 5000;
+  for (VDP::ChannelID id = 0; id < 3; id++) {
+    const uint64_t sent_us = link.now_us();
+    CHECK(brain.broadcast(
+        id, std::make_shared<VDP::Float>("x", []() { return 1.5f; })));
+    while (brain.acked.size() < (size_t)id + 1 && link.step()) {
+    }
+    CHECK(brain.acked.size() == (size_t)id + 1);
+    CHECK(link.now_us() - sent_us < MAX_REPLY_US);
+  }
+
+  const uint64_t ping_us = link.now_us();
+  CHECK(brain.ping(1234));
+  while (brain.num_pongs == 0 && link.step()) {
+  }
+  CHECK(brain.num_pongs == 1);
+  CHECK(link.now_us() - ping_us < MAX_REPLY_US);
+
+  const BusStats stats = bus.get_stats();
+  CHECK(stats.grants == 4);
+  CHECK(stats.scheduled == 4);
+  CHECK(stats.unscheduled == 0);
+  CHECK(stats.deferred == 0);
+  CHECK(stats.turnaround.count == 4);
+  CHECK(stats.turnaround.max_us == 0);
+  CHECK(link.num_collisions == 0);
+}
+} // namespace
+
+int main() {
+  test_grant();
+  test_reply_in_window();
+  test_deferred();
+  test_fragments_last();
+  test_overdue();
+  test_queue_full();
+  test_collision();
+  test_half_duplex_collision();
+  test_listener_replies();
+  return test_result();
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <cstdio>
+
+/**
+ * The tests are plain programs, each CHECK that fails prints where and the
+ * program exits non-zero from test_result() so ctest sees it
+ */
+inline int &test_failures() {
+  static int failures = 0;
+  return failures;
+}
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);          \
+      test_failures()++;                                                       \
+    }                                                                          \
+  } while (0)
+
+/**
+ * @return what main should return
+ */
+inline int test_result() {
+  if (test_failures() != 0) {
+    printf("%d checks failed\n", test_failures());
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
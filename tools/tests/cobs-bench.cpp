@@ -0,0 +1,142 @@
+// Times the COBS encoders and decoders against byte at a time versions over
+// a few packet size and zero density mixes. Not run by ctest:
+//   ./cobs-bench
+#include "cobs-scalar.hpp"
+#include "vdb/cobs.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+
+using VDB::WirePacket;
+using VDP::Packet;
+
+namespace {
+// the kind of traffic a mix of packets stands for
+struct Mix {
+  const char *name;
+  size_t min_size;
+  size_t max_size;
+  // one byte in this many is zero, 0 for none
+  uint32_t zero_every;
+};
+
+const Mix mixes[] = {
+    {"telemetry 8-64B, 1/4 zero", 8, 64, 4},
+    {"mixed 8-512B, 1/16 zero", 8, 512, 16},
+    {"bulk 1-2KB, 1/1000 zero", 1024, 2048, 1000},
+    {"bulk 2KB, no zeros", 2048, 2048, 0},
+};
+
+// packets per mix, and how many passes over them each timing takes
+constexpr size_t NUM_PACKETS = 512;
+constexpr double MIN_SECONDS = 0.2;
+
+/**
+ * runs pass over and over for at least MIN_SECONDS
+ * @return megabytes of packet per second
+ */
+double throughput(size_t bytes_per_pass, const std::function<void()> &pass) {
+  using clock = std::chrono::steady_clock;
+  const clock::time_point start = clock::now();
+  size_t passes = 0;
+  double seconds = 0;
+  do {
+    pass();
+    passes++;
+    seconds = std::chrono::duration<double>(clock::now() - start).count();
+  } while (seconds < MIN_SECONDS);
+  return (double)(bytes_per_pass * passes) / seconds / 1e6;
+}
+} // namespace
+
+int main() {
+  std::mt19937 rng(1);
+#if defined(__AVX2__)
+  printf("find_zero: AVX2\n");
+#elif defined(__SSE2__)
+  printf("find_zero: SSE2\n");
+#else
+  printf("find_zero: word at a time\n");
+#endif
+  printf("%-28s %10s %10s %10s %10s %10s %10s\n", "MB/s", "enc byte",
+         "enc", "enc frame", "dec byte", "dec", "dec frame");
+
+  for (const Mix &mix : mixes) {
+    std::vector<Packet> packets(NUM_PACKETS);
+    std::vector<WirePacket> frames(NUM_PACKETS);
+    size_t total = 0;
+    for (size_t i = 0; i < NUM_PACKETS; i++) {
+      const size_t size =
+          mix.min_size + rng() % (mix.max_size - mix.min_size + 1);
+      packets[i].resize(size);
+      for (uint8_t &b : packets[i]) {
+        const bool zero = mix.zero_every != 0 && rng() % mix.zero_every == 0;
+        b = zero ? 0 : (uint8_t)(1 + rng() % 255);
+      }
+      VDB::CobsEncode(packets[i], frames[i]);
+      // the decoders start after the leading delimiter
+      frames[i].erase(frames[i].begin());
+      total += size;
+    }
+
+    WirePacket encoded;
+    encoded.reserve(4096);
+    Packet decoded;
+    decoded.reserve(4096);
+    // keeps the compiler from dropping work whose result isn't used
+    size_t sink = 0;
+
+    const double enc_byte = throughput(total, [&]() {
+      for (const Packet &pac : packets) {
+        scalar_encode(pac, encoded);
+        sink += encoded.size();
+      }
+    });
+    const double enc = throughput(total, [&]() {
+      for (const Packet &pac : packets) {
+        VDB::CobsEncode(pac, encoded);
+        sink += encoded.size();
+      }
+    });
+    VDB::CobsFrameEncoder encoder;
+    const double enc_frame = throughput(total, [&]() {
+      for (const Packet &pac : packets) {
+        const VDP::PacketSpan span{pac.data(), pac.size()};
+        encoder.encode(&span, 1, [&](const uint8_t *, size_t size) {
+          sink += size;
+          return true;
+        });
+      }
+    });
+    const double dec_byte = throughput(total, [&]() {
+      for (const WirePacket &frame : frames) {
+        scalar_decode(frame, decoded);
+        sink += decoded.size();
+      }
+    });
+    const double dec = throughput(total, [&]() {
+      for (const WirePacket &frame : frames) {
+        VDB::CobsDecode(frame, decoded);
+        sink += decoded.size();
+      }
+    });
+    VDB::CobsFrameDecoder decoder(4096);
+    decoder.set_check_crc(false);
+    const double dec_frame = throughput(total, [&]() {
+      for (const WirePacket &frame : frames) {
+        size_t consumed = 0;
+        decoder.decode(frame.data(), frame.size(), decoded, consumed);
+        sink += decoded.size();
+      }
+    });
+
+    printf("%-28s %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f\n", mix.name,
+           enc_byte, enc, enc_frame, dec_byte, dec, dec_frame);
+    if (sink == 0) {
+      printf("\n");
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "vdb/cobs.hpp"
+
+/**
+ * COBS one byte at a time, the way it is usually written, for checking and
+ * timing the versions in cobs.cpp against. Frames are laid out the same way:
+ * a delimiter on both ends, and no empty block after a full one at the end
+ */
+
+/**
+ * @return the index of the first zero in buf, or size if there isn't one
+ */
+inline size_t scalar_find_zero(const uint8_t *buf, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    if (buf[i] == 0) {
+      return i;
+    }
+  }
+  return size;
+}
+
+/**
+ * like VDB::CobsEncode
+ */
+inline void scalar_encode(const VDP::Packet &in, VDB::WirePacket &out) {
+  out.clear();
+  if (in.empty()) {
+    return;
+  }
+  out.push_back(0);
+  size_t code_head = out.size();
+  out.push_back(0);
+  uint8_t code = 1;
+  for (size_t i = 0; i < in.size(); i++) {
+    if (in[i] == 0) {
+      out[code_head] = code;
+      code_head = out.size();
+      out.push_back(0);
+      code = 1;
+      continue;
+    }
+    out.push_back(in[i]);
+    code++;
+    if (code == 0xff && i + 1 < in.size()) {
+      out[code_head] = code;
+      code_head = out.size();
+      out.push_back(0);
+      code = 1;
+    }
+  }
+  out[code_head] = code;
+  out.push_back(0);
+}
+
+/**
+ * like VDB::CobsDecode, a block cut short by the delimiter keeps what
+ * arrived of it
+ */
+inline void scalar_decode(const VDB::WirePacket &in, VDP::Packet &out) {
+  out.clear();
+  size_t i = 0;
+  while (i < in.size() && in[i] != 0) {
+    const uint8_t code = in[i];
+    i++;
+    for (uint8_t k = 1; k < code && i < in.size() && in[i] != 0; k++) {
+      out.push_back(in[i]);
+      i++;
+    }
+    // every block but a full one stands for a zero, unless it's the last
+    if (code != 0xff && i < in.size() && in[i] != 0) {
+      out.push_back(0);
+    }
+  }
+}
@@ -0,0 +1,161 @@
+// Fuzzes the COBS encoders and decoders and find_zero against byte at a
+// time versions. Built once per zero search find_zero can use, see
+// CMakeLists.txt
+#include "check.hpp"
+#include "cobs-scalar.hpp"
+#include "vdb/cobs.hpp"
+
+#include <algorithm>
+#include <random>
+
+using VDB::WirePacket;
+using VDP::Packet;
+
+namespace {
+/**
+ * fills a packet with bytes that are zero one time in zero_every, or never
+ * if zero_every is 0
+ */
+Packet random_packet(std::mt19937 &rng, size_t size, uint32_t zero_every) {
+  Packet pac(size);
+  for (uint8_t &b : pac) {
+    if (zero_every != 0 && rng() % zero_every == 0) {
+      b = 0;
+    } else {
+      b = (uint8_t)(1 + rng() % 255);
+    }
+  }
+  return pac;
+}
+
+/**
+ * find_zero on every start offset and length of buf, so the vector and word
+ * paths see every alignment and every way of having bytes left over
+ */
+void check_find_zero(const Packet &buf) {
+  for (size_t start = 0; start < std::min<size_t>(buf.size(), 40); start++) {
+    for (size_t size = 0; start + size <= buf.size();
+         size += (size < 80 ? 1 : 37)) {
+      CHECK(VDB::find_zero(buf.data() + start, size) ==
+            scalar_find_zero(buf.data() + start, size));
+    }
+  }
+}
+
+/**
+ * encodes pac every way there is and checks it all matches the byte at a
+ * time version and decodes back to pac
+ */
+void check_round_trip(std::mt19937 &rng, const Packet &pac) {
+  WirePacket expected;
+  scalar_encode(pac, expected);
+
+  WirePacket encoded;
+  VDB::CobsEncode(pac, encoded);
+  CHECK(encoded == expected);
+  if (pac.empty()) {
+    return;
+  }
+  CHECK(VDB::find_zero(encoded.data() + 1, encoded.size() - 1) ==
+        encoded.size() - 2);
+
+  // the streaming encoder, with the packet cut into random pieces
+  std::vector<VDP::PacketSpan> spans;
+  for (size_t at = 0; at < pac.size();) {
+    const size_t size = std::min<size_t>(1 + rng() % 300, pac.size() - at);
+    spans.push_back(VDP::PacketSpan{pac.data() + at, size});
+    at += size;
+  }
+  WirePacket streamed;
+  VDB::CobsFrameEncoder encoder;
+  CHECK(encoder.encode(spans.data(), spans.size(),
+                       [&](const uint8_t *data, size_t size) {
+                         streamed.insert(streamed.end(), data, data + size);
+                         return true;
+                       }));
+  CHECK(streamed == expected);
+  CHECK(streamed.size() <= VDB::CobsFrameEncoder::max_encoded_size(pac.size()));
+
+  // both decoders start after the leading delimiter
+  const WirePacket body(expected.begin() + 1, expected.end());
+  Packet decoded;
+  VDB::CobsDecode(body, decoded);
+  CHECK(decoded == pac);
+
+  // the streaming decoder, fed the frame in random chunks
+  VDB::CobsFrameDecoder decoder(pac.size());
+  decoder.set_check_crc(false);
+  Packet out;
+  VDB::CobsFrameDecoder::Result result =
+      VDB::CobsFrameDecoder::Result::Incomplete;
+  for (size_t at = 0; at < expected.size();) {
+    const size_t size = std::min<size_t>(1 + rng() % 64, expected.size() - at);
+    size_t consumed = 0;
+    result = decoder.decode(expected.data() + at, size, out, consumed);
+    at += consumed;
+    if (result != VDB::CobsFrameDecoder::Result::Incomplete) {
+      CHECK(at == expected.size());
+      break;
+    }
+  }
+  // anything shorter is TooSmall, which still decodes it
+  if (pac.size() >= 5) {
+    CHECK(result == VDB::CobsFrameDecoder::Result::Ok);
+  }
+  CHECK(out == pac);
+}
+
+/**
+ * decodes bytes that weren't made by the encoder, blocks that run into the
+ * delimiter included
+ */
+void check_garbage(std::mt19937 &rng, size_t size) {
+  WirePacket body = random_packet(rng, size, 0);
+  body.push_back(0);
+  Packet expected;
+  scalar_decode(body, expected);
+  Packet decoded;
+  VDB::CobsDecode(body, decoded);
+  CHECK(decoded == expected);
+}
+} // namespace
+
+int main() {
+  std::mt19937 rng(1);
+
+  // sizes around the edges of the 16 and 32 byte vectors, the 254 byte
+  // blocks and the staging buffer in CobsFrameEncoder
+  std::vector<size_t> sizes;
+  for (size_t size = 0; size <= 600; size++) {
+    sizes.push_back(size);
+  }
+  for (size_t size : {762, 763, 1016, 1017, 1500, 2048, 4096}) {
+    sizes.push_back(size);
+  }
+
+  for (size_t size : sizes) {
+    // all zeros, no zeros, and zeros at a few densities
+    check_round_trip(rng, Packet(size, 0));
+    check_round_trip(rng, random_packet(rng, size, 0));
+    for (uint32_t zero_every : {2, 8, 64, 1000}) {
+      check_round_trip(rng, random_packet(rng, size, zero_every));
+    }
+    check_garbage(rng, size);
+  }
+
+  for (uint32_t zero_every : {0, 1, 3, 17, 100}) {
+    check_find_zero(random_packet(rng, 400, zero_every));
+  }
+  // one zero, everywhere it could be
+  for (size_t at = 0; at < 100; at++) {
+    Packet buf = random_packet(rng, 100, 0);
+    buf[at] = 0;
+    check_find_zero(buf);
+  }
+
+  for (int i = 0; i < 2000; i++) {
+    const size_t size = rng() % 3000;
+    check_round_trip(rng, random_packet(rng, size, 1 + rng() % 300));
+  }
+  return test_result();
+}
@@ -0,0 +1,153 @@
+// Checks that fixed decimals come out the same whichever way a data message
+// is written: from a template, the slow way when the template doesn't fit,
+// and as CBOR, and that a client's decimals message reaches all of them
+#include "channel-pipeline.hpp"
+#include "check.hpp"
+#include "data-template.hpp"
+#include "message-format.hpp"
+#include "vdb/types.hpp"
+
+#include <cstring>
+#include <memory>
+#include <string>
+
+using VDP::PartPtr;
+
+namespace {
+/**
+ * a record with a float, a double and a nested float
+ */
+PartPtr odometry() {
+  return std::make_shared<VDP::Record>(
+      "odometry",
+      std::vector<PartPtr>{
+          std::make_shared<VDP::Float>("x", []() { return 12.345f; }),
+          std::make_shared<VDP::Double>("y", []() { return 2.675; }),
+          std::make_shared<VDP::Record>(
+              "pose", std::vector<PartPtr>{std::make_shared<VDP::Float>(
+                          "theta", []() { return 1.5707964f; })}),
+      });
+}
+
+VDP::Channel fetched(PartPtr part) {
+  VDP::Channel channel{part};
+  channel.data->fetch();
+  channel.info.time_us = 1000;
+  channel.info.rx_time_us = 2000;
+  return channel;
+}
+
+/**
+ * @return the doubles in a CBOR message, in order
+ */
+std::vector<double> cbor_doubles(const std::string &cbor) {
+  std::vector<double> out;
+  for (size_t i = 0; i + 8 < cbor.size(); i++) {
+    if ((uint8_t)cbor[i] != 0xfb) {
+      continue;
+    }
+    uint64_t bits = 0;
+    for (int b = 0; b < 8; b++) {
+      bits = (bits << 8) | (uint8_t)cbor[i + 1 + b];
+    }
+    double num;
+    memcpy(&num, &bits, sizeof(num));
+    out.push_back(num);
+    i += 8;
+  }
+  return out;
+}
+
+/**
+ * the template, the slow way and CBOR all round the same fields
+ */
+void test_every_path() {
+  const VDP::Channel channel = fetched(odometry());
+  DataTemplates templates;
+  templates.set_decimals("odometry.x", 2);
+  templates.set_decimals("odometry.y", 2);
+  templates.set_decimals("odometry.pose.theta", 3);
+  templates.set(channel);
+
+  const std::string expected =
+      R"({"type":"data","channel_id":0,"rec_time":1000,"rx_time":2000,)"
+      R"("data":{"odometry":{"x":12.35,"y":2.67,"pose":{"theta":1.571}}}})";
+  std::string out;
+  templates.write(channel, DataFormat::Json, DataEncoding::Json, out);
+  CHECK(out == expected);
+  templates.write(channel, DataFormat::Compact, DataEncoding::Json, out);
+  CHECK(out == R"({"c":0,"t":1000,"v":[12.35,2.67,1.571]})");
+  CHECK(templates.num_fallbacks == 0);
+
+  // a packet with more fields doesn't fit, so it is written the slow way
+  VDP::Channel bigger = fetched(std::make_shared<VDP::Record>(
+      "odometry",
+      std::vector<PartPtr>{
+          std::make_shared<VDP::Float>("x", []() { return 12.345f; }),
+          std::make_shared<VDP::Double>("y", []() { return 2.675; }),
+          std::make_shared<VDP::Float>("z", []() { return 0.125f; }),
+          std::make_shared<VDP::Float>("w", []() { return 0.5f; }),
+      }));
+  templates.write(bigger, DataFormat::Json, DataEncoding::Json, out);
+  CHECK(templates.num_fallbacks == 1);
+  CHECK(out.find(R"("x":12.35,"y":2.67,"z":0.125,"w":0.5)") !=
+        std::string::npos);
+  templates.write(bigger, DataFormat::Compact, DataEncoding::Json, out);
+  CHECK(templates.num_fallbacks == 2);
+  CHECK(out == R"({"c":0,"t":1000,"v":[12.35,2.67,0.125,0.5]})");
+
+  // CBOR has no templates, the rounded values go out as the doubles a JSON
+  // reader would get
+  templates.write(channel, DataFormat::Compact, DataEncoding::Cbor, out);
+  CHECK(cbor_doubles(out) == (std::vector<double>{12.35, 2.67, 1.571}));
+  templates.write(channel, DataFormat::Json, DataEncoding::Cbor, out);
+  CHECK(cbor_doubles(out) == (std::vector<double>{12.35, 2.67, 1.571}));
+
+  // without decimals nothing changes
+  std::string plain;
+  write_data_msg(channel, plain);
+  CHECK(plain.find(R"("x":12.345,"y":2.675)") != std::string::npos);
+  write_cbor_data_msg(channel, DataFormat::Compact, plain);
+  CHECK(cbor_doubles(plain) == (std::vector<double>{2.675}));
+}
+
+/**
+ * a decimals message applies to channels already broadcast, from the next
+ * data packet on
+ */
+void test_message() {
+  std::vector<std::string> sent;
+  ChannelPipeline pipeline{
+      [](const ChannelPipeline::Message &, DataEncoding) {},
+      [&sent](int, const ChannelPipeline::Message &msg, int) {
+        sent.push_back(*msg);
+      }};
+  const VDP::Channel channel = fetched(odometry());
+  pipeline.on_broadcast(channel, VDP::BroadcastChange::Added);
+  pipeline.subscriptions.add_client(
+      1, ChannelPipeline::group_for(DataFormat::Compact, DataEncoding::Json));
+
+  CHECK(!pipeline.handle_message(R"({"type":"subscribe","names":["*"]})"));
+  CHECK(pipeline.on_data(channel));
+  CHECK(pipeline.handle_message(
+      R"({"type":"decimals","fields":{"odometry.x":1,"odometry.y":0}})"));
+  CHECK(pipeline.on_data(channel));
+  CHECK(pipeline.handle_message(
+      R"({"type":"decimals","fields":{"odometry.x":-1}})"));
+  CHECK(pipeline.on_data(channel));
+
+  CHECK(sent.size() == 3);
+  if (sent.size() == 3) {
+    CHECK(sent[0] == R"({"c":0,"t":1000,"v":[12.345,2.675,1.5707964]})");
+    CHECK(sent[1] == R"({"c":0,"t":1000,"v":[12.3,3,1.5707964]})");
+    CHECK(sent[2] == R"({"c":0,"t":1000,"v":[12.345,3,1.5707964]})");
+  }
+  CHECK(pipeline.templates.num_fallbacks == 0);
+}
+} // namespace
+
+int main() {
+  test_every_path();
+  test_message();
+  return test_result();
+}
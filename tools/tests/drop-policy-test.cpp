@@ -0,0 +1,188 @@
+// Checks which frame each drop policy gives up when the board's receive
+// buffers run out, over queues built by hand
+#include "check.hpp"
+#include "vdb/drop-policy.hpp"
+
+#include <deque>
+#include <vector>
+
+using VDB::DropChoice;
+using VDB::DropPolicy;
+using VDB::InboundFrame;
+using VDP::ChannelID;
+using VDP::Packet;
+
+namespace {
+/**
+ * frames waiting for the packet handler, oldest first
+ */
+struct Queue {
+  // deque so the packets stay put as more are added
+  std::deque<Packet> packets;
+  std::vector<InboundFrame> frames;
+
+  void add(Packet pac) {
+    packets.push_back(std::move(pac));
+    frames.push_back(InboundFrame{&packets.back(), 0});
+  }
+  DropChoice choose(DropPolicy policy, bool data, ChannelID new_id) const {
+    return VDB::choose_drop(policy, frames.data(), frames.size(), data,
+                            new_id);
+  }
+};
+
+/**
+ * a data packet for a channel, with a varint id so ids past MAX_CHANNELS can
+ * be written
+ */
+Packet data(ChannelID id) {
+  Packet pac;
+  VDP::PacketWriter writer{pac};
+  writer.set_varint_channel_ids(true);
+  writer.write_number<uint8_t>(VDP::make_header_byte(
+      VDP::PacketHeader{VDP::PacketType::Data, VDP::PacketFunction::Send,
+                        VDP::PacketFlags::VarintChannelID}));
+  writer.write_channel_id(id);
+  writer.write_number<float>(1.0f);
+  return pac;
+}
+Packet control(VDP::PacketType type, VDP::PacketFunction func) {
+  Packet pac;
+  VDP::PacketWriter writer{pac};
+  writer.write_number<uint8_t>(
+      VDP::make_header_byte(VDP::PacketHeader{type, func, 0}));
+  writer.write_number<uint32_t>(0);
+  return pac;
+}
+Packet broadcast() {
+  return control(VDP::PacketType::Broadcast, VDP::PacketFunction::Send);
+}
+Packet ping() {
+  return control(VDP::PacketType::Data, VDP::PacketFunction::Request);
+}
+
+bool same(const DropChoice &a, const DropChoice &b) {
+  return a.victim == b.victim && a.data == b.data &&
+         a.superseded == b.superseded;
+}
+
+/**
+ * only data sent to the board counts as channel data
+ */
+void test_data_channel() {
+  ChannelID id = 0;
+  CHECK(VDB::get_data_channel(data(7), id));
+  CHECK(id == 7);
+  CHECK(VDB::get_data_channel(data(5000), id));
+  CHECK(id == VDP::INVALID_CHANNEL_ID);
+  CHECK(!VDB::get_data_channel(broadcast(), id));
+  CHECK(!VDB::get_data_channel(ping(), id));
+}
+
+/**
+ * under LatestPerChannel data leaves the last CONTROL_RESERVE buffers to
+ * broadcasts, pings and requests. The other policies let anything take them
+ */
+void test_control_reserve() {
+  const size_t reserve = VDB::CONTROL_RESERVE;
+  CHECK(VDB::may_take_buffer(DropPolicy::LatestPerChannel, true, reserve + 1));
+  CHECK(!VDB::may_take_buffer(DropPolicy::LatestPerChannel, true, reserve));
+  CHECK(!VDB::may_take_buffer(DropPolicy::LatestPerChannel, true, 0));
+  CHECK(VDB::may_take_buffer(DropPolicy::LatestPerChannel, false, reserve));
+  CHECK(VDB::may_take_buffer(DropPolicy::LatestPerChannel, false, 1));
+  CHECK(VDB::may_take_buffer(DropPolicy::DropNewest, true, 1));
+  CHECK(VDB::may_take_buffer(DropPolicy::DropOldest, true, 1));
+}
+
+/**
+ * DropNewest never touches the queue
+ */
+void test_drop_newest() {
+  Queue q;
+  q.add(data(1));
+  q.add(broadcast());
+  CHECK(same(q.choose(DropPolicy::DropNewest, true, 1), {2, true, false}));
+  CHECK(same(q.choose(DropPolicy::DropNewest, false, VDP::INVALID_CHANNEL_ID),
+             {2, false, false}));
+}
+
+/**
+ * DropOldest gives up the front of the queue, whatever it is
+ */
+void test_drop_oldest() {
+  Queue q;
+  CHECK(same(q.choose(DropPolicy::DropOldest, true, 1), {0, true, false}));
+  q.add(broadcast());
+  q.add(data(1));
+  CHECK(same(q.choose(DropPolicy::DropOldest, true, 1), {0, false, false}));
+  Queue d;
+  d.add(data(2));
+  d.add(data(1));
+  CHECK(same(d.choose(DropPolicy::DropOldest, false, VDP::INVALID_CHANNEL_ID),
+             {0, true, false}));
+}
+
+/**
+ * LatestPerChannel replaces an older frame of the same channel, falls back to
+ * the oldest data, drops garbage first, and never drops control frames
+ */
+void test_latest_per_channel() {
+  Queue q;
+  q.add(broadcast());
+  q.add(data(1));
+  q.add(data(2));
+  q.add(ping());
+  q.add(data(2));
+  // the first frame of the same channel
+  CHECK(same(q.choose(DropPolicy::LatestPerChannel, true, 2), {2, true, true}));
+  // no frame of its own, the oldest data
+  CHECK(same(q.choose(DropPolicy::LatestPerChannel, true, 3),
+             {1, true, false}));
+  // a control frame pushes out the oldest data too
+  CHECK(same(q.choose(DropPolicy::LatestPerChannel, false,
+                      VDP::INVALID_CHANNEL_ID),
+             {1, true, false}));
+  // and doesn't count as any channel's newer frame
+  Queue zero;
+  zero.add(data(1));
+  zero.add(data(0));
+  CHECK(same(zero.choose(DropPolicy::LatestPerChannel, false,
+                         VDP::INVALID_CHANNEL_ID),
+             {0, true, false}));
+  // a frame the listener can't use never pushes anything out
+  CHECK(same(q.choose(DropPolicy::LatestPerChannel, true,
+                      VDP::INVALID_CHANNEL_ID),
+             {5, true, false}));
+
+  // garbage goes before any data the listener could use after it, even a
+  // frame of the same channel
+  Queue g;
+  g.add(data(1));
+  g.add(data(5000));
+  g.add(data(2));
+  CHECK(same(g.choose(DropPolicy::LatestPerChannel, true, 2),
+             {1, true, false}));
+
+  // with only control frames waiting there's nothing it will drop
+  Queue c;
+  c.add(broadcast());
+  c.add(ping());
+  CHECK(same(c.choose(DropPolicy::LatestPerChannel, true, 1),
+             {2, true, false}));
+  CHECK(same(c.choose(DropPolicy::LatestPerChannel, false,
+                      VDP::INVALID_CHANNEL_ID),
+             {2, false, false}));
+  Queue empty;
+  CHECK(same(empty.choose(DropPolicy::LatestPerChannel, true, 1),
+             {0, true, false}));
+}
+} // namespace
+
+int main() {
+  test_data_channel();
+  test_control_reserve();
+  test_drop_newest();
+  test_drop_oldest();
+  test_latest_per_channel();
+  return test_result();
+}
@@ -0,0 +1,13 @@
+#include "fake-clock.hpp"
+#include "vdb/protocol.hpp"
+
+static std::function<uint64_t()> clock_now = []() { return (uint64_t)0; };
+
+namespace test {
+void set_clock(std::function<uint64_t()> now) { clock_now = now; }
+} // namespace test
+
+namespace VDB {
+uint32_t time_ms() { return (uint32_t)(clock_now() / 1000); }
+uint64_t time_us() { return clock_now(); }
+} // namespace VDB
@@ -0,0 +1,12 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+
+namespace test {
+/**
+ * makes VDB::time_us() and VDB::time_ms() read from now, like a SimLink's
+ * now_us, so everything in a test runs on simulated time. They return 0
+ * until this is called
+ */
+void set_clock(std::function<uint64_t()> now);
+} // namespace test
@@ -0,0 +1,175 @@
+// Round trips packets through ReedSolomon with bad bytes in between: random
+// ones, bursts at every offset of the frame, and more than it can fix
+#include "check.hpp"
+#include "vdb/fec.hpp"
+
+#include <algorithm>
+#include <random>
+
+using VDB::ReedSolomon;
+using VDP::Packet;
+
+namespace {
+// parity per codeword and packet sizes, with one and several codewords and
+// packets that do and don't split evenly between them
+constexpr size_t PARITIES[] = {2, 8, 16};
+constexpr size_t SIZES[] = {1, 5, 100, 239, 240, 300, 301, 478, 479,
+                            717, 719, 1000, 1003};
+
+Packet random_packet(std::mt19937 &rng, size_t size) {
+  Packet pac(size);
+  for (uint8_t &b : pac) {
+    b = (uint8_t)rng();
+  }
+  return pac;
+}
+
+/**
+ * @return pac followed by its parity, worked out from pac in two pieces so
+ * protect has to carry a codeword across spans
+ */
+Packet protect(const ReedSolomon &rs, const Packet &pac) {
+  const size_t half = pac.size() / 2;
+  const VDP::PacketSpan spans[] = {{pac.data(), half},
+                                   {pac.data() + half, pac.size() - half}};
+  std::vector<uint8_t> parity;
+  rs.protect(spans, 2, parity);
+  CHECK(parity.size() == rs.overhead(pac.size()));
+  Packet frame = pac;
+  frame.insert(frame.end(), parity.begin(), parity.end());
+  return frame;
+}
+
+/**
+ * flips a byte to anything else
+ */
+void corrupt(std::mt19937 &rng, uint8_t &b) { b ^= (uint8_t)(1 + rng() % 255); }
+
+/**
+ * a clean frame comes back as the packet with nothing fixed
+ */
+void test_clean() {
+  std::mt19937 rng(1);
+  for (size_t parity : PARITIES) {
+    const ReedSolomon rs(parity);
+    for (size_t size : SIZES) {
+      const Packet pac = random_packet(rng, size);
+      Packet frame = protect(rs, pac);
+      CHECK(rs.repair(frame) == 0);
+      CHECK(frame == pac);
+    }
+  }
+  // off leaves frames alone
+  const ReedSolomon off(0);
+  CHECK(!off.enabled());
+  CHECK(off.overhead(100) == 0);
+}
+
+/**
+ * up to parity / 2 bad bytes in each codeword, anywhere in it, are fixed
+ */
+void test_random_errors() {
+  std::mt19937 rng(2);
+  for (size_t parity : PARITIES) {
+    const ReedSolomon rs(parity);
+    for (size_t size : SIZES) {
+      for (int round = 0; round < 50; round++) {
+        const Packet pac = random_packet(rng, size);
+        Packet frame = protect(rs, pac);
+        const size_t codewords = rs.overhead(size) / parity;
+        // the frame's bytes rotate through the codewords, so picking bytes
+        // at a stride of codewords keeps to one codeword
+        size_t bad = 0;
+        for (size_t j = 0; j < codewords; j++) {
+          std::vector<size_t> positions;
+          for (size_t i = j; i < frame.size(); i += codewords) {
+            positions.push_back(i);
+          }
+          std::shuffle(positions.begin(), positions.end(), rng);
+          const size_t count = rng() % (parity / 2 + 1);
+          for (size_t e = 0; e < count; e++) {
+            corrupt(rng, frame[positions[e]]);
+          }
+          bad += count;
+        }
+        CHECK(rs.repair(frame) == (int)bad);
+        CHECK(frame == pac);
+      }
+    }
+  }
+}
+
+/**
+ * a burst as long as all the codewords can fix together is fixed wherever it
+ * lands, including across the end of the packet into the parity
+ */
+void test_bursts() {
+  std::mt19937 rng(3);
+  for (size_t parity : PARITIES) {
+    const ReedSolomon rs(parity);
+    for (size_t size : SIZES) {
+      const Packet pac = random_packet(rng, size);
+      const Packet clean = protect(rs, pac);
+      const size_t burst = rs.overhead(size) / 2;
+      for (size_t start = 0; start + burst <= clean.size(); start++) {
+        Packet frame = clean;
+        for (size_t i = start; i < start + burst; i++) {
+          corrupt(rng, frame[i]);
+        }
+        CHECK(rs.repair(frame) == (int)burst);
+        CHECK(frame == pac);
+      }
+    }
+  }
+}
+
+/**
+ * one more bad byte than a codeword can fix is either caught, or comes back
+ * wrong for the frame checksum to catch. It's never passed off as the packet
+ */
+void test_too_many_errors() {
+  std::mt19937 rng(4);
+  for (size_t parity : PARITIES) {
+    const ReedSolomon rs(parity);
+    int caught = 0;
+    int rounds = 0;
+    for (size_t size : SIZES) {
+      for (int round = 0; round < 100; round++) {
+        const Packet pac = random_packet(rng, size);
+        Packet frame = protect(rs, pac);
+        const size_t codewords = rs.overhead(size) / parity;
+        const size_t j = rng() % codewords;
+        std::vector<size_t> positions;
+        for (size_t i = j; i < frame.size(); i += codewords) {
+          positions.push_back(i);
+        }
+        std::shuffle(positions.begin(), positions.end(), rng);
+        for (size_t e = 0; e < parity / 2 + 1; e++) {
+          corrupt(rng, frame[positions[e]]);
+        }
+        const int res = rs.repair(frame);
+        CHECK(res < 0 || frame != pac);
+        caught += res < 0;
+        rounds++;
+      }
+    }
+    // two parity bytes can't tell two bad bytes from one somewhere else, with
+    // more most are caught
+    if (parity > 2) {
+      CHECK(caught * 10 >= rounds * 9);
+    }
+  }
+  // too short to hold the parity at all
+  const ReedSolomon rs(16);
+  Packet short_frame(10, 0);
+  CHECK(rs.repair(short_frame) == -1);
+}
+} // namespace
+
+int main() {
+  test_clean();
+  test_random_errors();
+  test_bursts();
+  test_too_many_errors();
+  return test_result();
+}
@@ -0,0 +1,237 @@
+// Compiles records against the Foxglove well-known schema rules and checks
+// the messages FoxgloveMapping writes for them
+#include "cJSON.h"
+#include "check.hpp"
+#include "foxglove-mapping.hpp"
+#include "vdb/types.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <string>
+
+using VDP::PartPtr;
+
+namespace {
+constexpr double INCH = 0.0254;
+// 12.345678901s
+constexpr uint64_t TIMESTAMP_NS = 12345678901ULL;
+
+VDP::Channel channel_of(PartPtr part) {
+  VDP::Channel channel{part};
+  channel.data->fetch();
+  return channel;
+}
+PartPtr record(const std::string &name, std::vector<PartPtr> fields) {
+  return std::make_shared<VDP::Record>(name, fields);
+}
+PartPtr number(const std::string &name, const float &value) {
+  return std::make_shared<VDP::Float>(name, [&value]() { return value; });
+}
+PartPtr text(const std::string &name, const char *value) {
+  return std::make_shared<VDP::String>(
+      name, [value]() { return std::string(value); });
+}
+
+/**
+ * a parsed message, deleted when it goes out of scope
+ */
+struct Json {
+  cJSON *root;
+  explicit Json(const std::string &text) : root(cJSON_Parse(text.c_str())) {}
+  ~Json() { cJSON_Delete(root); }
+  /**
+   * @param path member names separated by dots
+   */
+  const cJSON *get(const char *path) const {
+    const cJSON *node = root;
+    std::string rest = path;
+    size_t start = 0;
+    while (node != nullptr) {
+      const size_t dot = rest.find('.', start);
+      node = cJSON_GetObjectItem(node, rest.substr(start, dot - start).c_str());
+      if (dot == std::string::npos) {
+        break;
+      }
+      start = dot + 1;
+    }
+    return node;
+  }
+  double num(const char *path) const {
+    const cJSON *node = get(path);
+    return cJSON_IsNumber(node) ? node->valuedouble : NAN;
+  }
+  std::string str(const char *path) const {
+    const cJSON *node = get(path);
+    return cJSON_IsString(node) ? node->valuestring : "";
+  }
+};
+
+bool near(double a, double b) { return std::fabs(a - b) < 1e-6; }
+
+/**
+ * an odometry record becomes a PoseInFrame in meters, with the heading as a
+ * quaternion about z
+ */
+void test_pose() {
+  float x = 10, y = -20, theta = 0;
+  const PartPtr part =
+      record("odometry", {number("x", x), number("y", y),
+                          number("theta", theta)});
+  FoxgloveMapping mapping;
+  CHECK(mapping.compile(channel_of(part)));
+  CHECK(strcmp(mapping.schema_name(), "foxglove.PoseInFrame") == 0);
+  Json schema{mapping.schema()};
+  CHECK(schema.str("type") == "object");
+  CHECK(schema.str("properties.pose.properties.position.properties.x.type") ==
+        "number");
+  CHECK(schema.str("properties.timestamp.properties.sec.type") == "integer");
+
+  std::string out;
+  CHECK(mapping.write(channel_of(part), TIMESTAMP_NS, out));
+  Json msg{out};
+  CHECK(msg.root != nullptr);
+  CHECK(msg.num("timestamp.sec") == 12);
+  CHECK(msg.num("timestamp.nsec") == 345678901);
+  CHECK(msg.str("frame_id") == "field");
+  CHECK(near(msg.num("pose.position.x"), 10 * INCH));
+  CHECK(near(msg.num("pose.position.y"), -20 * INCH));
+  // no z field, so the default
+  CHECK(msg.num("pose.position.z") == 0);
+  CHECK(msg.num("pose.orientation.x") == 0);
+  CHECK(msg.num("pose.orientation.y") == 0);
+  CHECK(near(msg.num("pose.orientation.z"), 0));
+  CHECK(near(msg.num("pose.orientation.w"), 1));
+
+  theta = 90;
+  CHECK(mapping.write(channel_of(part), TIMESTAMP_NS, out));
+  Json quarter{out};
+  CHECK(near(quarter.num("pose.orientation.z"), std::sqrt(0.5)));
+  CHECK(near(quarter.num("pose.orientation.w"), std::sqrt(0.5)));
+
+  theta = 180;
+  CHECK(mapping.write(channel_of(part), TIMESTAMP_NS, out));
+  Json half{out};
+  CHECK(near(half.num("pose.orientation.z"), 1));
+  CHECK(near(half.num("pose.orientation.w"), 0));
+}
+
+/**
+ * a record missing a required field, or not named like any rule, or not a
+ * record at all, doesn't map
+ */
+void test_rejected() {
+  float x = 1;
+  FoxgloveMapping mapping;
+  CHECK(!mapping.compile(channel_of(record("odometry", {number("x", x)}))));
+  CHECK(!mapping.compile(
+      channel_of(record("drive", {number("x", x), number("y", x)}))));
+  CHECK(!mapping.compile(channel_of(number("odometry", x))));
+  // a string can't fill a number
+  CHECK(!mapping.compile(
+      channel_of(record("pose", {number("x", x), text("y", "up")}))));
+  CHECK(!mapping.compile(channel_of(record("log", {number("level", x)}))));
+}
+
+/**
+ * a transform takes its child frame from a string field, or the default
+ * without one, and scales z too
+ */
+void test_transform() {
+  float x = 1, y = 2, z = 3, heading = 180;
+  const PartPtr part =
+      record("transform", {text("frame", "arm"), number("x", x),
+                           number("y", y), number("z", z),
+                           number("heading", heading)});
+  FoxgloveMapping mapping;
+  CHECK(mapping.compile(channel_of(part)));
+  CHECK(strcmp(mapping.schema_name(), "foxglove.FrameTransform") == 0);
+  std::string out;
+  CHECK(mapping.write(channel_of(part), TIMESTAMP_NS, out));
+  Json msg{out};
+  CHECK(msg.str("parent_frame_id") == "field");
+  CHECK(msg.str("child_frame_id") == "arm");
+  CHECK(near(msg.num("translation.x"), 1 * INCH));
+  CHECK(near(msg.num("translation.y"), 2 * INCH));
+  CHECK(near(msg.num("translation.z"), 3 * INCH));
+  CHECK(near(msg.num("rotation.z"), 1));
+  CHECK(near(msg.num("rotation.w"), 0));
+
+  const PartPtr plain = record("tf", {number("x", x), number("y", y)});
+  CHECK(mapping.compile(channel_of(plain)));
+  CHECK(mapping.write(channel_of(plain), TIMESTAMP_NS, out));
+  Json defaults{out};
+  CHECK(defaults.str("child_frame_id") == "robot");
+  CHECK(defaults.num("translation.z") == 0);
+  // no heading, so no rotation
+  CHECK(defaults.num("rotation.z") == 0);
+  CHECK(defaults.num("rotation.w") == 1);
+}
+
+/**
+ * a log record becomes a Log, with defaults for what it doesn't have and
+ * integer fields written as integers
+ */
+void test_log() {
+  float level = 4;
+  const PartPtr part =
+      record("log", {number("level", level), text("msg", "auton \"done\"")});
+  FoxgloveMapping mapping;
+  CHECK(mapping.compile(channel_of(part)));
+  CHECK(strcmp(mapping.schema_name(), "foxglove.Log") == 0);
+  std::string out;
+  CHECK(mapping.write(channel_of(part), TIMESTAMP_NS, out));
+  Json msg{out};
+  CHECK(msg.num("timestamp.sec") == 12);
+  CHECK(msg.num("timestamp.nsec") == 345678901);
+  CHECK(out.find(R"("level":4,)") != std::string::npos);
+  CHECK(msg.str("message") == "auton \"done\"");
+  CHECK(msg.str("name") == "brain");
+  CHECK(msg.str("file") == "");
+  CHECK(msg.num("line") == 0);
+}
+
+/**
+ * a packet whose fields don't line up with the compiled record is turned
+ * away
+ */
+void test_field_count() {
+  float x = 1;
+  FoxgloveMapping mapping;
+  CHECK(mapping.compile(
+      channel_of(record("odometry", {number("x", x), number("y", x)}))));
+  std::string out;
+  CHECK(!mapping.write(channel_of(record("odometry", {number("x", x)})),
+                       TIMESTAMP_NS, out));
+  CHECK(!mapping.write(channel_of(record("odometry",
+                                         {number("x", x), number("y", x),
+                                          number("theta", x)})),
+                       TIMESTAMP_NS, out));
+  CHECK(mapping.write(
+      channel_of(record("odometry", {number("x", x), number("y", x)})),
+      TIMESTAMP_NS, out));
+}
+
+/**
+ * channels no rule fits are written as their own fields
+ */
+void test_mappings() {
+  float x = 1.5f;
+  FoxgloveMappings mappings;
+  const VDP::Channel drive = channel_of(record("drive", {number("rpm", x)}));
+  mappings.set(drive);
+  std::string out;
+  CHECK(mappings.write(drive, TIMESTAMP_NS, out));
+  CHECK(Json{out}.num("rpm") == 1.5);
+}
+} // namespace
+
+int main() {
+  test_pose();
+  test_rejected();
+  test_transform();
+  test_log();
+  test_field_count();
+  test_mappings();
+  return test_result();
+}
@@ -0,0 +1,315 @@
+// Splits packets into fragments and puts them back together in whatever
+// order they show up, and checks a listener won't take a rebuilt packet
+// whose own checksum is bad
+#include "check.hpp"
+#include "fake-clock.hpp"
+#include "vdb/crc32.hpp"
+#include "vdb/fragment.hpp"
+#include "vdb/registry-listener.hpp"
+#include "vdb/sim-link.hpp"
+#include "vdb/types.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <random>
+
+using VDP::Packet;
+using VDP::Reassembler;
+using Result = VDP::Reassembler::Result;
+
+namespace {
+constexpr uint32_t TIMEOUT_US = 10000;
+constexpr size_t MTU = 64;
+
+/**
+ * a packet with a good checksum whose body counts up from seed
+ */
+Packet make_packet(size_t size, uint8_t seed) {
+  Packet pac;
+  for (size_t i = 0; i + 4 < size; i++) {
+    pac.push_back((uint8_t)(seed + i));
+  }
+  VDP::PacketWriter writer{pac};
+  writer.write_number<uint32_t>(CRC32::calculate(pac.data(), pac.size()));
+  return pac;
+}
+
+std::vector<Packet> split(const Packet &pac, uint16_t message_id) {
+  std::vector<Packet> fragments;
+  CHECK(VDP::fragment_packet(pac, MTU, message_id, fragments));
+  return fragments;
+}
+
+/**
+ * a fragment rewritten to say something else, with a checksum to match
+ */
+Packet rewrite(Packet fragment, size_t at, uint8_t value) {
+  fragment[at] = value;
+  fragment.resize(fragment.size() - 4);
+  VDP::PacketWriter writer{fragment};
+  writer.write_number<uint32_t>(
+      CRC32::calculate(fragment.data(), fragment.size()));
+  return fragment;
+}
+
+/**
+ * each fragment fits the MTU and carries its own good checksum
+ */
+void test_split() {
+  const Packet pac = make_packet(1000, 3);
+  const std::vector<Packet> fragments = split(pac, 7);
+  const size_t piece = MTU - VDP::FRAGMENT_OVERHEAD;
+  CHECK(fragments.size() == (pac.size() + piece - 1) / piece);
+  for (const Packet &fragment : fragments) {
+    CHECK(fragment.size() <= MTU);
+    CHECK(VDP::validate_packet(fragment) == VDP::PacketValidity::Ok);
+    CHECK(VDP::decode_header_byte(fragment[0]).flags &
+          VDP::PacketFlags::Fragment);
+  }
+  std::vector<Packet> too_many;
+  CHECK(!VDP::fragment_packet(make_packet(255 * piece + 1, 0), MTU, 0,
+                              too_many));
+  CHECK(!VDP::fragment_packet(pac, VDP::FRAGMENT_OVERHEAD, 0, too_many));
+}
+
+/**
+ * fragments put back together in any order, with repeats, give back the
+ * packet
+ */
+void test_out_of_order() {
+  std::mt19937 rng(5);
+  for (int trial = 0; trial < 50; trial++) {
+    const Packet pac = make_packet(100 + trial * 37, (uint8_t)trial);
+    std::vector<Packet> fragments = split(pac, (uint16_t)trial);
+    // some of them twice
+    const size_t num_pieces = fragments.size();
+    for (size_t i = 0; i < num_pieces; i += 3) {
+      fragments.push_back(fragments[i]);
+    }
+    std::shuffle(fragments.begin(), fragments.end(), rng);
+
+    Reassembler reassembler{TIMEOUT_US};
+    Packet out;
+    int num_complete = 0;
+    for (const Packet &fragment : fragments) {
+      const Result result = reassembler.add(fragment, 0, out);
+      CHECK(result != Result::Bad);
+      if (result == Result::Complete) {
+        num_complete++;
+        CHECK(out == pac);
+      }
+    }
+    // repeats after the last piece start a packet that never finishes
+    CHECK(num_complete == 1);
+    CHECK(reassembler.num_reassembled == 1);
+    CHECK(reassembler.num_fragments == (int)fragments.size());
+    CHECK(reassembler.num_bad == 0);
+  }
+}
+
+/**
+ * fragments of a few packets mixed together each make their own packet
+ */
+void test_interleaved() {
+  std::vector<Packet> packets;
+  std::vector<std::vector<Packet>> fragments;
+  for (uint16_t id = 0; id < Reassembler::MAX_PENDING; id++) {
+    packets.push_back(make_packet(200 + id * 10, (uint8_t)(id * 50)));
+    fragments.push_back(split(packets.back(), id));
+  }
+  Reassembler reassembler{TIMEOUT_US};
+  Packet out;
+  std::vector<Packet> done;
+  for (size_t i = 0; i < fragments[0].size() + 2; i++) {
+    for (const std::vector<Packet> &message : fragments) {
+      if (i < message.size() &&
+          reassembler.add(message[i], i, out) == Result::Complete) {
+        done.push_back(out);
+      }
+    }
+  }
+  CHECK(done == packets);
+  CHECK(reassembler.num_timeouts == 0);
+}
+
+/**
+ * a packet whose fragments stop coming is thrown away once the timeout
+ * passes, and what shows up after that can't finish it
+ */
+void test_timeout() {
+  Reassembler reassembler{TIMEOUT_US};
+  Packet out;
+  // right at the timeout it's still waiting
+  const Packet in_time = make_packet(200, 1);
+  const std::vector<Packet> first = split(in_time, 1);
+  CHECK(first.size() >= 3);
+  CHECK(reassembler.add(first[0], 1000, out) == Result::Incomplete);
+  Result result = Result::Incomplete;
+  for (size_t i = 1; i < first.size(); i++) {
+    result = reassembler.add(first[i], 1000 + TIMEOUT_US, out);
+  }
+  CHECK(result == Result::Complete);
+  CHECK(out == in_time);
+  CHECK(reassembler.num_timeouts == 0);
+
+  // any later and it's gone
+  const std::vector<Packet> late = split(make_packet(200, 2), 2);
+  CHECK(reassembler.add(late[0], 50000, out) == Result::Incomplete);
+  for (size_t i = 1; i < late.size(); i++) {
+    CHECK(reassembler.add(late[i], 50000 + TIMEOUT_US + 1, out) ==
+          Result::Incomplete);
+  }
+  CHECK(reassembler.num_timeouts == 1);
+  CHECK(reassembler.num_reassembled == 1);
+
+  // a packet that arrives in time still goes through afterwards
+  const Packet pac = make_packet(150, 9);
+  for (const Packet &fragment : split(pac, 3)) {
+    result = reassembler.add(fragment, 100000, out);
+  }
+  CHECK(result == Result::Complete);
+  CHECK(out == pac);
+}
+
+/**
+ * with every slot taken, the packet that has waited longest makes way for a
+ * new one and the rest still finish
+ */
+void test_eviction() {
+  std::vector<Packet> packets;
+  std::vector<std::vector<Packet>> fragments;
+  for (uint16_t id = 0; id <= Reassembler::MAX_PENDING; id++) {
+    packets.push_back(make_packet(150, (uint8_t)id));
+    fragments.push_back(split(packets.back(), id));
+  }
+  Reassembler reassembler{TIMEOUT_US};
+  Packet out;
+  // the first piece of each, packet 0 first
+  for (size_t id = 0; id < fragments.size(); id++) {
+    CHECK(reassembler.add(fragments[id][0], id, out) == Result::Incomplete);
+  }
+  CHECK(reassembler.num_timeouts == 1);
+  for (size_t id = 1; id < fragments.size(); id++) {
+    Result result = Result::Incomplete;
+    for (size_t i = 1; i < fragments[id].size(); i++) {
+      result = reassembler.add(fragments[id][i], 100, out);
+    }
+    CHECK(result == Result::Complete);
+    CHECK(out == packets[id]);
+  }
+  // the rest of packet 0 starts over without its first piece
+  for (size_t i = 1; i < fragments[0].size(); i++) {
+    CHECK(reassembler.add(fragments[0][i], 200, out) == Result::Incomplete);
+  }
+  CHECK(reassembler.num_reassembled == (int)Reassembler::MAX_PENDING);
+}
+
+/**
+ * fragments that don't make sense are turned away without upsetting the
+ * packet they claim to be part of
+ */
+void test_bad_fragments() {
+  const Packet pac = make_packet(200, 4);
+  const std::vector<Packet> fragments = split(pac, 3);
+  Reassembler reassembler{TIMEOUT_US};
+  Packet out;
+  CHECK(reassembler.add(fragments[0], 0, out) == Result::Incomplete);
+  // too short to have a piece
+  Packet tiny(fragments[1].begin(), fragments[1].begin() + 5);
+  CHECK(reassembler.add(tiny, 0, out) == Result::Bad);
+  // an index past the count
+  CHECK(reassembler.add(rewrite(fragments[1], 3, (uint8_t)fragments.size()),
+                        0, out) == Result::Bad);
+  // no pieces at all
+  CHECK(reassembler.add(rewrite(fragments[1], 4, 0), 0, out) == Result::Bad);
+  // a different count than the rest of its packet
+  const uint8_t wrong_count = (uint8_t)(fragments.size() + 1);
+  CHECK(reassembler.add(rewrite(fragments[1], 4, wrong_count), 0, out) ==
+        Result::Bad);
+  CHECK(reassembler.num_bad == 4);
+  Result result = Result::Incomplete;
+  for (size_t i = 1; i < fragments.size(); i++) {
+    result = reassembler.add(fragments[i], 0, out);
+  }
+  CHECK(result == Result::Complete);
+  CHECK(out == pac);
+
+  // pieces adding up past MAX_PACKET_SIZE
+  std::vector<Packet> huge;
+  CHECK(VDP::fragment_packet(make_packet(Reassembler::MAX_PACKET_SIZE + 1, 0),
+                             200, 9, huge));
+  result = Result::Incomplete;
+  for (const Packet &fragment : huge) {
+    result = reassembler.add(fragment, 0, out);
+    if (result != Result::Incomplete) {
+      break;
+    }
+  }
+  CHECK(result == Result::Bad);
+}
+
+/**
+ * a listener puts a data packet back together from its fragments, but drops
+ * it if the rebuilt packet's own checksum is wrong, even though every
+ * fragment's was good
+ */
+void test_listener_checks_whole_packet() {
+  VDB::SimLink link{VDB::LinkModel{}};
+  test::set_clock([&link]() { return link.now_us(); });
+  VDP::RegistryListener<std::mutex> reg{&link.board()};
+  std::vector<float> got;
+  reg.install_broadcast_callback([](const VDP::Channel &) {});
+  reg.install_data_callback([&got](const VDP::Channel &chan) {
+    const VDP::Record &record = static_cast<const VDP::Record &>(*chan.data);
+    got.push_back(std::static_pointer_cast<VDP::Float>(record.get_fields()[0])
+                      ->get_value());
+  });
+
+  float x = 0;
+  std::vector<VDP::PartPtr> fields;
+  for (int i = 0; i < 40; i++) {
+    fields.push_back(std::make_shared<VDP::Float>(
+        "f" + std::to_string(i), [&x, i]() { return x + (float)i; }));
+  }
+  const VDP::PartPtr part = std::make_shared<VDP::Record>("wide", fields);
+  Packet pac;
+  VDP::PacketWriter writer{pac};
+  writer.write_channel_broadcast(VDP::Channel{part});
+  reg.take_packet(writer.get_packet(), 0);
+
+  x = 5;
+  part->fetch();
+  writer.write_data_message(VDP::Channel{part});
+  const Packet data = writer.get_packet();
+  CHECK(data.size() > MTU);
+
+  Packet corrupted = data;
+  corrupted[corrupted.size() - 1] ^= 0x01;
+  for (const Packet &fragment : split(corrupted, 1)) {
+    reg.take_packet(fragment, 10);
+  }
+  CHECK(reg.num_bad == 1);
+  CHECK(got.empty());
+
+  for (const Packet &fragment : split(data, 2)) {
+    reg.take_packet(fragment, 20);
+  }
+  CHECK(reg.num_bad == 1);
+  CHECK(got == std::vector<float>{5});
+  const VDP::FragmentStats stats = reg.get_fragment_stats();
+  CHECK(stats.reassembled == 2);
+  CHECK(stats.bad == 0);
+}
+} // namespace
+
+int main() {
+  test_split();
+  test_out_of_order();
+  test_interleaved();
+  test_timeout();
+  test_eviction();
+  test_bad_fragments();
+  test_listener_checks_whole_packet();
+  return test_result();
+}
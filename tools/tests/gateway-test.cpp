@@ -0,0 +1,235 @@
+// Runs the gateway's pipeline against a simulated brain over pseudo
+// terminals, the way socat is used by hand: the board and the brain each
+// open a pty's slave end as their serial port, and the test copies bytes
+// between the two masters
+#include "channel-pipeline.hpp"
+#include "check.hpp"
+#include "cJSON.h"
+#include "sim-brain.hpp"
+#include "vdb/posix-serial.hpp"
+#include "vdb/registry-listener.hpp"
+#include "vdb/types.hpp"
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <poll.h>
+#include <pty.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using VDB::PosixSerialDevice;
+using VDP::ChannelID;
+using VDP::PartPtr;
+
+namespace {
+constexpr uint32_t BAUD = 115200 * 2;
+// stand-in websocket clients
+constexpr int JSON_CLIENT = 10;
+constexpr int CBOR_COMPACT_CLIENT = 11;
+
+/**
+ * a pseudo terminal whose slave end is opened by name like a serial port
+ */
+struct Pty {
+  int master = -1;
+  int slave = -1;
+  char name[64] = {};
+
+  Pty() { openpty(&master, &slave, name, nullptr, nullptr); }
+  ~Pty() {
+    close(master);
+    close(slave);
+  }
+};
+
+/**
+ * the board's listener and pipeline on one pty, the brain on the other
+ */
+struct Gateway {
+  Pty board_pty;
+  Pty brain_pty;
+  PosixSerialDevice board{board_pty.name, BAUD};
+  PosixSerialDevice brain_dev{brain_pty.name, BAUD};
+  SimBrain brain{&brain_dev};
+  VDP::RegistryListener<std::mutex> reg{&board};
+  // what the pipeline sent everyone in an encoding, and each client
+  std::vector<std::pair<DataEncoding, std::string>> to_encoding;
+  std::map<int, std::vector<std::string>> to_client;
+  ChannelPipeline pipeline{
+      [this](const ChannelPipeline::Message &msg, DataEncoding encoding) {
+        to_encoding.emplace_back(encoding, *msg);
+      },
+      [this](int fd, const ChannelPipeline::Message &msg, int) {
+        to_client[fd].push_back(*msg);
+      }};
+
+  Gateway() {
+    reg.install_broadcast_callback(
+        [this](const VDP::Channel &chan, VDP::BroadcastChange change) {
+          pipeline.on_broadcast(chan, change);
+        });
+    reg.install_data_callback(
+        [this](const VDP::Channel &chan) { pipeline.on_data(chan); });
+    pipeline.subscriptions.add_client(
+        JSON_CLIENT,
+        ChannelPipeline::group_for(DataFormat::Json, DataEncoding::Json));
+    pipeline.subscriptions.add_client(
+        CBOR_COMPACT_CLIENT,
+        ChannelPipeline::group_for(DataFormat::Compact, DataEncoding::Cbor));
+  }
+
+  /**
+   * copies what is waiting on one master to the other
+   */
+  static void shuttle(int from, int to) {
+    char buf[4096];
+    const ssize_t n = read(from, buf, sizeof(buf));
+    for (ssize_t written = 0; written < n;) {
+      const ssize_t w = write(to, buf + written, n - written);
+      if (w <= 0) {
+        return;
+      }
+      written += w;
+    }
+  }
+
+  /**
+   * moves bytes both ways and runs both devices for a while
+   */
+  void pump(int ms) {
+    const auto end =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    while (std::chrono::steady_clock::now() < end) {
+      pollfd fds[4] = {
+          {board_pty.master, POLLIN, 0},
+          {brain_pty.master, POLLIN, 0},
+          {board.fd(), (short)(POLLIN | (board.wants_write() ? POLLOUT : 0)), 0},
+          {brain_dev.fd(),
+           (short)(POLLIN | (brain_dev.wants_write() ? POLLOUT : 0)), 0},
+      };
+      if (poll(fds, 4, 5) <= 0) {
+        continue;
+      }
+      if (fds[0].revents & POLLIN) {
+        shuttle(board_pty.master, brain_pty.master);
+      }
+      if (fds[1].revents & POLLIN) {
+        shuttle(brain_pty.master, board_pty.master);
+      }
+      if (fds[2].revents & POLLOUT) {
+        board.handle_writable();
+      }
+      if (fds[2].revents & POLLIN) {
+        board.handle_readable();
+      }
+      if (fds[3].revents & POLLOUT) {
+        brain_dev.handle_writable();
+      }
+      if (fds[3].revents & POLLIN) {
+        brain_dev.handle_readable();
+      }
+    }
+  }
+};
+
+/**
+ * a record like the brain's odometry, whose values come from x
+ */
+PartPtr odometry(std::string name, float &x) {
+  return std::make_shared<VDP::Record>(
+      name, std::vector<PartPtr>{
+                std::make_shared<VDP::Float>("x", [&x]() { return x; }),
+                std::make_shared<VDP::Float>("y", [&x]() { return -x; }),
+            });
+}
+
+/**
+ * @return the "type" of a JSON message, or nothing if it isn't JSON
+ */
+std::string json_type(const std::string &msg) {
+  cJSON *root = cJSON_Parse(msg.c_str());
+  const cJSON *type = cJSON_GetObjectItem(root, "type");
+  std::string out = cJSON_IsString(type) ? type->valuestring : "";
+  cJSON_Delete(root);
+  return out;
+}
+
+/**
+ * channels are announced, clients hear about them when data starts, and
+ * every data packet reaches the clients subscribed to its channel
+ */
+void test_pipeline() {
+  Gateway g;
+  CHECK(g.board.is_open());
+  CHECK(g.brain_dev.is_open());
+  float x = 0;
+  for (ChannelID id = 0; id < 2; id++) {
+    CHECK(g.brain.broadcast(id, odometry("odom" + std::to_string(id), x)));
+    g.pump(20);
+  }
+  CHECK(g.brain.acked == (std::vector<ChannelID>{0, 1}));
+  CHECK(g.pipeline.channels().size() == 2);
+  CHECK(g.to_encoding.empty());
+  // still subscribed to "*", the id leaves channel 1 out anyway. Ids that
+  // aren't channels, like one that would wrap around to 0, are ignored
+  CHECK(g.pipeline.subscriptions.handle_message(
+      CBOR_COMPACT_CLIENT,
+      R"({"type":"unsubscribe","channels":[1,65536,-1,0.5]})"));
+
+  constexpr int NUM_SENT = 100;
+  for (int i = 0; i < NUM_SENT; i++) {
+    x = (float)i * 0.5f;
+    CHECK(g.brain.send_data(0));
+    CHECK(g.brain.send_data(1));
+    g.pump(2);
+  }
+  g.pump(100);
+
+  // one full advertisement in each encoding, when data started
+  CHECK(g.to_encoding.size() == 2);
+  if (g.to_encoding.size() == 2) {
+    CHECK(g.to_encoding[0].first == DataEncoding::Json);
+    CHECK(json_type(g.to_encoding[0].second) == "advertisement");
+    CHECK(g.to_encoding[1].first == DataEncoding::Cbor);
+  }
+
+  const std::vector<std::string> &json = g.to_client[JSON_CLIENT];
+  CHECK(json.size() == 2 * NUM_SENT);
+  for (size_t i = 0; i < json.size(); i++) {
+    cJSON *root = cJSON_Parse(json[i].c_str());
+    CHECK(root != nullptr);
+    const ChannelID id = (ChannelID)(i % 2);
+    const cJSON *channel_id = cJSON_GetObjectItem(root, "channel_id");
+    CHECK(cJSON_IsNumber(channel_id) && channel_id->valueint == id);
+    const cJSON *odom = cJSON_GetObjectItem(
+        cJSON_GetObjectItem(root, "data"), ("odom" + std::to_string(id)).c_str());
+    const cJSON *value = cJSON_GetObjectItem(odom, "x");
+    CHECK(cJSON_IsNumber(value) && value->valuedouble == (double)(i / 2) * 0.5);
+    cJSON_Delete(root);
+  }
+  // only subscribed to channel 0
+  CHECK(g.to_client[CBOR_COMPACT_CLIENT].size() == NUM_SENT);
+  CHECK(g.board.num_bad_checksum == 0);
+  CHECK(g.reg.num_bad == 0);
+
+  // a changed channel goes out as an update once data starts again
+  CHECK(g.brain.broadcast(1, std::make_shared<VDP::Float>("speed", [&x]() {
+                            return x;
+                          })));
+  g.pump(20);
+  CHECK(g.brain.send_data(1));
+  g.pump(20);
+  CHECK(g.to_encoding.size() == 4);
+  if (g.to_encoding.size() == 4) {
+    CHECK(json_type(g.to_encoding[2].second) == "advertisement_update");
+  }
+  CHECK(json.size() == 2 * NUM_SENT + 1);
+}
+} // namespace
+
+int main() {
+  test_pipeline();
+  return test_result();
+}
@@ -0,0 +1,218 @@
+// Times writing a data message the way the board used to, as a cJSON tree
+// printed pretty, against JSONWriter and the per-channel templates, for a
+// record like the brain's telemetry, and counts the heap allocations each
+// makes. Not run by ctest:
+//   ./json-bench
+#include "data-template.hpp"
+#include "message-format.hpp"
+#include "vdb/types.hpp"
+
+#include "cJSON.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+using VDP::PartPtr;
+
+// every operator new in the program, and every allocation cJSON makes, so
+// a row can count its own
+static size_t num_allocations = 0;
+
+void *operator new(size_t size) {
+  num_allocations++;
+  void *ptr = malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+static void *counted_malloc(size_t size) {
+  num_allocations++;
+  return malloc(size);
+}
+
+namespace {
+constexpr double MIN_SECONDS = 0.3;
+
+/**
+ * what one way of writing a message costs
+ */
+struct Cost {
+  double ns;
+  double allocations;
+};
+
+/**
+ * builds a channel's data as a cJSON tree, the way the board did before
+ * JSONWriter
+ */
+class TreeVisitor : public VDP::UpcastNumbersVisitor {
+public:
+  TreeVisitor() { stack.push_back(cJSON_CreateObject()); }
+  ~TreeVisitor() { cJSON_Delete(stack[0]); }
+
+  void VisitRecord(VDP::Record *record) override {
+    cJSON *node = cJSON_CreateObject();
+    cJSON_AddItemToObject(stack.back(), record->get_name().c_str(), node);
+    stack.push_back(node);
+    for (const PartPtr &field : record->get_fields()) {
+      field->Visit(this);
+    }
+    stack.pop_back();
+  }
+  void VisitString(VDP::String *str) override {
+    cJSON_AddStringToObject(stack.back(), str->get_name().c_str(),
+                            str->get_value().c_str());
+  }
+  void VisitBoolean(VDP::Boolean *bool_part) override {
+    cJSON_AddBoolToObject(stack.back(), bool_part->get_name().c_str(),
+                          bool_part->get_value());
+  }
+  void VisitAnyFloat(const std::string &name, double value,
+                     const VDP::Part *) override {
+    cJSON_AddNumberToObject(stack.back(), name.c_str(), value);
+  }
+  void VisitAnyInt(const std::string &name, int64_t value,
+                   const VDP::Part *) override {
+    cJSON_AddNumberToObject(stack.back(), name.c_str(), (double)value);
+  }
+  void VisitAnyUint(const std::string &name, uint64_t value,
+                    const VDP::Part *) override {
+    cJSON_AddNumberToObject(stack.back(), name.c_str(), (double)value);
+  }
+
+  std::vector<cJSON *> stack;
+};
+
+/**
+ * the old send_data_msg
+ */
+std::string tree_data_msg(const VDP::Channel &channel) {
+  cJSON *root = cJSON_CreateObject();
+  TreeVisitor visitor;
+  channel.data->Visit(&visitor);
+  cJSON_AddStringToObject(root, "type", "data");
+  cJSON_AddNumberToObject(root, "channel_id", channel.getID());
+  cJSON_AddNumberToObject(root, "rec_time", (double)data_rec_time(channel));
+  cJSON_AddNumberToObject(root, "rx_time", (double)channel.info.rx_time_us);
+  cJSON_AddItemReferenceToObject(root, "data", visitor.stack[0]);
+  char *json_str = cJSON_Print(root);
+  std::string str(json_str);
+  cJSON_free(json_str);
+  cJSON_Delete(root);
+  return str;
+}
+
+/**
+ * runs write over and over for at least MIN_SECONDS
+ * @return nanoseconds and heap allocations per message
+ */
+Cost time_ns(const std::function<void()> &write) {
+  using clock = std::chrono::steady_clock;
+  // the first one sizes the output string, that's not per message
+  write();
+  const size_t allocations = num_allocations;
+  const clock::time_point start = clock::now();
+  size_t messages = 0;
+  double seconds = 0;
+  do {
+    for (int i = 0; i < 100; i++) {
+      write();
+    }
+    messages += 100;
+    seconds = std::chrono::duration<double>(clock::now() - start).count();
+  } while (seconds < MIN_SECONDS);
+  return Cost{seconds * 1e9 / (double)messages,
+              (double)(num_allocations - allocations) / (double)messages};
+}
+
+/**
+ * prints a row of the table
+ */
+void print_row(const char *name, const Cost &cost, size_t bytes) {
+  printf("%-24s %10.0f %10.1f %10zu\n", name, cost.ns, cost.allocations,
+         bytes);
+}
+
+/**
+ * twelve fields of the kinds the brain sends: floats, ints, a bool, a string
+ * that needs escaping and a nested record
+ */
+PartPtr telemetry() {
+  return std::make_shared<VDP::Record>(
+      "telemetry",
+      std::vector<PartPtr>{
+          std::make_shared<VDP::Record>(
+              "odometry",
+              std::vector<PartPtr>{
+                  std::make_shared<VDP::Float>("x", []() { return 12.345f; }),
+                  std::make_shared<VDP::Float>("y", []() { return -3.25f; }),
+                  std::make_shared<VDP::Float>("theta",
+                                               []() { return 1.5707964f; }),
+              }),
+          std::make_shared<VDP::Double>("battery",
+                                        []() { return 12.600000000000001; }),
+          std::make_shared<VDP::Float>("left_rpm", []() { return 187.5f; }),
+          std::make_shared<VDP::Float>("right_rpm", []() { return -0.1f; }),
+          std::make_shared<VDP::Int32>("encoder", []() { return -48213; }),
+          std::make_shared<VDP::Uint16>("loop_us", []() { return 9876; }),
+          std::make_shared<VDP::Uint8>("mode", []() { return 3; }),
+          std::make_shared<VDP::Int64>("ticks",
+                                       []() { return 1234567890123LL; }),
+          std::make_shared<VDP::Boolean>("enabled", []() { return true; }),
+          std::make_shared<VDP::String>(
+              "status", []() { return std::string("auton \"skills\"\tok"); }),
+      });
+}
+} // namespace
+
+int main() {
+  cJSON_Hooks hooks{counted_malloc, free};
+  cJSON_InitHooks(&hooks);
+  VDP::Channel channel{telemetry()};
+  channel.data->fetch();
+  channel.info.rx_time_us = 123456789;
+
+  DataTemplates templates;
+  templates.set(channel);
+  std::string out;
+
+  const std::string tree = tree_data_msg(channel);
+  write_data_msg(channel, out);
+  const std::string writer_out = out;
+  templates.write(channel, DataFormat::Json, DataEncoding::Json, out);
+  // the template row stands for JSONWriter's message, so it has to be it
+  if (out != writer_out || templates.num_fallbacks != 0) {
+    fprintf(stderr, "template wrote\n%s\ninstead of\n%s\n", out.c_str(),
+            writer_out.c_str());
+    return 1;
+  }
+  templates.write(channel, DataFormat::Compact, DataEncoding::Json, out);
+  const size_t compact_size = out.size();
+
+  printf("%-24s %10s %10s %10s\n", "data message", "ns/msg", "allocs/msg",
+         "bytes");
+  print_row("cJSON tree, pretty",
+            time_ns([&]() { out = tree_data_msg(channel); }), tree.size());
+  print_row("JSONWriter", time_ns([&]() { write_data_msg(channel, out); }),
+            writer_out.size());
+  print_row("template", time_ns([&]() {
+              templates.write(channel, DataFormat::Json, DataEncoding::Json,
+                              out);
+            }),
+            writer_out.size());
+  print_row("template, compact", time_ns([&]() {
+              templates.write(channel, DataFormat::Compact, DataEncoding::Json,
+                              out);
+            }),
+            compact_size);
+  return 0;
+}
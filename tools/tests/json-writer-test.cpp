@@ -0,0 +1,178 @@
+// Checks that the numbers JSONWriter writes read back as what was written:
+// the shortest round trip digits for doubles and floats, and the fixed
+// decimals path against printf's rounding
+#include "check.hpp"
+#include "json-writer.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <string>
+
+namespace {
+constexpr int NUM_RANDOM = 200000;
+
+/**
+ * @return what JSONWriter writes for one value
+ */
+template <typename... Args> std::string written(Args... args) {
+  std::string out;
+  JSONWriter writer{out};
+  writer.value(args...);
+  return out;
+}
+
+/**
+ * @return a double with random bits that isn't nan or infinity, so every
+ * exponent and subnormals turn up
+ */
+double random_double(std::mt19937_64 &rng) {
+  while (true) {
+    const uint64_t bits = rng();
+    double num;
+    memcpy(&num, &bits, sizeof(num));
+    if (std::isfinite(num)) {
+      return num;
+    }
+  }
+}
+float random_float(std::mt19937 &rng) {
+  while (true) {
+    const uint32_t bits = rng();
+    float num;
+    memcpy(&num, &bits, sizeof(num));
+    if (std::isfinite(num)) {
+      return num;
+    }
+  }
+}
+
+/**
+ * any double reads back exactly, in no more than the 17 digits %.17g takes
+ */
+void test_double_round_trip() {
+  std::mt19937_64 rng(1);
+  for (int i = 0; i < NUM_RANDOM; i++) {
+    // half of them in the range telemetry is actually in
+    const double num = i % 2 == 0 ? random_double(rng)
+                                  : (double)(int64_t)rng() / (1LL << 40);
+    const std::string out = written(num);
+    CHECK(strtod(out.c_str(), nullptr) == num);
+    char printf_buf[32];
+    snprintf(printf_buf, sizeof(printf_buf), "%.17g", num);
+    CHECK(out.size() <= strlen(printf_buf));
+  }
+  CHECK(written(0.1) == "0.1");
+  CHECK(written(-2.5) == "-2.5");
+  CHECK(written(1e300) == "1e+300");
+  CHECK(written(std::numeric_limits<double>::denorm_min()) == "5e-324");
+}
+
+/**
+ * any float reads back as the same float, and doesn't pick up digits from
+ * being widened to a double
+ */
+void test_float_round_trip() {
+  std::mt19937 rng(2);
+  for (int i = 0; i < NUM_RANDOM; i++) {
+    const float num = i % 2 == 0 ? random_float(rng)
+                                 : (float)(int32_t)rng() / (float)(1 << 16);
+    const std::string out = written(num);
+    CHECK(strtof(out.c_str(), nullptr) == num);
+    // what a client reading it as a double and narrowing would get
+    CHECK((float)strtod(out.c_str(), nullptr) == num);
+    CHECK(out.size() <= written((double)num).size());
+  }
+  CHECK(written(0.1f) == "0.1");
+  CHECK(written(1.5707964f) == "1.5707964");
+  CHECK(written(-3.25f) == "-3.25");
+}
+
+/**
+ * fixed decimals round the way printf does, and have exactly that many
+ * digits after the point
+ */
+void test_fixed_decimals() {
+  std::mt19937_64 rng(3);
+  std::uniform_real_distribution<double> range(-1e6, 1e6);
+  for (int i = 0; i < NUM_RANDOM; i++) {
+    const double num = range(rng);
+    const int decimals = (int)(rng() % 7);
+    const std::string out = written(num, decimals);
+    char printf_buf[64];
+    snprintf(printf_buf, sizeof(printf_buf), "%.*f", decimals, num);
+    CHECK(out == printf_buf);
+    const char *point = strchr(out.c_str(), '.');
+    if (decimals == 0) {
+      CHECK(point == nullptr);
+    } else {
+      CHECK(point != nullptr && strlen(point + 1) == (size_t)decimals);
+    }
+    // off by at most half the last digit, plus what reading it back rounds
+    CHECK(std::fabs(strtod(out.c_str(), nullptr) - num) <=
+          0.5 * std::pow(10.0, -decimals) + std::fabs(num) * 1e-15);
+  }
+  CHECK(written(2.675, 2) == "2.67");
+  CHECK(written(0.125, 2) == "0.12");
+  CHECK(written(-0.0001, 2) == "-0.00");
+  CHECK(written(12.345f, 1) == "12.3");
+  // too long to write in fixed, so shortest round trip instead
+  CHECK(written(1e300, 3) == "1e+300");
+}
+
+/**
+ * JSON has no nan or infinity
+ */
+void test_not_finite() {
+  const double inf = std::numeric_limits<double>::infinity();
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  CHECK(written(inf) == "null");
+  CHECK(written(-inf) == "null");
+  CHECK(written(nan) == "null");
+  CHECK(written((float)nan) == "null");
+  CHECK(written(inf, 2) == "null");
+  CHECK(written(nan, 2) == "null");
+}
+
+void test_integers() {
+  CHECK(written(std::numeric_limits<int64_t>::min()) ==
+        "-9223372036854775808");
+  CHECK(written(std::numeric_limits<uint64_t>::max()) ==
+        "18446744073709551615");
+  CHECK(written((int64_t)0) == "0");
+}
+
+/**
+ * commas, nesting and escaping in one message
+ */
+void test_structure() {
+  std::string out;
+  JSONWriter writer{out};
+  writer.begin_object();
+  writer.key("a");
+  writer.begin_array();
+  writer.value((int64_t)1);
+  writer.value(2.5);
+  writer.value_null();
+  writer.end_array();
+  writer.key("s\"");
+  writer.value("tab\there\x01");
+  writer.key("o");
+  writer.begin_object();
+  writer.end_object();
+  writer.end_object();
+  CHECK(out == R"({"a":[1,2.5,null],"s\"":"tab\there\u0001","o":{}})");
+}
+} // namespace
+
+int main() {
+  test_double_round_trip();
+  test_float_round_trip();
+  test_fixed_decimals();
+  test_not_finite();
+  test_integers();
+  test_structure();
+  return test_result();
+}
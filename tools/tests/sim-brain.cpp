@@ -0,0 +1,72 @@
+#include "sim-brain.hpp"
+#include "vdb/crc32.hpp"
+
+SimBrain::SimBrain(VDP::AbstractDevice *device, bool varint_ids)
+    : device(device), varint_ids(varint_ids) {
+  device->register_receive_callback([this](const VDP::Packet &pac) {
+    const VDP::PacketHeader header = VDP::decode_header_byte(pac[0]);
+    if (header.type == VDP::PacketType::Broadcast &&
+        header.func == VDP::PacketFunction::Acknowledge) {
+      VDP::PacketReader reader{pac, 1};
+      acked.push_back(reader.get_channel_id(header));
+    } else if (header.type == VDP::PacketType::Broadcast &&
+               header.func == VDP::PacketFunction::Response) {
+      num_pongs++;
+    } else {
+      num_other++;
+    }
+  });
+}
+
+bool SimBrain::broadcast(VDP::ChannelID id, VDP::PartPtr part) {
+  if (channels.size() <= id) {
+    channels.resize(id + 1);
+  }
+  channels[id] = part;
+  VDP::Packet pac;
+  VDP::PacketWriter writer{pac};
+  writer.write_channel_broadcast(VDP::Channel{part});
+  return send_with_id(id, pac);
+}
+
+bool SimBrain::send_data(VDP::ChannelID id, const VDP::DataInfo *info) {
+  channels[id]->fetch();
+  VDP::Packet pac;
+  VDP::PacketWriter writer{pac};
+  if (info != nullptr) {
+    writer.write_data_message(VDP::Channel{channels[id]}, *info);
+  } else {
+    writer.write_data_message(VDP::Channel{channels[id]});
+  }
+  return send_with_id(id, pac);
+}
+
+bool SimBrain::ping(uint32_t time_ms) {
+  VDP::Packet pac;
+  VDP::PacketWriter writer{pac};
+  writer.write_ping(time_ms);
+  return device->send_packet(pac);
+}
+
+/**
+ * writes a packet for a channel the way PacketWriter does for channel 0,
+ * then puts the real id in its place
+ */
+bool SimBrain::send_with_id(VDP::ChannelID id,
+                            const VDP::Packet &as_channel_0) {
+  VDP::Packet pac;
+  VDP::PacketWriter writer{pac};
+  writer.set_varint_channel_ids(varint_ids);
+  uint8_t header = as_channel_0[0];
+  if (varint_ids) {
+    header |= VDP::PacketFlags::VarintChannelID;
+  }
+  writer.write_byte(header);
+  writer.write_channel_id(id);
+  // everything after the one byte id, up to the checksum
+  for (size_t i = 2; i + 4 < as_channel_0.size(); i++) {
+    writer.write_byte(as_channel_0[i]);
+  }
+  writer.write_number<uint32_t>(CRC32::calculate(pac.data(), pac.size()));
+  return device->send_packet(pac);
+}
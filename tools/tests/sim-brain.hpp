@@ -0,0 +1,55 @@
+#pragma once
+#include "vdb/protocol.hpp"
+#include <vector>
+
+/**
+ * The brain's half of the protocol, as much of it as the tests need:
+ * announces channels, sends their data and pings, and keeps track of the
+ * acks and pongs that come back. Talks through any AbstractDevice, like an
+ * end of a SimLink or a serial port
+ */
+class SimBrain {
+public:
+  /**
+   * @param device what to talk to the board through
+   * @param varint_ids whether channel ids go out as varints
+   */
+  SimBrain(VDP::AbstractDevice *device, bool varint_ids = false);
+
+  /**
+   * broadcasts a channel's schema
+   * @param id the channel's id, the brain hands them out from 0
+   * @param part the channel's schema, its values are what send_data sends
+   * @return whether the device took the packet
+   */
+  bool broadcast(VDP::ChannelID id, VDP::PartPtr part);
+  /**
+   * fetches a channel's values and sends them
+   * @param info the sequence number and timestamp to send, if any
+   * @return whether the device took the packet
+   */
+  bool send_data(VDP::ChannelID id, const VDP::DataInfo *info = nullptr);
+  /**
+   * sends a ping for the board to line its clock up with
+   * @param time_ms the brain's clock
+   */
+  bool ping(uint32_t time_ms);
+
+  // ids of the channels the board acked, in the order it acked them
+  std::vector<VDP::ChannelID> acked;
+  // pongs that came back
+  int num_pongs = 0;
+  // anything else the board sent
+  int num_other = 0;
+
+private:
+  /**
+   * writes a packet for a channel the way PacketWriter does for channel 0,
+   * then puts the real id in its place
+   */
+  bool send_with_id(VDP::ChannelID id, const VDP::Packet &as_channel_0);
+
+  VDP::AbstractDevice *device;
+  bool varint_ids;
+  std::vector<VDP::PartPtr> channels;
+};
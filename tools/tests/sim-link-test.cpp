@@ -0,0 +1,311 @@
+// Runs a simulated brain against a RegistryListener over a SimLink, with
+// VDB::time_us() reading the link's simulated clock, and checks what comes
+// out the other end
+#include "check.hpp"
+#include "fake-clock.hpp"
+#include "sim-brain.hpp"
+#include "vdb/registry-listener.hpp"
+#include "vdb/sim-link.hpp"
+#include "vdb/types.hpp"
+
+#include <map>
+#include <memory>
+#include <mutex>
+
+using VDB::LinkModel;
+using VDB::SimLink;
+using VDP::Channel;
+using VDP::ChannelID;
+using VDP::Packet;
+using VDP::PartPtr;
+
+namespace {
+/**
+ * a brain on one end of a link and a board's listener on the other
+ */
+struct Session {
+  SimLink link;
+  SimBrain brain;
+  VDP::RegistryListener<std::mutex> reg;
+  std::vector<ChannelID> broadcasts;
+  // how each broadcast, and each removal, changed the listener's table
+  std::vector<std::pair<ChannelID, VDP::BroadcastChange>> changes;
+  // every data packet the listener decoded, by channel
+  std::map<ChannelID, std::vector<Channel>> data;
+  // the values they held, since the listener reuses its parts
+  std::map<ChannelID, std::vector<float>> values;
+
+  explicit Session(const LinkModel &model, bool varint_ids = false,
+                   uint32_t seed = 1)
+      : link(model, seed), brain(&link.brain(), varint_ids),
+        reg(&link.board()) {
+    test::set_clock([this]() { return link.now_us(); });
+    reg.install_broadcast_callback(
+        [this](const Channel &chan, VDP::BroadcastChange change) {
+          changes.emplace_back(chan.getID(), change);
+          if (change != VDP::BroadcastChange::Removed) {
+            broadcasts.push_back(chan.getID());
+          }
+        });
+    reg.install_data_callback([this](const Channel &chan) {
+      data[chan.getID()].push_back(chan);
+      values[chan.getID()].push_back(first_float(chan.data));
+    });
+  }
+
+  void wait_us(uint64_t us) { link.run_until(link.now_us() + us); }
+
+  /**
+   * @return the value of a record's first field, which is always a Float
+   */
+  static float first_float(const PartPtr &part) {
+    const VDP::Record &record = static_cast<const VDP::Record &>(*part);
+    return std::static_pointer_cast<VDP::Float>(record.get_fields()[0])
+        ->get_value();
+  }
+};
+
+/**
+ * a record like the brain's odometry, whose values come from x
+ */
+PartPtr odometry(std::string name, float &x) {
+  return std::make_shared<VDP::Record>(
+      name, std::vector<PartPtr>{
+                std::make_shared<VDP::Float>("x", [&x]() { return x; }),
+                std::make_shared<VDP::Float>("y", [&x]() { return -x; }),
+                std::make_shared<VDP::Int32>("count",
+                                             [&x]() { return (int32_t)x; }),
+            });
+}
+
+/**
+ * channels are announced and acked, then every data packet arrives intact
+ */
+void test_clean() {
+  Session s{LinkModel{}};
+  float x = 0;
+  // the link is half duplex, the brain waits for each ack before going on
+  for (ChannelID id = 0; id < 3; id++) {
+    CHECK(s.brain.broadcast(id, odometry("odom" + std::to_string(id), x)));
+    s.wait_us(5000);
+  }
+  CHECK(s.broadcasts == (std::vector<ChannelID>{0, 1, 2}));
+  CHECK(s.brain.acked == (std::vector<ChannelID>{0, 1, 2}));
+
+  for (int i = 0; i < 100; i++) {
+    x = (float)i * 0.5f;
+    for (ChannelID id = 0; id < 3; id++) {
+      CHECK(s.brain.send_data(id));
+    }
+    s.wait_us(10000);
+  }
+  const std::vector<VDP::ChannelStats> stats = s.reg.get_channel_stats();
+  CHECK(stats.size() == 3);
+  for (ChannelID id = 0; id < 3; id++) {
+    CHECK(s.values[id].size() == 100);
+    for (size_t i = 0; i < s.values[id].size(); i++) {
+      CHECK(s.values[id][i] == (float)i * 0.5f);
+    }
+    CHECK(stats[id].received == 100);
+    CHECK(stats[id].lost == 0);
+  }
+  CHECK(s.link.board().num_bad_checksum == 0);
+  CHECK(s.reg.num_bad == 0);
+}
+
+/**
+ * ids past 255 only fit as varints
+ */
+void test_varint_ids() {
+  Session s{LinkModel{}, true};
+  float x = 0;
+  for (ChannelID id = 0; id < 300; id++) {
+    CHECK(s.brain.broadcast(id, odometry("c" + std::to_string(id), x)));
+    s.wait_us(5000);
+  }
+  CHECK(s.broadcasts.size() == 300);
+  CHECK(s.brain.acked.size() == 300);
+  CHECK(!s.brain.acked.empty() && s.brain.acked.back() == 299);
+
+  x = 42;
+  CHECK(s.brain.send_data(299));
+  s.wait_us(10000);
+  CHECK(s.values[299].size() == 1);
+  CHECK(!s.values[299].empty() && s.values[299][0] == 42);
+}
+
+/**
+ * on a noisy link some packets don't make it, the listener counts them from
+ * the sequence numbers, and nothing that does make it is wrong
+ */
+void test_noisy() {
+  LinkModel model;
+  model.bit_error_rate = 2e-5;
+  model.drop_rate = 0.05;
+  model.latency_us = 500;
+  model.jitter_us = 1000;
+  Session s{model, false, 7};
+  float x = 0;
+  // broadcasts can be lost too, keep going until one is acked
+  while (s.brain.acked.empty() && s.link.now_us() < 1000000) {
+    s.brain.broadcast(0, odometry("odom", x));
+    s.wait_us(20000);
+  }
+  CHECK(s.broadcasts.size() >= 1);
+
+  constexpr int NUM_SENT = 2000;
+  for (int i = 0; i < NUM_SENT; i++) {
+    x = (float)i;
+    VDP::DataInfo info;
+    info.has_sequence = true;
+    info.sequence = (uint16_t)i;
+    CHECK(s.brain.send_data(0, &info));
+    s.wait_us(3000);
+  }
+  s.wait_us(100000);
+
+  const std::vector<Channel> &got = s.data[0];
+  CHECK(got.size() > NUM_SENT * 8 / 10);
+  CHECK(got.size() < NUM_SENT);
+  for (size_t i = 0; i < got.size(); i++) {
+    // the sequence number says what the value was when it was sent
+    CHECK(got[i].info.has_sequence);
+    CHECK(s.values[0][i] == (float)got[i].info.sequence);
+  }
+  CHECK(s.link.num_dropped > 0);
+  CHECK(s.link.board().num_bad_checksum > 0);
+  const VDP::ChannelStats stats = s.reg.get_channel_stats()[0];
+  CHECK(stats.received == got.size());
+  CHECK(stats.reordered == 0);
+  // packets lost after the last one that arrived can't be counted
+  CHECK(stats.received + stats.lost <= (uint32_t)NUM_SENT);
+  CHECK(stats.received + stats.lost >= (uint32_t)NUM_SENT - 10);
+}
+
+/**
+ * a record with one Float field of its own, for a schema unlike odometry's
+ */
+PartPtr single(std::string name, float &x) {
+  return std::make_shared<VDP::Record>(
+      name, std::vector<PartPtr>{
+                std::make_shared<VDP::Float>("x", [&x]() { return x; })});
+}
+
+/**
+ * when the brain restarts it announces from channel 0 again. Channels with
+ * the same schema are kept as they were, ones with a new schema are
+ * replaced, and ones it doesn't announce again are dropped once its data
+ * starts
+ */
+void test_brain_restart() {
+  using VDP::BroadcastChange;
+  using Change = std::pair<ChannelID, BroadcastChange>;
+  Session s{LinkModel{}};
+  float x = 1;
+  CHECK(s.brain.broadcast(0, odometry("odom", x)));
+  s.wait_us(5000);
+  CHECK(s.brain.broadcast(1, odometry("arm", x)));
+  s.wait_us(5000);
+  CHECK(s.brain.broadcast(2, single("intake", x)));
+  s.wait_us(5000);
+  for (ChannelID id = 0; id < 3; id++) {
+    VDP::DataInfo info;
+    info.has_sequence = true;
+    info.sequence = 10;
+    CHECK(s.brain.send_data(id, &info));
+    s.wait_us(5000);
+  }
+  CHECK(s.changes == (std::vector<Change>{{0, BroadcastChange::Added},
+                                          {1, BroadcastChange::Added},
+                                          {2, BroadcastChange::Added}}));
+  const PartPtr odom_part = s.reg.get_remote_schema(0);
+  const PartPtr arm_part = s.reg.get_remote_schema(1);
+  s.changes.clear();
+
+  // the restarted brain has the same odometry, a different arm and no
+  // intake
+  SimBrain restarted{&s.link.brain()};
+  s.brain.acked.clear();
+  CHECK(restarted.broadcast(0, odometry("odom", x)));
+  s.wait_us(5000);
+  CHECK(restarted.broadcast(1, single("arm", x)));
+  s.wait_us(5000);
+  CHECK(restarted.acked == (std::vector<ChannelID>{0, 1}));
+  CHECK(s.changes == (std::vector<Change>{{0, BroadcastChange::Unchanged},
+                                          {1, BroadcastChange::Changed}}));
+  // nothing is dropped until the brain is done announcing
+  CHECK(s.reg.get_remote_schema(2) != nullptr);
+  // anything holding on to the unchanged channel's part keeps working
+  CHECK(s.reg.get_remote_schema(0) == odom_part);
+  CHECK(s.reg.get_remote_schema(1) != arm_part);
+  std::vector<VDP::ChannelStats> stats = s.reg.get_channel_stats();
+  CHECK(stats.size() == 3);
+  // kept, but its sequence numbers start over
+  CHECK(stats[0].received == 1);
+  CHECK(!stats[0].has_sequence);
+  // a new channel as far as the counters go
+  CHECK(stats[1].received == 0);
+
+  x = 2;
+  VDP::DataInfo info;
+  info.has_sequence = true;
+  info.sequence = 0;
+  CHECK(restarted.send_data(0, &info));
+  s.wait_us(5000);
+  CHECK(s.changes.size() == 3);
+  CHECK(s.changes.back() == Change(2, BroadcastChange::Removed));
+  CHECK(s.reg.get_remote_schema(2) == nullptr);
+  stats = s.reg.get_channel_stats();
+  CHECK(stats.size() == 2);
+  CHECK(stats[0].received == 2);
+  // starting over from 0 isn't a loss or a reorder
+  CHECK(stats[0].lost == 0);
+  CHECK(stats[0].reordered == 0);
+  CHECK(s.values[0].size() == 2);
+  CHECK(!s.values[0].empty() && s.values[0].back() == 2);
+
+  // data for the removed channel goes nowhere
+  CHECK(s.brain.send_data(2));
+  s.wait_us(5000);
+  CHECK(s.values[2].size() == 1);
+
+  // a brain that adds a channel later without restarting doesn't lose any
+  s.changes.clear();
+  CHECK(restarted.broadcast(2, odometry("lift", x)));
+  s.wait_us(5000);
+  CHECK(restarted.send_data(1));
+  s.wait_us(5000);
+  CHECK(s.changes == (std::vector<Change>{{2, BroadcastChange::Added}}));
+  CHECK(s.reg.get_remote_schema(0) == odom_part);
+  CHECK(s.values[1].size() == 2);
+}
+
+/**
+ * pings line the board's clock up with the brain's
+ */
+void test_clock_sync() {
+  Session s{LinkModel{}};
+  CHECK(!s.reg.get_clock_sync().synced());
+  // the brain's clock is 100 seconds ahead of the board's
+  for (int i = 0; i < 20; i++) {
+    CHECK(s.brain.ping((uint32_t)(s.link.now_us() / 1000) + 100000));
+    s.wait_us(50000);
+  }
+  CHECK(s.brain.num_pongs == 20);
+  const VDP::ClockSync clock = s.reg.get_clock_sync();
+  CHECK(clock.synced());
+  // off by the ping's time on the wire and the brain rounding to a
+  // millisecond, a couple of milliseconds at most
+  const int64_t error_us = clock.offset_us() + 100000 * 1000LL;
+  CHECK(error_us >= 0 && error_us < 3000);
+}
+} // namespace
+
+int main() {
+  test_clean();
+  test_varint_ids();
+  test_noisy();
+  test_brain_restart();
+  test_clock_sync();
+  return test_result();
+}